@@ -0,0 +1,63 @@
+#include <hellfire.h>
+#include <noc.h>
+#include <noc_coll.h>
+
+#define PARTS		4
+
+void task(void)
+{
+	int32_t i, val;
+	int32_t part[PARTS], sum[PARTS];
+	int32_t *data = NULL;
+	uint32_t cycles;
+
+	if (hf_comm_create(hf_selfid(), 2000, 0))
+		panic(0xff);
+
+	delay_ms(50);
+
+	if (hf_cpuid() == 0) {
+		data = (int32_t *)hf_malloc(hf_ncores() * sizeof(part));
+		if (!data) panic(0xff);
+		for (i = 0; i < hf_ncores() * PARTS; i++)
+			data[i] = i;
+	}
+
+	while (1) {
+		cycles = _readcounter();
+		val = hf_coll_barrier(2000, 0);
+		if (val)
+			printf("hf_coll_barrier(): error %d\n", val);
+		cycles = _readcounter() - cycles;
+		if (hf_cpuid() == 0)
+			printf("\nbarrier: %d cycles", cycles);
+
+		cycles = _readcounter();
+		val = hf_coll_scatter(0, 2000, (int8_t *)data, (int8_t *)part, sizeof(part), 0);
+		if (val)
+			printf("hf_coll_scatter(): error %d\n", val);
+
+		for (i = 0; i < PARTS; i++)
+			sum[i] = part[i] * 2;
+
+		val = hf_coll_gather(0, 2000, (int8_t *)sum, (int8_t *)data, sizeof(sum), 0);
+		if (val)
+			printf("hf_coll_gather(): error %d\n", val);
+
+		val = hf_coll_allreduce(2000, (int8_t *)sum, sizeof(sum), hf_coll_sum, 0);
+		if (val)
+			printf("hf_coll_allreduce(): error %d\n", val);
+		cycles = _readcounter() - cycles;
+
+		printf("\ncore %d: sum %d %d %d %d, %d cycles", hf_cpuid(), sum[0], sum[1], sum[2], sum[3], cycles);
+
+		if (hf_cpuid() == 0)
+			for (i = 0; i < hf_ncores() * PARTS; i++)
+				data[i] >>= 1;
+	}
+}
+
+void app_main(void)
+{
+	hf_spawn(task, 0, 0, 0, "coll task", 4096);
+}
@@ -0,0 +1,55 @@
+#include <hellfire.h>
+#include <noc.h>
+#include <noc_rdma.h>
+
+#define SLOT_SIZE	32
+
+int8_t window[NOC_WIDTH * NOC_HEIGHT * SLOT_SIZE];
+
+void task(void)
+{
+	int8_t buf[SLOT_SIZE];
+	int32_t i, val, round = 0;
+	uint32_t cycles;
+
+	if (hf_comm_create(hf_selfid(), 3000, 0))
+		panic(0xff);
+
+	hf_win_create(0, window, sizeof(window), WIN_READ | WIN_WRITE);
+
+	delay_ms(50);
+
+	while (1) {
+		round++;
+		if (hf_cpuid() != 0) {
+			/* publish a status on our slot of the window on core 0, and on the local window */
+			sprintf(window, "core %d, round %d", hf_cpuid(), round);
+			cycles = _readcounter();
+			val = hf_put(0, 0, hf_cpuid() * SLOT_SIZE, window, SLOT_SIZE);
+			if (val)
+				printf("hf_put(): error %d\n", val);
+			cycles = _readcounter() - cycles;
+			printf("\nput: %d cycles", cycles);
+		} else {
+			/* read the local window (written by remote cores) and remote windows */
+			for (i = 1; i < hf_ncores(); i++)
+				printf("\nlocal slot %d: %s", i, &window[i * SLOT_SIZE]);
+
+			for (i = 1; i < hf_ncores(); i++) {
+				cycles = _readcounter();
+				val = hf_get(i, 0, 0, buf, sizeof(buf), 0);
+				cycles = _readcounter() - cycles;
+				if (val)
+					printf("\nhf_get(): error %d", val);
+				else
+					printf("\nremote core %d: %s (%d cycles)", i, buf, cycles);
+			}
+		}
+		delay_ms(100);
+	}
+}
+
+void app_main(void)
+{
+	hf_spawn(task, 0, 0, 0, "rdma task", 2048);
+}
@@ -0,0 +1,87 @@
+#include <hellfire.h>
+#include <noc.h>
+#include <noc_rpc.h>
+
+struct calc_s {
+	int op;
+	int a;
+	int b;
+	int res;
+};
+
+int32_t calc(int8_t *in, int8_t *out)
+{
+	struct calc_s *data_in, *data_out;
+	
+	data_in = (struct calc_s *)in;
+	data_out = (struct calc_s *)out;
+	
+	switch (data_in->op) {
+		case 0:
+			data_out->res = data_in->a + data_in->b;
+			break;
+		case 1:
+			data_out->res = data_in->a - data_in->b;
+			break;
+		case 2:
+			data_out->res = data_in->a * data_in->b;
+			break;
+		case 3:
+			data_out->res = data_in->a / data_in->b;
+			break;
+		default:
+			data_out->op = -1;
+			data_out->res = 0;
+			return -1;
+	};
+	data_out->op = 0;
+
+	return 0;
+}
+
+void thread(void)
+{
+	int16_t i, j, n;
+	int32_t r, call[RPC_MAX_PARALLEL_CALLS];
+	uint32_t cycles;
+	struct calc_s input[RPC_MAX_PARALLEL_CALLS], result[RPC_MAX_PARALLEL_CALLS];
+
+	if (hf_comm_create(hf_selfid(), 1000, 0))
+		panic(0xff);
+
+	delay_ms(50);
+
+	while (1){
+		/* one batch of calls to every other core, all of them in flight at the same time */
+		cycles = _readcounter();
+		n = 0;
+		for (i = 0; i < hf_ncores(); i++) {
+			if (i != hf_cpuid()) {
+				for (j = 0; j < 4 && n < RPC_MAX_PARALLEL_CALLS; j++, n++) {
+					input[n].op = j;
+					input[n].a = 7 + i;
+					input[n].b = 3 + i;
+					call[n] = hf_call_async(i, 0, 0, (int8_t *)&input[n], sizeof(struct calc_s), (int8_t *)&result[n], sizeof(struct calc_s));
+				}
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			r = call[i] < 0 ? call[i] : hf_call_wait(call[i]);
+			printf("(r: %d) - %d (%d) %d = %d\n", r, input[i].a, input[i].op, input[i].b, result[i].res);
+		}
+		cycles = _readcounter() - cycles;
+		printf("%d calls, %d cycles\n", n, cycles);
+		
+		while(1);
+	}
+}
+
+void app_main(void)
+{
+	if (hf_cpuid() == 0){
+		hf_spawn(thread, 0, 0, 0, "app task", 4096);
+	}else{
+		hf_register(0, 0, calc, sizeof(struct calc_s), sizeof(struct calc_s));
+	}	
+}
@@ -5,7 +5,7 @@
 #include <uhfs.h>
 
 void app_main(void){
-	struct device ramdisk0 = {ramdisk_open, ramdisk_read, ramdisk_write, ramdisk_close, ramdisk_ioctl, 0};
+	struct device ramdisk0 = {ramdisk_open, ramdisk_read, ramdisk_write, ramdisk_close, ramdisk_ioctl, 0, ramdisk_request};
 	struct blk_info ramdisk0info;
 	struct file *fptr;
 	struct fs_direntry direntry;
@@ -174,6 +174,15 @@ void app_main(void){
 
 	printf("\nfreeblks: %d, label: %s", hf_getfree(&ramdisk0), str);
 	
+	fptr = hf_fopen(&ramdisk0, "/root/pig3", "w+");
+	hf_fwrite("some data for pig3", 1, 18, fptr);
+	hf_fseek(fptr, 5, SEEK_SET);
+	memset(str, 0, sizeof(str));
+	hf_fread(str, 1, sizeof(str) - 1, fptr);
+	printf("\nread: %s, position: %d, eof: %d", str, (int32_t)hf_ftell(fptr), hf_feof(fptr));
+	hf_fclose(fptr);
+	printf("\nsize %d", (int32_t)hf_size(&ramdisk0, "/root/pig3"));
+	
 	hf_umount(&ramdisk0);
 	hf_dev_ioctl(&ramdisk0, DISK_FINISH, 0);
 }
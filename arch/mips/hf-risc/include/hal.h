@@ -293,9 +293,9 @@ typedef void				(*funcptr)();
 #define XTEA_OUT1			(*(volatile uint32_t *)(XTEA_BASE + 0x080))
 
 /* software SPI interface for GPIO */
-/* SPI read / write ports */
-#define SPI_INPORT			PAIN
-#define SPI_OUTPORT			PAOUT
+/* SPI read / write ports (addresses, for _port_read() / _port_write()) */
+#define SPI_INPORT			(GPIO_BASE + 0x4020)
+#define SPI_OUTPORT			(GPIO_BASE + 0x4010)
 #define SPI_CS0				MASK_P4
 #define SPI_SCK				MASK_P5
 #define SPI_MOSI			MASK_P6
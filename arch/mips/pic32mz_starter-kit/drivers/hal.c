@@ -176,6 +176,35 @@ uint8_t switch_get(uint16_t sw)
 	return 0;
 }
 
+/* hardware SPI */
+void _spi_setup(uint8_t mode)
+{
+	SPI2CON = 0;					/* turning the module off clears the buffers */
+	ANSELGCLR = (1 << 6) | (1 << 7) | (1 << 8);
+	TRISGCLR = (1 << 6) | (1 << 8);			/* SCK2, SDO2 (outputs) */
+	TRISGSET = (1 << 7);				/* SDI2 (input) */
+	RPG8R = 6;					/* SDO2 on RPG8 */
+	SDI2R = 1;					/* SDI2 from RPG7 */
+	SPI2BRG = SPI_HW_BRG_SLOW;
+	SPI2STATCLR = SPISTAT_SPIROV;
+	SPI2CON = SPICON_MSTEN | ((mode & 2) ? SPICON_CKP : 0) | ((mode & 1) ? 0 : SPICON_CKE) | SPICON_ON;
+}
+
+void _spi_speed(uint8_t fast)
+{
+	SPI2CONCLR = SPICON_ON;
+	SPI2BRG = fast ? SPI_HW_BRG : SPI_HW_BRG_SLOW;
+	SPI2CONSET = SPICON_ON;
+}
+
+uint8_t _spi_transfer(uint8_t data)
+{
+	SPI2BUF = data;
+	while (!(SPI2STAT & SPISTAT_SPIRBF));
+
+	return SPI2BUF;
+}
+
 /* hardware dependent basic kernel stuff */
 void _cpu_idle(void)
 {
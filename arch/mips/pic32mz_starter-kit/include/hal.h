@@ -41,6 +41,16 @@ typedef void				(*funcptr)();
 #define SPI_MISO			(1 << 4)
 #define SPI_IRQ0			(1 << 5)
 
+/* hardware SPI (SPI2: SCK2 on RG6, SDO2 on RG8, SDI2 on RG7, chip select on the software SPI
+pin), used by the SPI driver if SPI_HW is 1. SCK2 is a fixed function of RG6, and RG7 / RG8 are
+remappable (PPS) pins on both the 100 and 144 pin PIC32MZ packages. the bus starts at the slow
+clock (SD cards are initialized at 100 - 400kHz) and is switched with _spi_speed() */
+#ifndef SPI_HW
+#define SPI_HW				0
+#endif
+#define SPI_HW_BRG			1		/* SCK = PBCLK2 / (2 * (SPI_HW_BRG + 1)), 25MHz */
+#define SPI_HW_BRG_SLOW			124		/* 400kHz */
+
 #define STACK_MAGIC			0xb00bb00b
 typedef uint32_t context[20];
 
@@ -63,6 +73,9 @@ void _port_write(uint32_t port, uint32_t val);
 void led_set(uint16_t led, uint8_t val);
 uint8_t button_get(uint16_t btn);
 uint8_t switch_get(uint16_t sw);
+void _spi_setup(uint8_t mode);
+void _spi_speed(uint8_t fast);
+uint8_t _spi_transfer(uint8_t data);
 
 /* hardware dependent basic kernel stuff */
 void _hardware_init(void);
@@ -24,3 +24,15 @@ void _ni_write(uint16_t data)
 	MemoryWrite(NOC_WRITE, data);
 //	asm ("nop\nnop\nnop");
 }
+
+int32_t _ni_window(uint16_t win, uint32_t base, uint32_t size, uint16_t flags)
+{
+	if (win >= MemoryRead(NOC_WIN_CTRL))
+		return 0;
+
+	MemoryWrite(NOC_WIN_BASE, base);
+	MemoryWrite(NOC_WIN_SIZE, size);
+	MemoryWrite(NOC_WIN_CTRL, win | (flags << 8));
+
+	return 1;
+}
@@ -2,9 +2,13 @@
 #define NOC_WRITE			0x20000080	/*WRITE*/
 #define NOC_STATUS			0x20000090	/*STATUS*/
 #define NOC_CTRL			0x200000C0	/*CONTROL*/
+#define NOC_WIN_BASE			0x20000100	/*RDMA WINDOW BASE*/
+#define NOC_WIN_SIZE			0x20000110	/*RDMA WINDOW SIZE*/
+#define NOC_WIN_CTRL			0x20000120	/*RDMA WINDOW CONTROL / NUMBER OF WINDOWS*/
 
 #define IRQ_NOC_READ			0x100
 
 uint16_t _ni_status(void);
 uint16_t _ni_read(void);
 void _ni_write(uint16_t data);
+int32_t _ni_window(uint16_t win, uint32_t base, uint32_t size, uint16_t flags);
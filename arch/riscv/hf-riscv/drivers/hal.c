@@ -117,6 +117,23 @@ uint8_t switch_get(uint16_t sw)
 	return 0;
 }
 
+/* hardware SPI (mode 0 only, fixed clock) */
+void _spi_setup(uint8_t mode)
+{
+}
+
+void _spi_speed(uint8_t fast)
+{
+}
+
+uint8_t _spi_transfer(uint8_t data)
+{
+	SPI0 = data;
+	while (!(SPICAUSE & MASK_SPI_READY));
+	
+	return SPI0;
+}
+
 /* hardware dependent basic kernel stuff */
 void _cpu_idle(void)
 {
@@ -293,14 +293,20 @@ typedef void				(*funcptr)();
 #define XTEA_OUT1			(*(volatile uint32_t *)(XTEA_BASE + 0x080))
 
 /* software SPI interface for GPIO */
-/* SPI read / write ports */
-#define SPI_INPORT			PAIN
-#define SPI_OUTPORT			PAOUT
+/* SPI read / write ports (addresses, for _port_read() / _port_write()) */
+#define SPI_INPORT			(GPIO_BASE + 0x4020)
+#define SPI_OUTPORT			(GPIO_BASE + 0x4010)
 #define SPI_CS0				MASK_P4
 #define SPI_SCK				MASK_P5
 #define SPI_MOSI			MASK_P6
 #define SPI_MISO			MASK_P7
 
+/* hardware SPI (SPI0, chip select on the software SPI pin), used by the SPI driver if SPI_HW is 1 */
+#ifndef SPI_HW
+#define SPI_HW				0
+#endif
+#define MASK_SPI_READY			(1 << 0)
+
 /* hardware dependent stuff */
 #define STACK_MAGIC			0xb00bb00b
 typedef uint32_t context[20];
@@ -321,6 +327,9 @@ void delay_us(uint32_t usec);
 void led_set(uint16_t led, uint8_t val);
 uint8_t button_get(uint16_t btn);
 uint8_t switch_get(uint16_t sw);
+void _spi_setup(uint8_t mode);
+void _spi_speed(uint8_t fast);
+uint8_t _spi_transfer(uint8_t data);
 
 /* hardware dependent basic kernel stuff */
 void _hardware_init(void);
@@ -1,5 +1,7 @@
 #define SDCARD_DEBUG			1
-#define SDCARD_SDHC			0
+#define SDCARD_BLOCK			512
+#define SDCARD_RETRIES			100		/* command responses and initialization */
+#define SDCARD_TIMEOUT			500000		/* data tokens and busy (bytes polled) */
 
 #define GO_IDLE_STATE			0
 #define SEND_OP_COND			1
@@ -23,5 +25,6 @@
 int32_t sdcard_open(uint32_t flags);
 int32_t sdcard_read(void *buf, uint32_t size);
 int32_t sdcard_write(void *buf, uint32_t size);
+int32_t sdcard_request(struct dev_request *req);
 int32_t sdcard_close(void);
 int32_t sdcard_ioctl(uint32_t request, void *pval);
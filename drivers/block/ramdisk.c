@@ -1,4 +1,5 @@
 #include <hellfire.h>
+#include <device.h>
 #include <block.h>
 #include <ramdisk.h>
 
@@ -13,35 +14,53 @@ int32_t ramdisk_open(uint32_t flags)
 
 int32_t ramdisk_read(void *buf, uint32_t size)
 {
-	if ((rampos > lastpos) || size < 1) {
+	if (size < 1 || rampos > lastpos || size > lastpos - rampos + 1) {
 		kprintf("\nread() error: invalid read");
 		for(;;);
 		
 		return -1;
 	}
 #if RAMDISK_DEBUG == 1
-	kprintf("\nDEBUG: read() block %d", rampos);
+	kprintf("\nDEBUG: read() block %d (%d blocks)", rampos, size);
 #endif
-	memcpy(buf, ramarena + rampos * ramdisk_info.bytes_sector, ramdisk_info.bytes_sector);
-	rampos++;
+	memcpy(buf, ramarena + rampos * ramdisk_info.bytes_sector, size * ramdisk_info.bytes_sector);
+	rampos += size;
 
 	return 0;
 }
 
 int32_t ramdisk_write(void *buf, uint32_t size)
 {
-	if ((rampos > lastpos) || size < 1) {
+	if (size < 1 || rampos > lastpos || size > lastpos - rampos + 1) {
 		kprintf("\nwrite() error: invalid write");
 		for(;;);
 		
 		return -1;
 	}
 #if RAMDISK_DEBUG == 1
-	kprintf("\nDEBUG: write() block %d", rampos);
-	hexdump(buf, ramdisk_info.bytes_sector);
+	kprintf("\nDEBUG: write() block %d (%d blocks)", rampos, size);
+	hexdump(buf, size * ramdisk_info.bytes_sector);
 #endif
-	memcpy(ramarena + rampos * ramdisk_info.bytes_sector, buf, ramdisk_info.bytes_sector);
-	rampos++;
+	memcpy(ramarena + rampos * ramdisk_info.bytes_sector, buf, size * ramdisk_info.bytes_sector);
+	rampos += size;
+	
+	return 0;
+}
+
+int32_t ramdisk_request(struct dev_request *req)
+{
+	if (req->count < 1 || req->lba > lastpos || req->count > lastpos - req->lba + 1) {
+		kprintf("\nrequest() error: invalid request");
+		
+		return -1;
+	}
+#if RAMDISK_DEBUG == 1
+	kprintf("\nDEBUG: request() %s block %d (%d blocks)", req->op == DEV_WRITE ? "write" : "read", req->lba, req->count);
+#endif
+	if (req->op == DEV_WRITE)
+		memcpy(ramarena + req->lba * ramdisk_info.bytes_sector, req->buf, req->count * ramdisk_info.bytes_sector);
+	else
+		memcpy(req->buf, ramarena + req->lba * ramdisk_info.bytes_sector, req->count * ramdisk_info.bytes_sector);
 	
 	return 0;
 }
@@ -67,8 +86,8 @@ int32_t ramdisk_ioctl(uint32_t request, void *pval)
 		ramarena = (int8_t *)hf_malloc((size_t)pval * ramdisk_info.bytes_sector);
 		if (!ramarena) return -1;		
 		rampos = 0;
-		lastpos = (int32_t)pval * ramdisk_info.bytes_sector - 1;
-		kprintf("\nKERNEL: ramdisk initialized, %d bytes", lastpos + 1);
+		lastpos = (uint32_t)pval - 1;
+		kprintf("\nKERNEL: ramdisk initialized, %d bytes", (lastpos + 1) * ramdisk_info.bytes_sector);
 		break;
 	case DISK_GETINFO:
 		infoptr = (struct blk_info *)pval;
@@ -1,126 +1,217 @@
 #include <hellfire.h>
 #include <spi.h>
+#include <device.h>
 #include <block.h>
 #include <sdcard.h>
 
+static uint32_t sd_hc;
+
 static uint8_t sd_command(uint8_t cmd, uint32_t arg)
 {
+	uint8_t frame[6];
 	uint8_t res;
+	int32_t i;
 
-#if SDCARD_SDHC == 0
-	switch (cmd) {
-	case READ_SINGLE_BLOCK:
-	case READ_MULTIPLE_BLOCKS:
-	case WRITE_SINGLE_BLOCK:
-	case WRITE_MULTIPLE_BLOCKS:
-	case ERASE_BLOCK_START_ADDR:
-	case ERASE_BLOCK_END_ADDR:
-		arg = arg << 9;
-		break;
-	default:
-		break;
+	/* standard capacity cards are byte addressed */
+	if (!sd_hc) {
+		switch (cmd) {
+		case READ_SINGLE_BLOCK:
+		case READ_MULTIPLE_BLOCKS:
+		case WRITE_SINGLE_BLOCK:
+		case WRITE_MULTIPLE_BLOCKS:
+		case ERASE_BLOCK_START_ADDR:
+		case ERASE_BLOCK_END_ADDR:
+			arg = arg << 9;
+			break;
+		default:
+			break;
+		}
 	}
-#endif
 	spi_sendrecv(0xff);
 
-	spi_sendrecv(cmd | 0x40);
-	spi_sendrecv(arg >> 24);
-	spi_sendrecv(arg >> 16);
-	spi_sendrecv(arg >> 8);
-	spi_sendrecv(arg);
-
+	frame[0] = cmd | 0x40;
+	frame[1] = arg >> 24;
+	frame[2] = arg >> 16;
+	frame[3] = arg >> 8;
+	frame[4] = arg;
 	if (cmd == SEND_IF_COND)
-		spi_sendrecv(0x87);     
-	else 
-		spi_sendrecv(0x95); 
+		frame[5] = 0x87;
+	else
+		frame[5] = 0x95;
+	spi_transfer(frame, 0, 6);
+
+	/* the byte after a stop command is not part of the response */
+	if (cmd == STOP_TRANSMISSION)
+		spi_sendrecv(0xff);
 
-	while ((res = spi_sendrecv(0xff)) == 0xff);
+	for (i = 0; i < SDCARD_RETRIES; i++)
+		if ((res = spi_sendrecv(0xff)) != 0xff) break;
 
 	return res;
 }
 
-static void sd_init(void)
+/* wait for a data token (or an error token) */
+static uint8_t sd_token(void)
 {
+	uint8_t res;
 	int32_t i;
-	
-	spi_setup(SPI_CS0, 0);
-	
-	for (i = 0; i < 10; i++)
-		spi_sendrecv(0xff);
-	
-	spi_start();
-	while (sd_command(GO_IDLE_STATE, 0) != 0x01);
-	while (sd_command(SEND_IF_COND, 0x000001AA) != 0x01);
-	while (sd_command(APP_CMD, 0) && sd_command(SD_SEND_OP_COND, 0x40000000));
-	while (sd_command(READ_OCR, 0) != 0x00);
-	
-	spi_stop();
+
+	for (i = 0; i < SDCARD_TIMEOUT; i++)
+		if ((res = spi_sendrecv(0xff)) != 0xff) break;
+
+	return res;
 }
 
-static void sd_getinfo(struct sd_raw_info *info)
+/* wait while the card is busy */
+static int32_t sd_ready(void)
 {
-	
+	int32_t i;
+
+	for (i = 0; i < SDCARD_TIMEOUT; i++)
+		if ((uint8_t)spi_sendrecv(0xff) == 0xff) return 0;
+
+	return -1;
 }
 
-static void sd_read_block(uint32_t block, uint8_t *buf)
+static int32_t sd_init(void)
 {
+	uint8_t ocr[4];
 	int32_t i;
 
+	sd_hc = 0;
+	spi_setup(SPI_CS0, 0);
+
+	for (i = 0; i < 10; i++)
+		spi_sendrecv(0xff);
+
 	spi_start();
-	
-	while (sd_command(READ_SINGLE_BLOCK, block) != 0x00);
-	while (spi_sendrecv(0xff) != 0xfe);
-	
-	for (i = 0; i < 512; i++)
-  		buf[i] = spi_sendrecv(0xff);
-	
-	spi_sendrecv(0xff); 
-	spi_sendrecv(0xff); 
-	
+	for (i = 0; sd_command(GO_IDLE_STATE, 0) != 0x01; i++)
+		if (i == SDCARD_RETRIES) goto fail;
+	if (sd_command(SEND_IF_COND, 0x000001aa) != 0x01) goto fail;
+	spi_transfer(0, ocr, 4);
+	for (i = 0; sd_command(APP_CMD, 0) > 0x01 || sd_command(SD_SEND_OP_COND, 0x40000000); i++)
+		if (i == SDCARD_TIMEOUT) goto fail;
+	if (sd_command(READ_OCR, 0)) goto fail;
+	spi_transfer(0, ocr, 4);
+	sd_hc = (ocr[0] & 0x40) ? 1 : 0;
+	if (!sd_hc && sd_command(SET_BLOCK_LEN, SDCARD_BLOCK)) goto fail;
 	spi_stop();
+	/* the card is initialized at a slow clock, and then the bus runs at full speed */
+	spi_speed(1);
+
+	return 0;
+
+fail:
+	spi_stop();
+
+	return -1;
 }
 
-static uint8_t sd_write_block(uint32_t block, uint8_t *buf)
+/* card capacity (in blocks), from the CSD register */
+static uint32_t sd_capacity(void)
 {
-	int32_t i;
-	uint8_t res;
+	uint8_t csd[18];
+	uint32_t c_size, c_size_mult, read_bl_len;
 
 	spi_start();
-	while (sd_command(WRITE_SINGLE_BLOCK, block) != 0x00);
-	
-	spi_sendrecv(0xfe);
-	for (i = 0; i < 512; i++)    
-  		spi_sendrecv(buf[i]);
-	spi_sendrecv(0xff);  
-	spi_sendrecv(0xff);
+	if (sd_command(SEND_CSD, 0) || sd_token() != 0xfe) {
+		spi_stop();
+
+		return 0;
+	}
+	spi_transfer(0, csd, 18);
+	spi_stop();
 
-	res = spi_sendrecv(0xff);
+	if ((csd[0] >> 6) == 1) {
+		c_size = ((csd[7] & 0x3f) << 16) | (csd[8] << 8) | csd[9];
 
-	if ((res & 0x1f) != 0x05) {		//res = 0bXXX0AAA1 ; AAA='010' - data accepted
-  		spi_stop();			//AAA='101' - CRC error
-						//AAA='110' - write error
-  		return res;
+		return (c_size + 1) << 10;
 	}
+	read_bl_len = csd[5] & 0x0f;
+	c_size = ((csd[6] & 0x03) << 10) | (csd[7] << 2) | (csd[8] >> 6);
+	c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
 
-	while (!spi_sendrecv(0xff));
+	return (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+}
 
+/*
+ * data transfers. runs of blocks are moved with a multiple block command (CMD18 / CMD25), so
+ * there is a single command (and a single busy wait, for writes) per run instead of per block.
+ */
+static int32_t sd_read_blocks(uint32_t block, uint8_t *buf, uint32_t count)
+{
+	uint8_t crc[2];
+	uint32_t i;
+	int32_t err = 0;
+
+	spi_start();
+	if (sd_command(count == 1 ? READ_SINGLE_BLOCK : READ_MULTIPLE_BLOCKS, block)) {
+		spi_stop();
+
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (sd_token() != 0xfe) {
+			err = -1;
+			break;
+		}
+		spi_transfer(0, buf + i * SDCARD_BLOCK, SDCARD_BLOCK);
+		spi_transfer(0, crc, 2);
+	}
+	if (count > 1) {
+		sd_command(STOP_TRANSMISSION, 0);
+		sd_ready();
+	}
 	spi_stop();
-	spi_sendrecv(0xff);
+
+	return err;
+}
+
+static int32_t sd_write_blocks(uint32_t block, uint8_t *buf, uint32_t count)
+{
+	uint8_t res;
+	uint32_t i;
+	int32_t err = 0;
 
 	spi_start();
-	while (!spi_sendrecv(0xff));
+	if (sd_command(count == 1 ? WRITE_SINGLE_BLOCK : WRITE_MULTIPLE_BLOCKS, block)) {
+		spi_stop();
+
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		spi_sendrecv(0xff);
+		spi_sendrecv(count == 1 ? 0xfe : 0xfc);
+		spi_transfer(buf + i * SDCARD_BLOCK, 0, SDCARD_BLOCK);
+		spi_transfer(0, 0, 2);
+
+		res = spi_sendrecv(0xff);
+		if ((res & 0x1f) != 0x05) {		//res = 0bXXX0AAA1 ; AAA='010' - data accepted
+			err = -1;			//AAA='101' - CRC error
+			break;				//AAA='110' - write error
+		}
+		if (sd_ready()) {
+			err = -1;
+			break;
+		}
+	}
+	if (count > 1) {
+		spi_sendrecv(0xfd);
+		spi_sendrecv(0xff);
+		if (sd_ready())
+			err = -1;
+	}
 	spi_stop();
 
-	return 0;
+	return err;
 }
 
 /*
  * sd card low level to HellfireOS wrapper
  */
-/*
 static uint32_t seekpos = -1, lastpos = -1;
 static struct blk_info sdcard_info;
- 
+
 int32_t sdcard_open(uint32_t flags)
 {
 	return 0;
@@ -128,39 +219,54 @@ int32_t sdcard_open(uint32_t flags)
 
 int32_t sdcard_read(void *buf, uint32_t size)
 {
-	if ((rampos > lastpos) || size < 1) {
+	if (size < 1 || seekpos > lastpos || size > lastpos - seekpos + 1) {
 		kprintf("\nread() error: invalid read");
-		for(;;);
-		
+
 		return -1;
 	}
-#if RAMDISK_DEBUG == 1
-	kprintf("\nDEBUG: read() block %d", rampos);
+#if SDCARD_DEBUG == 1
+	kprintf("\nDEBUG: read() block %d (%d blocks)", seekpos, size);
 #endif
-	memcpy(buf, ramarena + rampos * ramdisk_info.bytes_sector, ramdisk_info.bytes_sector);
-	rampos++;
+	if (sd_read_blocks(seekpos, buf, size))
+		return -1;
+	seekpos += size;
 
 	return 0;
 }
 
 int32_t sdcard_write(void *buf, uint32_t size)
 {
-	if ((rampos > lastpos) || size < 1) {
+	if (size < 1 || seekpos > lastpos || size > lastpos - seekpos + 1) {
 		kprintf("\nwrite() error: invalid write");
-		for(;;);
-		
+
 		return -1;
 	}
-#if RAMDISK_DEBUG == 1
-	kprintf("\nDEBUG: write() block %d", rampos);
-	hexdump(buf, ramdisk_info.bytes_sector);
+#if SDCARD_DEBUG == 1
+	kprintf("\nDEBUG: write() block %d (%d blocks)", seekpos, size);
 #endif
-	memcpy(ramarena + rampos * ramdisk_info.bytes_sector, buf, ramdisk_info.bytes_sector);
-	rampos++;
-	
+	if (sd_write_blocks(seekpos, buf, size))
+		return -1;
+	seekpos += size;
+
 	return 0;
 }
 
+int32_t sdcard_request(struct dev_request *req)
+{
+	if (req->count < 1 || req->lba > lastpos || req->count > lastpos - req->lba + 1) {
+		kprintf("\nrequest() error: invalid request");
+
+		return -1;
+	}
+#if SDCARD_DEBUG == 1
+	kprintf("\nDEBUG: request() %s block %d (%d blocks)", req->op == DEV_WRITE ? "write" : "read", req->lba, req->count);
+#endif
+	if (req->op == DEV_WRITE)
+		return sd_write_blocks(req->lba, req->buf, req->count);
+	else
+		return sd_read_blocks(req->lba, req->buf, req->count);
+}
+
 int32_t sdcard_close(void)
 {
 	return 0;
@@ -169,41 +275,45 @@ int32_t sdcard_close(void)
 int32_t sdcard_ioctl(uint32_t request, void *pval)
 {
 	static struct blk_info *infoptr;
-	
+
 	switch (request){
 	case DISK_INIT:
+		if (sd_init()) {
+			kprintf("\nKERNEL: sdcard not found");
+
+			return -1;
+		}
 		sdcard_info.num_cylinders = 0;
 		sdcard_info.num_heads = 0;
 		sdcard_info.sectors_track = 0;
-		sdcard_info.num_sectors = (uint32_t)pval;
-		sdcard_info.bytes_sector = 512;
+		sdcard_info.num_sectors = sd_capacity();
+		sdcard_info.bytes_sector = SDCARD_BLOCK;
 		sdcard_info.media_desc = 0x3000;
-		
+		if (!sdcard_info.num_sectors) return -1;
+
 		seekpos = 0;
-		lastpos = (int32_t)pval * ramdisk_info.bytes_sector - 1;
-		kprintf("\nKERNEL: sdcard initialized, %d bytes", lastpos + 1);
+		lastpos = sdcard_info.num_sectors - 1;
+		kprintf("\nKERNEL: sdcard initialized, %d blocks (%s)", sdcard_info.num_sectors, sd_hc ? "SDHC" : "SDSC");
 		break;
 	case DISK_GETINFO:
 		infoptr = (struct blk_info *)pval;
-		*infoptr = ramdisk_info;
+		*infoptr = sdcard_info;
 		break;
 	case DISK_SEEKSET:
-		rampos = (uint32_t)pval;
+		seekpos = (uint32_t)pval;
 		break;
 	case DISK_SEEKCUR:
-		return rampos;
+		return seekpos;
 	case DISK_SEEKEND:
-		rampos = lastpos;
+		seekpos = lastpos;
 		break;
 	case DISK_FINISH:
-		hf_free(ramarena);
-		rampos = -1;
+		seekpos = -1;
 		lastpos = -1;
 		break;
 	default:
 		return -1;
 	}
-	
+
 	return 0;
 }
-*/
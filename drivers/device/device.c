@@ -1,5 +1,6 @@
 #include <hellfire.h>
 #include <device.h>
+#include <block.h>
 
 int32_t hf_dev_open(struct device *dev, uint32_t flags)
 {
@@ -49,3 +50,170 @@ int32_t hf_dev_ioctl(struct device *dev, uint32_t request, void *pval)
 {
 	return dev->dev_ioctl(request, pval);
 }
+
+/*
+ * block requests. a whole transfer (count sectors from lba) is given to the driver on a single
+ * call, if the driver takes requests. otherwise, the device is positioned and then read or
+ * written (as a single multiple sector transfer). synchronous requests are always done by the
+ * calling task. while the I/O task runs, transfers hold a lock, so drivers are never entered by
+ * two tasks at the same time. synchronous requests are not ordered with queued ones, so a task
+ * waits for its own asynchronous requests before a synchronous request on the same blocks.
+ */
+static struct queue *dev_requests;
+static sem_t dev_pending;
+static mutex_t dev_lock;
+
+static int32_t dev_transfer(struct dev_request *req)
+{
+	struct device *dev = req->dev;
+	
+	if (dev->dev_request)
+		return dev->dev_request(req);
+	
+	if (dev->dev_ioctl(DISK_SEEKSET, (void *)(size_t)req->lba))
+		return -1;
+	if (req->op == DEV_WRITE)
+		return dev->dev_write(req->buf, req->count);
+	else
+		return dev->dev_read(req->buf, req->count);
+}
+
+static int32_t dev_locked(struct dev_request *req)
+{
+	int32_t err;
+	
+	if (!dev_requests)
+		return dev_transfer(req);
+	
+	hf_mtxlock(&dev_lock);
+	err = dev_transfer(req);
+	hf_mtxunlock(&dev_lock);
+	
+	return err;
+}
+
+static int32_t dev_blkrequest(struct device *dev, uint32_t op, uint32_t lba, void *buf, uint32_t count)
+{
+	struct dev_request req;
+	int32_t err;
+	
+	req.dev = dev;
+	req.op = op;
+	req.lba = lba;
+	req.count = count;
+	req.buf = buf;
+	req.callback = 0;
+	req.done = 0;
+	err = dev_locked(&req);
+	if (err)
+		kprintf("\nhf_dev_%sblk: error (block %d, %d blocks)", op == DEV_WRITE ? "write" : "read", lba, count);
+	
+	return err;
+}
+
+int32_t hf_dev_readblk(struct device *dev, uint32_t lba, void *buf, uint32_t count)
+{
+	return dev_blkrequest(dev, DEV_READ, lba, buf, count);
+}
+
+int32_t hf_dev_writeblk(struct device *dev, uint32_t lba, void *buf, uint32_t count)
+{
+	return dev_blkrequest(dev, DEV_WRITE, lba, buf, count);
+}
+
+/*
+ * asynchronous requests. submitted requests are kept on a queue, served in order by an I/O task
+ * (started by hf_dev_queue()). when a request is done, its status is set, the callback is
+ * called (from the I/O task) and the semaphore is posted. without the I/O task, requests are
+ * done when submitted.
+ */
+static void dev_complete(struct dev_request *req, int32_t status)
+{
+	req->status = status;
+	if (req->callback)
+		req->callback(req);
+	if (req->done)
+		hf_sempost(req->done);
+}
+
+static void dev_service(void)
+{
+	struct dev_request *req;
+	uint32_t status;
+	
+	for (;;) {
+		hf_semwait(&dev_pending);
+		status = _di();
+		req = hf_queue_remhead(dev_requests);
+		_ei(status);
+		if (req)
+			dev_complete(req, dev_locked(req));
+	}
+}
+
+int32_t hf_dev_queue(void)
+{
+	int32_t id;
+	
+	if (dev_requests)
+		return hf_id("dev I/O");
+	
+	dev_requests = hf_queue_create(DEV_QUEUE_SIZE);
+	if (!dev_requests)
+		return ERR_OUT_OF_MEMORY;
+	hf_seminit(&dev_pending, 0);
+	hf_mtxinit(&dev_lock);
+	
+	id = hf_spawn(dev_service, 0, 0, 0, "dev I/O", 1024);
+	if (id < 0) {
+		hf_semdestroy(&dev_pending);
+		hf_queue_destroy(dev_requests);
+		dev_requests = 0;
+	}
+	
+	return id;
+}
+
+static int32_t dev_enqueue(struct dev_request *req)
+{
+	uint32_t status;
+	int32_t err;
+	
+	req->status = DEV_PENDING;
+	status = _di();
+	err = hf_queue_addtail(dev_requests, req);
+	_ei(status);
+	if (err)
+		return -1;
+	hf_sempost(&dev_pending);
+	
+	return 0;
+}
+
+int32_t hf_dev_submit(struct dev_request *req)
+{
+	req->status = DEV_PENDING;
+	if (!dev_requests) {
+		dev_complete(req, dev_transfer(req));
+		
+		return 0;
+	}
+	
+	if (dev_enqueue(req)) {
+		kprintf("\nhf_dev_submit: request queue full");
+		
+		return -1;
+	}
+	
+	return 0;
+}
+
+int32_t hf_dev_wait(struct dev_request *req)
+{
+	if (req->done)
+		hf_semwait(req->done);
+	while (req->status == DEV_PENDING)
+		hf_yield();
+	
+	return req->status;
+}
@@ -2,15 +2,40 @@
 #define SEEK_CUR		1
 #define SEEK_END		2
 
+#define DEV_READ		0
+#define DEV_WRITE		1
+
+#define DEV_PENDING		1			/* status of a request not done yet */
+
+#ifndef DEV_QUEUE_SIZE
+#define DEV_QUEUE_SIZE		16			/* asynchronous requests queued (all devices) */
+#endif
+
+struct dev_request;
+
 struct device {
 	int32_t (*dev_open)(uint32_t flags);
-	int32_t (*dev_read)(void *buf, uint32_t size);		/* size is ignored for block devices */
+	int32_t (*dev_read)(void *buf, uint32_t size);		/* size is the number of sectors for block devices */
 	int32_t (*dev_write)(void *buf, uint32_t size);
 	int32_t (*dev_close)(void);
 	int32_t (*dev_ioctl)(uint32_t request, void *pval);
 	void *ptr;						/* pointer to device specific data
 								(e.g struct fs_blkdevice, struct blk_device
 								or struct chr_device) */
+	int32_t (*dev_request)(struct dev_request *req);	/* block transfer (optional, seek and read / write
+								are used otherwise) */
+};
+
+/* block device request: count sectors from lba */
+struct dev_request {
+	struct device *dev;
+	uint32_t op;						/* DEV_READ or DEV_WRITE */
+	uint32_t lba;
+	uint32_t count;
+	void *buf;
+	volatile int32_t status;				/* DEV_PENDING, then the result of the transfer */
+	void (*callback)(struct dev_request *req);		/* called when the request is done (optional) */
+	sem_t *done;						/* posted when the request is done (optional) */
 };
 
 int32_t hf_dev_open(struct device *dev, uint32_t flags);
@@ -18,3 +43,9 @@ int32_t hf_dev_read(struct device *dev, void *buf, uint32_t size);
 int32_t hf_dev_write(struct device *dev, void *buf, uint32_t size);
 int32_t hf_dev_close(struct device *dev);
 int32_t hf_dev_ioctl(struct device *dev, uint32_t request, void *pval);
+
+int32_t hf_dev_readblk(struct device *dev, uint32_t lba, void *buf, uint32_t count);
+int32_t hf_dev_writeblk(struct device *dev, uint32_t lba, void *buf, uint32_t count);
+int32_t hf_dev_queue(void);
+int32_t hf_dev_submit(struct dev_request *req);
+int32_t hf_dev_wait(struct dev_request *req);
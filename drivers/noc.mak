@@ -2,4 +2,6 @@ noc:
 	$(CC) $(CFLAGS) \
 		$(SRC_DIR)/drivers/noc/ni_hermes.c \
 		$(SRC_DIR)/drivers/noc/noc.c \
-		$(SRC_DIR)/drivers/noc/noc_rpc.c
+		$(SRC_DIR)/drivers/noc/noc_rpc.c \
+		$(SRC_DIR)/drivers/noc/noc_coll.c \
+		$(SRC_DIR)/drivers/noc/noc_rdma.c
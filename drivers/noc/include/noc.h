@@ -32,6 +32,17 @@
 #define PKT_SEQ			6
 #define PKT_CHANNEL		7
 
+#define PKT_PRIO_SHIFT		8		/*!< packet priority, on the high byte of the target flit */
+#define PKT_PRIO(flit)		(((flit) >> PKT_PRIO_SHIFT) & 0x1)
+#define NOC_PRIO_NORMAL		0		/*!< bulk traffic */
+#define NOC_PRIO_HIGH		1		/*!< latency critical traffic (control messages, RPC replies) */
+
+#define NOC_KERNEL_PORT		65520		/*!< ports from here up are reserved for kernel services (RPC, RDMA) */
+
+#ifndef NOC_PACKET_SLOTS_HIGH
+#define NOC_PACKET_SLOTS_HIGH	8		/*!< slots in the high priority packet pool */
+#endif
+
 #define NOC_COLUMN(core_n)	((core_n) % NOC_WIDTH)
 #define NOC_LINE(core_n)	((core_n) / NOC_WIDTH)
 
@@ -45,26 +56,87 @@ uint16_t pktdrv_ports[MAX_TASKS];
  */
 struct queue *pktdrv_tqueue[MAX_TASKS];
 
+/**
+ * @brief Array of packet priorities used by tasks when sending.
+ */
+uint16_t pktdrv_prio[MAX_TASKS];
+
 /**
  * @brief Queue of free (shared) packets. The number of packets is NOC_PACKET_SLOTS.
  */
 struct queue *pktdrv_queue;
 
+/**
+ * @brief Queue of free (shared) packets for high priority traffic. The number of packets is
+ * NOC_PACKET_SLOTS_HIGH.
+ */
+struct queue *pktdrv_hqueue;
+
+/**
+ * @brief Pool a packet belongs to (according to its priority).
+ */
+#define NOC_POOL(buf)		(PKT_PRIO((buf)[PKT_TARGET_CPU]) ? pktdrv_hqueue : pktdrv_queue)
+
 /**
  * @brief Callback function pointer. Called when PKT_TARGET_PORT is 0xffff.
  */
 int32_t (*pktdrv_callback)(uint16_t *buf);
 
+/**
+ * @brief Remote memory access handler. Called when PKT_TARGET_PORT is RDMA_PORT (see noc_rdma.h).
+ */
+int32_t (*pktdrv_rdma)(uint16_t *buf);
+
+/**
+ * @brief Packet driver statistics (per core).
+ */
+struct noc_stats_s {
+	uint32_t tx_packets;				/*!< packets injected in the network */
+	uint32_t tx_messages;				/*!< messages sent */
+	uint32_t rx_packets;				/*!< packets delivered to a task queue or callback */
+	uint32_t rx_messages;				/*!< messages received */
+	uint32_t drop_pool;				/*!< packets dropped, shared pool exhausted */
+	uint32_t drop_queue;				/*!< packets dropped, task queue full */
+	uint32_t drop_port;				/*!< packets dropped, no task on target port */
+	uint32_t drop_invalid;				/*!< packets dropped, invalid header */
+	uint32_t recv_retries;				/*!< out of order packets skipped during message reassembly */
+	uint32_t seq_errors;				/*!< messages received with sequence errors */
+	uint32_t ack_timeouts;				/*!< acknowledgements not received in time */
+	uint16_t pool_hwm;				/*!< high-watermark of buffers in use from the shared pool */
+	uint16_t hpool_hwm;				/*!< high-watermark of buffers in use from the high priority pool */
+	uint32_t tx_core[NOC_WIDTH * NOC_HEIGHT];	/*!< packets sent to each core */
+	uint32_t rx_core[NOC_WIDTH * NOC_HEIGHT];	/*!< packets received from each core */
+};
+
+/**
+ * @brief Packet driver statistics (per port).
+ */
+struct noc_portstats_s {
+	uint32_t rx_packets;				/*!< packets put on the task queue */
+	uint32_t drop_queue;				/*!< packets dropped, task queue full */
+	uint16_t queue_hwm;				/*!< high-watermark of packets waiting on the task queue */
+};
+
+struct noc_stats_s pktdrv_stats;
+struct noc_portstats_s pktdrv_portstats[MAX_TASKS];
+
 void ni_init(void);
 void ni_isr(void *arg);
+int32_t ni_comm_create(uint16_t id, uint16_t port, uint16_t packets);
 
 uint16_t hf_cpuid(void);
 uint16_t hf_ncores(void);
 int32_t hf_comm_create(uint16_t id, uint16_t port, uint16_t packets);
 int32_t hf_comm_destroy(uint16_t id);
+int32_t hf_comm_priority(uint16_t id, uint16_t priority);
 int32_t hf_recvprobe(void);
 int32_t hf_recv(uint16_t *source_cpu, uint16_t *source_port, int8_t *buf, uint16_t *size, uint16_t channel);
 int32_t hf_send(uint16_t target_cpu, uint16_t target_port, int8_t *buf, uint16_t size, uint16_t channel);
 int32_t hf_recvack(uint16_t *source_cpu, uint16_t *source_port, int8_t *buf, uint16_t *size, uint16_t channel);
 int32_t hf_sendack(uint16_t target_cpu, uint16_t target_port, int8_t *buf, uint16_t size, uint16_t channel, uint32_t timeout);
 // hf_request(), hf_reply()
+int32_t hf_noc_stats(struct noc_stats_s *stats);
+int32_t hf_noc_portstats(uint16_t port, struct noc_portstats_s *stats);
+void hf_noc_stats_reset(void);
+void hf_noc_stats_dump(void);
+int32_t hf_noc_stats_monitor(uint32_t period);
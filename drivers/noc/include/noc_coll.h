@@ -0,0 +1,44 @@
+/**
+ * @file noc_coll.h
+ * @author Sergio Johann Filho
+ * @date October 2026
+ *
+ * @section LICENSE
+ *
+ * This source code is licensed under the GNU General Public License,
+ * Version 2.  See the file 'doc/license/gpl-2.0.txt' for more details.
+ *
+ * @section DESCRIPTION
+ *
+ * Collective communication (broadcast, scatter, gather, reduce and barrier) on top of the
+ * Network-on-Chip primitives.
+ */
+
+#ifndef _NOC_COLL
+#define _NOC_COLL
+
+#if NOC_WIDTH > 16 || NOC_HEIGHT > 16
+#error "collectives are limited to 16x16 meshes (4 bit packet addresses)"
+#endif
+
+/* tree levels per mesh dimension, log2 of the largest dimension (rounded up) */
+#define COLL_LEVELS		((NOC_WIDTH > 8 || NOC_HEIGHT > 8) ? 4 : (NOC_WIDTH > 4 || NOC_HEIGHT > 4) ? 3 : \
+				(NOC_WIDTH > 2 || NOC_HEIGHT > 2) ? 2 : 1)
+#define COLL_CHANNELS		(4 * COLL_LEVELS)	/*!< channels used by a collective, starting at the base channel */
+
+#define COLL_UP			0
+#define COLL_DOWN		1
+#define COLL_DIM_X		0
+#define COLL_DIM_Y		1
+
+int32_t hf_coll_barrier(uint16_t port, uint16_t channel);
+int32_t hf_coll_bcast(uint16_t root, uint16_t port, int8_t *buf, uint16_t size, uint16_t channel);
+int32_t hf_coll_scatter(uint16_t root, uint16_t port, int8_t *sendbuf, int8_t *recvbuf, uint16_t size, uint16_t channel);
+int32_t hf_coll_gather(uint16_t root, uint16_t port, int8_t *sendbuf, int8_t *recvbuf, uint16_t size, uint16_t channel);
+int32_t hf_coll_reduce(uint16_t root, uint16_t port, int8_t *buf, uint16_t size, void (*op)(int8_t *, int8_t *, uint16_t), uint16_t channel);
+int32_t hf_coll_allreduce(uint16_t port, int8_t *buf, uint16_t size, void (*op)(int8_t *, int8_t *, uint16_t), uint16_t channel);
+void hf_coll_sum(int8_t *acc, int8_t *in, uint16_t size);
+void hf_coll_min(int8_t *acc, int8_t *in, uint16_t size);
+void hf_coll_max(int8_t *acc, int8_t *in, uint16_t size);
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ * @file noc_rdma.h
+ * @author Sergio Johann Filho
+ * @date October 2026
+ *
+ * @section LICENSE
+ *
+ * This source code is licensed under the GNU General Public License,
+ * Version 2.  See the file 'doc/license/gpl-2.0.txt' for more details.
+ *
+ * @section DESCRIPTION
+ *
+ * One-sided remote memory access (put / get) on registered memory windows, on top of the
+ * Network-on-Chip primitives.
+ */
+
+#ifndef _NOC_RDMA
+#define _NOC_RDMA
+
+#define RDMA_PORT		65534
+#define RDMA_WINDOWS		8
+
+#define RDMA_PUT		1
+#define RDMA_GET		2
+
+#define RDMA_OFFSET_HI		8
+#define RDMA_OFFSET_LO		9
+#define RDMA_CHANNEL		10
+#define RDMA_HEADER_SIZE	11
+
+#define RDMA_DEFERRED		1			/* a get request, kept by the RDMA task */
+
+#define RDMA_GET_PACKETS	4			/* reply packets of a get request */
+#define RDMA_GET_MAX		(RDMA_GET_PACKETS * (NOC_PACKET_SIZE - PKT_HEADER_SIZE) * sizeof(uint16_t))
+
+#define WIN_READ		0x01
+#define WIN_WRITE		0x02
+
+struct noc_win_s {
+	int8_t *base;
+	uint32_t size;
+	uint16_t flags;
+};
+
+struct noc_win_s noc_windows[RDMA_WINDOWS];
+
+int32_t hf_win_create(uint16_t win, int8_t *base, uint32_t size, uint16_t flags);
+int32_t hf_win_destroy(uint16_t win);
+int32_t hf_put(uint16_t cpu, uint16_t win, uint32_t offset, int8_t *buf, uint16_t size);
+int32_t hf_get(uint16_t cpu, uint16_t win, uint32_t offset, int8_t *buf, uint16_t size, uint16_t channel);
+
+#endif
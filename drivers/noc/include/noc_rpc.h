@@ -21,13 +21,19 @@
 #define RPC_STACK_SIZE		2048
 #define RPC_SCHANNEL		65534
 #define RPC_PORT		65535
+#define RPC_WORKER_PORT		NOC_KERNEL_PORT
+#define RPC_HASH_SIZE		16
 
-struct noc_rpc_s {
-	uint16_t thread_id;
-	struct list *proc_list;
-};
+#ifndef RPC_WORKERS
+#define RPC_WORKERS		1
+#endif
 
-struct noc_rpc_s noc_rpcdrv;
+/* the first worker is on RPC_PORT, the others on RPC_WORKER_PORT + 1 and up (below RDMA_PORT) */
+#if RPC_WORKERS > 14
+#error "too many RPC workers (the reserved port range holds 14)"
+#endif
+
+#define RPC_CHANNEL(cpu, call)	(RPC_SCHANNEL - ((cpu) * RPC_MAX_PARALLEL_CALLS + (call)))
 
 struct proc_param_s {
 	uint32_t prognum;
@@ -35,8 +41,21 @@ struct proc_param_s {
 	int32_t (*proc_ptr)(int8_t *, int8_t *);
 	uint16_t in_size;
 	uint16_t out_size;
-	int8_t *in_data;
+	struct proc_param_s *next;
+};
+
+struct noc_rpc_s {
+	uint16_t thread_id[RPC_WORKERS];
+	struct proc_param_s *proc_table[RPC_HASH_SIZE];
+};
+
+struct noc_rpc_s noc_rpcdrv;
+
+struct proc_call_s {
+	uint16_t task_id;
+	uint16_t busy;
 	int8_t *out_data;
+	uint16_t out_size;
 };
 
 struct proc_pkt_s {
@@ -56,5 +75,8 @@ mutex_t rpc_lock;
 
 int32_t hf_register(uint32_t prognum, uint32_t procnum, int32_t (*pname)(int8_t *, int8_t *), uint16_t in_size, uint16_t out_size);
 int32_t hf_call(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, uint16_t in_size, int8_t *out, uint16_t out_size);
+int32_t hf_call_async(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, uint16_t in_size, int8_t *out, uint16_t out_size);
+int32_t hf_call_probe(int32_t call_id);
+int32_t hf_call_wait(int32_t call_id);
 
 #endif
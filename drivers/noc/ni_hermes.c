@@ -78,3 +78,12 @@ retry:
 
 	return 0;
 }
+
+int32_t ni_window(uint16_t win, uint32_t base, uint32_t size, uint16_t flags)
+{
+#ifdef NOC_WIN_CTRL
+	return _ni_window(win, base, size, flags);
+#else
+	return 0;
+#endif
+}
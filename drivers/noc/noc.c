@@ -40,6 +40,7 @@
 #include <noc.h>
 #include <ni.h>
 #include <ni_generic.h>
+#include <noc_rdma.h>
 
 /**
  * @brief NoC driver: initializes the network interface.
@@ -56,13 +57,19 @@ void ni_init(void)
 	void *ptr;
 
 	kprintf("\nKERNEL: this is core #%d", CPU_ID);
-	kprintf("\nKERNEL: NoC queue init, %d packets", NOC_PACKET_SLOTS);
+	kprintf("\nKERNEL: NoC queue init, %d packets (%d high priority)", NOC_PACKET_SLOTS, NOC_PACKET_SLOTS_HIGH);
 
 	pktdrv_queue = hf_queue_create(NOC_PACKET_SLOTS);
 	if (pktdrv_queue == NULL) panic(PANIC_OOM);
+	pktdrv_hqueue = hf_queue_create(NOC_PACKET_SLOTS_HIGH);
+	if (pktdrv_hqueue == NULL) panic(PANIC_OOM);
 
-	for (i = 0; i < MAX_TASKS; i++)
+	for (i = 0; i < MAX_TASKS; i++){
 		pktdrv_ports[i] = 0;
+		pktdrv_prio[i] = NOC_PRIO_NORMAL;
+	}
+
+	hf_noc_stats_reset();
 
 	for (i = 0; i < NOC_PACKET_SLOTS; i++){
 		ptr = hf_malloc(sizeof(int16_t) * NOC_PACKET_SIZE);
@@ -70,6 +77,12 @@ void ni_init(void)
 		hf_queue_addtail(pktdrv_queue, ptr);
 	}
 
+	for (i = 0; i < NOC_PACKET_SLOTS_HIGH; i++){
+		ptr = hf_malloc(sizeof(int16_t) * NOC_PACKET_SIZE);
+		if (ptr == NULL) panic(PANIC_OOM);
+		hf_queue_addtail(pktdrv_hqueue, ptr);
+	}
+
 	i = ni_flush(NOC_PACKET_SIZE);
 	if (i){
 		_irq_register(IRQ_NOC_READ, (funcptr)ni_isr);
@@ -89,39 +102,82 @@ void ni_init(void)
  * contents of the empty packet are filled with flits from the hardware queue and the reference is
  * put on the target task (associated to a port) queue of packets. There is one queue per task of
  * configurable size (individual queues are elastic if size is zero, limited to the size of free
- * buffer elements from the common pool). If port 0xffff (65535) is used as the target, the packet
- * is passed to a callback. This mechanism can be used to build custom OS functions (such as user
- * defined protocols, RPC or remote system calls). Port 0 is used as a discard function, for testing
- * purposes.
+ * buffer elements from the common pool).
+ *
+ * There are two pools, one per packet priority. As the priority is known only after the packet is
+ * read, a buffer is borrowed from the other pool when needed and exchanged later for an empty
+ * buffer of the right pool (or the packet is dropped).
+ *
+ * Packets on port 0xffff (65535) are passed to a callback, which can be used to build custom OS
+ * functions (user defined protocols, RPC or remote system calls). Packets on RDMA_PORT (65534) are
+ * served by the RDMA handler (gets are replied later by the RDMA task). Port 0 is a discard port,
+ * for testing purposes. Delivered and dropped packets are accounted on the driver statistics.
  */
 void ni_isr(void *arg)
 {
 	int32_t k;
-	uint16_t *buf_ptr;
-
-	buf_ptr = hf_queue_remhead(pktdrv_queue);
+	uint16_t *buf_ptr, *ptr, used;
+	struct queue *pool;
+
+	pool = pktdrv_queue;
+	buf_ptr = hf_queue_remhead(pool);
+	if (!buf_ptr) {
+		pool = pktdrv_hqueue;
+		buf_ptr = hf_queue_remhead(pool);
+	}
 	if (buf_ptr) {
 		ni_read_packet(buf_ptr, NOC_PACKET_SIZE);
 
+		if (NOC_POOL(buf_ptr) != pool){
+			ptr = hf_queue_remhead(NOC_POOL(buf_ptr));
+			if (!ptr){
+				kprintf("\nKERNEL: NoC queue full! dropping packet...");
+				pktdrv_stats.drop_pool++;
+				hf_queue_addtail(pool, buf_ptr);
+				return;
+			}
+			hf_queue_addtail(pool, ptr);
+		}
+
+		used = NOC_PACKET_SLOTS - hf_queue_count(pktdrv_queue);
+		if (used > pktdrv_stats.pool_hwm)
+			pktdrv_stats.pool_hwm = used;
+		used = NOC_PACKET_SLOTS_HIGH - hf_queue_count(pktdrv_hqueue);
+		if (used > pktdrv_stats.hpool_hwm)
+			pktdrv_stats.hpool_hwm = used;
+
 		if (buf_ptr[PKT_PAYLOAD] != NOC_PACKET_SIZE - 2){
-			hf_queue_addtail(pktdrv_queue, buf_ptr);
+			pktdrv_stats.drop_invalid++;
+			hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 			return;
 		}
 
-		if (buf_ptr[PKT_TARGET_CPU] != ((NOC_COLUMN(CPU_ID) << 4) | NOC_LINE(CPU_ID))){
+		if ((buf_ptr[PKT_TARGET_CPU] & 0xff) != ((NOC_COLUMN(CPU_ID) << 4) | NOC_LINE(CPU_ID))){
 			kprintf("\nKERNEL: hardware error: this is not CPU X:%d Y:%d", (buf_ptr[PKT_TARGET_CPU] & 0xf0) >> 4, buf_ptr[PKT_TARGET_CPU] & 0xf);
-			hf_queue_addtail(pktdrv_queue, buf_ptr);
+			pktdrv_stats.drop_invalid++;
+			hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 			return;
 		}
 
+		if (buf_ptr[PKT_SOURCE_CPU] < NOC_WIDTH * NOC_HEIGHT)
+			pktdrv_stats.rx_core[buf_ptr[PKT_SOURCE_CPU]]++;
+
 		switch (buf_ptr[PKT_TARGET_PORT]) {
 		case 0x0000:
-			hf_queue_addtail(pktdrv_queue, buf_ptr);
+			hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 			return;
 		case 0xffff:
+			pktdrv_stats.rx_packets++;
 			if (pktdrv_callback)
 				pktdrv_callback(buf_ptr);
-			hf_queue_addtail(pktdrv_queue, buf_ptr);
+			hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
+			return;
+		case RDMA_PORT:
+			if (!pktdrv_rdma)
+				break;
+			pktdrv_stats.rx_packets++;
+			if (pktdrv_rdma(buf_ptr) != RDMA_DEFERRED)
+				hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 			return;
 		default:
 			break;
@@ -133,14 +189,24 @@ void ni_isr(void *arg)
 		if (k < MAX_TASKS && krnl_tcb[k].ptask){
 			if (hf_queue_addtail(pktdrv_tqueue[k], buf_ptr)){
 				kprintf("\nKERNEL: task (on port %d) queue full! dropping packet...", buf_ptr[PKT_TARGET_PORT]);
-				hf_queue_addtail(pktdrv_queue, buf_ptr);
+				pktdrv_stats.drop_queue++;
+				pktdrv_portstats[k].drop_queue++;
+				hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
+			}else{
+				pktdrv_stats.rx_packets++;
+				pktdrv_portstats[k].rx_packets++;
+				used = hf_queue_count(pktdrv_tqueue[k]);
+				if (used > pktdrv_portstats[k].queue_hwm)
+					pktdrv_portstats[k].queue_hwm = used;
 			}
 		}else{
 			kprintf("\nKERNEL: no task on port %d (offender: cpu %d port %d) - dropping packet...", buf_ptr[PKT_TARGET_PORT], buf_ptr[PKT_SOURCE_CPU], buf_ptr[PKT_SOURCE_PORT]);
-			hf_queue_addtail(pktdrv_queue, buf_ptr);
+			pktdrv_stats.drop_port++;
+			hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 		}
 	}else{
 		kprintf("\nKERNEL: NoC queue full! dropping packet...");
+		pktdrv_stats.drop_pool++;
 		ni_flush(NOC_PACKET_SIZE);
 	}
 
@@ -176,7 +242,8 @@ uint16_t hf_ncores(void)
  *
  * @return ERR_OK when successful, ERR_INVALID_ID if no task matches the specified id, ERR_COMM_UNFEASIBLE
  * if there is already a communication queue for the task, ERR_COMM_ERROR if there is already another task
- * using the specified port and ERR_OUT_OF_MEMORY if the systems runs out of memory.
+ * using the specified port or the port is reserved (NOC_KERNEL_PORT and above) and ERR_OUT_OF_MEMORY if
+ * the systems runs out of memory.
  *
  * The queue created for the task will be used for the reception of data. Both ni_isr() and hf_recv()
  * routines will manage the queue, putting and pulling packets from the queue on demand. The communication
@@ -187,6 +254,20 @@ uint16_t hf_ncores(void)
  * to the task for the reception of data. This is the default, and should be used in most situations.
  */
 int32_t hf_comm_create(uint16_t id, uint16_t port, uint16_t packets)
+{
+	if (port >= NOC_KERNEL_PORT)
+		return ERR_COMM_ERROR;
+
+	return ni_comm_create(id, port, packets);
+}
+
+/**
+ * @brief Creates a communication queue for a task, on any port.
+ *
+ * Same as hf_comm_create(), but ports reserved for kernel services are allowed. Used by the
+ * drivers which own these ports.
+ */
+int32_t ni_comm_create(uint16_t id, uint16_t port, uint16_t packets)
 {
 	int32_t k;
 
@@ -211,6 +292,8 @@ int32_t hf_comm_create(uint16_t id, uint16_t port, uint16_t packets)
 		return ERR_OUT_OF_MEMORY;
 	}else{
 		pktdrv_ports[id] = port;
+		pktdrv_prio[id] = NOC_PRIO_NORMAL;
+		memset(&pktdrv_portstats[id], 0, sizeof(struct noc_portstats_s));
 
 		return ERR_OK;
 	}
@@ -228,6 +311,7 @@ int32_t hf_comm_create(uint16_t id, uint16_t port, uint16_t packets)
 int32_t hf_comm_destroy(uint16_t id)
 {
 	int32_t status;
+	uint16_t *buf_ptr;
 
 	if (id < MAX_TASKS){
 		if (krnl_tcb[id].ptask == 0)
@@ -237,8 +321,10 @@ int32_t hf_comm_destroy(uint16_t id)
 	}
 
 	status = _di();
-	while (hf_queue_count(pktdrv_tqueue[id]))
-		hf_queue_addtail(pktdrv_queue, hf_queue_remhead(pktdrv_tqueue[id]));
+	while (hf_queue_count(pktdrv_tqueue[id])){
+		buf_ptr = hf_queue_remhead(pktdrv_tqueue[id]);
+		hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
+	}
 	_ei(status);
 
 	if (hf_queue_destroy(pktdrv_tqueue[id])){
@@ -251,6 +337,31 @@ int32_t hf_comm_destroy(uint16_t id)
 
 }
 
+/**
+ * @brief Sets the priority of packets sent by a task.
+ *
+ * @param id is the task id which owns the communication queue
+ * @param priority is the packet priority (NOC_PRIO_NORMAL or NOC_PRIO_HIGH)
+ *
+ * @return ERR_OK when successful, ERR_INVALID_ID if no task matches the specified id and
+ * ERR_INVALID_PARAMETER on an invalid priority.
+ *
+ * High priority packets are routed first by the network and are received on a separate pool of
+ * buffers, so latency critical messages (control messages, RPC replies) are not delayed by bulk
+ * transfers. The priority is reset to NOC_PRIO_NORMAL when the communication queue is created.
+ */
+int32_t hf_comm_priority(uint16_t id, uint16_t priority)
+{
+	if (id >= MAX_TASKS || krnl_tcb[id].ptask == 0)
+		return ERR_INVALID_ID;
+	if (priority > NOC_PRIO_HIGH)
+		return ERR_INVALID_PARAMETER;
+
+	pktdrv_prio[id] = priority;
+
+	return ERR_OK;
+}
+
 /**
  * @brief Probes for a message from a task.
 
@@ -321,6 +432,7 @@ int32_t hf_recv(uint16_t *source_cpu, uint16_t *source_port, int8_t *buf, uint16
 			status = _di();
 			buf_ptr = hf_queue_remhead(pktdrv_tqueue[id]);
 			hf_queue_addtail(pktdrv_tqueue[id], buf_ptr);
+			pktdrv_stats.recv_retries++;
 			_ei(status);
 		}
 	}
@@ -346,7 +458,7 @@ int32_t hf_recv(uint16_t *source_cpu, uint16_t *source_port, int8_t *buf, uint16
 			buf[p++] = (uint8_t)(buf_ptr[i] & 0xff);
 		}
 		status = _di();
-		hf_queue_addtail(pktdrv_queue, buf_ptr);
+		hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 		_ei(status);
 
 		i = 0;
@@ -360,6 +472,7 @@ int32_t hf_recv(uint16_t *source_cpu, uint16_t *source_port, int8_t *buf, uint16
 				status = _di();
 				buf_ptr = hf_queue_remhead(pktdrv_tqueue[id]);
 				hf_queue_addtail(pktdrv_tqueue[id], buf_ptr);
+				pktdrv_stats.recv_retries++;
 				_ei(status);
 				if (i++ > NOC_PACKET_SLOTS << 3) break;
 			}
@@ -377,7 +490,10 @@ int32_t hf_recv(uint16_t *source_cpu, uint16_t *source_port, int8_t *buf, uint16
 		buf[p++] = (uint8_t)(buf_ptr[i] & 0xff);
 	}
 	status = _di();
-	hf_queue_addtail(pktdrv_queue, buf_ptr);
+	hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
+	pktdrv_stats.rx_messages++;
+	if (error)
+		pktdrv_stats.seq_errors++;
 	_ei(status);
 
 	return error;
@@ -410,7 +526,7 @@ int32_t hf_send(uint16_t target_cpu, uint16_t target_port, int8_t *buf, uint16_t
 	packets = (size % payload_bytes == 0) ? (size / payload_bytes) : (size / payload_bytes + 1);
 
 	while (++packet < packets){
-		out_buf[PKT_TARGET_CPU] = (NOC_COLUMN(target_cpu) << 4) | NOC_LINE(target_cpu);
+		out_buf[PKT_TARGET_CPU] = (pktdrv_prio[id] << PKT_PRIO_SHIFT) | (NOC_COLUMN(target_cpu) << 4) | NOC_LINE(target_cpu);
 		out_buf[PKT_PAYLOAD] = NOC_PACKET_SIZE - 2;
 		out_buf[PKT_SOURCE_CPU] = hf_cpuid();
 		out_buf[PKT_SOURCE_PORT] = pktdrv_ports[id];
@@ -425,7 +541,12 @@ int32_t hf_send(uint16_t target_cpu, uint16_t target_port, int8_t *buf, uint16_t
 		ni_write_packet(out_buf, NOC_PACKET_SIZE);
 	}
 
-	out_buf[PKT_TARGET_CPU] = (NOC_COLUMN(target_cpu) << 4) | NOC_LINE(target_cpu);
+	pktdrv_stats.tx_packets += packets ? packets : 1;
+	pktdrv_stats.tx_messages++;
+	if (target_cpu < NOC_WIDTH * NOC_HEIGHT)
+		pktdrv_stats.tx_core[target_cpu] += packets ? packets : 1;
+
+	out_buf[PKT_TARGET_CPU] = (pktdrv_prio[id] << PKT_PRIO_SHIFT) | (NOC_COLUMN(target_cpu) << 4) | NOC_LINE(target_cpu);
 	out_buf[PKT_PAYLOAD] = NOC_PACKET_SIZE - 2;
 	out_buf[PKT_SOURCE_CPU] = hf_cpuid();
 	out_buf[PKT_SOURCE_PORT] = pktdrv_ports[id];
@@ -516,10 +637,165 @@ int32_t hf_sendack(uint16_t target_cpu, uint16_t target_port, int8_t *buf, uint1
 				if (buf_ptr)
 					if (buf_ptr[PKT_CHANNEL] == 65535 && buf_ptr[PKT_MSG_SIZE] == 3) break;
 			}
-			if (((_read_us() / 1000) - time) > timeout) return ERR_COMM_TIMEOUT;
+			if (((_read_us() / 1000) - time) > timeout){
+				pktdrv_stats.ack_timeouts++;
+				return ERR_COMM_TIMEOUT;
+			}
 		}
 		hf_recv(&source_cpu, &source_port, ack, &size, 65535);
 	}
 
 	return error;
 }
+
+/**
+ * @brief Returns the packet driver statistics of this core.
+ *
+ * @param stats is a pointer to a structure which will hold a copy of the statistics
+ *
+ * @return ERR_OK.
+ *
+ * Counters are kept for sent and received packets and messages, dropped packets (by reason),
+ * out of order packets skipped during message reassembly (on hf_recv()), acknowledgement timeouts
+ * (on hf_sendack()) and the high-watermark of buffers in use from the shared pool. Packets sent to
+ * and received from each core are accounted separately, so communication hot spots can be found.
+ */
+int32_t hf_noc_stats(struct noc_stats_s *stats)
+{
+	uint32_t status;
+
+	status = _di();
+	memcpy(stats, &pktdrv_stats, sizeof(struct noc_stats_s));
+	_ei(status);
+
+	return ERR_OK;
+}
+
+/**
+ * @brief Returns the packet driver statistics of a reception port.
+ *
+ * @param port is the reception port of a task
+ * @param stats is a pointer to a structure which will hold a copy of the statistics
+ *
+ * @return ERR_OK when successful and ERR_COMM_ERROR if no task is using the specified port.
+ *
+ * The high-watermark of the task queue can be used to size its communication queue (on hf_comm_create())
+ * and the shared pool of packets (NOC_PACKET_SLOTS).
+ */
+int32_t hf_noc_portstats(uint16_t port, struct noc_portstats_s *stats)
+{
+	uint32_t status;
+	int32_t k;
+
+	for (k = 0; k < MAX_TASKS; k++)
+		if (pktdrv_ports[k] == port && pktdrv_tqueue[k]) break;
+
+	if (k == MAX_TASKS)
+		return ERR_COMM_ERROR;
+
+	status = _di();
+	memcpy(stats, &pktdrv_portstats[k], sizeof(struct noc_portstats_s));
+	_ei(status);
+
+	return ERR_OK;
+}
+
+/**
+ * @brief Clears the packet driver statistics (per core and per port).
+ */
+void hf_noc_stats_reset(void)
+{
+	uint32_t status;
+
+	status = _di();
+	memset(&pktdrv_stats, 0, sizeof(struct noc_stats_s));
+	memset(pktdrv_portstats, 0, sizeof(pktdrv_portstats));
+	_ei(status);
+}
+
+/**
+ * @brief Prints the packet driver statistics (per core and per port).
+ *
+ * Counters are copied one line at a time (the whole structure is too large for the stack
+ * of a small task), so lines may be slightly out of step with each other. Only cores which
+ * exchanged packets with this core are listed.
+ */
+void hf_noc_stats_dump(void)
+{
+	struct noc_portstats_s portstats;
+	uint32_t status, v[4];
+	int32_t k;
+
+	kprintf("\nKERNEL: NoC stats, core %d", CPU_ID);
+
+	status = _di();
+	v[0] = pktdrv_stats.tx_packets;
+	v[1] = pktdrv_stats.tx_messages;
+	v[2] = pktdrv_stats.rx_packets;
+	v[3] = pktdrv_stats.rx_messages;
+	_ei(status);
+	kprintf("\ntx: %d packets, %d messages", v[0], v[1]);
+	kprintf("\nrx: %d packets, %d messages", v[2], v[3]);
+
+	status = _di();
+	v[0] = pktdrv_stats.drop_pool;
+	v[1] = pktdrv_stats.drop_queue;
+	v[2] = pktdrv_stats.drop_port;
+	v[3] = pktdrv_stats.drop_invalid;
+	_ei(status);
+	kprintf("\ndropped: %d (pool), %d (queue), %d (port), %d (invalid)", v[0], v[1], v[2], v[3]);
+
+	status = _di();
+	v[0] = pktdrv_stats.recv_retries;
+	v[1] = pktdrv_stats.seq_errors;
+	v[2] = pktdrv_stats.ack_timeouts;
+	_ei(status);
+	kprintf("\nreassembly retries: %d, sequence errors: %d, ack timeouts: %d", v[0], v[1], v[2]);
+
+	status = _di();
+	v[0] = pktdrv_stats.pool_hwm;
+	v[1] = pktdrv_stats.hpool_hwm;
+	_ei(status);
+	kprintf("\npool high-watermark: %d of %d packets (high priority: %d of %d)", v[0], NOC_PACKET_SLOTS, v[1], NOC_PACKET_SLOTS_HIGH);
+
+	for (k = 0; k < NOC_WIDTH * NOC_HEIGHT; k++){
+		status = _di();
+		v[0] = pktdrv_stats.tx_core[k];
+		v[1] = pktdrv_stats.rx_core[k];
+		_ei(status);
+		if (v[0] || v[1])
+			kprintf("\ncore %d: %d packets sent, %d packets received", k, v[0], v[1]);
+	}
+
+	for (k = 0; k < MAX_TASKS; k++){
+		if (pktdrv_tqueue[k] && pktdrv_ports[k]){
+			hf_noc_portstats(pktdrv_ports[k], &portstats);
+			kprintf("\nport %d (task %d): %d packets, %d dropped, queue high-watermark: %d of %d packets",
+				pktdrv_ports[k], k, portstats.rx_packets, portstats.drop_queue, portstats.queue_hwm, pktdrv_tqueue[k]->size);
+		}
+	}
+}
+
+static uint32_t noc_stats_period;
+
+static void noc_stats_monitor(void)
+{
+	for (;;){
+		delay_ms(noc_stats_period);
+		hf_noc_stats_dump();
+	}
+}
+
+/**
+ * @brief Spawns a task which prints the packet driver statistics periodically.
+ *
+ * @param period is the time (in ms) between statistics dumps
+ *
+ * @return the task id when successful, or an error code from hf_spawn().
+ */
+int32_t hf_noc_stats_monitor(uint32_t period)
+{
+	noc_stats_period = period;
+
+	return hf_spawn(noc_stats_monitor, 0, 0, 0, "NoC stats", 1024);
+}
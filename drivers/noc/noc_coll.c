@@ -0,0 +1,500 @@
+/**
+ * @file noc_coll.c
+ * @author Sergio Johann Filho
+ * @date October 2026
+ *
+ * @section LICENSE
+ *
+ * This source code is licensed under the GNU General Public License,
+ * Version 2.  See the file 'doc/license/gpl-2.0.txt' for more details.
+ *
+ * @section DESCRIPTION
+ *
+ * Collective communication on top of the Network-on-Chip primitives. All collectives involve
+ * one task on every core of the mesh, and all of them must use the same port (each task calls
+ * hf_comm_create() with that port before the first collective). Cores are arranged in a virtual
+ * mesh relative to the root (the root is always at 0, 0) and data flows in dimension order, as
+ * two binomial trees: first along the row of the root (X) and then along every column (Y), or
+ * in the reverse order for gather and reduce. This matches the XY routing of the NoC, so
+ * messages of a tree level never share links, and a collective finishes in about
+ * log2(NOC_WIDTH) + log2(NOC_HEIGHT) steps instead of hf_ncores() - 1 sequential messages.
+ *
+ * Each tree level uses its own message channel, so messages from different children are never
+ * mixed up on reception. A collective uses COLL_CHANNELS channels, starting from the selected
+ * channel, and these should not be used by other messages on the same port. Messages are also
+ * matched by their source core, as a core may already be in the next collective: a message from
+ * a core other than the expected peer is kept until a later collective asks for it.
+ */
+
+#include <hellfire.h>
+#include <noc.h>
+#include <noc_coll.h>
+
+struct coll_msg_s {
+	uint16_t id, cpu, channel, size;
+	int8_t *data;
+	struct coll_msg_s *next;
+};
+
+static struct coll_msg_s *coll_pending;
+
+static uint16_t coll_core(uint16_t root, uint16_t rx, uint16_t ry)
+{
+	return ((NOC_LINE(root) + ry) % NOC_HEIGHT) * NOC_WIDTH + (NOC_COLUMN(root) + rx) % NOC_WIDTH;
+}
+
+static uint16_t coll_channel(uint16_t channel, int32_t dir, int32_t dim, uint16_t mask)
+{
+	uint16_t level = 0;
+
+	while (mask >>= 1)
+		level++;
+
+	return channel + (dir * 2 + dim) * COLL_LEVELS + level;
+}
+
+/* number of nodes in the subtree of node r, on a binomial tree of n nodes */
+static uint16_t coll_span(uint16_t r, uint16_t n)
+{
+	uint16_t low;
+
+	if (r == 0)
+		return n;
+
+	low = r & (~r + 1);
+
+	return (low < n - r) ? low : n - r;
+}
+
+/* source and size of the first message waiting on a channel */
+static uint16_t coll_probe(uint16_t id, uint16_t channel, uint16_t *size)
+{
+	uint32_t status;
+	int32_t i, k;
+	uint16_t *buf_ptr, cpu;
+
+	while (1){
+		status = _di();
+		k = hf_queue_count(pktdrv_tqueue[id]);
+		for (i = 0; i < k; i++){
+			buf_ptr = hf_queue_get(pktdrv_tqueue[id], i);
+			if (buf_ptr && buf_ptr[PKT_CHANNEL] == channel && buf_ptr[PKT_SEQ] == 1){
+				cpu = buf_ptr[PKT_SOURCE_CPU];
+				*size = buf_ptr[PKT_MSG_SIZE];
+				_ei(status);
+
+				return cpu;
+			}
+		}
+		_ei(status);
+	}
+}
+
+/* receives a message from a peer, keeping messages from other cores on the same channel */
+static int32_t coll_recv(uint16_t cpu, int8_t *buf, uint16_t size, uint16_t channel)
+{
+	struct coll_msg_s *msg, **m;
+	uint16_t id, rcpu, port, rsize;
+	uint32_t status;
+	int32_t error;
+
+	id = hf_selfid();
+	if (pktdrv_tqueue[id] == NULL) return ERR_COMM_UNFEASIBLE;
+
+	while (1){
+		status = _di();
+		for (m = &coll_pending; *m; m = &(*m)->next)
+			if ((*m)->id == id && (*m)->cpu == cpu && (*m)->channel == channel) break;
+		msg = *m;
+		if (msg)
+			*m = msg->next;
+		_ei(status);
+
+		if (msg){
+			error = (msg->size == size) ? ERR_OK : ERR_COMM_ERROR;
+			if (error == ERR_OK)
+				memcpy(buf, msg->data, size);
+			hf_free(msg);
+
+			return error;
+		}
+
+		if (coll_probe(id, channel, &rsize) == cpu && rsize == size)
+			return hf_recv(&rcpu, &port, buf, &rsize, channel);
+
+		/* one byte more for an odd sized message (see hf_coll_scatter()) */
+		msg = (struct coll_msg_s *)hf_malloc(sizeof(struct coll_msg_s) + rsize + 1);
+		if (!msg) return ERR_OUT_OF_MEMORY;
+		msg->data = (int8_t *)(msg + 1);
+		error = hf_recv(&rcpu, &port, msg->data, &rsize, channel);
+		if (error || rcpu == cpu){
+			hf_free(msg);
+
+			return error ? error : ERR_COMM_ERROR;
+		}
+		msg->id = id;
+		msg->cpu = rcpu;
+		msg->channel = channel;
+		msg->size = rsize;
+		msg->next = NULL;
+
+		status = _di();
+		for (m = &coll_pending; *m; m = &(*m)->next);
+		*m = msg;
+		_ei(status);
+	}
+}
+
+/*
+ * data flows from the root to the leaves along one dimension. for a broadcast every node
+ * receives and forwards the same chunk, for a scatter a node receives the data of its whole
+ * subtree (span chunks) and forwards to each child the part belonging to the child subtree.
+ */
+static int32_t coll_down(uint16_t root, int32_t dim, uint16_t rx, uint16_t ry, uint16_t port, int8_t *buf, uint16_t chunk, uint16_t channel, int32_t scatter)
+{
+	uint16_t n, r, c, mask = 1;
+	int32_t error = ERR_OK;
+
+	n = (dim == COLL_DIM_X) ? NOC_WIDTH : NOC_HEIGHT;
+	r = (dim == COLL_DIM_X) ? rx : ry;
+
+	while (mask < n) {
+		if (r & mask) {
+			c = r - mask;
+			error = coll_recv(dim == COLL_DIM_X ? coll_core(root, c, ry) : coll_core(root, rx, c),
+				buf, scatter ? coll_span(r, n) * chunk : chunk, coll_channel(channel, COLL_DOWN, dim, mask));
+			if (error) return error;
+			break;
+		}
+		mask <<= 1;
+	}
+
+	for (mask >>= 1; mask > 0; mask >>= 1) {
+		c = r + mask;
+		if (c < n) {
+			if (scatter)
+				error = hf_send(dim == COLL_DIM_X ? coll_core(root, c, ry) : coll_core(root, rx, c), port,
+					buf + mask * chunk, coll_span(c, n) * chunk, coll_channel(channel, COLL_DOWN, dim, mask));
+			else
+				error = hf_send(dim == COLL_DIM_X ? coll_core(root, c, ry) : coll_core(root, rx, c), port,
+					buf, chunk, coll_channel(channel, COLL_DOWN, dim, mask));
+			if (error) return error;
+		}
+	}
+
+	return ERR_OK;
+}
+
+/*
+ * data flows from the leaves to the root along one dimension. if a reduction operator is
+ * given, data from each child is received on tmp and combined into buf, otherwise (gather)
+ * data from the subtree of each child is appended to buf, in subtree order.
+ */
+static int32_t coll_up(uint16_t root, int32_t dim, uint16_t rx, uint16_t ry, uint16_t port, int8_t *buf, uint16_t chunk, uint16_t channel, void (*op)(int8_t *, int8_t *, uint16_t), int8_t *tmp)
+{
+	uint16_t n, r, c, mask;
+	int32_t error;
+
+	n = (dim == COLL_DIM_X) ? NOC_WIDTH : NOC_HEIGHT;
+	r = (dim == COLL_DIM_X) ? rx : ry;
+
+	for (mask = 1; mask < n; mask <<= 1) {
+		if (r & mask) {
+			c = r - mask;
+			return hf_send(dim == COLL_DIM_X ? coll_core(root, c, ry) : coll_core(root, rx, c), port,
+				buf, op ? chunk : coll_span(r, n) * chunk, coll_channel(channel, COLL_UP, dim, mask));
+		}
+		c = r + mask;
+		if (c < n) {
+			if (op) {
+				error = coll_recv(dim == COLL_DIM_X ? coll_core(root, c, ry) : coll_core(root, rx, c),
+					tmp, chunk, coll_channel(channel, COLL_UP, dim, mask));
+				if (error) return error;
+				op(buf, tmp, chunk);
+			} else {
+				error = coll_recv(dim == COLL_DIM_X ? coll_core(root, c, ry) : coll_core(root, rx, c),
+					buf + mask * chunk, coll_span(c, n) * chunk, coll_channel(channel, COLL_UP, dim, mask));
+				if (error) return error;
+			}
+		}
+	}
+
+	return ERR_OK;
+}
+
+/**
+ * @brief Synchronizes all cores (blocking).
+ *
+ * @param port is the port used by the collective on all cores
+ * @param channel is the first of the COLL_CHANNELS message channels used by the collective
+ *
+ * @return ERR_OK when successful, ERR_COMM_ERROR on a protocol error or ERR_OUT_OF_MEMORY if
+ * the system runs out of memory.
+ *
+ * The calling task returns only after a task on every other core has entered the barrier.
+ */
+int32_t hf_coll_barrier(uint16_t port, uint16_t channel)
+{
+	int8_t token[2] = {0, 0};
+
+	/* a reduction of a single byte with no data to combine, followed by a broadcast */
+	return hf_coll_allreduce(port, token, 1, hf_coll_max, channel);
+}
+
+/**
+ * @brief Broadcasts a message from a root core to all cores (blocking).
+ *
+ * @param root is the core which holds the message
+ * @param port is the port used by the collective on all cores
+ * @param buf is a pointer to a buffer that holds the message on the root, or will hold it on the other cores
+ * @param size is the size (in bytes) of the message
+ * @param channel is the first of the COLL_CHANNELS message channels used by the collective
+ *
+ * @return ERR_OK when successful, ERR_INVALID_CPU if the root is not part of the mesh and
+ * ERR_COMM_ERROR on a protocol error.
+ */
+int32_t hf_coll_bcast(uint16_t root, uint16_t port, int8_t *buf, uint16_t size, uint16_t channel)
+{
+	uint16_t rx, ry;
+	int32_t error = ERR_OK;
+
+	if (root >= hf_ncores())
+		return ERR_INVALID_CPU;
+
+	rx = (NOC_COLUMN(hf_cpuid()) + NOC_WIDTH - NOC_COLUMN(root)) % NOC_WIDTH;
+	ry = (NOC_LINE(hf_cpuid()) + NOC_HEIGHT - NOC_LINE(root)) % NOC_HEIGHT;
+
+	if (ry == 0)
+		error = coll_down(root, COLL_DIM_X, rx, ry, port, buf, size, channel, 0);
+	if (error == ERR_OK)
+		error = coll_down(root, COLL_DIM_Y, rx, ry, port, buf, size, channel, 0);
+
+	return error;
+}
+
+/**
+ * @brief Distributes parts of a message from a root core to all cores (blocking).
+ *
+ * @param root is the core which holds the message
+ * @param port is the port used by the collective on all cores
+ * @param sendbuf is a pointer to a buffer that holds hf_ncores() parts, in core order (used on the root only)
+ * @param recvbuf is a pointer to a buffer that will hold the part for this core
+ * @param size is the size (in bytes) of each part
+ * @param channel is the first of the COLL_CHANNELS message channels used by the collective
+ *
+ * @return ERR_OK when successful, ERR_INVALID_CPU if the root is not part of the mesh,
+ * ERR_COMM_UNFEASIBLE if the whole message is larger than 65535 bytes, ERR_COMM_ERROR on a
+ * protocol error and ERR_OUT_OF_MEMORY if the system runs out of memory.
+ *
+ * Intermediate cores in the tree hold (and forward) the parts of their whole subtree, so a
+ * temporary buffer of that size is allocated during the collective.
+ */
+int32_t hf_coll_scatter(uint16_t root, uint16_t port, int8_t *sendbuf, int8_t *recvbuf, uint16_t size, uint16_t channel)
+{
+	uint16_t rx, ry, x, y;
+	uint32_t len;
+	int32_t error = ERR_OK;
+	int8_t *tmp;
+
+	if (root >= hf_ncores())
+		return ERR_INVALID_CPU;
+	if ((uint32_t)hf_ncores() * size > 0xffff)
+		return ERR_COMM_UNFEASIBLE;
+
+	rx = (NOC_COLUMN(hf_cpuid()) + NOC_WIDTH - NOC_COLUMN(root)) % NOC_WIDTH;
+	ry = (NOC_LINE(hf_cpuid()) + NOC_HEIGHT - NOC_LINE(root)) % NOC_HEIGHT;
+
+	if (ry == 0)
+		len = coll_span(rx, NOC_WIDTH) * NOC_HEIGHT * size;
+	else
+		len = coll_span(ry, NOC_HEIGHT) * size;
+
+	/* one byte more: hf_recv() stores whole flits, so an odd sized message takes one more byte */
+	tmp = (int8_t *)hf_malloc(len + 1);
+	if (!tmp) return ERR_OUT_OF_MEMORY;
+
+	/* parts are reordered as columns of the virtual mesh, so each subtree is contiguous */
+	if (hf_cpuid() == root)
+		for (x = 0; x < NOC_WIDTH; x++)
+			for (y = 0; y < NOC_HEIGHT; y++)
+				memcpy(tmp + (x * NOC_HEIGHT + y) * size, sendbuf + coll_core(root, x, y) * size, size);
+
+	if (ry == 0)
+		error = coll_down(root, COLL_DIM_X, rx, ry, port, tmp, NOC_HEIGHT * size, channel, 1);
+	if (error == ERR_OK)
+		error = coll_down(root, COLL_DIM_Y, rx, ry, port, tmp, size, channel, 1);
+	if (error == ERR_OK)
+		memcpy(recvbuf, tmp, size);
+
+	hf_free(tmp);
+
+	return error;
+}
+
+/**
+ * @brief Collects parts of a message from all cores on a root core (blocking).
+ *
+ * @param root is the core which will hold the message
+ * @param port is the port used by the collective on all cores
+ * @param sendbuf is a pointer to a buffer that holds the part of this core
+ * @param recvbuf is a pointer to a buffer that will hold hf_ncores() parts, in core order (used on the root only)
+ * @param size is the size (in bytes) of each part
+ * @param channel is the first of the COLL_CHANNELS message channels used by the collective
+ *
+ * @return ERR_OK when successful, ERR_INVALID_CPU if the root is not part of the mesh,
+ * ERR_COMM_UNFEASIBLE if the whole message is larger than 65535 bytes, ERR_COMM_ERROR on a
+ * protocol error and ERR_OUT_OF_MEMORY if the system runs out of memory.
+ */
+int32_t hf_coll_gather(uint16_t root, uint16_t port, int8_t *sendbuf, int8_t *recvbuf, uint16_t size, uint16_t channel)
+{
+	uint16_t rx, ry, x, y;
+	uint32_t len;
+	int32_t error;
+	int8_t *tmp;
+
+	if (root >= hf_ncores())
+		return ERR_INVALID_CPU;
+	if ((uint32_t)hf_ncores() * size > 0xffff)
+		return ERR_COMM_UNFEASIBLE;
+
+	rx = (NOC_COLUMN(hf_cpuid()) + NOC_WIDTH - NOC_COLUMN(root)) % NOC_WIDTH;
+	ry = (NOC_LINE(hf_cpuid()) + NOC_HEIGHT - NOC_LINE(root)) % NOC_HEIGHT;
+
+	if (ry == 0)
+		len = coll_span(rx, NOC_WIDTH) * NOC_HEIGHT * size;
+	else
+		len = coll_span(ry, NOC_HEIGHT) * size;
+
+	/* one byte more for an odd sized message (see hf_coll_scatter()) */
+	tmp = (int8_t *)hf_malloc(len + 1);
+	if (!tmp) return ERR_OUT_OF_MEMORY;
+
+	memcpy(tmp, sendbuf, size);
+	error = coll_up(root, COLL_DIM_Y, rx, ry, port, tmp, size, channel, 0, 0);
+	if (error == ERR_OK && ry == 0)
+		error = coll_up(root, COLL_DIM_X, rx, ry, port, tmp, NOC_HEIGHT * size, channel, 0, 0);
+
+	if (error == ERR_OK && hf_cpuid() == root)
+		for (x = 0; x < NOC_WIDTH; x++)
+			for (y = 0; y < NOC_HEIGHT; y++)
+				memcpy(recvbuf + coll_core(root, x, y) * size, tmp + (x * NOC_HEIGHT + y) * size, size);
+
+	hf_free(tmp);
+
+	return error;
+}
+
+/**
+ * @brief Combines messages from all cores on a root core (blocking).
+ *
+ * @param root is the core which will hold the result
+ * @param port is the port used by the collective on all cores
+ * @param buf is a pointer to a buffer that holds the data of this core, and the result on the root
+ * @param size is the size (in bytes) of the data
+ * @param op is the reduction operator, which combines its second argument into the first
+ * @param channel is the first of the COLL_CHANNELS message channels used by the collective
+ *
+ * @return ERR_OK when successful, ERR_INVALID_CPU if the root is not part of the mesh,
+ * ERR_COMM_ERROR on a protocol error and ERR_OUT_OF_MEMORY if the system runs out of memory.
+ *
+ * The reduction is performed in place, so on cores other than the root the buffer will hold
+ * a partial result after the call. The operator must be associative and commutative, such as
+ * hf_coll_sum(), hf_coll_min() and hf_coll_max().
+ */
+int32_t hf_coll_reduce(uint16_t root, uint16_t port, int8_t *buf, uint16_t size, void (*op)(int8_t *, int8_t *, uint16_t), uint16_t channel)
+{
+	uint16_t rx, ry;
+	int32_t error;
+	int8_t *tmp;
+
+	if (root >= hf_ncores())
+		return ERR_INVALID_CPU;
+
+	rx = (NOC_COLUMN(hf_cpuid()) + NOC_WIDTH - NOC_COLUMN(root)) % NOC_WIDTH;
+	ry = (NOC_LINE(hf_cpuid()) + NOC_HEIGHT - NOC_LINE(root)) % NOC_HEIGHT;
+
+	/* one byte more for an odd sized message (see hf_coll_scatter()) */
+	tmp = (int8_t *)hf_malloc(size + 1);
+	if (!tmp) return ERR_OUT_OF_MEMORY;
+
+	error = coll_up(root, COLL_DIM_Y, rx, ry, port, buf, size, channel, op, tmp);
+	if (error == ERR_OK && ry == 0)
+		error = coll_up(root, COLL_DIM_X, rx, ry, port, buf, size, channel, op, tmp);
+
+	hf_free(tmp);
+
+	return error;
+}
+
+/**
+ * @brief Combines messages from all cores, and distributes the result to all cores (blocking).
+ *
+ * @param port is the port used by the collective on all cores
+ * @param buf is a pointer to a buffer that holds the data of this core, and the result on return
+ * @param size is the size (in bytes) of the data
+ * @param op is the reduction operator, which combines its second argument into the first
+ * @param channel is the first of the COLL_CHANNELS message channels used by the collective
+ *
+ * @return ERR_OK when successful, ERR_COMM_ERROR on a protocol error and ERR_OUT_OF_MEMORY if
+ * the system runs out of memory.
+ *
+ * This is a reduction to core 0 followed by a broadcast of the result.
+ */
+int32_t hf_coll_allreduce(uint16_t port, int8_t *buf, uint16_t size, void (*op)(int8_t *, int8_t *, uint16_t), uint16_t channel)
+{
+	int32_t error;
+
+	error = hf_coll_reduce(0, port, buf, size, op, channel);
+	if (error == ERR_OK)
+		error = hf_coll_bcast(0, port, buf, size, channel);
+
+	return error;
+}
+
+/**
+ * @brief Reduction operator, sum of 32 bit integer vectors.
+ *
+ * @param acc is a pointer to the accumulated vector
+ * @param in is a pointer to the vector to be combined
+ * @param size is the size (in bytes) of the vectors
+ */
+void hf_coll_sum(int8_t *acc, int8_t *in, uint16_t size)
+{
+	int32_t *a = (int32_t *)acc, *b = (int32_t *)in;
+	uint16_t i;
+
+	for (i = 0; i < size / sizeof(int32_t); i++)
+		a[i] += b[i];
+}
+
+/**
+ * @brief Reduction operator, minimum of 32 bit integer vectors.
+ *
+ * @param acc is a pointer to the accumulated vector
+ * @param in is a pointer to the vector to be combined
+ * @param size is the size (in bytes) of the vectors
+ */
+void hf_coll_min(int8_t *acc, int8_t *in, uint16_t size)
+{
+	int32_t *a = (int32_t *)acc, *b = (int32_t *)in;
+	uint16_t i;
+
+	for (i = 0; i < size / sizeof(int32_t); i++)
+		if (b[i] < a[i]) a[i] = b[i];
+}
+
+/**
+ * @brief Reduction operator, maximum of 32 bit integer vectors.
+ *
+ * @param acc is a pointer to the accumulated vector
+ * @param in is a pointer to the vector to be combined
+ * @param size is the size (in bytes) of the vectors
+ */
+void hf_coll_max(int8_t *acc, int8_t *in, uint16_t size)
+{
+	int32_t *a = (int32_t *)acc, *b = (int32_t *)in;
+	uint16_t i;
+
+	for (i = 0; i < size / sizeof(int32_t); i++)
+		if (b[i] > a[i]) a[i] = b[i];
+}
@@ -0,0 +1,352 @@
+/**
+ * @file noc_rdma.c
+ * @author Sergio Johann Filho
+ * @date October 2026
+ *
+ * @section LICENSE
+ *
+ * This source code is licensed under the GNU General Public License,
+ * Version 2.  See the file 'doc/license/gpl-2.0.txt' for more details.
+ *
+ * @section DESCRIPTION
+ *
+ * One-sided remote memory access on top of the Network-on-Chip primitives. A core exposes
+ * memory windows (hf_win_create()) and other cores write to (hf_put()) or read from (hf_get())
+ * them with no intervention of an application task on the target core. Requests are sent to
+ * RDMA_PORT, and are served by the network interface (when the hardware supports it, and the
+ * window is also registered on the NI) or else by the NoC driver. Puts are written to the window
+ * by the interrupt handler, and gets are queued to a service task, so the interrupt handler never
+ * waits for the network to accept a reply. Replies to a get are regular messages, received by the
+ * caller on the selected channel, with the same priority of the request.
+ *
+ * Request packet format is as follows:
+ *
+ \verbatim
+  2 bytes   2 bytes   2 bytes   2 bytes   2 bytes   2 bytes   2 bytes   2 bytes   2 bytes   2 bytes   2 bytes      ....
+ ------------------------------------------------------------------------------------------------------------------------------
+ |tgt_cpu  |payload  |src_cpu  |src_port |RDMA_PORT|size     |op       |window   |offset hi|offset lo|channel  | ... data ... |
+ ------------------------------------------------------------------------------------------------------------------------------
+ \endverbatim
+ *
+ * The size field is the number of data bytes carried by a put packet, or the number of bytes
+ * requested by a get. Puts are not acknowledged, but packets from the same source follow the
+ * same path on the network, so a message sent after a put is delivered after the put is complete.
+ */
+
+#include <hellfire.h>
+#include <noc.h>
+#include <ni.h>
+#include <ni_generic.h>
+#include <noc_rdma.h>
+
+static struct queue *rdma_requests;
+static sem_t rdma_pending;
+
+static void rdma_header(uint16_t *buf, uint16_t prio, uint16_t target_cpu, uint16_t source_port, uint16_t target_port, uint16_t size, uint16_t seq, uint16_t channel)
+{
+	buf[PKT_TARGET_CPU] = (prio << PKT_PRIO_SHIFT) | (NOC_COLUMN(target_cpu) << 4) | NOC_LINE(target_cpu);
+	buf[PKT_PAYLOAD] = NOC_PACKET_SIZE - 2;
+	buf[PKT_SOURCE_CPU] = hf_cpuid();
+	buf[PKT_SOURCE_PORT] = source_port;
+	buf[PKT_TARGET_PORT] = target_port;
+	buf[PKT_MSG_SIZE] = size;
+	buf[PKT_SEQ] = seq;
+	buf[PKT_CHANNEL] = channel;
+}
+
+/*
+ * a get is replied as a regular message (same format used by hf_send()). packets are injected
+ * directly on the network interface.
+ */
+static void rdma_reply(uint16_t *req, int8_t *data, uint16_t size)
+{
+	uint16_t packet = 0, packets, payload_bytes;
+	uint16_t out_buf[NOC_PACKET_SIZE];
+	int32_t i, p = 0;
+
+	payload_bytes = (NOC_PACKET_SIZE - PKT_HEADER_SIZE) * sizeof(uint16_t);
+	packets = (size % payload_bytes == 0) ? (size / payload_bytes) : (size / payload_bytes + 1);
+	if (packets == 0)
+		packets = 1;
+
+	while (packet++ < packets){
+		rdma_header(out_buf, PKT_PRIO(req[PKT_TARGET_CPU]), req[PKT_SOURCE_CPU], RDMA_PORT, req[PKT_SOURCE_PORT], size, packet, req[RDMA_CHANNEL]);
+
+		for (i = PKT_HEADER_SIZE; i < NOC_PACKET_SIZE && p < size; i++, p += 2)
+			out_buf[i] = ((uint8_t)data[p] << 8) | (p + 1 < size ? (uint8_t)data[p+1] : 0);
+		for (; i < NOC_PACKET_SIZE; i++)
+			out_buf[i] = 0xdead;
+
+		ni_write_packet(out_buf, NOC_PACKET_SIZE);
+	}
+}
+
+/*
+ * get requests are served by the RDMA task, in order. the request packet is returned to the
+ * pool once the reply is sent. an invalid get (unknown window, access out of the window bounds
+ * or not allowed, or larger than RDMA_GET_MAX) is replied with an empty message.
+ */
+static void rdma_get(uint16_t *buf)
+{
+	struct noc_win_s *win;
+	uint32_t offset;
+	uint16_t size;
+
+	offset = ((uint32_t)buf[RDMA_OFFSET_HI] << 16) | buf[RDMA_OFFSET_LO];
+	size = buf[PKT_MSG_SIZE];
+	win = buf[PKT_CHANNEL] < RDMA_WINDOWS ? &noc_windows[buf[PKT_CHANNEL]] : NULL;
+
+	if (!win || !(win->flags & WIN_READ) || offset > win->size || size > win->size - offset ||
+		size > RDMA_GET_MAX)
+		rdma_reply(buf, NULL, 0);
+	else
+		rdma_reply(buf, win->base + offset, size);
+}
+
+static void rdma_service(void)
+{
+	uint16_t *buf;
+	uint32_t status;
+
+	for (;;) {
+		hf_semwait(&rdma_pending);
+		status = _di();
+		buf = hf_queue_remhead(rdma_requests);
+		_ei(status);
+		if (buf) {
+			rdma_get(buf);
+			status = _di();
+			hf_queue_addtail(NOC_POOL(buf), buf);
+			_ei(status);
+		}
+	}
+}
+
+/**
+ * @brief RDMA handler, called by the NoC driver interrupt handler for packets on RDMA_PORT.
+ *
+ * @param buf is a pointer to packet data
+ *
+ * @return ERR_OK when a put is done, RDMA_DEFERRED when a get is queued to the RDMA task (which
+ * keeps the packet) and ERR_COMM_ERROR on an invalid request (unknown window, or access out of
+ * the window bounds or not allowed).
+ */
+static int32_t rdma_handler(uint16_t *buf)
+{
+	struct noc_win_s *win;
+	uint32_t offset;
+	uint16_t size;
+	int32_t i, p;
+
+	offset = ((uint32_t)buf[RDMA_OFFSET_HI] << 16) | buf[RDMA_OFFSET_LO];
+	size = buf[PKT_MSG_SIZE];
+	win = buf[PKT_CHANNEL] < RDMA_WINDOWS ? &noc_windows[buf[PKT_CHANNEL]] : NULL;
+
+	switch (buf[PKT_SEQ]){
+	case RDMA_PUT:
+		if (!win || !(win->flags & WIN_WRITE) || offset > win->size || size > win->size - offset ||
+			size > (NOC_PACKET_SIZE - RDMA_HEADER_SIZE) * sizeof(uint16_t))
+			return ERR_COMM_ERROR;
+
+		for (i = RDMA_HEADER_SIZE, p = 0; p < size; i++){
+			win->base[offset + p++] = (int8_t)(buf[i] >> 8);
+			if (p < size)
+				win->base[offset + p++] = (int8_t)(buf[i] & 0xff);
+		}
+
+		return ERR_OK;
+	case RDMA_GET:
+		if (hf_queue_addtail(rdma_requests, buf))
+			return ERR_COMM_ERROR;
+		hf_sempost(&rdma_pending);
+
+		return RDMA_DEFERRED;
+	default:
+		return ERR_COMM_ERROR;
+	}
+}
+
+/**
+ * @brief Registers a memory window for remote access.
+ *
+ * @param win is the window number (0 to RDMA_WINDOWS - 1)
+ * @param base is a pointer to the window memory area
+ * @param size is the size (in bytes) of the window
+ * @param flags is the allowed access to the window (WIN_READ, WIN_WRITE or both)
+ *
+ * @return ERR_OK when successful, ERR_INVALID_PARAMETER on an invalid window number and
+ * ERR_OUT_OF_MEMORY if the RDMA task could not be started.
+ *
+ * The window is also registered on the network interface, if it supports remote memory
+ * access. In this case requests to the window are served by the hardware, and not by the
+ * processor. The window memory area must remain valid until the window is destroyed. The
+ * RDMA task, which replies to get requests, is started when the first window is created.
+ */
+int32_t hf_win_create(uint16_t win, int8_t *base, uint32_t size, uint16_t flags)
+{
+	uint32_t status;
+
+	if (win >= RDMA_WINDOWS)
+		return ERR_INVALID_PARAMETER;
+
+	if (!rdma_requests) {
+		/* every packet buffer of the driver fits, so a request is never dropped */
+		rdma_requests = hf_queue_create(NOC_PACKET_SLOTS + NOC_PACKET_SLOTS_HIGH);
+		if (!rdma_requests)
+			return ERR_OUT_OF_MEMORY;
+		hf_seminit(&rdma_pending, 0);
+		if (hf_spawn(rdma_service, 0, 0, 0, "NoC RDMA", 1024) < 0) {
+			hf_semdestroy(&rdma_pending);
+			hf_queue_destroy(rdma_requests);
+			rdma_requests = NULL;
+
+			return ERR_OUT_OF_MEMORY;
+		}
+	}
+
+	status = _di();
+	noc_windows[win].base = base;
+	noc_windows[win].size = size;
+	noc_windows[win].flags = flags;
+	pktdrv_rdma = rdma_handler;
+	_ei(status);
+
+	if (ni_window(win, (uint32_t)base, size, flags))
+		kprintf("\nKERNEL: RDMA window %d at %x (%d bytes), served by the NI", win, (uint32_t)base, size);
+	else
+		kprintf("\nKERNEL: RDMA window %d at %x (%d bytes)", win, (uint32_t)base, size);
+
+	return ERR_OK;
+}
+
+/**
+ * @brief Removes a memory window.
+ *
+ * @param win is the window number (0 to RDMA_WINDOWS - 1)
+ *
+ * @return ERR_OK when successful and ERR_INVALID_PARAMETER on an invalid window number.
+ */
+int32_t hf_win_destroy(uint16_t win)
+{
+	uint32_t status;
+
+	if (win >= RDMA_WINDOWS)
+		return ERR_INVALID_PARAMETER;
+
+	status = _di();
+	noc_windows[win].base = NULL;
+	noc_windows[win].size = 0;
+	noc_windows[win].flags = 0;
+	_ei(status);
+
+	ni_window(win, 0, 0, 0);
+
+	return ERR_OK;
+}
+
+/**
+ * @brief Writes data to a memory window of a remote core (non blocking).
+ *
+ * @param cpu is the target processor
+ * @param win is the window number on the target processor
+ * @param offset is the offset (in bytes) on the window
+ * @param buf is a pointer to a buffer that holds the data
+ * @param size is the size (in bytes) of the data
+ *
+ * @return ERR_OK when successful and ERR_COMM_UNFEASIBLE when no message queue (comm) was
+ * created for the calling task.
+ *
+ * Data is broken into packets, and each packet carries its own window offset, so packets are
+ * served independently on the target. There is no acknowledgement, and an invalid access
+ * (out of the window bounds or not allowed) is discarded on the target.
+ */
+int32_t hf_put(uint16_t cpu, uint16_t win, uint32_t offset, int8_t *buf, uint16_t size)
+{
+	uint16_t id, chunk, payload_bytes;
+	uint16_t out_buf[NOC_PACKET_SIZE];
+	int32_t i, p = 0;
+
+	id = hf_selfid();
+	if (pktdrv_tqueue[id] == NULL) return ERR_COMM_UNFEASIBLE;
+
+	payload_bytes = (NOC_PACKET_SIZE - RDMA_HEADER_SIZE) * sizeof(uint16_t);
+
+	while (p < size){
+		chunk = (size - p > payload_bytes) ? payload_bytes : size - p;
+
+		rdma_header(out_buf, pktdrv_prio[id], cpu, pktdrv_ports[id], RDMA_PORT, chunk, RDMA_PUT, win);
+		out_buf[RDMA_OFFSET_HI] = (offset + p) >> 16;
+		out_buf[RDMA_OFFSET_LO] = (offset + p) & 0xffff;
+		out_buf[RDMA_CHANNEL] = 0;
+
+		for (i = RDMA_HEADER_SIZE; i < NOC_PACKET_SIZE && chunk; i++, p += 2, chunk -= chunk > 1 ? 2 : 1)
+			out_buf[i] = ((uint8_t)buf[p] << 8) | (chunk > 1 ? (uint8_t)buf[p+1] : 0);
+		for (; i < NOC_PACKET_SIZE; i++)
+			out_buf[i] = 0xdead;
+
+		ni_write_packet(out_buf, NOC_PACKET_SIZE);
+		pktdrv_stats.tx_packets++;
+	}
+	pktdrv_stats.tx_messages++;
+
+	return ERR_OK;
+}
+
+/**
+ * @brief Reads data from a memory window of a remote core (blocking).
+ *
+ * @param cpu is the target processor
+ * @param win is the window number on the target processor
+ * @param offset is the offset (in bytes) on the window
+ * @param buf is a pointer to a buffer to hold the data
+ * @param size is the size (in bytes) of the data
+ * @param channel is the message channel used for the reply
+ *
+ * @return ERR_OK when successful, ERR_COMM_UNFEASIBLE when no message queue (comm) was
+ * created for the calling task, ERR_COMM_ERROR on an invalid access (out of the window
+ * bounds or not allowed) and ERR_SEQ_ERROR when the reply is corrupted.
+ *
+ * Data is requested in pieces of up to RDMA_GET_MAX bytes, so a single request is kept short.
+ * Each piece is a single request packet, and its data is received as a regular message. As
+ * hf_recv() stores whole flits, an odd last byte is requested on its own and received on a
+ * local buffer, so nothing is written past the end of buf.
+ */
+int32_t hf_get(uint16_t cpu, uint16_t win, uint32_t offset, int8_t *buf, uint16_t size, uint16_t channel)
+{
+	uint16_t id, rcpu, rport, rsize, chunk;
+	uint16_t out_buf[NOC_PACKET_SIZE];
+	int8_t tail[2];
+	int32_t i, p = 0, error = ERR_OK;
+
+	id = hf_selfid();
+	if (pktdrv_tqueue[id] == NULL) return ERR_COMM_UNFEASIBLE;
+
+	do {
+		chunk = (size - p > RDMA_GET_MAX) ? RDMA_GET_MAX : size - p;
+		if (chunk > 1)
+			chunk &= ~1;
+
+		rdma_header(out_buf, pktdrv_prio[id], cpu, pktdrv_ports[id], RDMA_PORT, chunk, RDMA_GET, win);
+		out_buf[RDMA_OFFSET_HI] = (offset + p) >> 16;
+		out_buf[RDMA_OFFSET_LO] = (offset + p) & 0xffff;
+		out_buf[RDMA_CHANNEL] = channel;
+		for (i = RDMA_HEADER_SIZE; i < NOC_PACKET_SIZE; i++)
+			out_buf[i] = 0xdead;
+
+		ni_write_packet(out_buf, NOC_PACKET_SIZE);
+		pktdrv_stats.tx_packets++;
+		pktdrv_stats.tx_messages++;
+
+		if (chunk & 1){
+			error = hf_recv(&rcpu, &rport, tail, &rsize, channel);
+			buf[p] = tail[0];
+		}else{
+			error = hf_recv(&rcpu, &rport, buf + p, &rsize, channel);
+		}
+		if (error == ERR_OK && rsize != chunk)
+			error = ERR_COMM_ERROR;
+		p += chunk;
+	} while (error == ERR_OK && p < size);
+
+	return error;
+}
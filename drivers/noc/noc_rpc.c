@@ -13,13 +13,40 @@
  * A basic RPC mechanism on top of the Network-on-Chip primitives. This driver implements
  * the RPC semantics for remote calls in a NoC environment. Callbacks can be registered and
  * the driver waits for remote calls. Remote calls are placed on a queue, and handled in
- * first-come-first-served (FIFO) order by the noc_rpcdrv_service thread.
+ * first-come-first-served (FIFO) order by a pool of RPC_WORKERS noc_rpcdrv_service threads.
+ *
+ * Calls are asynchronous: hf_call_async() sends a request and returns a call id, which is used
+ * later to wait for (hf_call_wait()) or test (hf_call_probe()) the completion of the call. Up to
+ * RPC_MAX_PARALLEL_CALLS calls may be in flight on each core, and each one of them uses its own
+ * message channel, so replies may arrive (and be waited for) in any order. hf_call() is just an
+ * asynchronous call followed by a wait.
  */
 
 #include <hellfire.h>
 #include <noc.h>
 #include <noc_rpc.h>
 
+static struct proc_call_s rpc_calls[RPC_MAX_PARALLEL_CALLS];
+
+static uint32_t rpc_hash(uint32_t prognum, uint32_t procnum)
+{
+	return (prognum * 31 + procnum) % RPC_HASH_SIZE;
+}
+
+static struct proc_param_s *rpc_lookup(uint32_t prognum, uint32_t procnum)
+{
+	struct proc_param_s *proc_param;
+
+	proc_param = noc_rpcdrv.proc_table[rpc_hash(prognum, procnum)];
+	while (proc_param) {
+		if (proc_param->prognum == prognum && proc_param->procnum == procnum)
+			break;
+		proc_param = proc_param->next;
+	}
+
+	return proc_param;
+}
+
 /**
  * @brief RPC callback
  * 
@@ -28,19 +55,22 @@
  * @return ERR_OK.
  * 
  * This is called when RPC packets arrive. This routine just places the packet (pointer to
- * a buffer taken from the NoC message queue pool) on the RPC thread message queue. On error
- * (queue full), the pointer is put back to the NoC pool. TODO: treat RPC service as a critical
- * event? The RR scheduler is behaving ok, but this is not enough!
+ * a buffer taken from the NoC message queue pool) on the message queue of one of the RPC
+ * threads. All packets on the same channel (which identifies the caller and the call) go to
+ * the same thread. On error (queue full), the pointer is put back to the NoC pool. TODO: treat
+ * RPC service as a critical event? The RR scheduler is behaving ok, but this is not enough!
  */
 static int32_t rpc_callback(uint16_t *buf_ptr)
 {
-	int32_t rpc_driver;
-	
-	if (hf_queue_addtail(pktdrv_tqueue[noc_rpcdrv.thread_id], buf_ptr)){
+	uint16_t id;
+
+	id = noc_rpcdrv.thread_id[buf_ptr[PKT_CHANNEL] % RPC_WORKERS];
+
+	if (hf_queue_addtail(pktdrv_tqueue[id], buf_ptr)){
 		kprintf("\nKERNEL: NoC RPC service queue full!");
-		hf_queue_addtail(pktdrv_queue, buf_ptr);
+		hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
 	} else {
-/*		krnl_tcb[noc_rpcdrv.thread_id].critical = 1; */
+/*		krnl_tcb[id].critical = 1; */
 	}
 	
 	return ERR_OK;
@@ -53,11 +83,11 @@ static int32_t rpc_callback(uint16_t *buf_ptr)
  * on the NoC driver. Data is received (composed of a header containing program and procedure
  * identification and procedure parameters / size), and the remote call is handled:
  * 
- * 1) look for the prognum / procnum pair in a list (for a registered procedure);
+ * 1) look for the prognum / procnum pair in a hash table (for a registered procedure);
  * 2) compare input and output parameter sizes, which should match;
- * 3) take packet data and fill input parameters;
- * 4) call the procedure, passing input and output parameters by reference;
- * 5) copy output parameters to packet data, and send it back or send an error code on fail.
+ * 3) call the procedure, passing input parameters (in the request packet data) and output
+ * parameters (in the reply packet data) by reference;
+ * 4) send the reply back or send an error code on fail.
  *
  * Data is sent structured as:
  * - 4 bytes (prognum)
@@ -66,54 +96,59 @@ static int32_t rpc_callback(uint16_t *buf_ptr)
  * - 2 bytes (out_size)
  * - 4 bytes (ecode)
  * - (output parameters)
+ *
+ * If more than one worker is configured, procedures may run concurrently and must be reentrant.
+ * The message size is checked on the first queued packet, before the request is received. Packets
+ * of a request which doesn't fit the request buffer are dropped one by one (all of them carry the
+ * message size).
  */
 static void noc_rpcdrv_service(void)
 {
-	union proc_pkt_u proc_pkt;
+	union proc_pkt_u req, rep;
 	struct proc_param_s *proc_param;
-	uint16_t cpu, port, size;
-	int32_t channel, i, k;
+	uint16_t cpu, port, size, id;
+	uint16_t *buf_ptr;
+	uint32_t status;
+	int32_t channel;
 	
-	hf_comm_create(hf_selfid(), 0xffff, 0);
+	id = hf_selfid();
 	
 	for (;;) {
 		channel = hf_recvprobe();
 		if (channel >= 0) {
-			hf_recv(&cpu, &port, proc_pkt.proc_data, &size, channel);
-
-			if (size > RPC_MAX_PARAM_SIZE) {
-				kprintf("\nKERNEL: RPC data > %d bytes, this is not right!", RPC_MAX_PARAM_SIZE);
+			status = _di();
+			buf_ptr = hf_queue_get(pktdrv_tqueue[id], 0);
+			size = buf_ptr[PKT_MSG_SIZE];
+			if (size < sizeof(struct proc_pkt_s) || size > sizeof(union proc_pkt_u)) {
+				buf_ptr = hf_queue_remhead(pktdrv_tqueue[id]);
+				hf_queue_addtail(NOC_POOL(buf_ptr), buf_ptr);
+				_ei(status);
+				kprintf("\nKERNEL: RPC request of %d bytes, this is not right!", size);
 				continue;
 			}
+			_ei(status);
 			
-			k = hf_list_count(noc_rpcdrv.proc_list);
-			for (i = 0; i < k; i++) {
-				proc_param = hf_list_get(noc_rpcdrv.proc_list, i);
-				if (proc_param) {
-					if (proc_param->prognum == proc_pkt.proc_hdr.prognum &&
-					proc_param->procnum == proc_pkt.proc_hdr.procnum)
-						break;
-				}
-			}
+			hf_recv(&cpu, &port, req.proc_data, &size, channel);
+			
+			rep.proc_hdr = req.proc_hdr;
+			proc_param = rpc_lookup(req.proc_hdr.prognum, req.proc_hdr.procnum);
 			
-			if (i < k) {
-				if (proc_param->in_size == proc_pkt.proc_hdr.in_size &&
-				proc_param->out_size == proc_pkt.proc_hdr.out_size) {
-					memcpy(proc_param->in_data, proc_pkt.proc_data + sizeof(struct proc_pkt_s), proc_param->in_size);
-					proc_param->proc_ptr(proc_param->in_data, proc_param->out_data);
-					memcpy(proc_pkt.proc_data + sizeof(struct proc_pkt_s), proc_param->out_data, proc_param->out_size);
+			if (proc_param) {
+				if (proc_param->in_size == req.proc_hdr.in_size &&
+				proc_param->out_size == req.proc_hdr.out_size) {
+					proc_param->proc_ptr(req.proc_data + sizeof(struct proc_pkt_s), rep.proc_data + sizeof(struct proc_pkt_s));
 				} else {
 					kprintf("\nKERNEL: RPC parameters size mismatch!");
-					proc_pkt.proc_hdr.out_size = 0;
-					proc_pkt.proc_hdr.ecode = -1;
+					rep.proc_hdr.out_size = 0;
+					rep.proc_hdr.ecode = -1;
 				}
 			} else {
 				kprintf("\nKERNEL: RPC prognum/procnum not found!");
-				proc_pkt.proc_hdr.out_size = 0;
-				proc_pkt.proc_hdr.ecode = -1;
+				rep.proc_hdr.out_size = 0;
+				rep.proc_hdr.ecode = -1;
 			}
 			
-			hf_send(cpu, port, proc_pkt.proc_data, sizeof(struct proc_pkt_s) + proc_pkt.proc_hdr.out_size, channel);
+			hf_send(cpu, port, rep.proc_data, sizeof(struct proc_pkt_s) + rep.proc_hdr.out_size, channel);
 		}
 	}
 }
@@ -123,65 +158,65 @@ static void noc_rpcdrv_service(void)
  * 
  * @return ERR_OK on success and ERR_ERROR on fail.
  *
- * Data structures related to the RPC driver are initialized, the RPC service thread is spawned
- * and the RPC callback is registered for incoming RPC packets.
+ * Data structures related to the RPC driver are initialized, the RPC service threads are spawned
+ * (each one with its own communication queue) and the RPC callback is registered for incoming
+ * RPC packets. Replies are sent with high priority.
  */
 static int32_t noc_rpcdrv_init(void)
 {
-	noc_rpcdrv.proc_list = hf_list_init();
-	noc_rpcdrv.thread_id = hf_spawn(noc_rpcdrv_service, 0, 0, 0, "NoC RPC", RPC_MAX_PARAM_SIZE + RPC_STACK_SIZE);
-
-	if (noc_rpcdrv.thread_id > 0) {
-		pktdrv_callback = rpc_callback;		
-		kprintf("\nKERNEL: NoC RPC driver registered");
-	}else{
-		kprintf("\nKERNEL: NoC RPC init failed");
-		
-		return ERR_ERROR;
+	int32_t i, id;
+
+	for (i = 0; i < RPC_HASH_SIZE; i++)
+		noc_rpcdrv.proc_table[i] = NULL;
+
+	for (i = 0; i < RPC_WORKERS; i++) {
+		id = hf_spawn(noc_rpcdrv_service, 0, 0, 0, "NoC RPC", 2 * RPC_MAX_PARAM_SIZE + RPC_STACK_SIZE);
+		if (id <= 0 || ni_comm_create(id, i ? RPC_WORKER_PORT + i : RPC_PORT, 0)) {
+			kprintf("\nKERNEL: NoC RPC init failed");
+			
+			return ERR_ERROR;
+		}
+		noc_rpcdrv.thread_id[i] = id;
+		hf_comm_priority(id, NOC_PRIO_HIGH);
 	}
+
+	pktdrv_callback = rpc_callback;
+	kprintf("\nKERNEL: NoC RPC driver registered, %d workers", RPC_WORKERS);
 	
 	return ERR_OK;
 }
 
 // -check if the RPC subsystem is initialized (hook registered to the NoC packet driver callback). if not, register it.
-// -compare the list of registered procedures to the prognum/procnum pair and abort if already used.
-// -add a list entry with prognum procnum, proc pointer and allocate in and out data structures (register it on the list)
+// -look for the prognum/procnum pair in the table of registered procedures and abort if already used.
+// -add a table entry with prognum procnum, proc pointer and parameter sizes (register it on the hash table)
 int32_t hf_register(uint32_t prognum, uint32_t procnum, int32_t (*pname)(int8_t *, int8_t *), uint16_t in_size, uint16_t out_size)
 {
-	int32_t i, k;
 	struct proc_param_s *proc_param;
-	int8_t *input, *output;
+	uint32_t hash;
 	
 	if (in_size > RPC_MAX_PARAM_SIZE || out_size > RPC_MAX_PARAM_SIZE)
 		return -1;
 	
-	if (noc_rpcdrv.thread_id == 0) {
+	if (noc_rpcdrv.thread_id[0] == 0) {
 		if (noc_rpcdrv_init())
 			return ERR_ERROR;
 	}
 	
-	k = hf_list_count(noc_rpcdrv.proc_list);
-	for (i = 0; i < k; i++) {
-		proc_param = hf_list_get(noc_rpcdrv.proc_list, i);
-		if (proc_param) {
-			if (proc_param->prognum == prognum && proc_param->procnum == procnum)
-				return ERR_ERROR;
-		}
-	}
+	if (rpc_lookup(prognum, procnum))
+		return ERR_ERROR;
 	
 	proc_param = (struct proc_param_s *)hf_malloc(sizeof(struct proc_param_s));
-	input = (int8_t *)hf_malloc(in_size);
-	output = (int8_t *)hf_malloc(out_size);
-	if (!proc_param || !input || !output) return ERR_OUT_OF_MEMORY;
+	if (!proc_param) return ERR_OUT_OF_MEMORY;
 	
 	proc_param->prognum = prognum;
 	proc_param->procnum = procnum;
 	proc_param->proc_ptr = pname;
 	proc_param->in_size = in_size;
 	proc_param->out_size = out_size;
-	proc_param->in_data = input;
-	proc_param->out_data = output;
-	hf_list_append(noc_rpcdrv.proc_list, proc_param);
+	
+	hash = rpc_hash(prognum, procnum);
+	proc_param->next = noc_rpcdrv.proc_table[hash];
+	noc_rpcdrv.proc_table[hash] = proc_param;
 	
 	kprintf("\nKERNEL: RPC registered prognum %d procnum %d at %x (in size %d, out size %d)", prognum, procnum, (uint32_t)pname, in_size, out_size);
 	
@@ -195,14 +230,18 @@ int32_t hf_register(uint32_t prognum, uint32_t procnum, int32_t (*pname)(int8_t
 // 2 bytes (out_size)
 // 4 bytes (ecode)
 // (input parameters)
-int32_t hf_call(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, uint16_t in_size, int8_t *out, uint16_t out_size)
+// the output buffer must remain valid until the call is waited for.
+int32_t hf_call_async(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, uint16_t in_size, int8_t *out, uint16_t out_size)
 {
 	union proc_pkt_u proc_pkt;
-	uint16_t rcpu, rport, rsize;
 	static volatile int8_t init = 0;
+	int32_t call;
 	
 	if (in_size > RPC_MAX_PARAM_SIZE || out_size > RPC_MAX_PARAM_SIZE)
 		return ERR_ERROR;
+	
+	if (pktdrv_tqueue[hf_selfid()] == NULL)
+		return ERR_COMM_UNFEASIBLE;
 		
 	if (!init) {
 		hf_mtxinit(&rpc_lock);
@@ -210,6 +249,20 @@ int32_t hf_call(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, ui
 	}
 	
 	hf_mtxlock(&rpc_lock);
+	for (call = 0; call < RPC_MAX_PARALLEL_CALLS; call++)
+		if (!rpc_calls[call].busy) break;
+	
+	if (call == RPC_MAX_PARALLEL_CALLS) {
+		hf_mtxunlock(&rpc_lock);
+		
+		return ERR_COMM_BUSY;
+	}
+	
+	rpc_calls[call].busy = 1;
+	rpc_calls[call].task_id = hf_selfid();
+	rpc_calls[call].out_data = out;
+	rpc_calls[call].out_size = out_size;
+	
 	proc_pkt.proc_hdr.prognum = prognum;
 	proc_pkt.proc_hdr.procnum = procnum;
 	proc_pkt.proc_hdr.in_size = in_size;
@@ -218,20 +271,80 @@ int32_t hf_call(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, ui
 	memcpy(proc_pkt.proc_data + sizeof(struct proc_pkt_s), in, in_size);
 	
 	/* TODO: use a better / more resilient protocol!
-	 * this is a blocking primitive, and will hang if no response is received.
+	 * hf_call_wait() will hang if no response is received.
 	 */
-	hf_send(cpu, RPC_PORT, proc_pkt.proc_data, sizeof(struct proc_pkt_s) + in_size, RPC_SCHANNEL - hf_cpuid());
+	hf_send(cpu, RPC_PORT, proc_pkt.proc_data, sizeof(struct proc_pkt_s) + in_size, RPC_CHANNEL(hf_cpuid(), call));
 	hf_mtxunlock(&rpc_lock);
 	
-	hf_recv(&rcpu, &rport, proc_pkt.proc_data, &rsize, RPC_SCHANNEL - hf_cpuid());
+	return call;
+}
+
+// returns 1 if the whole reply of a call is waiting in queue, 0 if not.
+int32_t hf_call_probe(int32_t call_id)
+{
+	uint16_t id, channel, payload_bytes, packets = 0;
+	uint32_t status;
+	int32_t i, k, size = -1;
+	uint16_t *buf_ptr;
+	
+	id = hf_selfid();
+	if (call_id < 0 || call_id >= RPC_MAX_PARALLEL_CALLS || !rpc_calls[call_id].busy || rpc_calls[call_id].task_id != id)
+		return ERR_INVALID_ID;
+	
+	channel = RPC_CHANNEL(hf_cpuid(), call_id);
+	
+	status = _di();
+	k = hf_queue_count(pktdrv_tqueue[id]);
+	for (i = 0; i < k; i++) {
+		buf_ptr = hf_queue_get(pktdrv_tqueue[id], i);
+		if (buf_ptr && buf_ptr[PKT_CHANNEL] == channel) {
+			size = buf_ptr[PKT_MSG_SIZE];
+			packets++;
+		}
+	}
+	_ei(status);
+	
+	if (size < 0)
+		return 0;
+	
+	payload_bytes = (NOC_PACKET_SIZE - PKT_HEADER_SIZE) * sizeof(uint16_t);
+	
+	return packets >= (size + payload_bytes - 1) / payload_bytes ? 1 : 0;
+}
+
+// waits for the reply of a call, copies output parameters and releases the call id.
+int32_t hf_call_wait(int32_t call_id)
+{
+	union proc_pkt_u proc_pkt;
+	uint16_t rcpu, rport, rsize;
+	int32_t error = ERR_OK;
+	
+	if (call_id < 0 || call_id >= RPC_MAX_PARALLEL_CALLS || !rpc_calls[call_id].busy || rpc_calls[call_id].task_id != hf_selfid())
+		return ERR_INVALID_ID;
+	
+	hf_recv(&rcpu, &rport, proc_pkt.proc_data, &rsize, RPC_CHANNEL(hf_cpuid(), call_id));
 	
 	if (proc_pkt.proc_hdr.ecode != 0)
-		return proc_pkt.proc_hdr.ecode;
+		error = proc_pkt.proc_hdr.ecode;
+	else if (rpc_calls[call_id].out_size != proc_pkt.proc_hdr.out_size)
+		error = ERR_ERROR;
+	else
+		memcpy(rpc_calls[call_id].out_data, proc_pkt.proc_data + sizeof(struct proc_pkt_s), rpc_calls[call_id].out_size);
 	
-	if (out_size != proc_pkt.proc_hdr.out_size)
-		return ERR_ERROR;
-		
-	memcpy(out, proc_pkt.proc_data + sizeof(struct proc_pkt_s), out_size);
-		
-	return ERR_OK;
+	hf_mtxlock(&rpc_lock);
+	rpc_calls[call_id].busy = 0;
+	hf_mtxunlock(&rpc_lock);
+	
+	return error;
+}
+
+int32_t hf_call(uint16_t cpu, uint32_t prognum, uint32_t procnum, int8_t *in, uint16_t in_size, int8_t *out, uint16_t out_size)
+{
+	int32_t call;
+	
+	call = hf_call_async(cpu, prognum, procnum, in, in_size, out, out_size);
+	if (call < 0)
+		return call;
+	
+	return hf_call_wait(call);
 }
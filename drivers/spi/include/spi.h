@@ -5,6 +5,8 @@
  */
 
 void spi_setup(uint32_t select, uint8_t mode);
+void spi_speed(uint8_t fast);
 void spi_start(void);
 void spi_stop(void);
 int8_t spi_sendrecv(int8_t data);
+void spi_transfer(uint8_t *out, uint8_t *in, uint32_t size);
@@ -29,6 +29,21 @@ void spi_setup(uint32_t select, uint8_t mode)
 		tmp |= SPI_SCK;
 		_port_write(SPI_OUTPORT, tmp);
 	}
+#if SPI_HW == 1
+	_spi_setup(mode);
+#endif
+}
+
+/*
+ * bus clock of the hardware interface: after spi_setup() the bus runs at a slow clock, as needed
+ * to initialize some devices (SD cards), and spi_speed(1) selects the full speed. the software
+ * interface runs as fast as the port is written.
+ */
+void spi_speed(uint8_t fast)
+{
+#if SPI_HW == 1
+	_spi_speed(fast);
+#endif
 }
 
 void spi_start(void)
@@ -51,6 +66,9 @@ void spi_stop(void)
 
 int8_t spi_sendrecv(int8_t data)
 {
+#if SPI_HW == 1
+	return _spi_transfer(data);
+#else
 	int32_t i;
 	uint32_t tmp;
 	int8_t newdata = 0;
@@ -161,4 +179,45 @@ int8_t spi_sendrecv(int8_t data)
 	}
 
 	return newdata;
+#endif
+}
+
+/*
+ * block transfer: size bytes from out are sent (0xff if out is null) and the bytes received are
+ * stored on in (if not null). on the software interface in mode 0, the output port is read once
+ * and written twice per bit (data with the clock low, then the clock high), so other pins of the
+ * port must not be changed during the transfer.
+ */
+void spi_transfer(uint8_t *out, uint8_t *in, uint32_t size)
+{
+	uint32_t i, data;
+#if SPI_HW == 0
+	int32_t k;
+	uint32_t port, bits, newdata;
+
+	if (port_mode == 0){
+		port = _port_read(SPI_OUTPORT) & ~(SPI_SCK | SPI_MOSI);
+		for (i = 0; i < size; i++){
+			data = out ? out[i] : 0xff;
+			newdata = 0;
+			for (k = 0; k < 8; k++){
+				bits = (data & 0x80) ? port | SPI_MOSI : port;
+				_port_write(SPI_OUTPORT, bits);
+				_port_write(SPI_OUTPORT, bits | SPI_SCK);
+				newdata = (newdata << 1) | ((_port_read(SPI_INPORT) & SPI_MISO) ? 1 : 0);
+				data <<= 1;
+			}
+			if (in)
+				in[i] = newdata;
+		}
+		_port_write(SPI_OUTPORT, port);
+
+		return;
+	}
+#endif
+	for (i = 0; i < size; i++){
+		data = (uint8_t)spi_sendrecv(out ? out[i] : 0xff);
+		if (in)
+			in[i] = data;
+	}
 }
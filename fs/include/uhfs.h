@@ -5,6 +5,8 @@
 #define UHFS_EOCHBLK		0xfffffffe		/* last block in the chain (end of file or end of chain of cluster map blocks) */
 #define UHFS_FREEBLK		0xffffffff		/* unused (free) block */
 
+#define UHFS_EXTENT		0x80000000		/* metadata_block of a file which is an extent (blocks on the low bits) */
+
 #define UHFS_ATTRDIR		0x01			/* directory */
 #define UHFS_ATTRHIDDEN		0x02			/* hidden */
 #define UHFS_ATTRARCHIVE	0x04			/* file needs archiving */
@@ -66,6 +68,8 @@ struct fs_superblock {
 	uint32_t first_cmb;
 	uint32_t root_dir_block;
 	uint32_t metadata_block;
+	uint32_t journal_block;			/* first block of the metadata journal */
+	uint32_t journal_blocks;		/* blocks of the journal (0 if the volume has no journal) */
 };
 
 struct fs_direntry {
@@ -73,11 +77,62 @@ struct fs_direntry {
 	uint8_t		attributes;
 	struct fs_date	date;
 	struct fs_time	time;
-	uint32_t	metadata_block;		/* block containing metadata for this file (future use) */
+	uint32_t	metadata_block;		/* extent record (UHFS_EXTENT | blocks) or 0 */
 	uint32_t	first_block;		/* the number of the first data block */
 	uint64_t	size;
 };
 
+#ifndef UHFS_CACHE_BLOCKS
+#define UHFS_CACHE_BLOCKS	8			/* block cache entries (per mounted volume) */
+#endif
+
+struct fs_cacheblock {
+	uint32_t block;				/* cached block (UHFS_FREEBLK if the entry is unused) */
+	uint32_t dirty;
+	uint32_t journal;			/* metadata block, written back through the journal */
+	uint32_t used;				/* time of the last access (LRU replacement) */
+	int8_t *data;
+};
+
+#define UHFS_JMETA		1			/* metadata block (modified since the last commit, if dirty) */
+#define UHFS_JCOMMITTED		2			/* metadata block on the journal, not written home yet */
+
+#ifndef UHFS_JOURNAL_BLOCKS
+#define UHFS_JOURNAL_BLOCKS	18			/* metadata journal blocks (two slots, created by hf_mkfs(), 0 for none) */
+#endif
+
+#ifndef UHFS_JOURNAL_BATCH
+#define UHFS_JOURNAL_BATCH	6			/* modified metadata blocks that start a commit between operations */
+#endif
+
+#define UHFS_JOURNAL_SIG	0x6a726e6c
+
+/* journal descriptor, on the first journal block. the block number and checksum of each image follow it */
+struct fs_journal {
+	uint32_t signature;
+	uint32_t sequence;
+	uint32_t count;				/* block images on the journal (0 if it is empty) */
+	uint32_t checksum;			/* of the descriptor */
+};
+
+#define UHFS_JOURNAL_MAX(bsize)	(((bsize) - sizeof(struct fs_journal)) / (2 * sizeof(uint32_t)))
+
+#ifndef UHFS_ALLOC_PROBES
+#define UHFS_ALLOC_PROBES	4			/* storage regions searched for a free run */
+#endif
+
+#ifndef UHFS_DENTRIES
+#define UHFS_DENTRIES		32			/* directory entry cache slots (a power of 2) */
+#endif
+
+struct fs_dentry {
+	uint32_t dir;				/* first block of the directory (0 if the slot is unused) */
+	uint32_t block;				/* directory block holding the entry (0 if the name is not there) */
+	uint32_t first_block;
+	uint8_t attributes;
+	int8_t name[39];
+};
+
 union fs_datablock {
 	uint32_t *cmb_data;
 	int8_t *data;
@@ -92,6 +147,59 @@ struct fs_blkdevice {
 	/* these structures change during filesystem usage */
 	struct fs_direntry fsdirentry;
 	union fs_datablock datablock;
+	/* block cache, allocated at mount */
+	struct fs_cacheblock *cache;
+	uint32_t cache_blocks;
+	uint32_t cache_time;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+	/* free space summary, built at mount */
+	uint16_t *region_free;			/* free blocks on each storage region */
+	uint32_t regions;
+	uint32_t region_shift;			/* log2 of the blocks per storage region */
+	uint32_t free_blocks;
+	uint32_t free_hint;			/* no free blocks before this region */
+	/* directory entry cache (names looked up on each directory, found or not) */
+	struct fs_dentry dentries[UHFS_DENTRIES];
+	/* metadata journal: transactions are written here (descriptor and block images) before the blocks go home */
+	int8_t *journal;
+	uint32_t journal_sequence;
+	uint32_t journal_clean;			/* the journal on the device is empty */
+	uint32_t journal_commits;
+};
+
+#define UHFS_MAXFILES		8			/* open files (all mounted volumes) */
+
+#ifndef UHFS_READAHEAD
+#define UHFS_READAHEAD		8			/* read-ahead window of sequential streams, in blocks (0 for none) */
+#endif
+
+#ifndef UHFS_WRITEBEHIND
+#define UHFS_WRITEBEHIND	8			/* write-behind window of sequential streams, in blocks (0 for none) */
+#endif
+
+#ifndef UHFS_SEQUENTIAL
+#define UHFS_SEQUENTIAL		2			/* sequential transfers on a descriptor before it is a stream */
+#endif
+
+#define UHFS_STREAM_BUFFERS	2			/* buffers of a stream (one is used while the other is transferred) */
+
+#define UHFS_SEMPTY		0			/* stream buffer unused */
+#define UHFS_SREAD		1			/* read-ahead blocks */
+#define UHFS_SFILL		2			/* write-behind blocks, being filled */
+#define UHFS_SWRITE		3			/* write-behind blocks, submitted */
+
+/* stream buffer: a window of consecutive blocks of the file, moved with an asynchronous request */
+struct fs_stream {
+	struct dev_request req;
+	sem_t done;
+	uint32_t state;
+	uint32_t pending;			/* the request was submitted, and not waited yet */
+	uint32_t index;				/* position of the first block on the chain */
+	uint32_t lba;				/* first block */
+	uint32_t count;				/* blocks read ahead */
+	uint32_t fill;				/* bytes written behind */
+	int8_t *data;
 };
 
 struct file {
@@ -101,6 +209,21 @@ struct file {
 	int32_t flags;
 	uint32_t block;
 	int64_t offset;
+	/* regular files only */
+	uint32_t index;				/* position of the current block on the chain */
+	uint32_t last_block;			/* last block of the chain */
+	uint32_t n_blocks;			/* blocks on the chain */
+	uint32_t extent;			/* chain made of consecutive data blocks */
+	uint32_t dir_block;			/* directory block holding the entry of this file */
+	uint32_t dir_entry;
+	uint64_t size;
+	/* sequential streams (read-ahead and write-behind) */
+	int64_t last_offset;			/* end of the previous transfer */
+	uint32_t sequential;			/* transfers in a row starting where the previous one ended */
+	uint32_t readahead;			/* windows, in blocks */
+	uint32_t writebehind;
+	int32_t stream_error;			/* a write-behind request failed */
+	struct fs_stream *stream;		/* buffers, allocated when the file becomes a stream */
 };
 
 /* volume management */
@@ -110,6 +233,7 @@ int32_t hf_umount(struct device *dev);
 int32_t hf_getfree(struct device *dev);
 int32_t hf_getlabel(struct device *dev, int8_t *label);
 int32_t hf_setlabel(struct device *dev, int8_t *label);
+int32_t hf_sync(struct device *dev);
 
 /* directory management / operations */
 int32_t hf_mkdir(struct device *dev, int8_t *path);
@@ -134,3 +258,6 @@ int64_t hf_fwrite(void *buf, int32_t isize, int32_t items, struct file *desc);
 int32_t hf_fseek(struct file *desc, int64_t offset, int32_t whence);
 int64_t hf_ftell(struct file *desc);
 int32_t hf_feof(struct file *desc);
+int32_t hf_fflush(struct file *desc);
+int32_t hf_fallocate(struct file *desc, int64_t size);
+int32_t hf_fstream(struct file *desc, uint32_t readahead, uint32_t writebehind);
@@ -3,55 +3,616 @@
 #include <block.h>
 #include <uhfs.h>
 
+/* open files */
+static struct file fs_files[UHFS_MAXFILES];
+static int32_t streamsync(struct file *desc);
+
 /* auxiliary functions */
 static int32_t ispowerof2(uint32_t x){
 	return x && !(x & (x - 1));
 }
 
+/*
+ * metadata journal. cluster map blocks and directory blocks modified on the block cache are only
+ * written to their places after they are on the journal. a commit writes a transaction with all
+ * metadata blocks of the cache that are not home yet (a descriptor with their block numbers and
+ * checksums, followed by the block images) with a single request, so the last transaction always
+ * holds every metadata block that differs from its place. data blocks of the cache are written
+ * before, so committed metadata never points to stale data. commits are grouped: modified metadata
+ * stays on the cache until there is no other block to replace, until UHFS_JOURNAL_BATCH blocks are
+ * waiting at the start of an operation, or hf_sync(). committed blocks are written home when they
+ * are replaced on the cache, and on hf_umount() (checkpoint), which records an empty journal.
+ *
+ * the journal has two slots, used in turns (by the parity of the record sequence), so a torn
+ * commit never destroys the previous record. at mount, the newest complete record is replayed.
+ */
+static uint32_t journalsum(struct fs_journal *jd)
+{
+	uint32_t sum, checksum;
+	
+	checksum = jd->checksum;
+	jd->checksum = 0;
+	sum = hf_crc32((int8_t *)jd, sizeof(struct fs_journal) + jd->count * 2 * sizeof(uint32_t));
+	jd->checksum = checksum;
+	
+	return sum;
+}
+
+/* write a record (a transaction of count blocks, or an empty journal) on the next slot */
+static int32_t journalwrite(struct device *dev, uint32_t count)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_journal *jd;
+	
+	blk_device = dev->ptr;
+	jd = (struct fs_journal *)blk_device->journal;
+	jd->signature = UHFS_JOURNAL_SIG;
+	jd->sequence = blk_device->journal_sequence;
+	jd->count = count;
+	jd->checksum = journalsum(jd);
+	if (hf_dev_writeblk(dev, blk_device->fssblock.journal_block + (jd->sequence & 1) * (blk_device->fssblock.journal_blocks / 2), jd, count + 1)) {
+#if UHFS_DEBUG == 1
+		kprintf("\njournalwrite: journal write failed");
+#endif
+		return -1;
+	}
+	blk_device->journal_sequence++;
+	blk_device->journal_clean = !count;
+	
+	return 0;
+}
+
+static int32_t journalcommit(struct device *dev)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t *list;
+	uint32_t i, n, bsize;
+	int32_t err = 0;
+	
+	blk_device = dev->ptr;
+	bsize = blk_device->fssblock.block_size;
+	
+	/* data blocks first (all blocks, if the volume has no journal) */
+	for (i = 0, n = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->dirty && !(cb->journal && blk_device->journal)) {
+			if (hf_dev_writeblk(dev, cb->block, cb->data, 1))
+				err = -1;
+			else
+				cb->dirty = 0;
+		}
+		if (cb->dirty && cb->journal == UHFS_JMETA)
+			n++;
+	}
+	if (!blk_device->journal || !n)
+		return err;
+	
+	/* the transaction: images of all metadata blocks not written home, after the descriptor */
+	list = (uint32_t *)((struct fs_journal *)blk_device->journal + 1);
+	for (i = 0, n = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->dirty && cb->journal) {
+			list[n * 2] = cb->block;
+			list[n * 2 + 1] = hf_crc32(cb->data, bsize);
+			memcpy(blk_device->journal + ++n * bsize, cb->data, bsize);
+		}
+	}
+	if (journalwrite(dev, n))
+		return -1;
+	blk_device->journal_commits++;
+	for (i = 0; i < blk_device->cache_blocks; i++)
+		if (blk_device->cache[i].dirty && blk_device->cache[i].journal)
+			blk_device->cache[i].journal = UHFS_JCOMMITTED;
+	
+	return err;
+}
+
+/* write committed blocks home, and record an empty journal */
+static int32_t journalcheckpoint(struct device *dev)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t i;
+	
+	blk_device = dev->ptr;
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->dirty) {
+			if (cb->journal == UHFS_JMETA) return -1;
+			if (hf_dev_writeblk(dev, cb->block, cb->data, 1)) return -1;
+			cb->dirty = 0;
+		}
+	}
+	
+	return journalwrite(dev, 0);
+}
+
+/* read the descriptor on a slot (1 if it is valid), and check or write home its block images */
+static int32_t journalslot(struct device *dev, uint32_t slot, int32_t images, int32_t write)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_journal *jd;
+	uint32_t *list;
+	int8_t *image;
+	uint32_t i, blk;
+	
+	blk_device = dev->ptr;
+	jd = (struct fs_journal *)blk_device->journal;
+	list = (uint32_t *)(jd + 1);
+	image = blk_device->journal + blk_device->fssblock.block_size;
+	blk = blk_device->fssblock.journal_block + slot * (blk_device->fssblock.journal_blocks / 2);
+	
+	if (hf_dev_readblk(dev, blk, jd, 1)) return -1;
+	if (jd->signature != UHFS_JOURNAL_SIG || jd->count >= blk_device->fssblock.journal_blocks / 2 ||
+	    jd->count > UHFS_JOURNAL_MAX(blk_device->fssblock.block_size) || journalsum(jd) != jd->checksum)
+		return 0;
+	if (!images)
+		return 1;
+	for (i = 0; i < jd->count; i++) {
+		if (list[i * 2] == 0 || list[i * 2] >= blk_device->fssblock.n_blocks) return 0;
+		if (hf_dev_readblk(dev, blk + 1 + i, image, 1)) return -1;
+		if (hf_crc32(image, blk_device->fssblock.block_size) != list[i * 2 + 1]) return 0;
+		if (write && hf_dev_writeblk(dev, list[i * 2], image, 1)) return -1;
+	}
+	
+	return 1;
+}
+
+static int32_t journalreplay(struct device *dev)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_journal *jd;
+	uint32_t i, slot, sequence[2];
+	int32_t valid[2];
+	
+	blk_device = dev->ptr;
+	jd = (struct fs_journal *)blk_device->journal;
+	
+	for (slot = 0; slot < 2; slot++) {
+		valid[slot] = journalslot(dev, slot, 0, 0);
+		if (valid[slot] < 0) return -1;
+		sequence[slot] = jd->sequence;
+	}
+	if (!valid[0] && !valid[1]) {
+		/* a new journal */
+		blk_device->journal_sequence = 0;
+		
+		return journalwrite(dev, 0);
+	}
+	slot = (valid[1] && (!valid[0] || (int32_t)(sequence[1] - sequence[0]) > 0)) ? 1 : 0;
+	blk_device->journal_sequence = sequence[slot] + 1;
+	
+	/* the newest complete record tells the state of the volume. a torn commit leaves the previous one */
+	for (i = 0; i < 2 && valid[slot]; i++, slot ^= 1) {
+		if (journalslot(dev, slot, 0, 0) < 0) return -1;
+		if (!jd->count) {
+			if (i == 0) {
+				blk_device->journal_clean = 1;
+				
+				return 0;
+			}
+			break;
+		}
+		switch (journalslot(dev, slot, 1, 0)) {
+		case -1:
+			return -1;
+		case 0:
+#if UHFS_DEBUG == 1
+			kprintf("\njournalreplay: incomplete transaction %d discarded", sequence[slot]);
+#endif
+			continue;
+		}
+		if (journalslot(dev, slot, 1, 1) < 0) return -1;
+#if UHFS_DEBUG == 1
+		kprintf("\njournalreplay: transaction %d replayed (%d blocks)", sequence[slot], jd->count);
+#endif
+		break;
+	}
+	
+	return journalwrite(dev, 0);
+}
+
+/*
+ * block cache. single block accesses (metadata and partial data blocks) are served by a small
+ * write-back cache with LRU replacement, allocated at mount. runs of blocks go straight to the
+ * device, and cached copies of blocks inside a run are kept coherent with it.
+ */
+static struct fs_cacheblock *cacheblock(struct device *dev, uint32_t blk, int32_t fill)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb, *victim;
+	uint32_t i;
+	
+	blk_device = dev->ptr;
+	victim = 0;
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->block == blk) {
+			cb->used = ++blk_device->cache_time;
+			blk_device->cache_hits++;
+			
+			return cb;
+		}
+		/* modified metadata stays on the cache until it is committed */
+		if (cb->dirty && cb->journal == UHFS_JMETA && blk_device->journal)
+			continue;
+		if (!victim || cb->used < victim->used)
+			victim = cb;
+	}
+	if (!victim) {
+		if (journalcommit(dev)) return 0;
+		
+		return cacheblock(dev, blk, fill);
+	}
+	blk_device->cache_misses++;
+	
+	/* replace the least recently used block */
+	if (victim->dirty) {
+		if (hf_dev_writeblk(dev, victim->block, victim->data, 1)) return 0;
+		victim->dirty = 0;
+	}
+	victim->block = UHFS_FREEBLK;
+	if (fill) {
+		if (hf_dev_readblk(dev, blk, victim->data, 1)) return 0;
+	}
+	victim->block = blk;
+	victim->used = ++blk_device->cache_time;
+	/* cluster map blocks are metadata. directory blocks are marked when written */
+	victim->journal = ((blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) ? 0 : UHFS_JMETA;
+	
+	return victim;
+}
+
+/* a cached block was modified (metadata has to be committed again) */
+static void markdirty(struct fs_cacheblock *cb)
+{
+	cb->dirty = 1;
+	if (cb->journal)
+		cb->journal = UHFS_JMETA;
+}
+
+/* read or write a run of consecutive blocks */
+static int32_t readblocks(struct device *dev, uint32_t blk, void *buf, uint32_t count)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t i;
+	int32_t err;
+	
+	blk_device = dev->ptr;
+	if (count == 1) {
+		cb = cacheblock(dev, blk, 1);
+		if (!cb) return -1;
+		memcpy(buf, cb->data, blk_device->fssblock.block_size);
+		
+		return 0;
+	}
+	
+	err = hf_dev_readblk(dev, blk, buf, count);
+	
+	/* blocks of the run written to the cache may not be on the device yet */
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->dirty && cb->block - blk < count)
+			memcpy((int8_t *)buf + (cb->block - blk) * blk_device->fssblock.block_size, cb->data, blk_device->fssblock.block_size);
+	}
+	
+	return err;
+}
+
+static int32_t writeblocks(struct device *dev, uint32_t blk, void *buf, uint32_t count)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t i;
+	int32_t err;
+	
+	blk_device = dev->ptr;
+	if (count == 1) {
+		cb = cacheblock(dev, blk, 0);
+		if (!cb) return -1;
+		memcpy(cb->data, buf, blk_device->fssblock.block_size);
+		markdirty(cb);
+		
+		return 0;
+	}
+	
+	err = hf_dev_writeblk(dev, blk, buf, count);
+	
+	/* cached copies of blocks of the run are now the same as the device */
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->block - blk < count) {
+			memcpy(cb->data, (int8_t *)buf + (cb->block - blk) * blk_device->fssblock.block_size, blk_device->fssblock.block_size);
+			cb->dirty = 0;
+			cb->journal = 0;
+		}
+	}
+	
+	return err;
+}
+
+/* write a directory block, through the journal */
+static int32_t writemeta(struct device *dev, uint32_t blk, void *buf)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	
+	blk_device = dev->ptr;
+	cb = cacheblock(dev, blk, 0);
+	if (!cb) return -1;
+	memcpy(cb->data, buf, blk_device->fssblock.block_size);
+	cb->dirty = 1;
+	cb->journal = UHFS_JMETA;
+	
+	return 0;
+}
+
+/* forget the cached copy of a data block (its contents are on a stream buffer) */
+static void cachedrop(struct fs_blkdevice *blk_device, uint32_t blk)
+{
+	uint32_t i;
+	
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		if (blk_device->cache[i].block == blk) {
+			blk_device->cache[i].block = UHFS_FREEBLK;
+			blk_device->cache[i].dirty = 0;
+			blk_device->cache[i].journal = 0;
+		}
+	}
+}
+
+/* write back modified cached copies of a run of data blocks (the run is read from the device) */
+static int32_t cachewrite(struct device *dev, uint32_t blk, uint32_t count)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t i;
+	
+	blk_device = dev->ptr;
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		cb = &blk_device->cache[i];
+		if (cb->dirty && cb->block - blk < count) {
+			if (hf_dev_writeblk(dev, cb->block, cb->data, 1)) return -1;
+			cb->dirty = 0;
+		}
+	}
+	
+	return 0;
+}
+
+/* start of an operation: commit the metadata modified by the previous ones, if there is enough of it */
+static void journalbatch(struct device *dev)
+{
+	struct fs_blkdevice *blk_device;
+	uint32_t i, n = 0;
+	
+	blk_device = dev->ptr;
+	if (!blk_device->journal)
+		return;
+	for (i = 0; i < blk_device->cache_blocks; i++)
+		if (blk_device->cache[i].dirty && blk_device->cache[i].journal == UHFS_JMETA)
+			n++;
+	if (n >= UHFS_JOURNAL_BATCH)
+		journalcommit(dev);
+}
+
+/* free space summary. keeps the number of free blocks on each storage region */
+static void freespace(struct fs_blkdevice *blk_device, uint32_t blk, int32_t delta)
+{
+	uint32_t region;
+	
+	region = (blk - 1) >> blk_device->region_shift;
+	blk_device->region_free[region] += delta;
+	blk_device->free_blocks += delta;
+	if (delta > 0 && region < blk_device->free_hint)
+		blk_device->free_hint = region;
+}
+
 static uint32_t getfreeblock(struct device *dev)
 {
 	struct fs_blkdevice *blk_device;
-	uint32_t j, chain_blk;
+	struct fs_cacheblock *cb;
+	uint32_t j, region, chain_blk;
 	
 	blk_device = dev->ptr;
 	
-	/* find a free block, starting from the first cluster map block */
-	chain_blk = blk_device->fssblock.first_cmb;
+	/* find the first storage region with free blocks, starting from the hint */
+	region = blk_device->free_hint;
 	while (1) {
-		if (chain_blk == UHFS_EOCHBLK) {
+		while (region < blk_device->regions && !blk_device->region_free[region])
+			region++;
+		blk_device->free_hint = region;
+		if (region == blk_device->regions) {
 #if UHFS_DEBUG == 1
 			kprintf("\ngetfreeblock: storage device is full");
 #endif
 			return 0;
 		}
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+		chain_blk = (region << blk_device->region_shift) + 1;
+		cb = cacheblock(dev, chain_blk, 1);
+		if (!cb) return 0;
 		for (j = 1; j < blk_device->fssblock.block_size / sizeof(uint32_t); j++)
-			if (blk_device->datablock.cmb_data[j] == UHFS_FREEBLK) break;
+			if (((uint32_t *)cb->data)[j] == UHFS_FREEBLK) break;
 
 		if (j < blk_device->fssblock.block_size / sizeof(uint32_t)) break;
-						
-		chain_blk = blk_device->datablock.cmb_data[0];
+		
+		/* the summary is wrong about this region */
+		blk_device->free_blocks -= blk_device->region_free[region];
+		blk_device->region_free[region] = 0;
 	}
 #if UHFS_DEBUG == 1
 	kprintf("\nfree blk at %d", chain_blk + j);
 #endif			
 	/* update the cluster map block */
-	blk_device->datablock.cmb_data[j] = UHFS_EOCHBLK;
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-	hf_dev_write(dev, blk_device->datablock.cmb_data, 1);
+	((uint32_t *)cb->data)[j] = UHFS_EOCHBLK;
+	markdirty(cb);
+	freespace(blk_device, chain_blk + j, -1);
 	
 	return chain_blk + j;
 }
 
-static int32_t searchdirectory(struct device *dev, int8_t *path, uint32_t *pblock, int8_t **ppath, uint32_t *lblock, int8_t **lpath)
+/*
+ * allocate a run of up to count contiguous free blocks, chained in order. a few storage regions
+ * (starting from the first one with free blocks) are searched for a run of the whole size. when
+ * there is none, the first region with all of its blocks free is used or else the longest run
+ * found is taken. the run length is returned on len.
+ */
+static uint32_t getfreerun(struct device *dev, uint32_t count, uint32_t *len)
 {
 	struct fs_blkdevice *blk_device;
-	int32_t found;
-	uint32_t i, chain_blk, dir_blk, dir_blk_next, first_dir_blk;
+	struct fs_cacheblock *cb;
+	uint32_t *cmb_data;
+	uint32_t i, j, n, want, mask, region, probes, best = 0, best_len = 0;
+	
+	blk_device = dev->ptr;
+	mask = blk_device->fssblock.block_size / sizeof(uint32_t) - 1;
+	want = count < mask ? count : mask;
+	
+	for (region = blk_device->free_hint, probes = 0; region < blk_device->regions; region++) {
+		if (blk_device->region_free[region] <= best_len)
+			continue;
+		/* a region with all blocks free needs no search. past the probes, only these are taken */
+		if (blk_device->region_free[region] == mask) {
+			best = (region << blk_device->region_shift) + 2;
+			best_len = want;
+			break;
+		}
+		if (probes == UHFS_ALLOC_PROBES)
+			continue;
+		probes++;
+		cb = cacheblock(dev, (region << blk_device->region_shift) + 1, 1);
+		if (!cb) return 0;
+		cmb_data = (uint32_t *)cb->data;
+		for (i = 1; i <= mask && best_len < want; i += n + 1) {
+			for (n = 0; i + n <= mask && n < want && cmb_data[i + n] == UHFS_FREEBLK; n++);
+			if (n > best_len) {
+				best = (region << blk_device->region_shift) + 1 + i;
+				best_len = n;
+			}
+		}
+		if (best_len >= want) break;
+	}
+	if (!best_len) {
+#if UHFS_DEBUG == 1
+		kprintf("\ngetfreerun: storage device is full");
+#endif
+		return 0;
+	}
+	
+	/* chain the blocks of the run */
+	cb = cacheblock(dev, ((best - 1) & ~mask) + 1, 1);
+	if (!cb) return 0;
+	cmb_data = (uint32_t *)cb->data;
+	for (j = 0; j < best_len - 1; j++)
+		cmb_data[(best + j - 1) & mask] = best + j + 1;
+	cmb_data[(best + best_len - 2) & mask] = UHFS_EOCHBLK;
+	markdirty(cb);
+	freespace(blk_device, best, -(int32_t)best_len);
+#if UHFS_DEBUG == 1
+	kprintf("\nfree run at %d (%d blocks)", best, best_len);
+#endif
+	*len = best_len;
+	
+	return best;
+}
+
+/*
+ * directory entry cache. names looked up on a directory are kept on a hashed table, along with
+ * the location of their entries, or the fact that they are not there (negative entries). entries
+ * are dropped when names are created, removed or renamed.
+ */
+static uint32_t dentryhash(uint32_t dir, int8_t *name)
+{
+	uint32_t hash = dir * 2654435761u;
+	
+	while (*name)
+		hash = (hash ^ (uint8_t)*name++) * 16777619;
+	
+	return hash & (UHFS_DENTRIES - 1);
+}
+
+static void dropentries(struct fs_blkdevice *blk_device, int8_t *name, uint32_t dir)
+{
+	uint32_t i;
+	
+	for (i = 0; i < UHFS_DENTRIES; i++)
+		if (blk_device->dentries[i].dir && ((name && !strcmp(blk_device->dentries[i].name, name)) || blk_device->dentries[i].dir == dir))
+			blk_device->dentries[i].dir = 0;
+}
+
+static int32_t scandirectory(struct device *dev, uint32_t dir_blk, int8_t *name, struct fs_dentry *entry)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	struct fs_direntry *dir_data;
+	uint32_t i, mask, dir_blk_next;
+	
+	blk_device = dev->ptr;
+	mask = blk_device->fssblock.block_size / sizeof(uint32_t) - 1;
+	
+	/* follow the directory chain, scanning its blocks on the block cache */
+	do {
+		cb = cacheblock(dev, ((dir_blk - 1) & ~mask) + 1, 1);
+		if (!cb) return 0;
+		dir_blk_next = ((uint32_t *)cb->data)[(dir_blk - 1) & mask];
+#if UHFS_DEBUG == 1
+		kprintf("\nchain %d dir_blk_next: %d", ((dir_blk - 1) & ~mask) + 1, dir_blk_next);
+#endif
+		cb = cacheblock(dev, dir_blk, 1);
+		if (!cb) return 0;
+		dir_data = (struct fs_direntry *)cb->data;
+		for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
+			if (!(dir_data[i].attributes & UHFS_ATTRFREE) && strcmp(dir_data[i].filename, name) == 0) {
+				entry->block = dir_blk;
+				entry->first_block = dir_data[i].first_block;
+				entry->attributes = dir_data[i].attributes;
+				
+				return 1;
+			}
+		}
+		dir_blk = dir_blk_next;
+	} while (dir_blk != UHFS_EOCHBLK && dir_blk < blk_device->fssblock.n_blocks);
+	
+	return 0;
+}
 
+static int32_t lookupentry(struct device *dev, uint32_t dir, int8_t *name, struct fs_dentry *entry)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_dentry *dentry;
+	int32_t found;
 	
 	blk_device = dev->ptr;
+	
+	/* names that don't fit on a directory entry can't be there, and aren't cached */
+	if (strlen(name) >= sizeof(entry->name))
+		return 0;
+	
+	dentry = &blk_device->dentries[dentryhash(dir, name)];
+	if (dentry->dir == dir && !strcmp(dentry->name, name)) {
+		*entry = *dentry;
+		
+		return entry->block != 0;
+	}
+	
+	found = scandirectory(dev, dir, name, entry);
+	if (!found)
+		entry->block = 0;
+	entry->dir = dir;
+	strcpy(entry->name, name);
+	*dentry = *entry;
+	
+	return found;
+}
+
+static int32_t searchdirectory(struct device *dev, int8_t *path, uint32_t *pblock, int8_t **ppath, uint32_t *lblock, int8_t **lpath)
+{
+	struct fs_dentry entry;
+	int32_t found = 0;
+	uint32_t first_dir_blk;
+
 	path = strtok(path, " /");
 
 	if (!path) {
@@ -62,52 +623,25 @@ static int32_t searchdirectory(struct device *dev, int8_t *path, uint32_t *pbloc
 	}
 	
 	/* search the path, following the directory tree */
-	chain_blk = blk_device->fssblock.first_cmb;
-	dir_blk = blk_device->fssblock.root_dir_block;
-	first_dir_blk = dir_blk;
+	first_dir_blk = ((struct fs_blkdevice *)dev->ptr)->fssblock.root_dir_block;
 	*pblock = 0;
 	while (path != NULL) {
-		found = 0;
-		do {
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-			hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
-			dir_blk_next = blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
-#if UHFS_DEBUG == 1
-			kprintf("\nchain %d dir_blk_next: %d", chain_blk, dir_blk_next);
-#endif
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-			hf_dev_read(dev, blk_device->datablock.dir_data, 1);
-
-			for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry) && !found; i++) {
-				if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE)) {
-					if (strcmp(blk_device->datablock.dir_data[i].filename, path) == 0) {
-						if (blk_device->datablock.dir_data[i].attributes & UHFS_ATTRDIR) {
-							found = 1;
-							*pblock = dir_blk;
-							*ppath = path;
-							dir_blk = blk_device->datablock.dir_data[i].first_block;
-							first_dir_blk = dir_blk;
-						} else {
+		found = lookupentry(dev, first_dir_blk, path, &entry);
+		if (found) {
+			*pblock = entry.block;
+			*ppath = path;
+			if (entry.attributes & UHFS_ATTRDIR) {
+				first_dir_blk = entry.first_block;
+			} else {
 #if UHFS_DEBUG == 1
-							kprintf("\nsearchdirectory: %s is not a directory", blk_device->datablock.dir_data[i].filename);
+				kprintf("\nsearchdirectory: %s is not a directory", path);
 #endif
-							*pblock = dir_blk;
-							*ppath = path;
-							*lblock = blk_device->datablock.dir_data[i].first_block;
-							*lpath = path;
+				*lblock = entry.first_block;
+				*lpath = path;
 
-							return 1;
-						}
-					}
-				}
+				return 1;
 			}
-			if (found) break;
-
-			chain_blk = ((dir_blk_next - 1) & ~(blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) + 1;
-			dir_blk = dir_blk_next;
-			if (dir_blk < 0 || (dir_blk > blk_device->fssblock.n_blocks * blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) break;
-			
-		} while (dir_blk_next != UHFS_EOCHBLK);
+		}
 		
 		*lpath = path;
 		path = strtok(NULL, " /");
@@ -140,7 +674,7 @@ int32_t hf_mkfs(struct device *dev, uint32_t blk_size)
 {
 	struct blk_info fsblk_info;
 	struct fs_blkdevice blk_device;
-	uint32_t i, k;
+	uint32_t i, j, k;
 
 	if (dev->ptr) {
 #if UHFS_DEBUG == 1
@@ -186,6 +720,18 @@ int32_t hf_mkfs(struct device *dev, uint32_t blk_size)
 	blk_device.fssblock.first_cmb = 1;
 	blk_device.fssblock.root_dir_block = 2;
 	blk_device.fssblock.metadata_block = 0;
+	
+	/* the metadata journal follows the root directory, on the first storage region */
+	j = UHFS_JOURNAL_BLOCKS;
+	if (j > blk_size / sizeof(uint32_t) - 2)
+		j = blk_size / sizeof(uint32_t) - 2;
+	while (j && (j + 1) * blk_size >= blk_device.vsize - blk_size)
+		j--;
+	j &= ~1;
+	if (j < 4)
+		j = 0;
+	blk_device.fssblock.journal_block = j ? blk_device.fssblock.root_dir_block + 1 : 0;
+	blk_device.fssblock.journal_blocks = j;
 		
 	blk_device.datablock.data = (int8_t *)hf_malloc(blk_size);
 	if (!blk_device.datablock.data) return -1;
@@ -193,8 +739,7 @@ int32_t hf_mkfs(struct device *dev, uint32_t blk_size)
 	/* write the superblock */
 	memcpy(blk_device.datablock.data, &blk_device.fssblock, sizeof(struct fs_superblock));
 	memset(blk_device.datablock.data + sizeof(struct fs_superblock), 0, blk_size - sizeof(struct fs_superblock));
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)0);
-	hf_dev_write(dev, blk_device.datablock.data, 1);
+	hf_dev_writeblk(dev, 0, blk_device.datablock.data, 1);
 	
 	/* write cluster map blocks and data blocks (storage regions) */
 	for (k = 1; k < blk_device.fssblock.n_blocks; k += blk_size / (sizeof(uint32_t))) {
@@ -212,13 +757,13 @@ int32_t hf_mkfs(struct device *dev, uint32_t blk_size)
 				blk_device.datablock.cmb_data[i] = UHFS_FIXDBLK;
 		}
 		/* write cluster map block from this storage region */
-		hf_dev_write(dev, blk_device.datablock.data, 1);
+		hf_dev_writeblk(dev, k, blk_device.datablock.data, 1);
 		
 		/* fill data with zeroes and write blocks of this storage region to disk */
 		memset(blk_device.datablock.data, 0, blk_size);
 		for (i = 1; i < blk_size / sizeof(uint32_t); i++)
 			if ((k - 1 + i) * blk_size < blk_device.vsize - blk_size)
-				hf_dev_write(dev, blk_device.datablock.data, 1);
+				hf_dev_writeblk(dev, k + i, blk_device.datablock.data, 1);
 	}
 	
 	/* create root directory */
@@ -226,14 +771,13 @@ int32_t hf_mkfs(struct device *dev, uint32_t blk_size)
 	blk_device.fsdirentry.attributes = UHFS_ATTRFREE;
 	for (i = 0; i < blk_size / sizeof(struct fs_direntry); i++)
 		memcpy(blk_device.datablock.data + i * sizeof(struct fs_direntry), &blk_device.fsdirentry, sizeof(struct fs_direntry));
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)blk_device.fssblock.root_dir_block);
-	hf_dev_write(dev, blk_device.datablock.data, 1);
+	hf_dev_writeblk(dev, blk_device.fssblock.root_dir_block, blk_device.datablock.data, 1);
 	
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)blk_device.fssblock.first_cmb);
-	hf_dev_read(dev, blk_device.datablock.data, 1);
+	hf_dev_readblk(dev, blk_device.fssblock.first_cmb, blk_device.datablock.data, 1);
 	blk_device.datablock.cmb_data[blk_device.fssblock.first_cmb] = UHFS_EOCHBLK;
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)blk_device.fssblock.first_cmb);
-	hf_dev_write(dev, blk_device.datablock.data, 1);
+	for (i = 0; i < j; i++)
+		blk_device.datablock.cmb_data[blk_device.fssblock.journal_block + i - 1] = UHFS_FIXDBLK;
+	hf_dev_writeblk(dev, blk_device.fssblock.first_cmb, blk_device.datablock.data, 1);
 	
 	hf_free(blk_device.datablock.data);
 	
@@ -245,6 +789,7 @@ int32_t hf_mount(struct device *dev)
 	struct blk_info fsblk_info;
 	struct fs_blkdevice *blk_device;
 	struct fs_superblock *tmp_sblock;
+	uint32_t i, k;
 
 	if (dev->ptr) {
 #if UHFS_DEBUG == 1
@@ -266,13 +811,15 @@ int32_t hf_mount(struct device *dev)
 	if (!blk_device) return -1;
 	blk_device->fsblk_info = fsblk_info;
 	blk_device->vsize = fsblk_info.num_sectors * fsblk_info.bytes_sector;
+	blk_device->datablock.data = 0;
+	blk_device->cache = 0;
+	blk_device->journal = 0;
 	
 	/* read superblock from the first media sector. FIXME: maybe read other copies if this fails? */
 	tmp_sblock = (struct fs_superblock *)hf_malloc(fsblk_info.bytes_sector);
-	if (!tmp_sblock) return -1;
+	if (!tmp_sblock) goto fail;
 	
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)0);
-	hf_dev_read(dev, tmp_sblock, 1);
+	hf_dev_readblk(dev, 0, tmp_sblock, 1);
 	memcpy(&blk_device->fssblock, tmp_sblock, sizeof(struct fs_superblock));
 	hf_free(tmp_sblock);
 	
@@ -281,18 +828,104 @@ int32_t hf_mount(struct device *dev)
 #if UHFS_DEBUG == 1
 		kprintf("\nhf_mount: invalid block size");
 #endif
-		return -1;
+		goto fail;
 	}
 	blk_device->datablock.data = (int8_t *)hf_malloc(blk_device->fssblock.block_size);
-	if (!blk_device->datablock.data) return -1;
+	if (!blk_device->datablock.data) goto fail;
+	
+	/* allocate the block cache. it gets smaller if memory is short, but has at least one block */
+	blk_device->cache_blocks = UHFS_CACHE_BLOCKS;
+	if (blk_device->cache_blocks > blk_device->fssblock.n_blocks)
+		blk_device->cache_blocks = blk_device->fssblock.n_blocks;
+	if (blk_device->fssblock.journal_blocks) {
+		if (blk_device->fssblock.journal_blocks < 4 || blk_device->fssblock.journal_block + blk_device->fssblock.journal_blocks > blk_device->fssblock.n_blocks) {
+#if UHFS_DEBUG == 1
+			kprintf("\nhf_mount: invalid journal");
+#endif
+			goto fail;
+		}
+		/* all modified blocks of the cache must fit on a transaction (half of the journal) */
+		if (blk_device->cache_blocks > blk_device->fssblock.journal_blocks / 2 - 1)
+			blk_device->cache_blocks = blk_device->fssblock.journal_blocks / 2 - 1;
+		if (blk_device->cache_blocks > UHFS_JOURNAL_MAX(blk_device->fssblock.block_size))
+			blk_device->cache_blocks = UHFS_JOURNAL_MAX(blk_device->fssblock.block_size);
+	}
+	blk_device->cache = (struct fs_cacheblock *)hf_malloc(blk_device->cache_blocks * sizeof(struct fs_cacheblock));
+	if (!blk_device->cache) goto fail;
+	for (; blk_device->cache_blocks; blk_device->cache_blocks >>= 1) {
+		blk_device->cache[0].data = (int8_t *)hf_malloc(blk_device->cache_blocks * blk_device->fssblock.block_size);
+		if (blk_device->cache[0].data) break;
+	}
+	if (!blk_device->cache_blocks) goto fail;
+	for (i = 0; i < blk_device->cache_blocks; i++) {
+		blk_device->cache[i].block = UHFS_FREEBLK;
+		blk_device->cache[i].dirty = 0;
+		blk_device->cache[i].journal = 0;
+		blk_device->cache[i].used = 0;
+		blk_device->cache[i].data = blk_device->cache[0].data + i * blk_device->fssblock.block_size;
+	}
+	blk_device->cache_time = 0;
+	blk_device->cache_hits = 0;
+	blk_device->cache_misses = 0;
+	for (i = 0; i < UHFS_DENTRIES; i++)
+		blk_device->dentries[i].dir = 0;
+	
+	/* the journal buffer holds a whole transaction (descriptor and the blocks of the cache) */
+	blk_device->journal_sequence = 0;
+	blk_device->journal_clean = 1;
+	blk_device->journal_commits = 0;
+	if (blk_device->fssblock.journal_blocks) {
+		blk_device->journal = (int8_t *)hf_malloc((blk_device->cache_blocks + 1) * blk_device->fssblock.block_size);
+		if (!blk_device->journal) goto fail;
+	}
 	
 	/* attach filesystem structure (fs_blkdevice) to device */
 	dev->ptr = blk_device;
+	
+	/* a transaction left on the journal (the volume was not unmounted) is written home again */
+	if (blk_device->journal && journalreplay(dev)) {
+		dev->ptr = 0;
+		goto fail;
+	}
+	
+	/* build the free space summary, sweeping through all cluster map blocks */
+	for (blk_device->region_shift = 0; (1 << blk_device->region_shift) < blk_device->fssblock.block_size / sizeof(uint32_t); blk_device->region_shift++);
+	blk_device->regions = ((blk_device->fssblock.n_blocks - 2) >> blk_device->region_shift) + 1;
+	blk_device->region_free = (uint16_t *)hf_malloc(blk_device->regions * sizeof(uint16_t));
+	if (!blk_device->region_free) {
+		dev->ptr = 0;
+		goto fail;
+	}
+	blk_device->free_blocks = 0;
+	blk_device->free_hint = 0;
+	for (i = 0; i < blk_device->regions; i++) {
+		readblocks(dev, (i << blk_device->region_shift) + 1, blk_device->datablock.cmb_data, 1);
+		blk_device->region_free[i] = 0;
+		for (k = 1; k < blk_device->fssblock.block_size / sizeof(uint32_t); k++)
+			if (blk_device->datablock.cmb_data[k] == UHFS_FREEBLK)
+				blk_device->region_free[i]++;
+		blk_device->free_blocks += blk_device->region_free[i];
+	}
 #if UHFS_DEBUG == 1
-	kprintf("\nhf_mount: block device mounted; sector size: %d, sectors %d, block size: %d, blocks: %d", 
-		blk_device->fsblk_info.bytes_sector, blk_device->fsblk_info.num_sectors, blk_device->fssblock.block_size, blk_device->fssblock.n_blocks); 
+	kprintf("\nhf_mount: block device mounted; sector size: %d, sectors %d, block size: %d, blocks: %d, cached blocks: %d", 
+		blk_device->fsblk_info.bytes_sector, blk_device->fsblk_info.num_sectors, blk_device->fssblock.block_size, blk_device->fssblock.n_blocks, blk_device->cache_blocks); 
 #endif
 	return 0;
+
+fail:
+	/* undo a partial mount, freeing whatever was allocated so far */
+	if (blk_device->journal)
+		hf_free(blk_device->journal);
+	if (blk_device->cache) {
+		if (blk_device->cache_blocks)
+			hf_free(blk_device->cache[0].data);
+		hf_free(blk_device->cache);
+	}
+	if (blk_device->datablock.data)
+		hf_free(blk_device->datablock.data);
+	hf_free(blk_device);
+
+	return -1;
 }
 
 int32_t hf_umount(struct device *dev)
@@ -306,8 +939,20 @@ int32_t hf_umount(struct device *dev)
 		return -1;
 	}
 	
-	/* free data structures from device: data block and block device structure */
+	/* write back the block cache. the journal is left empty, so it is not replayed on the next mount */
 	blk_device = dev->ptr;
+	if (!hf_sync(dev) && blk_device->journal && !blk_device->journal_clean)
+		journalcheckpoint(dev);
+	
+	/* free data structures from device: block cache, data block and block device structure */
+#if UHFS_DEBUG == 1
+	kprintf("\nhf_umount: block cache hits: %d, misses: %d, journal commits: %d", blk_device->cache_hits, blk_device->cache_misses, blk_device->journal_commits);
+#endif
+	if (blk_device->journal)
+		hf_free(blk_device->journal);
+	hf_free(blk_device->region_free);
+	hf_free(blk_device->cache[0].data);
+	hf_free(blk_device->cache);
 	hf_free(blk_device->datablock.data);
 	hf_free(blk_device);
 	
@@ -319,31 +964,32 @@ int32_t hf_umount(struct device *dev)
 	return 0;
 }
 
+int32_t hf_sync(struct device *dev)
+{
+	uint32_t i;
+	int32_t err = 0;
+	
+	if (!dev->ptr) return -1;
+	
+	/* write-behind buffers of open files first, then dirty data blocks, and commit modified metadata to the journal */
+	for (i = 0; i < UHFS_MAXFILES; i++)
+		if ((fs_files[i].flags & UHFS_OPENFILE) && fs_files[i].dev == dev && streamsync(&fs_files[i]))
+			err = -1;
+	if (journalcommit(dev))
+		err = -1;
+	
+	return err;
+}
+
 int32_t hf_getfree(struct device *dev)
 {
 	struct fs_blkdevice *blk_device;
-	uint32_t k, freeblks = 0;
 
 	if (!dev->ptr) return -1;
 	
 	blk_device = dev->ptr;
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)blk_device->fssblock.first_cmb);
 	
-	/* sweep through all cluster map blocks, counting free blocks */
-	while (1) {
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
-		
-		for (k = 1; k < blk_device->fssblock.block_size / sizeof(uint32_t); k++)
-			if (blk_device->datablock.cmb_data[k] == UHFS_FREEBLK)
-				freeblks++;
-		
-		if (blk_device->datablock.cmb_data[0] == UHFS_EOCHBLK)
-			break;
-			
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)blk_device->datablock.cmb_data[0]);
-	};
-	
-	return freeblks;
+	return blk_device->free_blocks;
 }
 
 int32_t hf_getlabel(struct device *dev, int8_t *label)
@@ -382,7 +1028,9 @@ int32_t hf_mkdir(struct device *dev, int8_t *path)
 		return -1;
 	}
 	
-	dirpath = (int8_t *)hf_malloc(strlen(path));
+	journalbatch(dev);
+	
+	dirpath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!dirpath)
 		return -1;
 	strcpy(dirpath, path);
@@ -405,11 +1053,9 @@ int32_t hf_mkdir(struct device *dev, int8_t *path)
 #endif
 	while (1) {
 		do {
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-			hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+			readblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 			dir_blk_next = blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-			hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+			readblocks(dev, dir_blk, blk_device->datablock.dir_data, 1);
 #if UHFS_DEBUG == 1
 			kprintf("\nhf_mkdir: chain: %d blk: %d next %d", chain_blk, dir_blk, dir_blk_next);
 #endif
@@ -420,23 +1066,21 @@ int32_t hf_mkdir(struct device *dev, int8_t *path)
 					if (!k) return -1;
 					
 					/* clean the block for empty directory entries */
-					hf_dev_ioctl(dev, DISK_SEEKSET, (void *)k);
 					memset(blk_device->datablock.dir_data, 0, blk_device->fssblock.block_size);
 					for (j = 0; j < blk_device->fssblock.block_size / sizeof(struct fs_direntry); j++)
 						blk_device->datablock.dir_data[j].attributes = UHFS_ATTRFREE;
-					hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+					writemeta(dev, k, blk_device->datablock.dir_data);
 					
 					/* update the directory entry, pointing to the new subdirectory file */
-					hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-					hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+					readblocks(dev, dir_blk, blk_device->datablock.dir_data, 1);
 
 					strcpy(blk_device->datablock.dir_data[i].filename, lpath);
 					blk_device->datablock.dir_data[i].attributes = UHFS_ATTRDIR | UHFS_ATTRREAD | UHFS_ATTRWRITE | UHFS_ATTREXEC;
 					blk_device->datablock.dir_data[i].metadata_block = 0;
 					blk_device->datablock.dir_data[i].first_block = k;
 					blk_device->datablock.dir_data[i].size = 0;
-					hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-					hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+					writemeta(dev, dir_blk, blk_device->datablock.dir_data);
+					dropentries(blk_device, lpath, 0);
 					
 					hf_free(dirpath);
 					
@@ -465,18 +1109,15 @@ int32_t hf_mkdir(struct device *dev, int8_t *path)
 		}
 			
 		/* clean the block for empty directory entries */
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)k);
 		memset(blk_device->datablock.dir_data, 0, blk_device->fssblock.block_size);
 		for (j = 0; j < blk_device->fssblock.block_size / sizeof(struct fs_direntry); j++)
 			blk_device->datablock.dir_data[j].attributes = UHFS_ATTRFREE;
-		hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+		writemeta(dev, k, blk_device->datablock.dir_data);
 
 		/* update the a cluster map block */
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk_last);
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+		readblocks(dev, chain_blk_last, blk_device->datablock.cmb_data, 1);
 		blk_device->datablock.cmb_data[(dir_blk_last - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)] = k;
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk_last);
-		hf_dev_write(dev, blk_device->datablock.cmb_data, 1);
+		writeblocks(dev, chain_blk_last, blk_device->datablock.cmb_data, 1);
 		
 		dir_blk = k;
 		chain_blk = ((k - 1) & ~(blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) + 1;
@@ -505,7 +1146,7 @@ struct file * hf_opendir(struct device *dev, int8_t *path)
 	if (!fptr)
 		return 0;
 
-	dirpath = (int8_t *)hf_malloc(strlen(path));
+	dirpath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!dirpath)
 		return 0;
 	strcpy(dirpath, path);	
@@ -568,11 +1209,9 @@ int32_t hf_readdir(struct file *desc, struct fs_direntry *entry)
 		chain_blk = ((desc->block - 1) & ~(blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) + 1;
 		dir_blk = desc->block;
 
-		hf_dev_ioctl(desc->dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_read(desc->dev, blk_device->datablock.cmb_data, 1);
+		readblocks(desc->dev, chain_blk, blk_device->datablock.cmb_data, 1);
 		dir_blk_next = blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
-		hf_dev_ioctl(desc->dev, DISK_SEEKSET, (void *)dir_blk);
-		hf_dev_read(desc->dev, blk_device->datablock.dir_data, 1);
+		readblocks(desc->dev, dir_blk, blk_device->datablock.dir_data, 1);
 		desc->block = dir_blk_next;
 #if UHFS_DEBUG == 1
 		kprintf("\nhf_readdir: chain: %d blk: %d next %d", chain_blk, dir_blk, dir_blk_next);
@@ -603,7 +1242,9 @@ int32_t hf_rmdir(struct device *dev, int8_t *path)
 		return -1;
 	}
 	
-	dirpath = (int8_t *)hf_malloc(strlen(path));
+	journalbatch(dev);
+	
+	dirpath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!dirpath)
 		return -1;
 	strcpy(dirpath, path);
@@ -628,11 +1269,9 @@ int32_t hf_rmdir(struct device *dev, int8_t *path)
 #endif
 	/* find a non-empty directory entry */
 	do {
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+		readblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 		dir_blk_next = blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-		hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+		readblocks(dev, dir_blk, blk_device->datablock.dir_data, 1);
 #if UHFS_DEBUG == 1
 		kprintf("\nhf_rmdir: chain: %d blk: %d next %d", chain_blk, dir_blk, dir_blk_next);
 #endif
@@ -660,16 +1299,15 @@ int32_t hf_rmdir(struct device *dev, int8_t *path)
 	/* free directory entry on parent block */
 	dir_blk = parent_dir_blk;
 
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-	hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+	readblocks(dev, dir_blk, blk_device->datablock.dir_data, 1);
 	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
-		if (!strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
 			blk_device->datablock.dir_data[i].attributes |= UHFS_ATTRFREE;
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-			hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+			writemeta(dev, dir_blk, blk_device->datablock.dir_data);
 #if UHFS_DEBUG == 1
 			kprintf("\nhf_rmdir: freed directory entry");
 #endif
+			dropentries(blk_device, ppath, first_dir_blk);
 			break;
 		}
 	}
@@ -681,12 +1319,11 @@ int32_t hf_rmdir(struct device *dev, int8_t *path)
 	kprintf("\nhf_rmdir: chain %d block %d", chain_blk, dir_blk);
 #endif
 	do {
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+		readblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 		dir_blk_next = blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
 		blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)] = UHFS_FREEBLK;
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_write(dev, blk_device->datablock.cmb_data, 1);
+		freespace(blk_device, dir_blk, 1);
+		writeblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 #if UHFS_DEBUG == 1
 		kprintf("\nhf_rmdir: freed block %d", dir_blk);
 #endif
@@ -714,7 +1351,9 @@ int32_t hf_create(struct device *dev, int8_t *path)
 		return -1;
 	}
 	
-	dirpath = (int8_t *)hf_malloc(strlen(path));
+	journalbatch(dev);
+	
+	dirpath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!dirpath)
 		return -1;
 	strcpy(dirpath, path);
@@ -737,11 +1376,9 @@ int32_t hf_create(struct device *dev, int8_t *path)
 #endif
 	while (1) {
 		do {
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-			hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+			readblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 			dir_blk_next = blk_device->datablock.cmb_data[(dir_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-			hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+			readblocks(dev, dir_blk, blk_device->datablock.dir_data, 1);
 #if UHFS_DEBUG == 1
 			kprintf("\nhf_mkdir: chain: %d blk: %d next %d", chain_blk, dir_blk, dir_blk_next);
 #endif
@@ -752,21 +1389,19 @@ int32_t hf_create(struct device *dev, int8_t *path)
 					if (!k) return -1;
 					
 					/* clean the block */
-					hf_dev_ioctl(dev, DISK_SEEKSET, (void *)k);
 					memset(blk_device->datablock.data, 0, blk_device->fssblock.block_size);
-					hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+					writeblocks(dev, k, blk_device->datablock.dir_data, 1);
 					
 					/* update the directory entry, pointing to the new file */
-					hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-					hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+					readblocks(dev, dir_blk, blk_device->datablock.dir_data, 1);
 
 					strcpy(blk_device->datablock.dir_data[i].filename, lpath);
 					blk_device->datablock.dir_data[i].attributes = UHFS_ATTRREAD | UHFS_ATTRWRITE;
 					blk_device->datablock.dir_data[i].metadata_block = 0;
 					blk_device->datablock.dir_data[i].first_block = k;
 					blk_device->datablock.dir_data[i].size = 0;
-					hf_dev_ioctl(dev, DISK_SEEKSET, (void *)dir_blk);
-					hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+					writemeta(dev, dir_blk, blk_device->datablock.dir_data);
+					dropentries(blk_device, lpath, 0);
 					
 					hf_free(dirpath);
 					
@@ -795,18 +1430,15 @@ int32_t hf_create(struct device *dev, int8_t *path)
 		}
 			
 		/* clean the block for empty directory entries */
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)k);
 		memset(blk_device->datablock.dir_data, 0, blk_device->fssblock.block_size);
 		for (j = 0; j < blk_device->fssblock.block_size / sizeof(struct fs_direntry); j++)
 			blk_device->datablock.dir_data[j].attributes = UHFS_ATTRFREE;
-		hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+		writemeta(dev, k, blk_device->datablock.dir_data);
 
 		/* update the a cluster map block */
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk_last);
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+		readblocks(dev, chain_blk_last, blk_device->datablock.cmb_data, 1);
 		blk_device->datablock.cmb_data[(dir_blk_last - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)] = k;
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk_last);
-		hf_dev_write(dev, blk_device->datablock.cmb_data, 1);
+		writeblocks(dev, chain_blk_last, blk_device->datablock.cmb_data, 1);
 		
 		dir_blk = k;
 		chain_blk = ((k - 1) & ~(blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) + 1;
@@ -831,7 +1463,9 @@ int32_t hf_unlink(struct device *dev, int8_t *path)
 		return -1;
 	}
 	
-	filepath = (int8_t *)hf_malloc(strlen(path));
+	journalbatch(dev);
+	
+	filepath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!filepath)
 		return -1;
 	strcpy(filepath, path);
@@ -859,6 +1493,17 @@ int32_t hf_unlink(struct device *dev, int8_t *path)
 		return -1;
 	}
 	
+	for (i = 0; i < UHFS_MAXFILES; i++) {
+		if ((fs_files[i].flags & UHFS_OPENFILE) && fs_files[i].dev == dev && fs_files[i].first_block == first_file_blk) {
+#if UHFS_DEBUG == 1
+			kprintf("\nhf_unlink: %s is open", path);
+#endif
+			hf_free(filepath);
+			
+			return -1;
+		}
+	}
+	
 	blk_device = dev->ptr;
 	
 	chain_blk = ((first_file_blk - 1) & ~(blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) + 1;
@@ -869,16 +1514,15 @@ int32_t hf_unlink(struct device *dev, int8_t *path)
 	/* free directory entry on parent block */
 	file_blk = parent_dir_blk;
 
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-	hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+	readblocks(dev, file_blk, blk_device->datablock.dir_data, 1);
 	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
-		if (!strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
 			blk_device->datablock.dir_data[i].attributes |= UHFS_ATTRFREE;
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-			hf_dev_write(dev, blk_device->datablock.dir_data, 1);
+			writemeta(dev, file_blk, blk_device->datablock.dir_data);
 #if UHFS_DEBUG == 1
 			kprintf("\nhf_unlink: freed directory entry");
 #endif
+			dropentries(blk_device, ppath, 0);
 			break;
 		}
 	}
@@ -890,12 +1534,11 @@ int32_t hf_unlink(struct device *dev, int8_t *path)
 	kprintf("\nhf_unlink: chain %d block %d", chain_blk, file_blk);
 #endif
 	do {
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_read(dev, blk_device->datablock.cmb_data, 1);
+		readblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 		file_blk_next = blk_device->datablock.cmb_data[(file_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)];
 		blk_device->datablock.cmb_data[(file_blk - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)] = UHFS_FREEBLK;
-		hf_dev_ioctl(dev, DISK_SEEKSET, (void *)chain_blk);
-		hf_dev_write(dev, blk_device->datablock.cmb_data, 1);
+		freespace(blk_device, file_blk, 1);
+		writeblocks(dev, chain_blk, blk_device->datablock.cmb_data, 1);
 #if UHFS_DEBUG == 1
 		kprintf("\nhf_unlink: freed block %d", file_blk);
 #endif
@@ -922,7 +1565,7 @@ int64_t hf_size(struct device *dev, int8_t *path)
 		return -1;
 	}
 	
-	filepath = (int8_t *)hf_malloc(strlen(path));
+	filepath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!filepath)
 		return -1;
 	strcpy(filepath, path);
@@ -939,10 +1582,9 @@ int64_t hf_size(struct device *dev, int8_t *path)
 	blk_device = dev->ptr;
 	/* find directory entry on parent block */
 	file_blk = parent_dir_blk;
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-	hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+	readblocks(dev, file_blk, blk_device->datablock.dir_data, 1);
 	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
-		if (!strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
 			hf_free(filepath);
 			
 			return blk_device->datablock.dir_data[i].size;
@@ -968,7 +1610,9 @@ int32_t hf_rename(struct device *dev, int8_t *path, int8_t *newname)
 		return -1;
 	}
 	
-	filepath = (int8_t *)hf_malloc(strlen(path));
+	journalbatch(dev);
+	
+	filepath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!filepath)
 		return -1;
 	strcpy(filepath, path);
@@ -985,14 +1629,14 @@ int32_t hf_rename(struct device *dev, int8_t *path, int8_t *newname)
 	blk_device = dev->ptr;
 	/* find directory entry on parent block */
 	file_blk = parent_dir_blk;
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-	hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+	readblocks(dev, file_blk, blk_device->datablock.dir_data, 1);
 	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
-		if (!strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
 			strncpy(blk_device->datablock.dir_data[i].filename, newname, sizeof(blk_device->datablock.dir_data[i].filename));
 			
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-			hf_dev_write(dev, blk_device->datablock.dir_data, 1);						
+			writemeta(dev, file_blk, blk_device->datablock.dir_data);						
+			dropentries(blk_device, ppath, 0);
+			dropentries(blk_device, newname, 0);
 			
 			hf_free(filepath);
 			
@@ -1019,7 +1663,9 @@ int32_t hf_chmod(struct device *dev, int8_t *path, int8_t mode)
 		return -1;
 	}
 	
-	filepath = (int8_t *)hf_malloc(strlen(path));
+	journalbatch(dev);
+	
+	filepath = (int8_t *)hf_malloc(strlen(path) + 1);
 	if (!filepath)
 		return -1;
 	strcpy(filepath, path);
@@ -1036,15 +1682,13 @@ int32_t hf_chmod(struct device *dev, int8_t *path, int8_t mode)
 	blk_device = dev->ptr;
 	/* find directory entry on parent block */
 	file_blk = parent_dir_blk;
-	hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-	hf_dev_read(dev, blk_device->datablock.dir_data, 1);
+	readblocks(dev, file_blk, blk_device->datablock.dir_data, 1);
 	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
-		if (!strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
 			blk_device->datablock.dir_data[i].attributes &= ~0x7e;		/* directory and free attributes cannot be changed */
 			blk_device->datablock.dir_data[i].attributes |= mode;
 
-			hf_dev_ioctl(dev, DISK_SEEKSET, (void *)file_blk);
-			hf_dev_write(dev, blk_device->datablock.dir_data, 1);						
+			writemeta(dev, file_blk, blk_device->datablock.dir_data);						
 			
 			hf_free(filepath);
 			
@@ -1059,41 +1703,1006 @@ int32_t hf_chmod(struct device *dev, int8_t *path, int8_t mode)
 
 int32_t hf_touch(struct device *dev, int8_t *path, struct fs_date *ndate, struct fs_time *ntime)
 {
+	struct fs_blkdevice *blk_device;
+	uint32_t i, file_blk, parent_dir_blk, first_file_blk;
+	int8_t *ppath, *lpath;
+	int8_t *filepath;
+	
+	if (!dev->ptr) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_touch: filesystem not mounted");
+#endif
+		return -1;
+	}
+	
+	journalbatch(dev);
+	
+	filepath = (int8_t *)hf_malloc(strlen(path) + 1);
+	if (!filepath)
+		return -1;
+	strcpy(filepath, path);
+
+	if (searchdirectory(dev, filepath, &parent_dir_blk, &ppath, &first_file_blk, &lpath) != 1) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_touch: path not found");
+#endif
+		hf_free(filepath);
+		
+		return -1;
+	}
+
+	blk_device = dev->ptr;
+	/* find directory entry on parent block */
+	file_blk = parent_dir_blk;
+	readblocks(dev, file_blk, blk_device->datablock.dir_data, 1);
+	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++) {
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath)){
+			blk_device->datablock.dir_data[i].date = *ndate;
+			blk_device->datablock.dir_data[i].time = *ntime;
+
+			writemeta(dev, file_blk, blk_device->datablock.dir_data);
+			
+			hf_free(filepath);
+			
+			return 0;
+		}
+	}	
+	
+	hf_free(filepath);
+
+	return -1;
+}
+
+/*
+ * file data path. data blocks are found following the file chain on the cluster map, and runs
+ * of contiguous blocks are moved with a single multiple block request, straight from (or to)
+ * the caller's buffer. only partial blocks go through the block buffer of the volume. the
+ * position on the chain is kept on the descriptor, so sequential access never walks the chain
+ * from its start.
+ *
+ * a file is an extent when its chain is a sequence of consecutive data blocks (stepping over
+ * the cluster map blocks between storage regions). blocks of an extent are found without
+ * looking at the cluster map, and the extent is recorded on the metadata_block field of the
+ * directory entry, so the chain doesn't have to be walked when the file is opened.
+ */
+static uint32_t nextdatablock(struct fs_blkdevice *blk_device, uint32_t blk)
+{
+	return (blk & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1)) ? blk + 1 : blk + 2;
+}
+
+static uint32_t extentblock(struct fs_blkdevice *blk_device, uint32_t first, uint32_t index)
+{
+	uint32_t mask, data_blks;
+	
+	/* data blocks per storage region, and position of the block among all data blocks */
+	mask = blk_device->fssblock.block_size / sizeof(uint32_t) - 1;
+	data_blks = mask;
+	index += ((first - 1) >> blk_device->region_shift) * data_blks + ((first - 1) & mask) - 1;
+	
+	return ((index / data_blks) << blk_device->region_shift) + index % data_blks + 2;
+}
+
+static uint32_t blockrun(struct device *dev, uint32_t blk, uint32_t max, uint32_t *next)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t *cmb_data;
+	uint32_t mask, count = 1;
+	
+	blk_device = dev->ptr;
+	mask = blk_device->fssblock.block_size / sizeof(uint32_t) - 1;
+	
+	/* a run never crosses a storage region (the next one starts with a cluster map block) */
+	cb = cacheblock(dev, ((blk - 1) & ~mask) + 1, 1);
+	if (!cb) {
+		*next = UHFS_EOCHBLK;
+		
+		return 1;
+	}
+	cmb_data = (uint32_t *)cb->data;
+	while (count < max && cmb_data[(blk - 1) & mask] == blk + 1) {
+		blk++;
+		count++;
+	}
+	*next = cmb_data[(blk - 1) & mask];
+	
+	return count;
+}
+
+/* contiguous blocks of the file from the current block (upto max) */
+static uint32_t filerun(struct file *desc, uint32_t max)
+{
+	struct fs_blkdevice *blk_device;
+	uint32_t count, next;
+	
+	blk_device = desc->dev->ptr;
+	if (desc->extent) {
+		count = blk_device->fssblock.block_size / sizeof(uint32_t) - ((desc->block - 1) & (blk_device->fssblock.block_size / sizeof(uint32_t) - 1));
+		if (count > desc->n_blocks - desc->index)
+			count = desc->n_blocks - desc->index;
+		
+		return count < max ? count : max;
+	}
+	
+	return blockrun(desc->dev, desc->block, max, &next);
+}
+
+static int32_t seekblock(struct file *desc, uint32_t index)
+{
+	uint32_t count, next;
+	
+	if (index >= desc->n_blocks)
+		return -1;
+	
+	if (index == desc->n_blocks - 1) {
+		desc->block = desc->last_block;
+		desc->index = index;
+		
+		return 0;
+	}
+	
+	if (desc->extent) {
+		desc->block = extentblock(desc->dev->ptr, desc->first_block, index);
+		desc->index = index;
+		
+		return 0;
+	}
+	
+	if (index < desc->index) {
+		desc->block = desc->first_block;
+		desc->index = 0;
+	}
+	
+	while (desc->index < index) {
+		count = blockrun(desc->dev, desc->block, index - desc->index + 1, &next);
+		if (desc->index + count > index) {
+			desc->block += index - desc->index;
+			desc->index = index;
+		} else {
+			desc->block = next;
+			desc->index += count;
+		}
+	}
+	
+	return 0;
+}
+
+/* write the file size and extent (and first block, if the file was moved) back to its directory entry */
+static void updateentry(struct file *desc)
+{
+	struct fs_blkdevice *blk_device;
+	uint32_t metadata;
+	
+	blk_device = desc->dev->ptr;
+	metadata = desc->extent ? UHFS_EXTENT | desc->n_blocks : 0;
+	readblocks(desc->dev, desc->dir_block, blk_device->datablock.dir_data, 1);
+	if (blk_device->datablock.dir_data[desc->dir_entry].size != desc->size || blk_device->datablock.dir_data[desc->dir_entry].metadata_block != metadata ||
+	    blk_device->datablock.dir_data[desc->dir_entry].first_block != desc->first_block) {
+		blk_device->datablock.dir_data[desc->dir_entry].size = desc->size;
+		blk_device->datablock.dir_data[desc->dir_entry].metadata_block = metadata;
+		blk_device->datablock.dir_data[desc->dir_entry].first_block = desc->first_block;
+		writemeta(desc->dev, desc->dir_block, blk_device->datablock.dir_data);
+	}
+}
+
+/* the file is open on other descriptors */
+static int32_t sharedfile(struct file *desc)
+{
+	uint32_t i;
+	
+	for (i = 0; i < UHFS_MAXFILES; i++)
+		if (&fs_files[i] != desc && (fs_files[i].flags & UHFS_OPENFILE) && fs_files[i].dev == desc->dev && fs_files[i].first_block == desc->first_block)
+			return 1;
+	
+	return 0;
+}
+
+/*
+ * append blocks to the file chain. the data blocks right after its end are used when these are
+ * free (keeping the file an extent), otherwise runs of contiguous blocks are allocated.
+ */
+static int32_t growchain(struct file *desc, uint32_t count)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_cacheblock *cb;
+	uint32_t *cmb_data;
+	uint32_t i, k, n, mask, last;
+	
+	blk_device = desc->dev->ptr;
+	mask = blk_device->fssblock.block_size / sizeof(uint32_t) - 1;
+	
+	last = desc->last_block;
+	while (count) {
+		n = 0;
+		k = nextdatablock(blk_device, last);
+		if (((k - 1) >> blk_device->region_shift) < blk_device->regions) {
+			cb = cacheblock(desc->dev, ((k - 1) & ~mask) + 1, 1);
+			if (!cb) return -1;
+			cmb_data = (uint32_t *)cb->data;
+			while (n < count && ((k + n - 1) & mask) && cmb_data[(k + n - 1) & mask] == UHFS_FREEBLK)
+				n++;
+		}
+		if (n < count && desc->n_blocks == 1 && !desc->size && !sharedfile(desc)) {
+			/* an empty file is moved to a free run large enough (if there is one), so it stays an extent */
+			k = getfreerun(desc->dev, count + 1, &n);
+			if (!k) return -1;
+			cb = cacheblock(desc->dev, ((last - 1) & ~mask) + 1, 1);
+			if (!cb) return -1;
+			((uint32_t *)cb->data)[(last - 1) & mask] = UHFS_FREEBLK;
+			markdirty(cb);
+			freespace(blk_device, last, 1);
+			for (i = 0; i < UHFS_DENTRIES; i++)
+				if (blk_device->dentries[i].block == desc->dir_block && blk_device->dentries[i].first_block == last)
+					blk_device->dentries[i].first_block = k;
+			desc->first_block = k;
+			desc->block = k;
+			desc->index = 0;
+			last = k + n - 1;
+			desc->last_block = last;
+			desc->n_blocks = n;
+			count -= n - 1;
+			updateentry(desc);
+			continue;
+		}
+		if (n) {
+			for (i = 0; i < n - 1; i++)
+				cmb_data[(k + i - 1) & mask] = k + i + 1;
+			cmb_data[(k + n - 2) & mask] = UHFS_EOCHBLK;
+			markdirty(cb);
+			freespace(blk_device, k, -(int32_t)n);
+		}
+		if (!n) {
+			k = getfreerun(desc->dev, count, &n);
+			if (!k) return -1;
+			desc->extent = 0;
+		}
+		
+		/* link the new blocks to the end of the chain */
+		cb = cacheblock(desc->dev, ((last - 1) & ~mask) + 1, 1);
+		if (!cb) return -1;
+		((uint32_t *)cb->data)[(last - 1) & mask] = k;
+		markdirty(cb);
+		
+		last = k + n - 1;
+		desc->last_block = last;
+		desc->n_blocks += n;
+		count -= n;
+	}
+	
+	return 0;
+}
+
+/* free all blocks of a file, except the first one */
+static void truncatechain(struct file *desc)
+{
+	struct fs_blkdevice *blk_device;
+	uint32_t mask, chain_blk, blk, next;
+	
+	blk_device = desc->dev->ptr;
+	mask = blk_device->fssblock.block_size / sizeof(uint32_t) - 1;
+	
+	chain_blk = ((desc->first_block - 1) & ~mask) + 1;
+	readblocks(desc->dev, chain_blk, blk_device->datablock.cmb_data, 1);
+	blk = blk_device->datablock.cmb_data[(desc->first_block - 1) & mask];
+	blk_device->datablock.cmb_data[(desc->first_block - 1) & mask] = UHFS_EOCHBLK;
+	while (blk != UHFS_EOCHBLK && blk < blk_device->fssblock.n_blocks) {
+		if (((blk - 1) & ~mask) + 1 != chain_blk) {
+			writeblocks(desc->dev, chain_blk, blk_device->datablock.cmb_data, 1);
+			chain_blk = ((blk - 1) & ~mask) + 1;
+			readblocks(desc->dev, chain_blk, blk_device->datablock.cmb_data, 1);
+		}
+		next = blk_device->datablock.cmb_data[(blk - 1) & mask];
+		blk_device->datablock.cmb_data[(blk - 1) & mask] = UHFS_FREEBLK;
+		freespace(blk_device, blk, 1);
+		blk = next;
+	}
+	writeblocks(desc->dev, chain_blk, blk_device->datablock.cmb_data, 1);
+	
+	desc->block = desc->first_block;
+	desc->index = 0;
+	desc->last_block = desc->first_block;
+	desc->n_blocks = 1;
+	desc->extent = 1;
+	desc->size = 0;
+}
+
+/*
+ * sequential streams. a descriptor whose transfers start where the previous one ended becomes a
+ * stream after UHFS_SEQUENTIAL of them. reads of a stream are served from read-ahead buffers,
+ * filled with asynchronous requests for the blocks after the position, and appends are copied to
+ * write-behind buffers, written when a window is full. a stream has UHFS_STREAM_BUFFERS buffers
+ * (each holds a run of consecutive blocks, upto a window), so the task works on one while the
+ * device moves the other. requests are served by the device I/O task, the write-behind flusher,
+ * started by hf_dev_queue() with the first stream (without it, requests are done when
+ * submitted). write-behind data is on the device before the file size is written on the
+ * directory entry (buffers are written and waited on hf_fflush(), hf_fclose() and hf_sync()).
+ * files open on more than one descriptor are not streams.
+ */
+static int32_t streamwait(struct file *desc, struct fs_stream *s)
+{
+	if (s->pending) {
+		hf_dev_wait(&s->req);
+		s->pending = 0;
+		if (s->req.status && s->state == UHFS_SWRITE)
+			desc->stream_error = -1;
+	}
+	
+	return s->req.status;
+}
+
+static void streamsubmit(struct file *desc, struct fs_stream *s, uint32_t op, uint32_t count)
+{
+	s->req.dev = desc->dev;
+	s->req.op = op;
+	s->req.lba = s->lba;
+	s->req.count = count;
+	s->req.buf = s->data;
+	s->req.callback = 0;
+	s->req.done = &s->done;
+	s->pending = 1;
+	if (hf_dev_submit(&s->req)) {
+		/* the request queue is full, so this one is done now */
+		s->pending = 0;
+		if (op == DEV_WRITE)
+			s->req.status = hf_dev_writeblk(desc->dev, s->lba, s->data, count);
+		else
+			s->req.status = hf_dev_readblk(desc->dev, s->lba, s->data, count);
+		if (s->req.status && op == DEV_WRITE)
+			desc->stream_error = -1;
+	}
+}
+
+/* write the blocks of a write-behind buffer (the end of the last block is cleared) */
+static void streamwrite(struct file *desc, struct fs_stream *s)
+{
+	uint32_t bsize, count;
+	
+	if (s->state != UHFS_SFILL)
+		return;
+	bsize = ((struct fs_blkdevice *)desc->dev->ptr)->fssblock.block_size;
+	count = (s->fill + bsize - 1) / bsize;
+	memset(s->data + s->fill, 0, count * bsize - s->fill);
+	s->state = UHFS_SWRITE;
+	streamsubmit(desc, s, DEV_WRITE, count);
+}
+
+/* write the buffers being filled, without waiting */
+static void streamflush(struct file *desc)
+{
+	uint32_t i;
+	
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++)
+		streamwrite(desc, &desc->stream[i]);
+}
+
+/* write all write-behind buffers, and wait until they are on the device */
+static int32_t streamsync(struct file *desc)
+{
+	uint32_t i;
+	int32_t err;
+	
+	if (!desc->stream)
+		return 0;
+	streamflush(desc);
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++) {
+		if (desc->stream[i].state == UHFS_SWRITE) {
+			streamwait(desc, &desc->stream[i]);
+			desc->stream[i].state = UHFS_SEMPTY;
+		}
+	}
+	err = desc->stream_error;
+	desc->stream_error = 0;
+	
+	return err;
+}
+
+/* forget the read-ahead buffers (the file is written) */
+static void streamdrop(struct file *desc)
+{
+	uint32_t i;
+	
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++) {
+		if (desc->stream[i].state == UHFS_SREAD) {
+			streamwait(desc, &desc->stream[i]);
+			desc->stream[i].state = UHFS_SEMPTY;
+		}
+	}
+}
+
+/* end the stream, and free its buffers */
+static int32_t streamstop(struct file *desc)
+{
+	uint32_t i;
+	int32_t err;
+	
+	desc->sequential = 0;
+	if (!desc->stream)
+		return 0;
+	err = streamsync(desc);
+	streamdrop(desc);
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++)
+		hf_semdestroy(&desc->stream[i].done);
+	hf_free(desc->stream[0].data);
+	hf_free(desc->stream);
+	desc->stream = 0;
+	
+	return err;
+}
+
+/* count sequential transfers, and set the buffers up when the descriptor becomes a stream */
+static int32_t streamstart(struct file *desc)
+{
+	struct fs_blkdevice *blk_device;
+	uint32_t i, window;
+	
+	if (desc->offset != desc->last_offset)
+		desc->sequential = 0;
+	else if (desc->sequential < UHFS_SEQUENTIAL)
+		desc->sequential++;
+	if (desc->sequential < UHFS_SEQUENTIAL || (!desc->readahead && !desc->writebehind))
+		return 0;
+	if (sharedfile(desc)) {
+		streamstop(desc);
+		
+		return 0;
+	}
+	if (desc->stream)
+		return 1;
+	
+	blk_device = desc->dev->ptr;
+	window = desc->readahead > desc->writebehind ? desc->readahead : desc->writebehind;
+	desc->stream = (struct fs_stream *)hf_malloc(UHFS_STREAM_BUFFERS * sizeof(struct fs_stream));
+	if (!desc->stream)
+		return 0;
+	desc->stream[0].data = (int8_t *)hf_malloc(UHFS_STREAM_BUFFERS * window * blk_device->fssblock.block_size);
+	if (!desc->stream[0].data) {
+		hf_free(desc->stream);
+		desc->stream = 0;
+		
+		return 0;
+	}
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++) {
+		desc->stream[i].data = desc->stream[0].data + i * window * blk_device->fssblock.block_size;
+		desc->stream[i].state = UHFS_SEMPTY;
+		desc->stream[i].pending = 0;
+		desc->stream[i].req.status = 0;
+		hf_seminit(&desc->stream[i].done, 0);
+	}
+	hf_dev_queue();
+	
+	return 1;
+}
+
+/* the read-ahead buffer holding a block of the file */
+static struct fs_stream *streamfind(struct file *desc, uint32_t index)
+{
+	uint32_t i;
+	
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++)
+		if (desc->stream[i].state == UHFS_SREAD && index - desc->stream[i].index < desc->stream[i].count)
+			return &desc->stream[i];
+	
 	return 0;
 }
 
+/* read ahead the blocks after the position, on the buffers not holding any of them */
+static void streamfill(struct file *desc)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_stream *s;
+	uint32_t i, first, last, next, count, block, index;
+	
+	blk_device = desc->dev->ptr;
+	first = desc->offset / blk_device->fssblock.block_size;
+	last = (desc->size + blk_device->fssblock.block_size - 1) / blk_device->fssblock.block_size;
+	block = desc->block;
+	index = desc->index;
+	for (next = first; next < last; next += count) {
+		s = streamfind(desc, next);
+		if (s) {
+			count = s->index + s->count - next;
+			continue;
+		}
+		for (i = 0; i < UHFS_STREAM_BUFFERS; i++) {
+			s = &desc->stream[i];
+			if (s->state == UHFS_SEMPTY || (s->state == UHFS_SREAD && (s->index + s->count <= first || s->index > next)))
+				break;
+		}
+		if (i == UHFS_STREAM_BUFFERS) break;
+		streamwait(desc, s);
+		s->state = UHFS_SEMPTY;
+		if (seekblock(desc, next)) break;
+		count = filerun(desc, desc->readahead);
+		if (count > last - next)
+			count = last - next;
+		/* blocks modified on the cache go to the device first */
+		if (cachewrite(desc->dev, desc->block, count)) break;
+		s->state = UHFS_SREAD;
+		s->index = next;
+		s->lba = desc->block;
+		s->count = count;
+		streamsubmit(desc, s, DEV_READ, count);
+	}
+	desc->block = block;
+	desc->index = index;
+}
+
+/* the write-behind buffer taking the block at the position (a new one is started on appends) */
+static struct fs_stream *streamappend(struct file *desc, uint32_t boff, int64_t remaining)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_stream *s = 0;
+	uint32_t i, bsize;
+	
+	blk_device = desc->dev->ptr;
+	bsize = blk_device->fssblock.block_size;
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++) {
+		if (desc->stream[i].state == UHFS_SFILL)
+			s = &desc->stream[i];
+	}
+	if (s) {
+		/* the buffer goes on while the position is at its end, on the next consecutive block */
+		if (desc->offset == (int64_t)s->index * bsize + s->fill && desc->index - s->index < desc->writebehind &&
+		    desc->block == s->lba + (desc->index - s->index)) {
+			cachedrop(blk_device, desc->block);
+			
+			return s;
+		}
+		streamwrite(desc, s);
+	}
+	
+	/* whole windows are written straight from the caller */
+	if (desc->offset != (int64_t)desc->size || (!boff && remaining >= (int64_t)desc->writebehind * bsize))
+		return 0;
+	s = 0;
+	for (i = 0; i < UHFS_STREAM_BUFFERS; i++) {
+		if (desc->stream[i].state != UHFS_SFILL && (!s || !desc->stream[i].pending ||
+		    (s->pending && desc->stream[i].index < s->index)))
+			s = &desc->stream[i];
+	}
+	if (!s)
+		return 0;
+	streamwait(desc, s);
+	s->state = UHFS_SFILL;
+	s->index = desc->index;
+	s->lba = desc->block;
+	s->fill = boff;
+	if (boff && readblocks(desc->dev, desc->block, s->data, 1)) {
+		s->state = UHFS_SEMPTY;
+		
+		return 0;
+	}
+	cachedrop(blk_device, desc->block);
+	
+	return s;
+}
+
 /* file operations */
 struct file * hf_fopen(struct device *dev, int8_t *path, int8_t *mode)
 {
-	return 0;
+	struct fs_blkdevice *blk_device;
+	struct file *fptr;
+	uint32_t i, count, next, metadata, parent_dir_blk, first_file_blk;
+	int32_t flags, ret;
+	int8_t *ppath, *lpath;
+	int8_t *filepath;
+	
+	if (!dev->ptr) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fopen: filesystem not mounted");
+#endif
+		return 0;
+	}
+	
+	journalbatch(dev);
+	
+	switch (mode[0]) {
+	case 'r': flags = UHFS_RDONLY; break;
+	case 'w': flags = UHFS_WRONLY | UHFS_CREAT; break;
+	case 'a': flags = UHFS_WRONLY | UHFS_CREAT | UHFS_APPEND; break;
+	default:
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fopen: invalid mode");
+#endif
+		return 0;
+	}
+	if (strchr(mode, '+'))
+		flags |= UHFS_RDWR;
+	
+	for (i = 0; i < UHFS_MAXFILES; i++)
+		if (!(fs_files[i].flags & UHFS_OPENFILE)) break;
+	if (i == UHFS_MAXFILES) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fopen: too many open files");
+#endif
+		return 0;
+	}
+	fptr = &fs_files[i];
+	
+	filepath = (int8_t *)hf_malloc(strlen(path) + 1);
+	if (!filepath)
+		return 0;
+	strcpy(filepath, path);
+	
+	ret = searchdirectory(dev, filepath, &parent_dir_blk, &ppath, &first_file_blk, &lpath);
+	if (ret == 0 && (flags & UHFS_CREAT) && !hf_create(dev, path)) {
+		strcpy(filepath, path);
+		ret = searchdirectory(dev, filepath, &parent_dir_blk, &ppath, &first_file_blk, &lpath);
+	}
+	if (ret != 1) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fopen: path not found");
+#endif
+		hf_free(filepath);
+		
+		return 0;
+	}
+	
+	blk_device = dev->ptr;
+	/* find directory entry on parent block */
+	readblocks(dev, parent_dir_blk, blk_device->datablock.dir_data, 1);
+	for (i = 0; i < blk_device->fssblock.block_size / sizeof(struct fs_direntry); i++)
+		if (!(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRFREE) && !strcmp(blk_device->datablock.dir_data[i].filename, ppath))
+			break;
+	hf_free(filepath);
+	
+	if (i == blk_device->fssblock.block_size / sizeof(struct fs_direntry)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fopen: directory entry not found");
+#endif
+		return 0;
+	}
+	if (((flags & UHFS_RDONLY) && !(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRREAD)) ||
+	    ((flags & UHFS_WRONLY) && !(blk_device->datablock.dir_data[i].attributes & UHFS_ATTRWRITE))) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fopen: permission denied");
+#endif
+		return 0;
+	}
+	
+	fptr->dev = dev;
+	fptr->first_block = blk_device->datablock.dir_data[i].first_block;
+	fptr->mode = blk_device->datablock.dir_data[i].attributes;
+	fptr->block = fptr->first_block;
+	fptr->offset = 0;
+	fptr->index = 0;
+	fptr->dir_block = parent_dir_blk;
+	fptr->dir_entry = i;
+	fptr->size = blk_device->datablock.dir_data[i].size;
+	fptr->last_offset = 0;
+	fptr->sequential = 0;
+	fptr->readahead = UHFS_READAHEAD;
+	fptr->writebehind = UHFS_WRITEBEHIND;
+	fptr->stream_error = 0;
+	fptr->stream = 0;
+	
+	/* find the end of the file chain. an extent record gives it, if it is right */
+	metadata = blk_device->datablock.dir_data[i].metadata_block;
+	fptr->n_blocks = 0;
+	if (metadata & UHFS_EXTENT) {
+		fptr->n_blocks = metadata & ~UHFS_EXTENT;
+		fptr->last_block = extentblock(blk_device, fptr->first_block, fptr->n_blocks - 1);
+		if (fptr->last_block >= blk_device->fssblock.n_blocks || blockrun(dev, fptr->last_block, 1, &next) != 1 || next != UHFS_EOCHBLK)
+			fptr->n_blocks = 0;
+	}
+	if (fptr->n_blocks) {
+		fptr->extent = 1;
+	} else {
+		fptr->extent = 1;
+		next = fptr->first_block;
+		do {
+			if (next >= blk_device->fssblock.n_blocks) {
+#if UHFS_DEBUG == 1
+				kprintf("\nhf_fopen: broken file chain");
+#endif
+				return 0;
+			}
+			if (fptr->n_blocks && next != nextdatablock(blk_device, fptr->last_block))
+				fptr->extent = 0;
+			fptr->last_block = next;
+			count = blockrun(dev, fptr->last_block, blk_device->fssblock.n_blocks, &next);
+			fptr->last_block += count - 1;
+			fptr->n_blocks += count;
+		} while (next != UHFS_EOCHBLK);
+	}
+	
+	if (mode[0] == 'w' && (fptr->size || fptr->n_blocks > 1)) {
+		/* other descriptors of the file must not write behind on blocks being freed */
+		for (i = 0; i < UHFS_MAXFILES; i++)
+			if (&fs_files[i] != fptr && (fs_files[i].flags & UHFS_OPENFILE) && fs_files[i].dev == dev && fs_files[i].first_block == fptr->first_block)
+				streamstop(&fs_files[i]);
+		truncatechain(fptr);
+		updateentry(fptr);
+	}
+	if (flags & UHFS_APPEND)
+		fptr->offset = fptr->size;
+	fptr->last_offset = fptr->offset;
+	fptr->flags = flags | UHFS_OPENFILE;
+	
+	return fptr;
 }
 
 int32_t hf_fclose(struct file *desc)
 {
-	return 0;
+	int32_t err;
+	
+	if (!(desc->flags & UHFS_OPENFILE)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fclose: not an open file");
+#endif
+		return -1;
+	}
+	
+	journalbatch(desc->dev);
+	
+	err = streamstop(desc);
+	if (desc->flags & UHFS_WRONLY)
+		updateentry(desc);
+	desc->flags = 0;
+	
+	return err;
 }
 
 int64_t hf_fread(void *buf, int32_t isize, int32_t items, struct file *desc)
 {
-	return 0;
+	struct fs_blkdevice *blk_device;
+	struct fs_stream *s;
+	uint32_t bsize, boff, chunk, count, stream;
+	int64_t size, done = 0;
+	int8_t *ptr = buf;
+	
+	if (!(desc->flags & UHFS_OPENFILE) || !(desc->flags & UHFS_RDONLY)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fread: file not open for reading");
+#endif
+		return -1;
+	}
+	if (isize <= 0 || items <= 0)
+		return 0;
+	
+	blk_device = desc->dev->ptr;
+	bsize = blk_device->fssblock.block_size;
+	size = (int64_t)isize * items;
+	if (desc->offset + size > (int64_t)desc->size) {
+		size = desc->size - desc->offset;
+		desc->flags |= UHFS_EOF;
+	}
+	
+	/* data written behind must be on the device before it is read */
+	if (desc->flags & UHFS_WRONLY)
+		streamsync(desc);
+	stream = streamstart(desc) && desc->readahead;
+	
+	while (done < size) {
+		if (seekblock(desc, desc->offset / bsize)) break;
+		boff = desc->offset & (bsize - 1);
+		s = stream ? streamfind(desc, desc->index) : 0;
+		if (s) {
+			if (streamwait(desc, s)) {
+				s->state = UHFS_SEMPTY;
+				break;
+			}
+			chunk = (s->index + s->count - desc->index) * bsize - boff;
+			if (chunk > size - done)
+				chunk = size - done;
+			memcpy(ptr + done, s->data + (desc->index - s->index) * bsize + boff, chunk);
+			if (desc->offset + chunk == (int64_t)(s->index + s->count) * bsize)
+				s->state = UHFS_SEMPTY;
+		} else if (boff || size - done < bsize) {
+			chunk = bsize - boff;
+			if (chunk > size - done)
+				chunk = size - done;
+			if (readblocks(desc->dev, desc->block, blk_device->datablock.data, 1)) break;
+			memcpy(ptr + done, blk_device->datablock.data + boff, chunk);
+		} else {
+			count = filerun(desc, (size - done) / bsize);
+			if (readblocks(desc->dev, desc->block, ptr + done, count)) break;
+			desc->block += count - 1;
+			desc->index += count - 1;
+			chunk = count * bsize;
+		}
+		done += chunk;
+		desc->offset += chunk;
+		/* a buffer read upto its end is filled again, ahead of the other */
+		if (s && s->state == UHFS_SEMPTY)
+			streamfill(desc);
+	}
+	if (stream)
+		streamfill(desc);
+	desc->last_offset = desc->offset;
+	
+	return done / isize;
 }
 
 int64_t hf_fwrite(void *buf, int32_t isize, int32_t items, struct file *desc)
 {
-	return 0;
+	struct fs_blkdevice *blk_device;
+	struct fs_stream *s;
+	uint32_t bsize, boff, chunk, count, stream;
+	int64_t size, done = 0;
+	int8_t *ptr = buf;
+	
+	if (!(desc->flags & UHFS_OPENFILE) || !(desc->flags & UHFS_WRONLY)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fwrite: file not open for writing");
+#endif
+		return -1;
+	}
+	
+	journalbatch(desc->dev);
+	
+	if (isize <= 0 || items <= 0)
+		return 0;
+	
+	blk_device = desc->dev->ptr;
+	bsize = blk_device->fssblock.block_size;
+	size = (int64_t)isize * items;
+	if (desc->flags & UHFS_APPEND)
+		desc->offset = desc->size;
+	
+	/* allocate all blocks needed for this write first, so contiguous blocks can be written together */
+	count = (desc->offset + size + bsize - 1) / bsize;
+	if (count > desc->n_blocks && growchain(desc, count - desc->n_blocks)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fwrite: storage device is full");
+#endif
+		size = (int64_t)desc->n_blocks * bsize - desc->offset;
+	}
+	
+	/* read-ahead data is stale once the file is written, and buffers not going on are written */
+	stream = streamstart(desc) && desc->writebehind;
+	if (desc->stream) {
+		streamdrop(desc);
+		if (!stream)
+			streamflush(desc);
+	}
+	
+	while (done < size) {
+		if (seekblock(desc, desc->offset / bsize)) break;
+		boff = desc->offset & (bsize - 1);
+		s = stream ? streamappend(desc, boff, size - done) : 0;
+		if (s) {
+			chunk = bsize - boff;
+			if (chunk > size - done)
+				chunk = size - done;
+			memcpy(s->data + (desc->index - s->index) * bsize + boff, ptr + done, chunk);
+			s->fill = (desc->index - s->index) * bsize + boff + chunk;
+			if (s->fill == desc->writebehind * bsize)
+				streamwrite(desc, s);
+		} else if (boff || size - done < bsize) {
+			chunk = bsize - boff;
+			if (chunk > size - done)
+				chunk = size - done;
+			/* keep the data around the written part (if the block holds any) */
+			if (desc->offset - boff < (int64_t)desc->size) {
+				if (readblocks(desc->dev, desc->block, blk_device->datablock.data, 1)) break;
+			} else {
+				memset(blk_device->datablock.data, 0, bsize);
+			}
+			memcpy(blk_device->datablock.data + boff, ptr + done, chunk);
+			if (writeblocks(desc->dev, desc->block, blk_device->datablock.data, 1)) break;
+		} else {
+			count = filerun(desc, (size - done) / bsize);
+			if (writeblocks(desc->dev, desc->block, ptr + done, count)) break;
+			desc->block += count - 1;
+			desc->index += count - 1;
+			chunk = count * bsize;
+		}
+		done += chunk;
+		desc->offset += chunk;
+		if (desc->offset > (int64_t)desc->size)
+			desc->size = desc->offset;
+	}
+	desc->last_offset = desc->offset;
+	
+	return done / isize;
 }
 
 int32_t hf_fseek(struct file *desc, int64_t offset, int32_t whence)
 {
+	int64_t pos;
+	
+	if (!(desc->flags & UHFS_OPENFILE)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fseek: not an open file");
+#endif
+		return -1;
+	}
+	
+	switch (whence) {
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = desc->offset + offset; break;
+	case SEEK_END: pos = desc->size + offset; break;
+	default: return -1;
+	}
+	
+	/* files have no holes, so the position can't go past the end of the file */
+	if (pos < 0 || pos > (int64_t)desc->size)
+		return -1;
+	
+	/* a buffer being filled ends here */
+	if (desc->stream)
+		streamflush(desc);
+	desc->offset = pos;
+	desc->flags &= ~UHFS_EOF;
+	
 	return 0;
 }
 
 int64_t hf_ftell(struct file *desc)
 {
-	return 0;
+	if (!(desc->flags & UHFS_OPENFILE))
+		return -1;
+	
+	return desc->offset;
 }
 
 int32_t hf_feof(struct file *desc)
 {
+	if (!(desc->flags & UHFS_OPENFILE))
+		return -1;
+	
+	return (desc->flags & UHFS_EOF) ? 1 : 0;
+}
+
+int32_t hf_fflush(struct file *desc)
+{
+	int32_t err;
+	
+	if (!(desc->flags & UHFS_OPENFILE))
+		return -1;
+	
+	err = streamsync(desc);
+	if (desc->flags & UHFS_WRONLY)
+		updateentry(desc);
+	if (hf_sync(desc->dev))
+		err = -1;
+	
+	return err;
+}
+
+/* allocate the blocks of a file upto size (in bytes), keeping its size */
+int32_t hf_fallocate(struct file *desc, int64_t size)
+{
+	struct fs_blkdevice *blk_device;
+	uint32_t count;
+	
+	if (!(desc->flags & UHFS_OPENFILE) || !(desc->flags & UHFS_WRONLY)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fallocate: file not open for writing");
+#endif
+		return -1;
+	}
+	
+	journalbatch(desc->dev);
+	
+	blk_device = desc->dev->ptr;
+	count = (size + blk_device->fssblock.block_size - 1) / blk_device->fssblock.block_size;
+	if (count > desc->n_blocks && growchain(desc, count - desc->n_blocks)) {
+#if UHFS_DEBUG == 1
+		kprintf("\nhf_fallocate: storage device is full");
+#endif
+		return -1;
+	}
+	/* the size written on the entry covers data written behind */
+	if (streamsync(desc))
+		return -1;
+	updateentry(desc);
+	
 	return 0;
 }
+
+/* set the read-ahead and write-behind windows (in blocks) of a file, 0 turns them off */
+int32_t hf_fstream(struct file *desc, uint32_t readahead, uint32_t writebehind)
+{
+	int32_t err;
+	
+	if (!(desc->flags & UHFS_OPENFILE))
+		return -1;
+	
+	err = streamstop(desc);
+	desc->readahead = readahead;
+	desc->writebehind = writebehind;
+	
+	return err;
+}
@@ -65,17 +65,102 @@ int8_t sram[MEM_SIZE];
 FILE *fptr;
 int32_t log_enabled = 0;
 
-static int32_t mem_read(state *s, int32_t size, uint32_t address){
-	uint32_t value=0;
-	uint32_t *ptr;
+/*
+memory mapped devices. each device registers the address range it decodes and handlers for
+its registers. RAM accesses (below EXIT_TRAP) use the memory array directly, and only
+accesses to the I/O space are dispatched to the region table. unmapped I/O addresses (and
+device registers with no handler) read as zero and ignore writes.
+*/
+#define MAX_REGIONS			16
+
+typedef struct {
+	uint32_t base, size;
+	int32_t (*read)(state *s, int32_t size, uint32_t address);
+	void (*write)(state *s, int32_t size, uint32_t address, uint32_t value);
+} region;
+
+region regions[MAX_REGIONS];
+int32_t n_regions = 0;
 
+static void register_region(uint32_t base, uint32_t size,
+	int32_t (*read)(state *s, int32_t size, uint32_t address),
+	void (*write)(state *s, int32_t size, uint32_t address, uint32_t value)){
+
+	if (n_regions == MAX_REGIONS){
+		printf("\ntoo many memory regions");
+		exit(1);
+	}
+	regions[n_regions].base = base;
+	regions[n_regions].size = size;
+	regions[n_regions].read = read;
+	regions[n_regions].write = write;
+	n_regions++;
+}
+
+static region *find_region(uint32_t address){
+	int32_t i;
+
+	for (i = 0; i < n_regions; i++)
+		if (address - regions[i].base < regions[i].size)
+			return &regions[i];
+
+	return NULL;
+}
+
+static int32_t irq_read(state *s, int32_t size, uint32_t address){
 	switch (address){
 		case IRQ_VECTOR:	return s->vector;
 		case IRQ_CAUSE:		return s->cause;
 		case IRQ_MASK:		return s->mask;
 		case IRQ_STATUS:	return s->status;
 		case IRQ_EPC:		return s->epc;
-		case S0CAUSE:		return s->s0cause;
+	}
+
+	return 0;
+}
+
+static void irq_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	uint32_t i;
+
+	switch (address){
+		case IRQ_VECTOR:	s->vector = value; return;
+		case IRQ_MASK:		s->mask = value; return;
+		case IRQ_STATUS:	if (value == 0){ s->status = 0; for (i = 0; i < 4; i++) s->status_dly[i] = 0; }else{ s->status_dly[3] = value; } return;
+		case IRQ_EPC:		s->epc = value; return;
+		case DEBUG_ADDR:
+			if (log_enabled)
+				fprintf(fptr, "%c", (int8_t)(value & 0xff));
+			return;
+	}
+}
+
+static void exit_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	fflush(stdout);
+	if (log_enabled)
+		fclose(fptr);
+	printf("\nend of simulation.\n");
+	printf("instructions: %d\n", s->ins);
+	printf("arith: %d (%f)\n", s->arith, (float)s->arith / (float)s->ins);
+	printf("logic: %d (%f)\n", s->logic, (float)s->logic / (float)s->ins);
+	printf("shift: %d (%f)\n", s->shift, (float)s->shift / (float)s->ins);
+	printf("compare: %d (%f)\n", s->logic, (float)s->comp/ (float)s->ins);
+	printf("memory: %d (%f)\n", s->ls, (float)s->ls / (float)s->ins);
+	printf("branch: %d (%f) (taken: %d, %f)\n", s->bra, (float)s->bra / (float)s->ins, s->taken_bra, (float)s->taken_bra/(float)s->bra);
+	printf("jump: %d (%f)\n", s->jmp, (float)s->jmp / (float)s->ins);
+	printf("mul: %d (%f)\n", s->mul, (float)s->mul / (float)s->ins);
+	printf("div: %d (%f)\n", s->div, (float)s->div / (float)s->ins);
+	printf("other: %d (%f)\n", s->other, (float)s->other / (float)s->ins);
+	exit(0);
+}
+
+static int32_t s0_read(state *s, int32_t size, uint32_t address){
+	if (address == S0CAUSE) return s->s0cause;
+
+	return 0;
+}
+
+static int32_t timer_read(state *s, int32_t size, uint32_t address){
+	switch (address){
 		case TIMERCAUSE:	return s->timercause;
 		case TIMERCAUSE_INV:	return s->timercause_inv;
 		case TIMERMASK:		return s->timermask;
@@ -84,14 +169,61 @@ static int32_t mem_read(state *s, int32_t size, uint32_t address){
 		case TIMER1_PRE:	return s->timer1_pre;
 		case TIMER1_CTC:	return s->timer1_ctc;
 		case TIMER1_OCR:	return s->timer1_ocr;
+	}
+
+	return 0;
+}
+
+static void timer_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	switch (address){
+		case TIMERCAUSE_INV:	s->timercause_inv = value & 0xff; return;
+		case TIMERMASK:		s->timermask = value & 0xff; return;
+		case TIMER1:		s->timer1 = value & 0xffff; return;
+		case TIMER1_PRE:	s->timer1_pre = value & 0xffff; return;
+		case TIMER1_CTC:	s->timer1_ctc = value & 0xffff; return;
+		case TIMER1_OCR:	s->timer1_ocr = value & 0xffff; return;
+	}
+}
+
+static int32_t uart_read(state *s, int32_t size, uint32_t address){
+	switch (address){
 		case UARTCAUSE:		return s->uartcause;
 		case UARTCAUSE_INV:	return s->uartcause_inv;
 		case UARTMASK:		return s->uartmask;
 		case UART0:		return getchar();
-		case UART0_DIV:		return 0;
 	}
-	if (address >= EXIT_TRAP) return 0;
-	
+
+	return 0;
+}
+
+static void uart_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	switch (address){
+		case UARTCAUSE_INV:	s->uartcause_inv = value & 0xff; return;
+		case UARTMASK:		s->uartmask = value & 0xff; return;
+		case UART0:
+			fprintf(stdout, "%c", (int8_t)(value & 0xff));
+			return;
+	}
+}
+
+static void register_devices(void){
+	register_region(EXIT_TRAP, 0x10, NULL, exit_write);
+	register_region(S0CAUSE & 0xffff0000, 0x10000, s0_read, NULL);
+	register_region(TIMERCAUSE & 0xffff0000, 0x10000, timer_read, timer_write);
+	register_region(UARTCAUSE & 0xffff0000, 0x10000, uart_read, uart_write);
+	register_region(IRQ_VECTOR, 0x100, irq_read, irq_write);
+}
+
+static int32_t mem_read(state *s, int32_t size, uint32_t address){
+	uint32_t value=0;
+	uint32_t *ptr;
+	region *r;
+
+	if (address >= EXIT_TRAP){
+		r = find_region(address);
+		return (r && r->read) ? r->read(s, size, address) : 0;
+	}
+
 	ptr = (uint32_t *)(s->mem + (address % MEM_SIZE));
 
 	switch(size){
@@ -124,51 +256,14 @@ static int32_t mem_read(state *s, int32_t size, uint32_t address){
 }
 
 static void mem_write(state *s, int32_t size, uint32_t address, uint32_t value){
-	uint32_t i;
 	uint32_t *ptr;
+	region *r;
 
-	switch (address){
-		case IRQ_VECTOR:	s->vector = value; return;
-		case IRQ_MASK:		s->mask = value; return;
-		case IRQ_STATUS:	if (value == 0){ s->status = 0; for (i = 0; i < 4; i++) s->status_dly[i] = 0; }else{ s->status_dly[3] = value; } return;
-		case IRQ_EPC:		s->epc = value; return;
-		case TIMERCAUSE_INV:	s->timercause_inv = value & 0xff; return;
-		case TIMERMASK:		s->timermask = value & 0xff; return;
-		case TIMER0:		return;
-		case TIMER1:		s->timer1 = value & 0xffff; return;
-		case TIMER1_PRE:	s->timer1_pre = value & 0xffff; return;
-		case TIMER1_CTC:	s->timer1_ctc = value & 0xffff; return;
-		case TIMER1_OCR:	s->timer1_ocr = value & 0xffff; return;
-		case UARTCAUSE_INV:	s->uartcause_inv = value & 0xff; return;
-		case UARTMASK:		s->uartmask = value & 0xff; return;
-		case EXIT_TRAP:
-			fflush(stdout);
-			if (log_enabled)
-				fclose(fptr);
-			printf("\nend of simulation.\n");
-			printf("instructions: %d\n", s->ins);
-			printf("arith: %d (%f)\n", s->arith, (float)s->arith / (float)s->ins);
-			printf("logic: %d (%f)\n", s->logic, (float)s->logic / (float)s->ins);
-			printf("shift: %d (%f)\n", s->shift, (float)s->shift / (float)s->ins);
-			printf("compare: %d (%f)\n", s->logic, (float)s->comp/ (float)s->ins);
-			printf("memory: %d (%f)\n", s->ls, (float)s->ls / (float)s->ins);
-			printf("branch: %d (%f) (taken: %d, %f)\n", s->bra, (float)s->bra / (float)s->ins, s->taken_bra, (float)s->taken_bra/(float)s->bra);
-			printf("jump: %d (%f)\n", s->jmp, (float)s->jmp / (float)s->ins);
-			printf("mul: %d (%f)\n", s->mul, (float)s->mul / (float)s->ins);
-			printf("div: %d (%f)\n", s->div, (float)s->div / (float)s->ins);
-			printf("other: %d (%f)\n", s->other, (float)s->other / (float)s->ins);
-			exit(0);
-		case DEBUG_ADDR:
-			if (log_enabled)
-				fprintf(fptr, "%c", (int8_t)(value & 0xff));
-			return;
-		case UART0:
-			fprintf(stdout, "%c", (int8_t)(value & 0xff));
-			return;
-		case UART0_DIV:
-			return;
+	if (address >= EXIT_TRAP){
+		r = find_region(address);
+		if (r && r->write) r->write(s, size, address, value);
+		return;
 	}
-	if (address >= EXIT_TRAP) return;
 
 	ptr = (uint32_t *)(s->mem + (address % MEM_SIZE));
 
@@ -245,8 +340,44 @@ void mult_signed(int32_t a, int32_t b, uint32_t *hi, uint32_t *lo){
 	*lo = c0;
 }
 
+/*
+predecoded instructions. each memory word has an entry, holding the instruction it was decoded
+from (so a store to code is detected on the next fetch) and its fields.
+*/
+typedef struct {
+	uint32_t opcode;
+	uint8_t valid, op, rs, rt, rd, re, func;
+	uint32_t imm, target;
+	int32_t imm_shift;
+} decoded;
+
+decoded predecoded[MEM_SIZE >> 2];
+
+static uint32_t mem_fetch(state *s, uint32_t address){
+	uint32_t value;
+
+	value = *(uint32_t *)(s->mem + (address % MEM_SIZE));
+
+	return ntohl(value);
+}
+
+static void decode(decoded *d, uint32_t opcode){
+	d->opcode = opcode;
+	d->valid = 1;
+	d->op = (opcode >> 26) & 0x3f;
+	d->rs = (opcode >> 21) & 0x1f;
+	d->rt = (opcode >> 16) & 0x1f;
+	d->rd = (opcode >> 11) & 0x1f;
+	d->re = (opcode >> 6) & 0x1f;
+	d->func = opcode & 0x3f;
+	d->imm = opcode & 0xffff;
+	d->imm_shift = (((int32_t)(int16_t)d->imm) << 2) - 4;
+	d->target = (opcode << 6) >> 4;
+}
+
 void cycle(state *s){
 	uint32_t opcode, i;
+	decoded *d;
 	uint32_t op, rs, rt, rd, re, func, imm, target;
 	int32_t imm_shift, branch=0;
 	int32_t *r = s->r;
@@ -263,16 +394,19 @@ void cycle(state *s){
 		return;
 	}
 
-	opcode = mem_read(s, 4, s->pc);
-	op = (opcode >> 26) & 0x3f;
-	rs = (opcode >> 21) & 0x1f;
-	rt = (opcode >> 16) & 0x1f;
-	rd = (opcode >> 11) & 0x1f;
-	re = (opcode >> 6) & 0x1f;
-	func = opcode & 0x3f;
-	imm = opcode & 0xffff;
-	imm_shift = (((int32_t)(int16_t)imm) << 2) - 4;
-	target = (opcode << 6) >> 4;
+	opcode = mem_fetch(s, s->pc);
+	d = &predecoded[(s->pc % MEM_SIZE) >> 2];
+	if (d->opcode != opcode || !d->valid)
+		decode(d, opcode);
+	op = d->op;
+	rs = d->rs;
+	rt = d->rt;
+	rd = d->rd;
+	re = d->re;
+	func = d->func;
+	imm = d->imm;
+	imm_shift = d->imm_shift;
+	target = d->target;
 	ptr = (int16_t)imm + r[rs];
 	r[0] = 0;
 	s->pc = s->pc_next;
@@ -412,11 +546,56 @@ void cycle(state *s){
 	s->timer1 &= 0xffff;
 }
 
+/*
+idle skipping. a branch to itself with a nop on the delay slot (the idle loop, "b ." / "nop") has
+no effect other than the time spent on it, so instead of executing it up to the next event the
+timers (and instruction counters) are advanced at once, stopping on the cycle before any timer
+event (or change of the interrupt cause). the state is the same as if the loop was executed.
+*/
+static void idle_skip(state *s){
+	uint32_t i, t0, k, shift, bound, s0cause;
+	uint64_t lim;
+
+	if (s->j || s->nox_bds || s->pc_next != s->pc + 4) return;
+	if (mem_fetch(s, s->pc) != 0x1000ffff || mem_fetch(s, s->pc + 4) != 0) return;
+	if (s->status && (s->cause & s->mask)) return;
+	for (i = 0; i < 4; i++)
+		if (s->status_dly[i] != s->status) return;
+
+	s0cause = (s->timercause ^ s->timercause_inv) & s->timermask ? 0x04 : 0x00;
+	if (s0cause != s->s0cause || (s0cause ? 0x01 : 0x00) != s->cause) return;
+	if (s->timer1 == s->timer1_ctc || (s->timer1 < s->timer1_ocr) != ((s->timercause & 0x8) != 0)) return;
+
+	/* timer0 bits 16 and 18 (timercause) change only on a 64k boundary */
+	t0 = s->timer0;
+	k = -t0 & 0xffff;
+
+	/* timer1 must stay below the compare and output compare registers */
+	bound = 0x10000;
+	if (s->timer1_ctc > s->timer1) bound = s->timer1_ctc;
+	if (s->timer1_ocr > s->timer1 && s->timer1_ocr < bound) bound = s->timer1_ocr;
+	shift = (s->timer1_pre >= 1 && s->timer1_pre <= 7) ? s->timer1_pre * 2 : 0;
+	lim = ((((uint64_t)t0 >> shift) + bound - s->timer1) << shift) - 1 - t0;
+	if (lim < k) k = lim;
+
+	/* whole iterations of the loop (branch and delay slot) */
+	k &= ~1;
+	if (k < 2) return;
+
+	s->timer1 += (((uint64_t)t0 + k) >> shift) - (t0 >> shift);
+	s->timer0 += k;
+	s->ins += k;
+	s->bra += k / 2;
+	s->taken_bra += k / 2;
+	s->shift += k / 2;
+}
+
 int main(int argc, char *argv[]){
 	state context;
 	state *s;
 	FILE *in;
 	int bytes;
+	uint32_t pc;
 
 	s = &context;
 	memset(s, 0, sizeof(state));
@@ -452,8 +631,13 @@ int main(int argc, char *argv[]){
 	s->pc_next = s->pc + 4;
 	s->mem = &sram[0];
 
+	register_devices();
+
 	for(;;){
+		pc = s->pc;
 		cycle(s);
+		if (s->pc + 4 == pc)
+			idle_skip(s);
 	}
 
 	return 0;
@@ -70,23 +70,135 @@ static int32_t mem_fetch(state *s, uint32_t address){
 	return(value);
 }
 
-static int64_t mem_read(state *s, int32_t size, uint64_t address){
-	uint64_t value=0;
-	uint64_t *ptr;
+/*
+memory mapped devices. each device registers the address range it decodes and handlers for
+its registers. RAM accesses (below EXIT_TRAP) use the memory array directly, and only
+accesses to the I/O space are dispatched to the region table. I/O addresses not claimed by a
+device fall back to RAM.
+*/
+#define MAX_REGIONS			16
+
+typedef struct {
+	uint64_t base, size;
+	int64_t (*read)(state *s, int32_t size, uint64_t address);
+	void (*write)(state *s, int32_t size, uint64_t address, uint64_t value);
+} region;
+
+region regions[MAX_REGIONS];
+int32_t n_regions = 0;
+
+static void register_region(uint64_t base, uint64_t size,
+	int64_t (*read)(state *s, int32_t size, uint64_t address),
+	void (*write)(state *s, int32_t size, uint64_t address, uint64_t value)){
+
+	if (n_regions == MAX_REGIONS){
+		printf("\ntoo many memory regions");
+		exit(1);
+	}
+	regions[n_regions].base = base;
+	regions[n_regions].size = size;
+	regions[n_regions].read = read;
+	regions[n_regions].write = write;
+	n_regions++;
+}
+
+static region *find_region(uint64_t address){
+	int32_t i;
+
+	for (i = 0; i < n_regions; i++)
+		if (address - regions[i].base < regions[i].size)
+			return &regions[i];
+
+	return NULL;
+}
 
+static int64_t irq_read(state *s, int32_t size, uint64_t address){
 	switch(address){
 		case IRQ_VECTOR:	return s->vector;
 		case IRQ_CAUSE:		return s->cause | 0x0080 | 0x0040;
 		case IRQ_MASK:		return s->mask;
 		case IRQ_STATUS:	return s->status;
 		case IRQ_EPC:		return s->epc;
+	}
+
+	return 0;
+}
+
+static void irq_write(state *s, int32_t size, uint64_t address, uint64_t value){
+	uint64_t i;
+
+	switch(address){
+		case IRQ_VECTOR:	s->vector = value; return;
+		case IRQ_CAUSE:		s->cause = value; return;
+		case IRQ_MASK:		s->mask = value; return;
+		case IRQ_STATUS:	if (value == 0){ s->status = 0; for (i = 0; i < 4; i++) s->status_dly[i] = 0; }else{ s->status_dly[3] = value; } return;
+		case IRQ_EPC:		s->epc = value; return;
+	}
+}
+
+static int64_t timer_read(state *s, int32_t size, uint64_t address){
+	switch(address){
 		case COUNTER:		return s->counter;
 		case COMPARE:		return s->compare;
 		case COMPARE2:		return s->compare2;
+	}
+
+	return 0;
+}
+
+static void timer_write(state *s, int32_t size, uint64_t address, uint64_t value){
+	switch(address){
+		case COUNTER:		s->counter = value; return;
+		case COMPARE:		s->compare = value; s->cause &= 0xffef; return;
+		case COMPARE2:		s->compare2 = value; s->cause &= 0xffdf; return;
+	}
+}
+
+static void exit_write(state *s, int32_t size, uint64_t address, uint64_t value){
+	fflush(stdout);
+	if (log_enabled)
+		fclose(fptr);
+	printf("\nend of simulation - %d cycles.\n", s->counter);
+	exit(0);
+}
+
+static void debug_write(state *s, int32_t size, uint64_t address, uint64_t value){
+	if (log_enabled)
+		fprintf(fptr, "%c", (int8_t)(value & 0xff));
+}
+
+static int64_t uart_read(state *s, int32_t size, uint64_t address){
+	switch(address){
 		case UART_READ:		return getchar();
 		case UART_DIVISOR:	return 0;
 	}
 
+	return 0;
+}
+
+static void uart_write(state *s, int32_t size, uint64_t address, uint64_t value){
+	if (address == UART_WRITE)
+		fprintf(stderr, "%c", (int8_t)(value & 0xff));
+}
+
+static void register_devices(void){
+	register_region(EXIT_TRAP, 0x10, NULL, exit_write);
+	register_region(IRQ_VECTOR, 0x50, irq_read, irq_write);
+	register_region(COUNTER, 0x30, timer_read, timer_write);
+	register_region(DEBUG_ADDR, 0x10, NULL, debug_write);
+	register_region(UART_WRITE, 0x20, uart_read, uart_write);
+}
+
+static int64_t mem_read(state *s, int32_t size, uint64_t address){
+	uint64_t value=0;
+	uint64_t *ptr;
+	region *r;
+
+	if (address >= EXIT_TRAP){
+		r = find_region(address);
+		if (r && r->read) return r->read(s, size, address);
+	}
+
 	ptr = (uint64_t *)(s->mem + (address % MEM_SIZE));
 
 	switch(size){
@@ -130,32 +242,14 @@ static int64_t mem_read(state *s, int32_t size, uint64_t address){
 
 static void mem_write(state *s, int32_t size, uint64_t address, uint64_t value){
 	uint64_t *ptr;
-	uint64_t i;
+	region *r;
 
-	switch(address){
-		case IRQ_VECTOR:	s->vector = value; return;
-		case IRQ_CAUSE:		s->cause = value; return;
-		case IRQ_MASK:		s->mask = value; return;
-		case IRQ_STATUS:	if (value == 0){ s->status = 0; for (i = 0; i < 4; i++) s->status_dly[i] = 0; }else{ s->status_dly[3] = value; } return;
-		case IRQ_EPC:		s->epc = value; return;
-		case COUNTER:		s->counter = value; return;
-		case COMPARE:		s->compare = value; s->cause &= 0xffef; return;
-		case COMPARE2:		s->compare2 = value; s->cause &= 0xffdf; return;
-		case EXIT_TRAP:
-			fflush(stdout);
-			if (log_enabled)
-				fclose(fptr);
-			printf("\nend of simulation - %d cycles.\n", s->counter);
-			exit(0);
-		case DEBUG_ADDR:
-			if (log_enabled)
-				fprintf(fptr, "%c", (int8_t)(value & 0xff));
-			return;
-		case UART_WRITE:
-			fprintf(stderr, "%c", (int8_t)(value & 0xff));
-			return;
-		case UART_DIVISOR:
+	if (address >= EXIT_TRAP){
+		r = find_region(address);
+		if (r && r->write){
+			r->write(s, size, address, value);
 			return;
+		}
 	}
 
 	ptr = (uint64_t *)(s->mem + (address % MEM_SIZE));
@@ -203,24 +297,34 @@ static void mem_write(state *s, int32_t size, uint64_t address, uint64_t value){
 	}
 }
 
-void cycle(state *s){
-	uint32_t inst, i;
-	uint32_t opcode, rd, rs1, rs2, funct3, funct7;
-	int64_t imm_i, imm_s, imm_sb, imm_u, imm_uj;
-	int64_t *r = s->r;
-	uint64_t *u = (uint64_t *)s->r;
-	uint32_t ptr_l, ptr_s;
+/*
+predecoded instructions. each memory word has an entry, holding the instruction it was decoded
+from (so a store to code is detected on the next fetch), the operation and the operands.
+*/
+enum {
+	OP_DECODE = 0, OP_INVALID, OP_NOP,
+	OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+	OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+	OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU, OP_SB, OP_SH, OP_SW, OP_SD,
+	OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SRLI, OP_SRAI,
+	OP_ADDIW, OP_SLLIW, OP_SRLIW, OP_SRAIW,
+	OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+	OP_ADDW, OP_SUBW, OP_SLLW, OP_SRLW, OP_SRAW
+};
 
-	if (s->status && (s->cause & s->mask)){
-		s->epc = s->pc_next;
-		s->pc = s->vector;
-		s->pc_next = s->vector + 4;
-		s->status = 0;
-		for (i = 0; i < 4; i++)
-			s->status_dly[i] = 0;
-	}
+typedef struct {
+	uint32_t inst;
+	uint8_t op, rd, rs1, rs2;
+	int64_t imm;
+} decoded;
 
-	inst = mem_fetch(s, s->pc);
+decoded predecoded[MEM_SIZE >> 2];
+
+static void decode(decoded *d, uint32_t inst){
+	uint32_t opcode, rd, rs1, rs2, funct3, funct7;
+	int64_t imm_i, imm_s, imm_sb, imm_u, imm_uj;
+	uint8_t op = OP_INVALID;
+	int64_t imm = 0;
 
 	opcode = inst & 0x7f;
 	rd = (inst >> 7) & 0x1f;
@@ -239,152 +343,614 @@ void cycle(state *s){
 		imm_sb |= 0xffffffffffffe000;
 		imm_uj |= 0xffffffffffe00000;
 	}
-	ptr_l = r[rs1] + imm_i;
-	ptr_s = r[rs1] + imm_s;
-	r[0] = 0;
 
 	switch(opcode){
-		case 0x37: r[rd] = (int64_t)(int32_t)imm_u; break;										/* LUI */
-		case 0x17: r[rd] = s->pc + (int64_t)(int32_t)imm_u; break;									/* AUIPC */
-		case 0x6f: r[rd] = s->pc_next; s->pc_next = s->pc + imm_uj; break;						/* JAL */
-		case 0x67: r[rd] = s->pc_next; s->pc_next = (r[rs1] + imm_i); break;				/* JALR */
+		case 0x37: op = OP_LUI; imm = (int64_t)(int32_t)imm_u; break;
+		case 0x17: op = OP_AUIPC; imm = (int64_t)(int32_t)imm_u; break;
+		case 0x6f: op = OP_JAL; imm = imm_uj; break;
+		case 0x67: op = OP_JALR; imm = imm_i; break;
 		case 0x63:
+			imm = imm_sb;
 			switch(funct3){
-				case 0x0: if (r[rs1] == r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BEQ */
-				case 0x1: if (r[rs1] != r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BNE */
-				case 0x4: if (r[rs1] < r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BLT */
-				case 0x5: if (r[rs1] >= r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BGE */
-				case 0x6: if (u[rs1] < u[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BLTU */
-				case 0x7: if (u[rs1] >= u[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BGEU */
-				default: goto fail;
+				case 0x0: op = OP_BEQ; break;
+				case 0x1: op = OP_BNE; break;
+				case 0x4: op = OP_BLT; break;
+				case 0x5: op = OP_BGE; break;
+				case 0x6: op = OP_BLTU; break;
+				case 0x7: op = OP_BGEU; break;
 			}
 			break;
 		case 0x3:
+			imm = imm_i;
 			switch(funct3){
-				case 0x0: r[rd] = (int8_t)mem_read(s,1,ptr_l); break;						/* LB */
-				case 0x1: r[rd] = (int16_t)mem_read(s,2,ptr_l); break;						/* LH */
-				case 0x2: r[rd] = mem_read(s,4,ptr_l); break;							/* LW */
-				case 0x3: r[rd] = mem_read(s,8,ptr_l); break;							/* LD */
-				case 0x4: r[rd] = (uint8_t)mem_read(s,1,ptr_l); break;						/* LBU */
-				case 0x5: r[rd] = (uint16_t)mem_read(s,2,ptr_l); break;						/* LHU */
-				case 0x6: r[rd] = (uint32_t)mem_read(s, 4, ptr_l); break;					/* LWU */
-				default: goto fail;
+				case 0x0: op = OP_LB; break;
+				case 0x1: op = OP_LH; break;
+				case 0x2: op = OP_LW; break;
+				case 0x3: op = OP_LD; break;
+				case 0x4: op = OP_LBU; break;
+				case 0x5: op = OP_LHU; break;
+				case 0x6: op = OP_LWU; break;
 			}
 			break;
 		case 0x23:
+			imm = imm_s;
 			switch(funct3){
-				case 0x0: mem_write(s,1,ptr_s,r[rs2]); break;							/* SB */
-				case 0x1: mem_write(s,2,ptr_s,r[rs2]); break;							/* SH */
-				case 0x2: mem_write(s,4,ptr_s,r[rs2]); break;							/* SW */
-				case 0x3: mem_write(s,8,ptr_s,r[rs2]); break;							/* SD */
-				default: goto fail;
+				case 0x0: op = OP_SB; break;
+				case 0x1: op = OP_SH; break;
+				case 0x2: op = OP_SW; break;
+				case 0x3: op = OP_SD; break;
 			}
 			break;
 		case 0x13:
+			imm = imm_i;
 			switch(funct3){
-				case 0x0: r[rd] = r[rs1] + (int64_t)imm_i; break;						/* ADDI */
-				case 0x1: r[rd] = u[rs1] << (rs2 & 0x3f); break;						/* SLLI */
-				case 0x2: r[rd] = r[rs1] < (int64_t)imm_i; break;		 				/* SLTI */
-				case 0x3: r[rd] = u[rs1] < (uint64_t)imm_i; break;						/* SLTIU */
-				case 0x4: r[rd] = r[rs1] ^ (int64_t)imm_i; break;						/* XORI */
-				case 0x6: r[rd] = r[rs1] | (int64_t)imm_i; break;						/* ORI */
-				case 0x7: r[rd] = r[rs1] & (int64_t)imm_i; break;						/* ANDI */
+				case 0x0: op = OP_ADDI; break;
+				case 0x1: op = OP_SLLI; imm = rs2 & 0x3f; break;
+				case 0x2: op = OP_SLTI; break;
+				case 0x3: op = OP_SLTIU; break;
+				case 0x4: op = OP_XORI; break;
+				case 0x6: op = OP_ORI; break;
+				case 0x7: op = OP_ANDI; break;
 				case 0x5:
-//					switch((funct7 & 0xfe) << 1){				// ?????
+					imm = rs2 & 0x3f;
 					switch(funct7){
-						case 0x0: r[rd] = u[rs1] >> (rs2 & 0x3f); break;				/* SRLI */
-						case 0x20: r[rd] = r[rs1] >> (rs2 & 0x3f); break;				/* SRAI */
-						default: goto fail;
+						case 0x0: op = OP_SRLI; break;
+						case 0x20: op = OP_SRAI; break;
 					}
 					break;
-				default: goto fail;
 			}
 			break;
 		case 0x1b:
+			imm = imm_i;
 			switch(funct3){
-				case 0x0: r[rd] = (int64_t)(int32_t)((r[rs1] + imm_i) & 0xffffffff); break;						/* ADDIW */
-				case 0x1: r[rd] = (int64_t)(int32_t)(u[rs1] << (rs2 & 0x3f)); break;					/* SLLIW */
+				case 0x0: op = OP_ADDIW; break;
+				case 0x1: op = OP_SLLIW; imm = rs2 & 0x3f; break;
 				case 0x5:
+					imm = rs2 & 0x3f;
 					switch(funct7){
-						case 0x0: r[rd] = (int64_t)(int32_t)((u[rs1] & 0xffffffff) >> (rs2 & 0x3f)); break;			/* SRLIW */
-						case 0x20: r[rd] = (int64_t)((int32_t)(r[rs1] & 0xffffffff) >> (rs2 & 0x3f)); break;			/* SRAIW */
-						default: goto fail;
+						case 0x0: op = OP_SRLIW; break;
+						case 0x20: op = OP_SRAIW; break;
 					}
 					break;
-				default: goto fail;
 			}
 			break;
 		case 0x33:
 			switch(funct3){
 				case 0x0:
 					switch(funct7){
-						case 0x0: r[rd] = r[rs1] + r[rs2]; break;					/* ADD */
-						case 0x20: r[rd] = r[rs1] - r[rs2]; break;					/* SUB */
-						default: goto fail;
+						case 0x0: op = OP_ADD; break;
+						case 0x20: op = OP_SUB; break;
 					}
 					break;
-				case 0x1: r[rd] = r[rs1] << r[rs2]; break;							/* SLL */
-				case 0x2: r[rd] = r[rs1] < r[rs2]; break;		 					/* SLT */
-				case 0x3: r[rd] = u[rs1] < u[rs2]; break;		 					/* SLTU */
-				case 0x4: r[rd] = r[rs1] ^ r[rs2]; break;							/* XOR */
+				case 0x1: op = OP_SLL; break;
+				case 0x2: op = OP_SLT; break;
+				case 0x3: op = OP_SLTU; break;
+				case 0x4: op = OP_XOR; break;
 				case 0x5:
 					switch(funct7){
-						case 0x0: r[rd] = u[rs1] >> u[rs2]; break;					/* SRL */
-						case 0x20: r[rd] = r[rs1] >> r[rs2]; break;					/* SRA */
-						default: goto fail;
+						case 0x0: op = OP_SRL; break;
+						case 0x20: op = OP_SRA; break;
 					}
 					break;
-				case 0x6: r[rd] = r[rs1] | r[rs2]; break;							/* OR */
-				case 0x7: r[rd] = r[rs1] & r[rs2]; break;							/* AND */
-				default: goto fail;
+				case 0x6: op = OP_OR; break;
+				case 0x7: op = OP_AND; break;
 			}
 			break;
 		case 0x3b:
 			switch(funct3){
 				case 0x0:
 					switch(funct7){
-						case 0x0: r[rd] = (int32_t)r[rs1] + (int32_t)r[rs2]; break;			/* ADDW */
-						case 0x20: r[rd] = (int32_t)r[rs1] - (int32_t)r[rs2]; break;			/* SUBW */
-						default: goto fail;
+						case 0x0: op = OP_ADDW; break;
+						case 0x20: op = OP_SUBW; break;
 					}
 					break;
-				case 0x1: r[rd] = (int32_t)r[rs1] << (r[rs2] & 0x3f); break;					/* SLLW */
+				case 0x1: op = OP_SLLW; break;
 				case 0x5:
 					switch(funct7){
-						case 0x0: r[rd] = (uint32_t)r[rs1] >> (uint32_t)r[rs2]; break;		/* SRLW */
-						case 0x20: r[rd] = (int32_t)r[rs1] >> (int32_t)r[rs2]; break;			/* SRAW */
-						default: goto fail;
+						case 0x0: op = OP_SRLW; break;
+						case 0x20: op = OP_SRAW; break;
 					}
 					break;
-				default: goto fail;
 			}
 			break;
 		case 0x73:
 			switch(funct3){
-				case 0:
-					switch(imm_i){
-//						case 0:	break;									/* SCALL */
-//						case 1:	bp(s, inst); break;							/* SBREAK */
-//						default: goto fail;
-					}
-					break;
+				case 0: op = OP_NOP; break;								/* SCALL / SBREAK */
 				case 2:
 					switch(imm_i){
-						case 0xc00: break;								/* RDCYCLE */
-						case 0xc80: break;								/* RDCYCLEH */
-						case 0xc01: break;								/* RDTIME */
-						case 0xc81: break;								/* RDTIMEH */
-						case 0xc02: break;								/* RDINSTRET */
-						case 0xc82: break;								/* RDINSTRETH */
-						default: goto fail;
+						case 0xc00:								/* RDCYCLE */
+						case 0xc80:								/* RDCYCLEH */
+						case 0xc01:								/* RDTIME */
+						case 0xc81:								/* RDTIMEH */
+						case 0xc02:								/* RDINSTRET */
+						case 0xc82:								/* RDINSTRETH */
+							op = OP_NOP;
+							break;
 					};
 					break;
-				default: goto fail;
 			}
 			break;
+	}
+
+	d->inst = inst;
+	d->op = op;
+	d->rd = rd;
+	d->rs1 = rs1;
+	d->rs2 = rs2;
+	d->imm = imm;
+}
+
+/*
+profiling. symbols of the code are read from the ELF image (functions, and labels on executable
+sections). cycles spent on each instruction and calls (jal / jalr with ra as the link register)
+are counted exactly, and the call stack is sampled every PROF_PERIOD cycles. calls and returns
+are tracked on a shadow stack: a return (a jump to the address after a call on the stack) pops
+all frames above it, and an interrupt is handled as a call from the interrupted instruction to
+the interrupt vector. a ret to an address not on the stack (a context switch) clears it. the
+total (inclusive) cycles of a function are counted exactly as well, from the cycles spent while
+it is on the shadow stack or is running, so they never fall below its own (self) cycles. the
+flat profile and call graph are written to profile.txt, and sampled stacks to profile.folded,
+in the format used by flame graph tools.
+*/
+#define PROF_DEPTH			32
+#define PROF_STACKS			16384		/* power of 2 */
+#define PROF_ARCS			8192		/* power of 2 */
+#define PROF_PERIOD			97
+
+typedef struct {
+	uint64_t addr, size;
+	uint32_t func;
+	char *name;
+} symbol;
+
+typedef struct {
+	uint64_t site, callee;
+	uint64_t count;
+} prof_arc;
+
+typedef struct {
+	uint32_t hash, depth;
+	uint64_t frames[PROF_DEPTH + 1];
+	uint64_t count;
+} prof_stack;
+
+symbol *symbols;
+int32_t n_symbols = 0;
+
+int32_t prof_enabled = 0;
+uint64_t *prof_hits;
+prof_arc prof_arcs[PROF_ARCS];
+prof_stack *prof_stacks;
+uint64_t prof_ret[PROF_DEPTH], prof_func[PROF_DEPTH];
+int32_t prof_sym[PROF_DEPTH], prof_depth = 0, prof_leaf = -1;
+uint64_t prof_next = 0, prof_lost = 0;
+uint64_t prof_lo = 0, prof_hi = 0;
+uint32_t *prof_active;
+uint64_t *prof_since, *prof_total, prof_clock = 0;
+
+static uint64_t elf_read(uint8_t *p, int32_t size){
+	uint64_t value = 0;
+
+	while (size--)
+		value = (value << 8) | p[size];
+
+	return value;
+}
+
+static int symbol_cmp(const void *a, const void *b){
+	const symbol *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+
+	return y->func - x->func;
+}
+
+static int32_t load_symbols(char *file){
+	FILE *f;
+	uint8_t *elf, *sh, *sym, *sec;
+	uint64_t len, shoff, shentsize, shnum, i, j, off, size, entsize, stroff, shndx;
+
+	f = fopen(file, "rb");
+	if (!f) return -1;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	elf = malloc(len + 1);
+	if (!elf || fread(elf, 1, len, f) != len || len < 0x40 || memcmp(elf, "\177ELF\002\001", 6)){
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	elf[len] = 0;
+
+	shoff = elf_read(elf + 0x28, 8);
+	shentsize = elf_read(elf + 0x3a, 2);
+	shnum = elf_read(elf + 0x3c, 2);
+	if (shoff + shnum * shentsize > len) return -1;
+
+	for (i = 0; i < shnum; i++){
+		sh = elf + shoff + i * shentsize;
+		if (elf_read(sh + 4, 4) != 2) continue;		/* SHT_SYMTAB */
+		off = elf_read(sh + 0x18, 8);
+		size = elf_read(sh + 0x20, 8);
+		entsize = elf_read(sh + 0x38, 8);
+		j = elf_read(sh + 0x28, 4);
+		if (j >= shnum || entsize < 24 || off + size > len) return -1;
+		stroff = elf_read(elf + shoff + j * shentsize + 0x18, 8);
+		if (stroff >= len) return -1;
+
+		symbols = malloc((size / entsize) * sizeof(symbol));
+		for (j = 0; j < size / entsize; j++){
+			sym = elf + off + j * entsize;
+			shndx = elf_read(sym + 6, 2);
+			if (shndx == 0 || shndx >= shnum) continue;
+			sec = elf + shoff + shndx * shentsize;
+			if (!(elf_read(sec + 8, 8) & 0x4)) continue;	/* SHF_EXECINSTR */
+			if ((sym[4] & 0xf) != 0 && (sym[4] & 0xf) != 2) continue;	/* STT_NOTYPE, STT_FUNC */
+			if (stroff + elf_read(sym, 4) >= len) continue;
+			symbols[n_symbols].name = (char *)elf + stroff + elf_read(sym, 4);
+			if (symbols[n_symbols].name[0] == '\0' || symbols[n_symbols].name[0] == '.' || symbols[n_symbols].name[0] == '$') continue;
+			symbols[n_symbols].addr = elf_read(sym + 8, 8);
+			symbols[n_symbols].size = elf_read(sym + 16, 8);
+			symbols[n_symbols].func = (sym[4] & 0xf) == 2;
+			n_symbols++;
+		}
+		break;
+	}
+	if (!n_symbols) return -1;
+
+	/* one symbol per address, functions first */
+	qsort(symbols, n_symbols, sizeof(symbol), symbol_cmp);
+	for (i = 1, j = 0; i < n_symbols; i++)
+		if (symbols[i].addr != symbols[j].addr)
+			symbols[++j] = symbols[i];
+	n_symbols = j + 1;
+
+	return 0;
+}
+
+/* index of the symbol holding an address, or n_symbols if there is none */
+static int32_t find_symbol(uint64_t addr){
+	int32_t l = 0, h = n_symbols - 1, m;
+
+	while (l <= h){
+		m = (l + h) / 2;
+		if (symbols[m].addr <= addr) l = m + 1; else h = m - 1;
+	}
+	if (h < 0 || (symbols[h].size && addr - symbols[h].addr >= symbols[h].size))
+		return n_symbols;
+
+	return h;
+}
+
+static uint32_t prof_hash(uint64_t *frames, uint32_t n){
+	uint32_t i, hash = 2166136261u;
+
+	for (i = 0; i < n; i++)
+		hash = (hash ^ frames[i] ^ (frames[i] >> 32)) * 16777619u;
+
+	return hash;
+}
+
+static void prof_sample(uint64_t pc, uint64_t count){
+	uint64_t frames[PROF_DEPTH + 1];
+	uint32_t i, n, hash;
+	int32_t k;
+	prof_stack *p;
+
+	/* the leaf is the function of the last frame, unless it jumped elsewhere */
+	memcpy(frames, prof_func, prof_depth * sizeof(uint64_t));
+	k = find_symbol(pc);
+	frames[prof_depth] = k < n_symbols ? symbols[k].addr : pc;
+	n = prof_depth + 1;
+	if (prof_depth && frames[n - 1] == frames[n - 2])
+		n--;
+	hash = prof_hash(frames, n);
+
+	for (i = 0; i < PROF_STACKS; i++){
+		p = &prof_stacks[(hash + i) & (PROF_STACKS - 1)];
+		if (p->count == 0){
+			p->hash = hash;
+			p->depth = n;
+			memcpy(p->frames, frames, n * sizeof(uint64_t));
+		}
+		if (p->hash == hash && p->depth == n && !memcmp(p->frames, frames, n * sizeof(uint64_t))){
+			p->count += count;
+			return;
+		}
+	}
+	prof_lost += count;
+}
+
+/* a symbol is active while it is on the stack or is the leaf, and its total counts from the first activation to the last */
+static void prof_enter(int32_t k){
+	if (prof_active[k]++ == 0)
+		prof_since[k] = prof_clock;
+}
+
+static void prof_leave(int32_t k){
+	if (--prof_active[k] == 0)
+		prof_total[k] += prof_clock - prof_since[k];
+}
+
+/* count cycles spent on an instruction, and sample the stack if a sampling point is crossed */
+static void prof_account(state *s, uint64_t pc, uint64_t cycles){
+	uint64_t n;
+	int32_t k;
+
+	/* the leaf symbol is looked up only when the pc leaves its address range */
+	if (pc - prof_lo >= prof_hi - prof_lo){
+		k = find_symbol(pc);
+		prof_lo = prof_hi = 0;
+		if (k < n_symbols){
+			prof_lo = symbols[k].addr;
+			prof_hi = k + 1 < n_symbols ? symbols[k + 1].addr : (uint64_t)-1;
+			if (symbols[k].size && symbols[k].size < prof_hi - prof_lo)
+				prof_hi = prof_lo + symbols[k].size;
+		}
+		prof_enter(k);
+		if (prof_leaf >= 0)
+			prof_leave(prof_leaf);
+		prof_leaf = k;
+	}
+	prof_clock += cycles;
+	prof_hits[(pc % MEM_SIZE) >> 2] += cycles;
+	if (s->counter + cycles > prof_next){
+		n = (s->counter + cycles - prof_next + PROF_PERIOD - 1) / PROF_PERIOD;
+		prof_next += n * PROF_PERIOD;
+		prof_sample(pc, n);
+	}
+}
+
+static void prof_call(uint64_t site, uint64_t ret, uint64_t callee){
+	uint32_t i, hash;
+	prof_arc *a;
+
+	hash = (site >> 2) * 31 + (callee >> 2);
+	for (i = 0; i < PROF_ARCS; i++){
+		a = &prof_arcs[(hash + i) & (PROF_ARCS - 1)];
+		if (a->count == 0){
+			a->site = site;
+			a->callee = callee;
+		}
+		if (a->site == site && a->callee == callee){
+			a->count++;
+			break;
+		}
+	}
+
+	if (prof_depth == PROF_DEPTH){
+		prof_leave(prof_sym[0]);
+		memmove(prof_sym, prof_sym + 1, (PROF_DEPTH - 1) * sizeof(int32_t));
+		memmove(prof_ret, prof_ret + 1, (PROF_DEPTH - 1) * sizeof(uint64_t));
+		memmove(prof_func, prof_func + 1, (PROF_DEPTH - 1) * sizeof(uint64_t));
+		prof_depth--;
+	}
+	prof_ret[prof_depth] = ret;
+	prof_func[prof_depth] = callee;
+	prof_sym[prof_depth] = find_symbol(callee);
+	prof_enter(prof_sym[prof_depth]);
+	prof_depth++;
+}
+
+static void prof_jump(uint64_t target, int32_t ret){
+	int32_t i;
+
+	for (i = prof_depth - 1; i >= 0; i--){
+		if (prof_ret[i] == target){
+			while (prof_depth > i)
+				prof_leave(prof_sym[--prof_depth]);
+			return;
+		}
+	}
+	if (ret)
+		while (prof_depth > 0)
+			prof_leave(prof_sym[--prof_depth]);
+}
+
+static void prof_print(FILE *f, uint64_t addr){
+	int32_t k;
+
+	k = find_symbol(addr);
+	if (k < n_symbols)
+		fprintf(f, "%s", symbols[k].name);
+	else
+		fprintf(f, "0x%016lx", addr);
+}
+
+static int arc_cmp(const void *a, const void *b){
+	const prof_arc *x = a, *y = b;
+
+	if (x->site != y->site) return x->site < y->site ? -1 : 1;
+	if (x->callee != y->callee) return x->callee < y->callee ? -1 : 1;
+
+	return 0;
+}
+
+static int count_cmp(const void *a, const void *b){
+	const prof_arc *x = a, *y = b;
+
+	return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+static void prof_report(void){
+	FILE *f;
+	uint64_t *self, *calls, *total, cycles = 0, samples = 0;
+	prof_arc *arcs, *order;
+	int32_t i, j, k, n;
+
+	self = calloc(n_symbols + 1, sizeof(uint64_t));
+	calls = calloc(n_symbols + 1, sizeof(uint64_t));
+	total = calloc(n_symbols + 1, sizeof(uint64_t));
+	arcs = malloc(PROF_ARCS * sizeof(prof_arc));
+	order = malloc((n_symbols + 1) * sizeof(prof_arc));
+
+	for (i = 0; i < (MEM_SIZE >> 2); i++){
+		if (!prof_hits[i]) continue;
+		self[find_symbol(SRAM_BASE + (i << 2))] += prof_hits[i];
+		cycles += prof_hits[i];
+	}
+	for (i = 0; i < PROF_STACKS; i++)
+		samples += prof_stacks[i].count;
+	for (k = 0; k <= n_symbols; k++)
+		total[k] = prof_total[k] + (prof_active[k] ? prof_clock - prof_since[k] : 0);
+
+	/* call arcs, by caller and callee symbols */
+	for (i = 0, n = 0; i < PROF_ARCS; i++){
+		if (!prof_arcs[i].count) continue;
+		arcs[n].site = find_symbol(prof_arcs[i].site);
+		arcs[n].callee = find_symbol(prof_arcs[i].callee);
+		arcs[n].count = prof_arcs[i].count;
+		calls[arcs[n].callee] += arcs[n].count;
+		n++;
+	}
+	qsort(arcs, n, sizeof(prof_arc), arc_cmp);
+	for (i = 1, j = 0; i < n; i++){
+		if (arcs[i].site == arcs[j].site && arcs[i].callee == arcs[j].callee)
+			arcs[j].count += arcs[i].count;
+		else
+			arcs[++j] = arcs[i];
+	}
+	if (n) n = j + 1;
+	qsort(arcs, n, sizeof(prof_arc), count_cmp);
+
+	f = fopen("profile.txt", "wb");
+	if (!f){
+		printf("\nerror writing profile.\n");
+		return;
+	}
+	fprintf(f, "flat profile: %lu cycles (exact), %lu stack samples (every %d cycles)\n\n", cycles, samples, PROF_PERIOD);
+	fprintf(f, "  %%self    self cycles       calls  %%total  name\n");
+	for (i = 0; i <= n_symbols; i++){
+		order[i].site = i;
+		order[i].count = self[i];
+	}
+	qsort(order, n_symbols + 1, sizeof(prof_arc), count_cmp);
+	for (i = 0; i <= n_symbols; i++){
+		k = order[i].site;
+		if (!self[k] && !total[k]) continue;
+		fprintf(f, "%6.2f %14lu %11lu %7.2f  %s\n", cycles ? 100.0 * self[k] / cycles : 0.0, self[k], calls[k],
+			cycles ? 100.0 * total[k] / cycles : 0.0, k < n_symbols ? symbols[k].name : "[unknown]");
+	}
+
+	fprintf(f, "\ncall graph (exact)\n\n");
+	fprintf(f, "      calls  caller -> callee\n");
+	for (i = 0; i < n; i++)
+		fprintf(f, "%11lu  %s -> %s\n", arcs[i].count, arcs[i].site < n_symbols ? symbols[arcs[i].site].name : "[unknown]",
+			arcs[i].callee < n_symbols ? symbols[arcs[i].callee].name : "[unknown]");
+	if (prof_lost)
+		fprintf(f, "\n%lu samples lost (stack table full)\n", prof_lost);
+	fclose(f);
+
+	f = fopen("profile.folded", "wb");
+	if (!f){
+		printf("\nerror writing profile.\n");
+		return;
+	}
+	for (i = 0; i < PROF_STACKS; i++){
+		if (!prof_stacks[i].count) continue;
+		for (j = 0; j < prof_stacks[i].depth; j++){
+			if (j) fprintf(f, ";");
+			prof_print(f, prof_stacks[i].frames[j]);
+		}
+		fprintf(f, " %lu\n", prof_stacks[i].count);
+	}
+	fclose(f);
+
+	printf("\nprofile written to profile.txt and profile.folded.\n");
+}
+
+void cycle(state *s){
+	uint32_t inst, i;
+	decoded *d;
+	int64_t *r = s->r;
+	uint64_t *u = (uint64_t *)s->r;
+	uint32_t ptr;
+
+	if (s->status && (s->cause & s->mask)){
+		if (prof_enabled)
+			prof_call(s->pc, s->pc, s->vector);
+		s->epc = s->pc_next;
+		s->pc = s->vector;
+		s->pc_next = s->vector + 4;
+		s->status = 0;
+		for (i = 0; i < 4; i++)
+			s->status_dly[i] = 0;
+	}
+
+	inst = mem_fetch(s, s->pc);
+	d = &predecoded[(s->pc % MEM_SIZE) >> 2];
+	if (d->inst != inst || d->op == OP_DECODE)
+		decode(d, inst);
+
+	ptr = r[d->rs1] + d->imm;
+	r[0] = 0;
+
+	switch(d->op){
+		case OP_NOP: break;
+		case OP_LUI: r[d->rd] = d->imm; break;
+		case OP_AUIPC: r[d->rd] = s->pc + d->imm; break;
+		case OP_JAL: r[d->rd] = s->pc_next; s->pc_next = s->pc + d->imm; break;
+		case OP_JALR: r[d->rd] = s->pc_next; s->pc_next = (r[d->rs1] + d->imm); break;
+		case OP_BEQ: if (r[d->rs1] == r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BNE: if (r[d->rs1] != r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BLT: if (r[d->rs1] < r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BGE: if (r[d->rs1] >= r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BLTU: if (u[d->rs1] < u[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BGEU: if (u[d->rs1] >= u[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_LB: r[d->rd] = (int8_t)mem_read(s,1,ptr); break;
+		case OP_LH: r[d->rd] = (int16_t)mem_read(s,2,ptr); break;
+		case OP_LW: r[d->rd] = mem_read(s,4,ptr); break;
+		case OP_LD: r[d->rd] = mem_read(s,8,ptr); break;
+		case OP_LBU: r[d->rd] = (uint8_t)mem_read(s,1,ptr); break;
+		case OP_LHU: r[d->rd] = (uint16_t)mem_read(s,2,ptr); break;
+		case OP_LWU: r[d->rd] = (uint32_t)mem_read(s, 4, ptr); break;
+		case OP_SB: mem_write(s,1,ptr,r[d->rs2]); break;
+		case OP_SH: mem_write(s,2,ptr,r[d->rs2]); break;
+		case OP_SW: mem_write(s,4,ptr,r[d->rs2]); break;
+		case OP_SD: mem_write(s,8,ptr,r[d->rs2]); break;
+		case OP_ADDI: r[d->rd] = r[d->rs1] + d->imm; break;
+		case OP_SLLI: r[d->rd] = u[d->rs1] << d->imm; break;
+		case OP_SLTI: r[d->rd] = r[d->rs1] < d->imm; break;
+		case OP_SLTIU: r[d->rd] = u[d->rs1] < (uint64_t)d->imm; break;
+		case OP_XORI: r[d->rd] = r[d->rs1] ^ d->imm; break;
+		case OP_ORI: r[d->rd] = r[d->rs1] | d->imm; break;
+		case OP_ANDI: r[d->rd] = r[d->rs1] & d->imm; break;
+		case OP_SRLI: r[d->rd] = u[d->rs1] >> d->imm; break;
+		case OP_SRAI: r[d->rd] = r[d->rs1] >> d->imm; break;
+		case OP_ADDIW: r[d->rd] = (int64_t)(int32_t)((r[d->rs1] + d->imm) & 0xffffffff); break;
+		case OP_SLLIW: r[d->rd] = (int64_t)(int32_t)(u[d->rs1] << d->imm); break;
+		case OP_SRLIW: r[d->rd] = (int64_t)(int32_t)((u[d->rs1] & 0xffffffff) >> d->imm); break;
+		case OP_SRAIW: r[d->rd] = (int64_t)((int32_t)(r[d->rs1] & 0xffffffff) >> d->imm); break;
+		case OP_ADD: r[d->rd] = r[d->rs1] + r[d->rs2]; break;
+		case OP_SUB: r[d->rd] = r[d->rs1] - r[d->rs2]; break;
+		case OP_SLL: r[d->rd] = r[d->rs1] << r[d->rs2]; break;
+		case OP_SLT: r[d->rd] = r[d->rs1] < r[d->rs2]; break;
+		case OP_SLTU: r[d->rd] = u[d->rs1] < u[d->rs2]; break;
+		case OP_XOR: r[d->rd] = r[d->rs1] ^ r[d->rs2]; break;
+		case OP_SRL: r[d->rd] = u[d->rs1] >> u[d->rs2]; break;
+		case OP_SRA: r[d->rd] = r[d->rs1] >> r[d->rs2]; break;
+		case OP_OR: r[d->rd] = r[d->rs1] | r[d->rs2]; break;
+		case OP_AND: r[d->rd] = r[d->rs1] & r[d->rs2]; break;
+		case OP_ADDW: r[d->rd] = (int32_t)r[d->rs1] + (int32_t)r[d->rs2]; break;
+		case OP_SUBW: r[d->rd] = (int32_t)r[d->rs1] - (int32_t)r[d->rs2]; break;
+		case OP_SLLW: r[d->rd] = (int32_t)r[d->rs1] << (r[d->rs2] & 0x3f); break;
+		case OP_SRLW: r[d->rd] = (uint32_t)r[d->rs1] >> (uint32_t)r[d->rs2]; break;
+		case OP_SRAW: r[d->rd] = (int32_t)r[d->rs1] >> (int32_t)r[d->rs2]; break;
 		default: goto fail;
 	}
 
+	if (prof_enabled){
+		prof_account(s, s->pc, 1);
+		if (d->op == OP_JAL || d->op == OP_JALR){
+			if (d->rd == 1)
+				prof_call(s->pc, s->pc + 4, s->pc_next);
+			else if (d->op == OP_JALR && d->rd == 0)
+				prof_jump(s->pc_next, d->rs1 == 1);
+		}
+	}
+
 	s->pc = s->pc_next;
 	s->pc_next = s->pc_next + 4;
 	s->status = s->status_dly[0];
@@ -406,16 +972,59 @@ fail:
 	exit(0);
 }
 
+/*
+idle skipping. a jump to itself (the idle loop, "j .") has no effect other than the time spent
+on it, so instead of executing it up to the next event the counter is advanced at once, stopping
+on the cycle before any timer event (a compare match or a change of the counter interrupts).
+the state is the same as if the loop was executed.
+*/
+static void idle_skip(state *s){
+	int64_t i, k, d, cause;
+
+	if (mem_fetch(s, s->pc) != 0x0000006f) return;
+	if (s->status && (s->cause & s->mask)) return;
+	for (i = 0; i < 4; i++)
+		if (s->status_dly[i] != s->status) return;
+
+	cause = s->cause & ~0xf;
+	cause |= (s->counter & 0x10000) ? 0x4 : 0x8;
+	cause |= (s->counter & 0x40000) ? 0x1 : 0x2;
+	if (cause != s->cause) return;
+
+	/* counter bits 16 and 18 change only on a 64k boundary */
+	k = (-s->counter & 0xffff) - 1;
+	if (k < 0) k = 0xffff;
+	d = s->compare - s->counter - 1;
+	if (d >= 0 && d < k) k = d;
+	d = ((s->compare2 - s->counter) & 0xffffff) - 1;
+	if (d >= 0 && d < k) k = d;
+	if (k < 2) return;
+
+	if (prof_enabled)
+		prof_account(s, s->pc, k);
+	s->counter += k;
+}
+
 int main(int argc, char *argv[]){
 	state context;
 	state *s;
 	FILE *in;
-	int bytes, i;
+	int bytes, i, n;
+	uint64_t pc;
+	char *elf_file = NULL;
 
 	s = &context;
 	memset(s, 0, sizeof(state));
 	memset(sram, 0xff, sizeof(MEM_SIZE));
 
+	for (i = 1, n = 1; i < argc; i++){
+		if (!strcmp(argv[i], "-p") && i + 1 < argc)
+			elf_file = argv[++i];
+		else
+			argv[n++] = argv[i];
+	}
+	argc = n;
+
 	if (argc >= 2){
 		in = fopen(argv[1], "rb");
 		if (in == 0){
@@ -436,8 +1045,21 @@ int main(int argc, char *argv[]){
 			}
 			log_enabled = 1;
 		}
+		if (elf_file){
+			if (load_symbols(elf_file)){
+				printf("\nerror reading symbols from %s.\n", elf_file);
+				return 1;
+			}
+			prof_hits = calloc(MEM_SIZE >> 2, sizeof(uint64_t));
+			prof_stacks = calloc(PROF_STACKS, sizeof(prof_stack));
+			prof_active = calloc(n_symbols + 1, sizeof(uint32_t));
+			prof_since = calloc(n_symbols + 1, sizeof(uint64_t));
+			prof_total = calloc(n_symbols + 1, sizeof(uint64_t));
+			prof_enabled = 1;
+			atexit(prof_report);
+		}
 	}else{
-		printf("\nsyntax: hf_risc_sim [file.bin] [logfile.txt]\n");
+		printf("\nsyntax: hf_risc_sim [file.bin] [logfile.txt] [-p file.elf]\n");
 		return 1;
 	}
 
@@ -455,8 +1077,13 @@ int main(int argc, char *argv[]){
 	s->compare = 0;
 	s->compare2 = 0;
 
+	register_devices();
+
 	for(;;){
+		pc = s->pc;
 		cycle(s);
+		if (s->pc == pc)
+			idle_skip(s);
 	}
 
 	return(0);
@@ -51,6 +51,9 @@
 #define UART0				0xe1034000
 #define UART0_DIV			0xe1034010
 
+#define SPICAUSE			0xe1040400
+#define SPI0				0xe1044000
+
 #define ntohs(A) ( ((A)>>8) | (((A)&0xff)<<8) )
 #define htons(A) ntohs(A)
 #define ntohl(A) ( ((A)>>24) | (((A)&0xff0000)>>8) | (((A)&0xff00)<<8) | ((A)<<24) )
@@ -67,7 +70,10 @@ typedef struct {
 	uint32_t timercause, timercause_inv, timermask;
 	uint32_t timer0, timer1, timer1_pre, timer1_ctc, timer1_ocr;
 	uint32_t uartcause, uartcause_inv, uartmask;
+	uint32_t spi0;
+	uint64_t spi_done;
 	uint64_t cycles;
+	uint32_t stall;
 } state;
 
 int8_t sram[MEM_SIZE];
@@ -101,17 +107,627 @@ static int32_t mem_fetch(state *s, uint32_t address){
 	return(value);
 }
 
-static int32_t mem_read(state *s, int32_t size, uint32_t address){
-	uint32_t value=0;
-	uint32_t *ptr;
+/*
+symbols, read from the ELF image of the code: functions and labels on executable sections, and
+data objects. they are used to name code and data on profiles and cache statistics.
+*/
+typedef struct {
+	uint32_t addr, size, func;
+	char *name;
+} symbol;
+
+symbol *symbols;
+int32_t n_symbols = 0;
+
+static uint32_t elf_read(uint8_t *p, int32_t size){
+	uint32_t value = 0;
+
+	while (size--)
+		value = (value << 8) | p[size];
+
+	return value;
+}
+
+static int symbol_cmp(const void *a, const void *b){
+	const symbol *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+
+	return y->func - x->func;
+}
+
+static int32_t load_symbols(char *file){
+	FILE *f;
+	uint8_t *elf, *sh, *sym, *sec;
+	uint32_t len, shoff, shentsize, shnum, i, j, off, size, entsize, stroff, shndx, type;
+
+	f = fopen(file, "rb");
+	if (!f) return -1;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	elf = malloc(len + 1);
+	if (!elf || fread(elf, 1, len, f) != len || len < 0x34 || memcmp(elf, "\177ELF\001\001", 6)){
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	elf[len] = 0;
+
+	shoff = elf_read(elf + 0x20, 4);
+	shentsize = elf_read(elf + 0x2e, 2);
+	shnum = elf_read(elf + 0x30, 2);
+	if (shoff + shnum * shentsize > len) return -1;
+
+	for (i = 0; i < shnum; i++){
+		sh = elf + shoff + i * shentsize;
+		if (elf_read(sh + 4, 4) != 2) continue;		/* SHT_SYMTAB */
+		off = elf_read(sh + 0x10, 4);
+		size = elf_read(sh + 0x14, 4);
+		entsize = elf_read(sh + 0x24, 4);
+		j = elf_read(sh + 0x18, 4);
+		if (j >= shnum || entsize < 16 || off + size > len) return -1;
+		stroff = elf_read(elf + shoff + j * shentsize + 0x10, 4);
+		if (stroff >= len) return -1;
+
+		symbols = malloc((size / entsize) * sizeof(symbol));
+		for (j = 0; j < size / entsize; j++){
+			sym = elf + off + j * entsize;
+			shndx = elf_read(sym + 14, 2);
+			if (shndx == 0 || shndx >= shnum) continue;
+			sec = elf + shoff + shndx * shentsize;
+			type = sym[12] & 0xf;
+			if (elf_read(sec + 8, 4) & 0x4){		/* SHF_EXECINSTR */
+				if (type != 0 && type != 2) continue;	/* STT_NOTYPE, STT_FUNC */
+			}else{
+				if (type != 1 || !(elf_read(sec + 8, 4) & 0x2)) continue;	/* STT_OBJECT, SHF_ALLOC */
+			}
+			if (stroff + elf_read(sym, 4) >= len) continue;
+			symbols[n_symbols].name = (char *)elf + stroff + elf_read(sym, 4);
+			if (symbols[n_symbols].name[0] == '\0' || symbols[n_symbols].name[0] == '.' || symbols[n_symbols].name[0] == '$') continue;
+			symbols[n_symbols].addr = elf_read(sym + 4, 4);
+			symbols[n_symbols].size = elf_read(sym + 8, 4);
+			symbols[n_symbols].func = type == 2;
+			n_symbols++;
+		}
+		break;
+	}
+	if (!n_symbols) return -1;
+
+	/* one symbol per address, functions first */
+	qsort(symbols, n_symbols, sizeof(symbol), symbol_cmp);
+	for (i = 1, j = 0; i < n_symbols; i++)
+		if (symbols[i].addr != symbols[j].addr)
+			symbols[++j] = symbols[i];
+	n_symbols = j + 1;
+
+	return 0;
+}
+
+/* index of the symbol holding an address, or n_symbols if there is none */
+static int32_t find_symbol(uint32_t addr){
+	int32_t l = 0, h = n_symbols - 1, m;
+
+	while (l <= h){
+		m = (l + h) / 2;
+		if (symbols[m].addr <= addr) l = m + 1; else h = m - 1;
+	}
+	if (h < 0 || (symbols[h].size && addr - symbols[h].addr >= symbols[h].size))
+		return n_symbols;
+
+	return h;
+}
+
+/*
+caches. optional instruction and data caches, set associative with LRU replacement, write back
+and write allocate. a miss stalls the processor for the miss penalty (twice the penalty when a
+dirty line is written back), and timers keep running while the processor is stalled. only RAM
+is cached. when symbols are loaded, accesses and misses are also counted per function (for the
+instruction cache) and per data object (for the data cache). statistics are written to cache.txt.
+*/
+typedef struct {
+	uint32_t size, ways, line, penalty;
+	uint32_t sets, shift;
+	uint32_t *tags;			/* line number + 1, 0 for an invalid line */
+	uint64_t *lru;
+	uint8_t *dirty;
+	uint64_t accesses, misses, writebacks, stamp;
+	uint64_t *sym_accesses, *sym_misses;
+} cache;
+
+cache icache, dcache;
+
+static int32_t cache_init(cache *c, char *config){
+	uint32_t lines;
+
+	if (sscanf(config, "%u,%u,%u,%u", &c->size, &c->ways, &c->line, &c->penalty) != 4)
+		return -1;
+	if (!c->size || !c->ways || c->line < 4 || (c->line & (c->line - 1)) || c->size % (c->ways * c->line))
+		return -1;
+	c->sets = c->size / (c->ways * c->line);
+	if (c->sets & (c->sets - 1))
+		return -1;
+	for (c->shift = 0; (1u << c->shift) < c->line; c->shift++);
+
+	lines = c->sets * c->ways;
+	c->tags = calloc(lines, sizeof(uint32_t));
+	c->lru = calloc(lines, sizeof(uint64_t));
+	c->dirty = calloc(lines, sizeof(uint8_t));
+
+	return 0;
+}
+
+/* returns the stall cycles of an access */
+static uint32_t cache_access(cache *c, uint32_t address, int32_t write){
+	uint32_t tag, base, i, victim, penalty;
+	int32_t k = 0;
+
+	tag = ((address % MEM_SIZE) >> c->shift) + 1;
+	base = ((tag - 1) & (c->sets - 1)) * c->ways;
+	c->accesses++;
+	c->stamp++;
+	if (c->sym_accesses){
+		k = find_symbol(address);
+		c->sym_accesses[k]++;
+	}
+
+	for (i = 0; i < c->ways; i++){
+		if (c->tags[base + i] == tag){
+			c->lru[base + i] = c->stamp;
+			c->dirty[base + i] |= write;
+			return 0;
+		}
+	}
+
+	c->misses++;
+	if (c->sym_misses)
+		c->sym_misses[k]++;
+	victim = base;
+	for (i = 0; i < c->ways; i++){
+		if (c->tags[base + i] == 0){
+			victim = base + i;
+			break;
+		}
+		if (c->lru[base + i] < c->lru[victim])
+			victim = base + i;
+	}
+	penalty = c->penalty;
+	if (c->tags[victim] && c->dirty[victim]){
+		c->writebacks++;
+		penalty += c->penalty;
+	}
+	c->tags[victim] = tag;
+	c->lru[victim] = c->stamp;
+	c->dirty[victim] = write;
 
+	return penalty;
+}
+
+static void cache_print(FILE *f, cache *c, char *name){
+	int32_t i;
+
+	if (!c->size) return;
+	fprintf(f, "%s: %u bytes, %u way(s), %u byte lines, %u cycles miss penalty\n", name, c->size, c->ways, c->line, c->penalty);
+	fprintf(f, "  accesses %lu, misses %lu (%.2f%%), write backs %lu\n\n", c->accesses, c->misses,
+		c->accesses ? 100.0 * c->misses / c->accesses : 0.0, c->writebacks);
+	if (!c->sym_accesses) return;
+	fprintf(f, "      accesses       misses  %%miss  name\n");
+	for (i = 0; i <= n_symbols; i++){
+		if (!c->sym_accesses[i]) continue;
+		fprintf(f, "%14lu %12lu %6.2f  %s\n", c->sym_accesses[i], c->sym_misses[i],
+			100.0 * c->sym_misses[i] / c->sym_accesses[i], i < n_symbols ? symbols[i].name : "[other]");
+	}
+	fprintf(f, "\n");
+}
+
+static void cache_report(void){
+	FILE *f;
+
+	f = fopen("cache.txt", "wb");
+	if (!f){
+		printf("\nerror writing cache statistics.\n");
+		return;
+	}
+	cache_print(f, &icache, "instruction cache");
+	cache_print(f, &dcache, "data cache");
+	fclose(f);
+
+	if (icache.size)
+		printf("\nicache: %lu accesses, %lu misses", icache.accesses, icache.misses);
+	if (dcache.size)
+		printf("\ndcache: %lu accesses, %lu misses, %lu write backs", dcache.accesses, dcache.misses, dcache.writebacks);
+	printf("\ncache statistics written to cache.txt.\n");
+}
+
+/*
+memory mapped devices. each device registers the address range it decodes and handlers for
+its registers. RAM accesses (below EXIT_TRAP) use the memory array directly, and only
+accesses to the I/O space are dispatched to the region table. unmapped I/O addresses (and
+device registers with no handler) read as zero and ignore writes.
+*/
+#define MAX_REGIONS			16
+
+typedef struct {
+	uint32_t base, size;
+	int32_t (*read)(state *s, int32_t size, uint32_t address);
+	void (*write)(state *s, int32_t size, uint32_t address, uint32_t value);
+} region;
+
+region regions[MAX_REGIONS];
+int32_t n_regions = 0;
+
+static void register_region(uint32_t base, uint32_t size,
+	int32_t (*read)(state *s, int32_t size, uint32_t address),
+	void (*write)(state *s, int32_t size, uint32_t address, uint32_t value)){
+
+	if (n_regions == MAX_REGIONS){
+		printf("\ntoo many memory regions");
+		exit(1);
+	}
+	regions[n_regions].base = base;
+	regions[n_regions].size = size;
+	regions[n_regions].read = read;
+	regions[n_regions].write = write;
+	n_regions++;
+}
+
+static region *find_region(uint32_t address){
+	int32_t i;
+
+	for (i = 0; i < n_regions; i++)
+		if (address - regions[i].base < regions[i].size)
+			return &regions[i];
+
+	return NULL;
+}
+
+static int32_t irq_read(state *s, int32_t size, uint32_t address){
 	switch (address){
 		case IRQ_VECTOR:	return s->vector;
 		case IRQ_CAUSE:		return s->cause;
 		case IRQ_MASK:		return s->mask;
 		case IRQ_STATUS:	return s->status;
 		case IRQ_EPC:		return s->epc;
-		case S0CAUSE:		return s->s0cause;
+	}
+
+	return 0;
+}
+
+static void irq_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	uint32_t i;
+
+	switch (address){
+		case IRQ_VECTOR:	s->vector = value; return;
+		case IRQ_MASK:		s->mask = value; return;
+		case IRQ_STATUS:	if (value == 0){ s->status = 0; for (i = 0; i < 4; i++) s->status_dly[i] = 0; }else{ s->status_dly[3] = value; } return;
+		case IRQ_EPC:		s->epc = value; return;
+		case DEBUG_ADDR:
+			if (log_enabled)
+				fprintf(fptr, "%c", (int8_t)(value & 0xff));
+			return;
+	}
+}
+
+static void exit_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	fflush(stdout);
+	if (log_enabled)
+		fclose(fptr);
+	printf("\nend of simulation - %ld cycles.\n", s->cycles);
+	exit(0);
+}
+
+/*
+SD card model (SPI mode), backed by an image file (-sd image). the card is on the software SPI
+pins of port A (CS on P4, SCK on P5, MOSI on P6 and MISO on P7, SPI mode 0) and also on the SPI
+controller: a byte written to SPI0 is sent (and the byte received is read from SPI0), taking
+SPI_CYCLES cycles, and SPICAUSE bit 0 is set when the controller is ready. the chip select is
+always the port A pin.
+
+the card is a high capacity card (block addressing). single and multiple block reads and writes
+(CMD17, CMD18, CMD24 and CMD25) and the commands used for initialization are implemented, data
+CRCs are not checked. the card state is not saved on checkpoints.
+*/
+#define SD_CS				0x10
+#define SD_SCK				0x20
+#define SD_MOSI				0x40
+#define SD_MISO				0x80
+#define SD_BLOCK			512
+#define SD_FIFO				1024
+#define SPI_CYCLES			16	/* one byte at half the processor clock */
+
+enum { SD_IDLE = 0, SD_READ, SD_WRITE, SD_DATA };
+
+typedef struct {
+	FILE *image;
+	uint32_t blocks;
+	int32_t ready, app, state, multiple;
+	uint32_t block;
+	uint8_t cmd[6];
+	int32_t cmd_len;
+	uint8_t data[SD_BLOCK + 2];
+	int32_t data_len;
+	uint8_t fifo[SD_FIFO];
+	int32_t head, tail;
+	uint8_t shift_in, shift_out;
+	int32_t bits;
+	uint64_t blocks_read, blocks_written;
+} sdcard;
+
+sdcard sd;
+
+static void sd_queue(uint8_t value){
+	if ((sd.tail + 1) % SD_FIFO == sd.head){
+		printf("\nsd: response fifo overflow");
+		exit(1);
+	}
+	sd.fifo[sd.tail] = value;
+	sd.tail = (sd.tail + 1) % SD_FIFO;
+}
+
+static void sd_queueblock(uint32_t block){
+	uint8_t data[SD_BLOCK];
+	int32_t i;
+
+	memset(data, 0, SD_BLOCK);
+	fseek(sd.image, (long)block * SD_BLOCK, SEEK_SET);
+	if (fread(data, 1, SD_BLOCK, sd.image) != SD_BLOCK)
+		printf("\nsd: error reading block %u", block);
+	sd_queue(0xff);
+	sd_queue(0xfe);
+	for (i = 0; i < SD_BLOCK; i++)
+		sd_queue(data[i]);
+	sd_queue(0xff);
+	sd_queue(0xff);
+	sd.blocks_read++;
+}
+
+static void sd_command(void){
+	uint32_t cmd, arg, c_size;
+	uint8_t r1;
+
+	cmd = sd.cmd[0] & 0x3f;
+	arg = (sd.cmd[1] << 24) | (sd.cmd[2] << 16) | (sd.cmd[3] << 8) | sd.cmd[4];
+	r1 = sd.ready ? 0x00 : 0x01;
+
+	/* a command stops a multiple block read (CMD12 is the only one expected) */
+	if (sd.state == SD_READ){
+		sd.head = sd.tail = 0;
+		sd.state = SD_IDLE;
+		sd_queue(0xff);
+	}
+	sd_queue(0xff);
+	if (sd.app){
+		sd.app = 0;
+		if (cmd == 41){
+			sd.ready = 1;
+			sd_queue(0x00);
+		}else{
+			sd_queue(r1 | 0x04);
+		}
+		return;
+	}
+	switch (cmd){
+	case 0:
+		sd.ready = 0;
+		sd.state = SD_IDLE;
+		sd_queue(0x01);
+		break;
+	case 8:
+		sd_queue(r1);
+		sd_queue(0x00);
+		sd_queue(0x00);
+		sd_queue((arg >> 8) & 0x0f);
+		sd_queue(arg & 0xff);
+		break;
+	case 9:
+		/* CSD version 2.0, capacity in 512KB units */
+		c_size = sd.blocks / 1024 - 1;
+		sd_queue(r1);
+		sd_queue(0xff);
+		sd_queue(0xfe);
+		sd_queue(0x40); sd_queue(0x0e); sd_queue(0x00); sd_queue(0x32);
+		sd_queue(0x5b); sd_queue(0x59); sd_queue(0x00); sd_queue((c_size >> 16) & 0x3f);
+		sd_queue((c_size >> 8) & 0xff); sd_queue(c_size & 0xff); sd_queue(0x7f); sd_queue(0x80);
+		sd_queue(0x0a); sd_queue(0x40); sd_queue(0x00); sd_queue(0x01);
+		sd_queue(0xff);
+		sd_queue(0xff);
+		break;
+	case 12:
+		sd_queue(r1);
+		break;
+	case 13:
+		sd_queue(r1);
+		sd_queue(0x00);
+		break;
+	case 17:
+	case 18:
+		if (!sd.ready || arg >= sd.blocks){
+			sd_queue(r1 | 0x40);
+			break;
+		}
+		sd_queue(0x00);
+		if (cmd == 17){
+			sd_queueblock(arg);
+		}else{
+			sd.state = SD_READ;
+			sd.block = arg;
+		}
+		break;
+	case 24:
+	case 25:
+		if (!sd.ready || arg >= sd.blocks){
+			sd_queue(r1 | 0x40);
+			break;
+		}
+		sd_queue(0x00);
+		sd.state = SD_WRITE;
+		sd.multiple = (cmd == 25);
+		sd.block = arg;
+		break;
+	case 55:
+		sd.app = 1;
+		sd_queue(r1);
+		break;
+	case 58:
+		/* OCR: powered up, high capacity */
+		sd_queue(r1);
+		sd_queue(sd.ready ? 0xc0 : 0x40);
+		sd_queue(0xff);
+		sd_queue(0x80);
+		sd_queue(0x00);
+		break;
+	case 16:
+	case 59:
+		sd_queue(r1);
+		break;
+	default:
+		sd_queue(r1 | 0x04);
+	}
+}
+
+/* byte sent by the card on the next transfer */
+static uint8_t sd_output(void){
+	uint8_t value;
+
+	if (sd.head == sd.tail && sd.state == SD_READ){
+		if (sd.block < sd.blocks){
+			sd_queueblock(sd.block++);
+		}else{
+			sd_queue(0x08);		/* data error token, out of range */
+			sd.state = SD_IDLE;
+		}
+	}
+	if (sd.head == sd.tail)
+		return 0xff;
+	value = sd.fifo[sd.head];
+	sd.head = (sd.head + 1) % SD_FIFO;
+
+	return value;
+}
+
+/* byte received by the card */
+static void sd_input(uint8_t value){
+	int32_t i;
+
+	switch (sd.state){
+	case SD_WRITE:
+		if (value == 0xfe || (sd.multiple && value == 0xfc)){
+			sd.state = SD_DATA;
+			sd.data_len = 0;
+		}else if (sd.multiple && value == 0xfd){
+			/* stop transmission token, busy for a while */
+			sd.state = SD_IDLE;
+			sd_queue(0xff);
+			for (i = 0; i < 4; i++)
+				sd_queue(0x00);
+		}
+		return;
+	case SD_DATA:
+		sd.data[sd.data_len++] = value;
+		if (sd.data_len < SD_BLOCK + 2)
+			return;
+		if (sd.block < sd.blocks){
+			fseek(sd.image, (long)sd.block * SD_BLOCK, SEEK_SET);
+			fwrite(sd.data, 1, SD_BLOCK, sd.image);
+			sd.blocks_written++;
+			sd_queue(0xe5);		/* data accepted */
+		}else{
+			sd_queue(0xed);		/* write error */
+		}
+		for (i = 0; i < 4; i++)
+			sd_queue(0x00);
+		sd.block++;
+		sd.state = sd.multiple ? SD_WRITE : SD_IDLE;
+		return;
+	}
+
+	if (sd.cmd_len == 0 && (value & 0xc0) != 0x40)
+		return;
+	sd.cmd[sd.cmd_len++] = value;
+	if (sd.cmd_len == 6){
+		sd.cmd_len = 0;
+		sd_command();
+	}
+}
+
+/* software SPI: data is taken on the rising edges of SCK */
+static void sd_port(state *s, uint32_t old, uint32_t new){
+	if (!sd.image)
+		return;
+	if (new & SD_CS){
+		sd.bits = 0;
+		sd.cmd_len = 0;
+		s->pain |= SD_MISO;
+		return;
+	}
+	if ((old & SD_SCK) || !(new & SD_SCK))
+		return;
+	if (sd.bits == 0)
+		sd.shift_out = sd_output();
+	if (sd.shift_out & (0x80 >> sd.bits))
+		s->pain |= SD_MISO;
+	else
+		s->pain &= ~SD_MISO;
+	sd.shift_in = (sd.shift_in << 1) | ((new & SD_MOSI) ? 1 : 0);
+	if (++sd.bits == 8){
+		sd.bits = 0;
+		sd_input(sd.shift_in);
+	}
+}
+
+static int32_t sd_open(char *file){
+	long size;
+
+	sd.image = fopen(file, "r+b");
+	if (!sd.image)
+		return -1;
+	fseek(sd.image, 0, SEEK_END);
+	size = ftell(sd.image);
+	sd.blocks = size / SD_BLOCK;
+	if (sd.blocks < 1024){
+		fclose(sd.image);
+		sd.image = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sd_report(void){
+	printf("\nsd: %lu blocks read, %lu blocks written\n", sd.blocks_read, sd.blocks_written);
+	fclose(sd.image);
+}
+
+static int32_t spi_read(state *s, int32_t size, uint32_t address){
+	switch (address){
+		case SPICAUSE:		return s->cycles >= s->spi_done ? 0x01 : 0x00;
+		case SPI0:		return s->spi0;
+	}
+
+	return 0;
+}
+
+static void spi_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	if (address != SPI0)
+		return;
+	if (sd.image && !(s->paout & SD_CS)){
+		s->spi0 = sd_output();
+		sd_input(value & 0xff);
+	}else{
+		s->spi0 = 0xff;
+	}
+	s->spi_done = s->cycles + SPI_CYCLES;
+}
+
+static int32_t s0_read(state *s, int32_t size, uint32_t address){
+	if (address == S0CAUSE) return s->s0cause;
+
+	return 0;
+}
+
+static int32_t gpio_read(state *s, int32_t size, uint32_t address){
+	switch (address){
 		case GPIOCAUSE:		return s->gpiocause;
 		case GPIOCAUSEINV:	return s->gpiocause_inv;
 		case GPIOMASK:		return s->gpiomask;
@@ -120,6 +736,26 @@ static int32_t mem_read(state *s, int32_t size, uint32_t address){
 		case PAIN:		return s->pain;
 		case PAININV:		return s->pain_inv;
 		case PAINMASK:		return s->pain_mask;
+	}
+
+	return 0;
+}
+
+static void gpio_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	switch (address){
+		case GPIOCAUSE:		s->gpiocause = value & 0xffff; return;
+		case GPIOCAUSEINV:	s->gpiocause_inv = value & 0xffff; return;
+		case GPIOMASK:		s->gpiomask = value & 0xffff; return;
+		case PADDR:		s->paddr = value & 0xffff; return;
+		case PAOUT:		sd_port(s, s->paout, value & 0xffff); s->paout = value & 0xffff; return;
+//		case PAIN:		s->gpiocause = value & 0xffff; return;
+		case PAININV:		s->pain_inv = value & 0xffff; return;
+		case PAINMASK:		s->pain_mask = value & 0xffff; return;
+	}
+}
+
+static int32_t timer_read(state *s, int32_t size, uint32_t address){
+	switch (address){
 		case TIMERCAUSE:	return s->timercause;
 		case TIMERCAUSE_INV:	return s->timercause_inv;
 		case TIMERMASK:		return s->timermask;
@@ -128,13 +764,64 @@ static int32_t mem_read(state *s, int32_t size, uint32_t address){
 		case TIMER1_PRE:	return s->timer1_pre;
 		case TIMER1_CTC:	return s->timer1_ctc;
 		case TIMER1_OCR:	return s->timer1_ocr;
+	}
+
+	return 0;
+}
+
+static void timer_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	switch (address){
+		case TIMERCAUSE_INV:	s->timercause_inv = value & 0xff; return;
+		case TIMERMASK:		s->timermask = value & 0xff; return;
+		case TIMER1:		s->timer1 = value & 0xffff; return;
+		case TIMER1_PRE:	s->timer1_pre = value & 0xffff; return;
+		case TIMER1_CTC:	s->timer1_ctc = value & 0xffff; return;
+		case TIMER1_OCR:	s->timer1_ocr = value & 0xffff; return;
+	}
+}
+
+static int32_t uart_read(state *s, int32_t size, uint32_t address){
+	switch (address){
 		case UARTCAUSE:		return s->uartcause;
 		case UARTCAUSE_INV:	return s->uartcause_inv;
 		case UARTMASK:		return s->uartmask;
 		case UART0:		return getchar();
-		case UART0_DIV:		return 0;
 	}
-	if (address >= EXIT_TRAP) return 0;
+
+	return 0;
+}
+
+static void uart_write(state *s, int32_t size, uint32_t address, uint32_t value){
+	switch (address){
+		case UARTCAUSE_INV:	s->uartcause_inv = value & 0xff; return;
+		case UARTMASK:		s->uartmask = value & 0xff; return;
+		case UART0:
+			fprintf(stdout, "%c", (int8_t)(value & 0xff));
+			return;
+	}
+}
+
+static void register_devices(void){
+	register_region(EXIT_TRAP, 0x10, NULL, exit_write);
+	register_region(S0CAUSE & 0xffff0000, 0x10000, s0_read, NULL);
+	register_region(GPIOCAUSE & 0xffff0000, 0x10000, gpio_read, gpio_write);
+	register_region(TIMERCAUSE & 0xffff0000, 0x10000, timer_read, timer_write);
+	register_region(UARTCAUSE & 0xffff0000, 0x10000, uart_read, uart_write);
+	register_region(SPICAUSE & 0xffff0000, 0x10000, spi_read, spi_write);
+	register_region(IRQ_VECTOR, 0x100, irq_read, irq_write);
+}
+
+static int32_t mem_read(state *s, int32_t size, uint32_t address){
+	uint32_t value=0;
+	uint32_t *ptr;
+	region *r;
+
+	if (address >= EXIT_TRAP){
+		r = find_region(address);
+		return (r && r->read) ? r->read(s, size, address) : 0;
+	}
+	if (dcache.size)
+		s->stall += cache_access(&dcache, address, 0);
 
 	ptr = (uint32_t *)(s->mem + (address % MEM_SIZE));
 
@@ -168,49 +855,16 @@ static int32_t mem_read(state *s, int32_t size, uint32_t address){
 }
 
 static void mem_write(state *s, int32_t size, uint32_t address, uint32_t value){
-	uint32_t i;
 	uint32_t *ptr;
+	region *r;
 
-	switch (address){
-		case IRQ_VECTOR:	s->vector = value; return;
-		case IRQ_MASK:		s->mask = value; return;
-		case IRQ_STATUS:	if (value == 0){ s->status = 0; for (i = 0; i < 4; i++) s->status_dly[i] = 0; }else{ s->status_dly[3] = value; } return;
-		case IRQ_EPC:		s->epc = value; return;
-		case GPIOCAUSE:		s->gpiocause = value & 0xffff; return;
-		case GPIOCAUSEINV:	s->gpiocause_inv = value & 0xffff; return;
-		case GPIOMASK:		s->gpiomask = value & 0xffff; return;
-		case PADDR:		s->paddr = value & 0xffff; return;
-		case PAOUT:		s->paout = value & 0xffff; return;
-//		case PAIN:		s->gpiocause = value & 0xffff; return;
-		case PAININV:		s->pain_inv = value & 0xffff; return;
-		case PAINMASK:		s->pain_mask = value & 0xffff; return;
-		case TIMERCAUSE_INV:	s->timercause_inv = value & 0xff; return;
-		case TIMERMASK:		s->timermask = value & 0xff; return;
-		case TIMER0:		return;
-		case TIMER1:		s->timer1 = value & 0xffff; return;
-		case TIMER1_PRE:	s->timer1_pre = value & 0xffff; return;
-		case TIMER1_CTC:	s->timer1_ctc = value & 0xffff; return;
-		case TIMER1_OCR:	s->timer1_ocr = value & 0xffff; return;
-		case UARTCAUSE_INV:	s->uartcause_inv = value & 0xff; return;
-		case UARTMASK:		s->uartmask = value & 0xff; return;
-
-		case EXIT_TRAP:
-			fflush(stdout);
-			if (log_enabled)
-				fclose(fptr);
-			printf("\nend of simulation - %ld cycles.\n", s->cycles);
-			exit(0);
-		case DEBUG_ADDR:
-			if (log_enabled)
-				fprintf(fptr, "%c", (int8_t)(value & 0xff));
-			return;
-		case UART0:
-			fprintf(stdout, "%c", (int8_t)(value & 0xff));
-			return;
-		case UART0_DIV:
-			return;
+	if (address >= EXIT_TRAP){
+		r = find_region(address);
+		if (r && r->write) r->write(s, size, address, value);
+		return;
 	}
-	if (address >= EXIT_TRAP) return;
+	if (dcache.size)
+		s->stall += cache_access(&dcache, address, 1);
 
 	ptr = (uint32_t *)(s->mem + (address % MEM_SIZE));
 
@@ -241,24 +895,32 @@ static void mem_write(state *s, int32_t size, uint32_t address, uint32_t value){
 	}
 }
 
-void cycle(state *s){
-	uint32_t inst, i;
-	uint32_t opcode, rd, rs1, rs2, funct3, funct7, imm_i, imm_s, imm_sb, imm_u, imm_uj;
-	int32_t *r = s->r;
-	uint32_t *u = (uint32_t *)s->r;
-	uint32_t ptr_l, ptr_s;
+/*
+predecoded instructions. each memory word has an entry, holding the instruction it was decoded
+from (so a store to code is detected on the next fetch), the operation and the operands.
+*/
+enum {
+	OP_DECODE = 0, OP_INVALID,
+	OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+	OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+	OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU, OP_SB, OP_SH, OP_SW,
+	OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+	OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+	OP_SCALL, OP_SBREAK
+};
 
-	if ((s->status && (s->cause & s->mask)) || s->exception){
-		s->epc = s->pc_next;
-		s->pc = s->vector;
-		s->pc_next = s->vector + 4;
-		s->status = 0;
-		s->exception = 0;
-		for (i = 0; i < 4; i++)
-			s->status_dly[i] = 0;
-	}
+typedef struct {
+	uint32_t inst;
+	uint8_t op, rd, rs1, rs2;
+	int32_t imm;
+} decoded;
 
-	inst = mem_fetch(s, s->pc);
+decoded predecoded[MEM_SIZE >> 2];
+
+static void decode(decoded *d, uint32_t inst){
+	uint32_t opcode, rd, rs1, rs2, funct3, funct7, imm_i, imm_s, imm_sb, imm_u, imm_uj;
+	uint8_t op = OP_INVALID;
+	int32_t imm = 0;
 
 	opcode = inst & 0x7f;
 	rd = (inst >> 7) & 0x1f;
@@ -277,107 +939,465 @@ void cycle(state *s){
 		imm_sb |= 0xffffe000;
 		imm_uj |= 0xffe00000;
 	}
-	ptr_l = r[rs1] + (int32_t)imm_i;
-	ptr_s = r[rs1] + (int32_t)imm_s;
-	r[0] = 0;
 
 	switch (opcode){
-		case 0x37: r[rd] = imm_u; break;										/* LUI */
-		case 0x17: r[rd] = s->pc + imm_u; break;									/* AUIPC */
-		case 0x6f: r[rd] = s->pc_next; s->pc_next = s->pc + imm_uj; break;						/* JAL */
-		case 0x67: r[rd] = s->pc_next; s->pc_next = (r[rs1] + imm_i) & 0xfffffffe; break;				/* JALR */
+		case 0x37: op = OP_LUI; imm = imm_u; break;
+		case 0x17: op = OP_AUIPC; imm = imm_u; break;
+		case 0x6f: op = OP_JAL; imm = imm_uj; break;
+		case 0x67: op = OP_JALR; imm = imm_i; break;
 		case 0x63:
+			imm = imm_sb;
 			switch (funct3){
-				case 0x0: if (r[rs1] == r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BEQ */
-				case 0x1: if (r[rs1] != r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BNE */
-				case 0x4: if (r[rs1] < r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BLT */
-				case 0x5: if (r[rs1] >= r[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BGE */
-				case 0x6: if (u[rs1] < u[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BLTU */
-				case 0x7: if (u[rs1] >= u[rs2]){ s->pc_next = s->pc + imm_sb; } break;				/* BGEU */
-				default: goto fail;
+				case 0x0: op = OP_BEQ; break;
+				case 0x1: op = OP_BNE; break;
+				case 0x4: op = OP_BLT; break;
+				case 0x5: op = OP_BGE; break;
+				case 0x6: op = OP_BLTU; break;
+				case 0x7: op = OP_BGEU; break;
 			}
 			break;
 		case 0x3:
+			imm = imm_i;
 			switch (funct3){
-				case 0x0: r[rd] = (int8_t)mem_read(s,1,ptr_l); break;						/* LB */
-				case 0x1: r[rd] = (int16_t)mem_read(s,2,ptr_l); break;						/* LH */
-				case 0x2: r[rd] = mem_read(s,4,ptr_l); break;							/* LW */
-				case 0x4: r[rd] = (uint8_t)mem_read(s,1,ptr_l); break;						/* LBU */
-				case 0x5: r[rd] = (uint16_t)mem_read(s,2,ptr_l); break;						/* LHU */
-				default: goto fail;
+				case 0x0: op = OP_LB; break;
+				case 0x1: op = OP_LH; break;
+				case 0x2: op = OP_LW; break;
+				case 0x4: op = OP_LBU; break;
+				case 0x5: op = OP_LHU; break;
 			}
 			break;
 		case 0x23:
+			imm = imm_s;
 			switch (funct3){
-				case 0x0: mem_write(s,1,ptr_s,r[rs2]); break;							/* SB */
-				case 0x1: mem_write(s,2,ptr_s,r[rs2]); break;							/* SH */
-				case 0x2: mem_write(s,4,ptr_s,r[rs2]); break;							/* SW */
-				default: goto fail;
+				case 0x0: op = OP_SB; break;
+				case 0x1: op = OP_SH; break;
+				case 0x2: op = OP_SW; break;
 			}
 			break;
 		case 0x13:
+			imm = imm_i;
 			switch (funct3){
-				case 0x0: r[rd] = r[rs1] + (int32_t)imm_i; break;						/* ADDI */
-				case 0x2: r[rd] = r[rs1] < (int32_t)imm_i; break;		 				/* SLTI */
-				case 0x3: r[rd] = u[rs1] < (uint32_t)imm_i; break;						/* SLTIU */
-				case 0x4: r[rd] = r[rs1] ^ (int32_t)imm_i; break;						/* XORI */
-				case 0x6: r[rd] = r[rs1] | (int32_t)imm_i; break;						/* ORI */
-				case 0x7: r[rd] = r[rs1] & (int32_t)imm_i; break;						/* ANDI */
-				case 0x1: r[rd] = u[rs1] << (rs2 & 0x3f); break;						/* SLLI */
+				case 0x0: op = OP_ADDI; break;
+				case 0x2: op = OP_SLTI; break;
+				case 0x3: op = OP_SLTIU; break;
+				case 0x4: op = OP_XORI; break;
+				case 0x6: op = OP_ORI; break;
+				case 0x7: op = OP_ANDI; break;
+				case 0x1: op = OP_SLLI; imm = rs2 & 0x3f; break;
 				case 0x5:
+					imm = rs2 & 0x3f;
 					switch (funct7){
-						case 0x0: r[rd] = u[rs1] >> (rs2 & 0x3f); break;				/* SRLI */
-						case 0x20: r[rd] = r[rs1] >> (rs2 & 0x3f); break;				/* SRAI */
-						default: goto fail;
+						case 0x0: op = OP_SRLI; break;
+						case 0x20: op = OP_SRAI; break;
 					}
 					break;
-				default: goto fail;
 			}
 			break;
 		case 0x33:
 			switch (funct3){
 				case 0x0:
 					switch (funct7){
-						case 0x0: r[rd] = r[rs1] + r[rs2]; break;					/* ADD */
-						case 0x20: r[rd] = r[rs1] - r[rs2]; break;					/* SUB */
-						default: goto fail;
+						case 0x0: op = OP_ADD; break;
+						case 0x20: op = OP_SUB; break;
 					}
 					break;
-				case 0x1: r[rd] = r[rs1] << r[rs2]; break;							/* SLL */
-				case 0x2: r[rd] = r[rs1] < r[rs2]; break;		 					/* SLT */
-				case 0x3: r[rd] = u[rs1] < u[rs2]; break;		 					/* SLTU */
-				case 0x4: r[rd] = r[rs1] ^ r[rs2]; break;							/* XOR */
+				case 0x1: op = OP_SLL; break;
+				case 0x2: op = OP_SLT; break;
+				case 0x3: op = OP_SLTU; break;
+				case 0x4: op = OP_XOR; break;
 				case 0x5:
 					switch (funct7){
-						case 0x0: r[rd] = u[rs1] >> u[rs2]; break;					/* SRL */
-						case 0x20: r[rd] = r[rs1] >> r[rs2]; break;					/* SRA */
-						default: goto fail;
+						case 0x0: op = OP_SRL; break;
+						case 0x20: op = OP_SRA; break;
 					}
 					break;
-				case 0x6: r[rd] = r[rs1] | r[rs2]; break;							/* OR */
-				case 0x7: r[rd] = r[rs1] & r[rs2]; break;							/* AND */
-				default: goto fail;
+				case 0x6: op = OP_OR; break;
+				case 0x7: op = OP_AND; break;
 			}
 			break;
 		case 0x73:
-			switch(funct3){
-				case 0:
-					switch(imm_i){
-						case 0:										/* SCALL */
-							s->exception = 1;
-							break;
-						case 1:	bp(s, inst); break;							/* SBREAK */
-						default: goto fail;
-					}
-					break;
-				default: goto fail;
+			if (funct3 == 0){
+				switch (imm_i){
+					case 0: op = OP_SCALL; break;
+					case 1: op = OP_SBREAK; break;
+				}
 			}
 			break;
+	}
+
+	d->inst = inst;
+	d->op = op;
+	d->rd = rd;
+	d->rs1 = rs1;
+	d->rs2 = rs2;
+	d->imm = imm;
+}
+
+/*
+profiling. cycles spent on each instruction and calls (jal / jalr with ra as the link register)
+are counted exactly, and the call stack is sampled every PROF_PERIOD cycles. calls and returns
+are tracked on a shadow stack: a return (a jump to the address after a call on the stack) pops
+all frames above it, and an interrupt is handled as a call from the interrupted instruction to
+the interrupt vector. a ret to an address not on the stack (a context switch) clears it. the
+total (inclusive) cycles of a function are counted exactly as well, from the cycles spent while
+it is on the shadow stack or is running, so they never fall below its own (self) cycles. the
+flat profile and call graph are written to profile.txt, and sampled stacks to profile.folded,
+in the format used by flame graph tools.
+*/
+#define PROF_DEPTH			32
+#define PROF_STACKS			16384		/* power of 2 */
+#define PROF_ARCS			8192		/* power of 2 */
+#define PROF_PERIOD			97
+
+typedef struct {
+	uint32_t site, callee;
+	uint64_t count;
+} prof_arc;
+
+typedef struct {
+	uint32_t hash, depth;
+	uint32_t frames[PROF_DEPTH + 1];
+	uint64_t count;
+} prof_stack;
+
+int32_t prof_enabled = 0;
+uint64_t *prof_hits;
+prof_arc prof_arcs[PROF_ARCS];
+prof_stack *prof_stacks;
+uint32_t prof_ret[PROF_DEPTH], prof_func[PROF_DEPTH];
+int32_t prof_sym[PROF_DEPTH], prof_depth = 0, prof_leaf = -1;
+uint64_t prof_next = 0, prof_lost = 0;
+uint32_t prof_lo = 0, prof_hi = 0;
+uint32_t *prof_active;
+uint64_t *prof_since, *prof_total, prof_clock = 0;
+
+static uint32_t prof_hash(uint32_t *frames, uint32_t n){
+	uint32_t i, hash = 2166136261u;
+
+	for (i = 0; i < n; i++)
+		hash = (hash ^ frames[i]) * 16777619u;
+
+	return hash;
+}
+
+static void prof_sample(uint32_t pc, uint64_t count){
+	uint32_t frames[PROF_DEPTH + 1];
+	uint32_t i, n, hash;
+	int32_t k;
+	prof_stack *p;
+
+	/* the leaf is the function of the last frame, unless it jumped elsewhere */
+	memcpy(frames, prof_func, prof_depth * sizeof(uint32_t));
+	k = find_symbol(pc);
+	frames[prof_depth] = k < n_symbols ? symbols[k].addr : pc;
+	n = prof_depth + 1;
+	if (prof_depth && frames[n - 1] == frames[n - 2])
+		n--;
+	hash = prof_hash(frames, n);
+
+	for (i = 0; i < PROF_STACKS; i++){
+		p = &prof_stacks[(hash + i) & (PROF_STACKS - 1)];
+		if (p->count == 0){
+			p->hash = hash;
+			p->depth = n;
+			memcpy(p->frames, frames, n * sizeof(uint32_t));
+		}
+		if (p->hash == hash && p->depth == n && !memcmp(p->frames, frames, n * sizeof(uint32_t))){
+			p->count += count;
+			return;
+		}
+	}
+	prof_lost += count;
+}
+
+/* a symbol is active while it is on the stack or is the leaf, and its total counts from the first activation to the last */
+static void prof_enter(int32_t k){
+	if (prof_active[k]++ == 0)
+		prof_since[k] = prof_clock;
+}
+
+static void prof_leave(int32_t k){
+	if (--prof_active[k] == 0)
+		prof_total[k] += prof_clock - prof_since[k];
+}
+
+/* count cycles spent on an instruction, and sample the stack if a sampling point is crossed */
+static void prof_account(state *s, uint32_t pc, uint64_t cycles){
+	uint64_t n;
+	int32_t k;
+
+	/* the leaf symbol is looked up only when the pc leaves its address range */
+	if (pc - prof_lo >= prof_hi - prof_lo){
+		k = find_symbol(pc);
+		prof_lo = prof_hi = 0;
+		if (k < n_symbols){
+			prof_lo = symbols[k].addr;
+			prof_hi = k + 1 < n_symbols ? symbols[k + 1].addr : (uint32_t)-1;
+			if (symbols[k].size && symbols[k].size < prof_hi - prof_lo)
+				prof_hi = prof_lo + symbols[k].size;
+		}
+		prof_enter(k);
+		if (prof_leaf >= 0)
+			prof_leave(prof_leaf);
+		prof_leaf = k;
+	}
+	prof_clock += cycles;
+	prof_hits[(pc % MEM_SIZE) >> 2] += cycles;
+	if (s->cycles + cycles > prof_next){
+		n = (s->cycles + cycles - prof_next + PROF_PERIOD - 1) / PROF_PERIOD;
+		prof_next += n * PROF_PERIOD;
+		prof_sample(pc, n);
+	}
+}
+
+static void prof_call(uint32_t site, uint32_t ret, uint32_t callee){
+	uint32_t i, hash;
+	prof_arc *a;
+
+	hash = (site >> 2) * 31 + (callee >> 2);
+	for (i = 0; i < PROF_ARCS; i++){
+		a = &prof_arcs[(hash + i) & (PROF_ARCS - 1)];
+		if (a->count == 0){
+			a->site = site;
+			a->callee = callee;
+		}
+		if (a->site == site && a->callee == callee){
+			a->count++;
+			break;
+		}
+	}
+
+	if (prof_depth == PROF_DEPTH){
+		prof_leave(prof_sym[0]);
+		memmove(prof_sym, prof_sym + 1, (PROF_DEPTH - 1) * sizeof(int32_t));
+		memmove(prof_ret, prof_ret + 1, (PROF_DEPTH - 1) * sizeof(uint32_t));
+		memmove(prof_func, prof_func + 1, (PROF_DEPTH - 1) * sizeof(uint32_t));
+		prof_depth--;
+	}
+	prof_ret[prof_depth] = ret;
+	prof_func[prof_depth] = callee;
+	prof_sym[prof_depth] = find_symbol(callee);
+	prof_enter(prof_sym[prof_depth]);
+	prof_depth++;
+}
+
+static void prof_jump(uint32_t target, int32_t ret){
+	int32_t i;
+
+	for (i = prof_depth - 1; i >= 0; i--){
+		if (prof_ret[i] == target){
+			while (prof_depth > i)
+				prof_leave(prof_sym[--prof_depth]);
+			return;
+		}
+	}
+	if (ret)
+		while (prof_depth > 0)
+			prof_leave(prof_sym[--prof_depth]);
+}
+
+static void prof_print(FILE *f, uint32_t addr){
+	int32_t k;
+
+	k = find_symbol(addr);
+	if (k < n_symbols)
+		fprintf(f, "%s", symbols[k].name);
+	else
+		fprintf(f, "0x%08x", addr);
+}
+
+static int arc_cmp(const void *a, const void *b){
+	const prof_arc *x = a, *y = b;
+
+	if (x->site != y->site) return x->site < y->site ? -1 : 1;
+	if (x->callee != y->callee) return x->callee < y->callee ? -1 : 1;
+
+	return 0;
+}
+
+static int count_cmp(const void *a, const void *b){
+	const prof_arc *x = a, *y = b;
+
+	return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+static void prof_report(void){
+	FILE *f;
+	uint64_t *self, *calls, *total, cycles = 0, samples = 0;
+	prof_arc *arcs, *order;
+	int32_t i, j, k, n;
+
+	self = calloc(n_symbols + 1, sizeof(uint64_t));
+	calls = calloc(n_symbols + 1, sizeof(uint64_t));
+	total = calloc(n_symbols + 1, sizeof(uint64_t));
+	arcs = malloc(PROF_ARCS * sizeof(prof_arc));
+	order = malloc((n_symbols + 1) * sizeof(prof_arc));
+
+	for (i = 0; i < (MEM_SIZE >> 2); i++){
+		if (!prof_hits[i]) continue;
+		self[find_symbol(SRAM_BASE + (i << 2))] += prof_hits[i];
+		cycles += prof_hits[i];
+	}
+	for (i = 0; i < PROF_STACKS; i++)
+		samples += prof_stacks[i].count;
+	for (k = 0; k <= n_symbols; k++)
+		total[k] = prof_total[k] + (prof_active[k] ? prof_clock - prof_since[k] : 0);
+
+	/* call arcs, by caller and callee symbols */
+	for (i = 0, n = 0; i < PROF_ARCS; i++){
+		if (!prof_arcs[i].count) continue;
+		arcs[n].site = find_symbol(prof_arcs[i].site);
+		arcs[n].callee = find_symbol(prof_arcs[i].callee);
+		arcs[n].count = prof_arcs[i].count;
+		calls[arcs[n].callee] += arcs[n].count;
+		n++;
+	}
+	qsort(arcs, n, sizeof(prof_arc), arc_cmp);
+	for (i = 1, j = 0; i < n; i++){
+		if (arcs[i].site == arcs[j].site && arcs[i].callee == arcs[j].callee)
+			arcs[j].count += arcs[i].count;
+		else
+			arcs[++j] = arcs[i];
+	}
+	if (n) n = j + 1;
+	qsort(arcs, n, sizeof(prof_arc), count_cmp);
+
+	f = fopen("profile.txt", "wb");
+	if (!f){
+		printf("\nerror writing profile.\n");
+		return;
+	}
+	fprintf(f, "flat profile: %lu cycles (exact), %lu stack samples (every %d cycles)\n\n", cycles, samples, PROF_PERIOD);
+	fprintf(f, "  %%self    self cycles       calls  %%total  name\n");
+	for (i = 0; i <= n_symbols; i++){
+		order[i].site = i;
+		order[i].count = self[i];
+	}
+	qsort(order, n_symbols + 1, sizeof(prof_arc), count_cmp);
+	for (i = 0; i <= n_symbols; i++){
+		k = order[i].site;
+		if (!self[k] && !total[k]) continue;
+		fprintf(f, "%6.2f %14lu %11lu %7.2f  %s\n", cycles ? 100.0 * self[k] / cycles : 0.0, self[k], calls[k],
+			cycles ? 100.0 * total[k] / cycles : 0.0, k < n_symbols ? symbols[k].name : "[unknown]");
+	}
+
+	fprintf(f, "\ncall graph (exact)\n\n");
+	fprintf(f, "      calls  caller -> callee\n");
+	for (i = 0; i < n; i++)
+		fprintf(f, "%11lu  %s -> %s\n", arcs[i].count, arcs[i].site < n_symbols ? symbols[arcs[i].site].name : "[unknown]",
+			arcs[i].callee < n_symbols ? symbols[arcs[i].callee].name : "[unknown]");
+	if (prof_lost)
+		fprintf(f, "\n%lu samples lost (stack table full)\n", prof_lost);
+	fclose(f);
+
+	f = fopen("profile.folded", "wb");
+	if (!f){
+		printf("\nerror writing profile.\n");
+		return;
+	}
+	for (i = 0; i < PROF_STACKS; i++){
+		if (!prof_stacks[i].count) continue;
+		for (j = 0; j < prof_stacks[i].depth; j++){
+			if (j) fprintf(f, ";");
+			prof_print(f, prof_stacks[i].frames[j]);
+		}
+		fprintf(f, " %lu\n", prof_stacks[i].count);
+	}
+	fclose(f);
+
+	printf("\nprofile written to profile.txt and profile.folded.\n");
+}
+
+void cycle(state *s){
+	uint32_t inst, i;
+	decoded *d;
+	int32_t *r = s->r;
+	uint32_t *u = (uint32_t *)s->r;
+	uint32_t ptr;
+
+	if (s->stall){
+		s->stall--;
+		goto tick;
+	}
+
+	if ((s->status && (s->cause & s->mask)) || s->exception){
+		if (prof_enabled)
+			prof_call(s->pc, s->pc, s->vector);
+		s->epc = s->pc_next;
+		s->pc = s->vector;
+		s->pc_next = s->vector + 4;
+		s->status = 0;
+		s->exception = 0;
+		for (i = 0; i < 4; i++)
+			s->status_dly[i] = 0;
+	}
+
+	inst = mem_fetch(s, s->pc);
+	d = &predecoded[(s->pc % MEM_SIZE) >> 2];
+	if (d->inst != inst || d->op == OP_DECODE)
+		decode(d, inst);
+	if (icache.size)
+		s->stall += cache_access(&icache, s->pc, 0);
+
+	ptr = r[d->rs1] + d->imm;
+	r[0] = 0;
+
+	switch (d->op){
+		case OP_LUI: r[d->rd] = d->imm; break;
+		case OP_AUIPC: r[d->rd] = s->pc + d->imm; break;
+		case OP_JAL: r[d->rd] = s->pc_next; s->pc_next = s->pc + d->imm; break;
+		case OP_JALR: r[d->rd] = s->pc_next; s->pc_next = (r[d->rs1] + d->imm) & 0xfffffffe; break;
+		case OP_BEQ: if (r[d->rs1] == r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BNE: if (r[d->rs1] != r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BLT: if (r[d->rs1] < r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BGE: if (r[d->rs1] >= r[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BLTU: if (u[d->rs1] < u[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_BGEU: if (u[d->rs1] >= u[d->rs2]){ s->pc_next = s->pc + d->imm; } break;
+		case OP_LB: r[d->rd] = (int8_t)mem_read(s,1,ptr); break;
+		case OP_LH: r[d->rd] = (int16_t)mem_read(s,2,ptr); break;
+		case OP_LW: r[d->rd] = mem_read(s,4,ptr); break;
+		case OP_LBU: r[d->rd] = (uint8_t)mem_read(s,1,ptr); break;
+		case OP_LHU: r[d->rd] = (uint16_t)mem_read(s,2,ptr); break;
+		case OP_SB: mem_write(s,1,ptr,r[d->rs2]); break;
+		case OP_SH: mem_write(s,2,ptr,r[d->rs2]); break;
+		case OP_SW: mem_write(s,4,ptr,r[d->rs2]); break;
+		case OP_ADDI: r[d->rd] = r[d->rs1] + d->imm; break;
+		case OP_SLTI: r[d->rd] = r[d->rs1] < d->imm; break;
+		case OP_SLTIU: r[d->rd] = u[d->rs1] < (uint32_t)d->imm; break;
+		case OP_XORI: r[d->rd] = r[d->rs1] ^ d->imm; break;
+		case OP_ORI: r[d->rd] = r[d->rs1] | d->imm; break;
+		case OP_ANDI: r[d->rd] = r[d->rs1] & d->imm; break;
+		case OP_SLLI: r[d->rd] = u[d->rs1] << d->imm; break;
+		case OP_SRLI: r[d->rd] = u[d->rs1] >> d->imm; break;
+		case OP_SRAI: r[d->rd] = r[d->rs1] >> d->imm; break;
+		case OP_ADD: r[d->rd] = r[d->rs1] + r[d->rs2]; break;
+		case OP_SUB: r[d->rd] = r[d->rs1] - r[d->rs2]; break;
+		case OP_SLL: r[d->rd] = r[d->rs1] << r[d->rs2]; break;
+		case OP_SLT: r[d->rd] = r[d->rs1] < r[d->rs2]; break;
+		case OP_SLTU: r[d->rd] = u[d->rs1] < u[d->rs2]; break;
+		case OP_XOR: r[d->rd] = r[d->rs1] ^ r[d->rs2]; break;
+		case OP_SRL: r[d->rd] = u[d->rs1] >> u[d->rs2]; break;
+		case OP_SRA: r[d->rd] = r[d->rs1] >> r[d->rs2]; break;
+		case OP_OR: r[d->rd] = r[d->rs1] | r[d->rs2]; break;
+		case OP_AND: r[d->rd] = r[d->rs1] & r[d->rs2]; break;
+		case OP_SCALL: s->exception = 1; break;
+		case OP_SBREAK: bp(s, inst); break;
 		default: goto fail;
 	}
 
+	if (prof_enabled){
+		prof_account(s, s->pc, 1 + s->stall);
+		if (d->op == OP_JAL || d->op == OP_JALR){
+			if (d->rd == 1)
+				prof_call(s->pc, s->pc + 4, s->pc_next);
+			else if (d->op == OP_JALR && d->rd == 0)
+				prof_jump(s->pc_next, d->rs1 == 1);
+		}
+	}
+
 	s->pc = s->pc_next;
 	s->pc_next = s->pc_next + 4;
+tick:
 	s->status = s->status_dly[0];
 	for (i = 0; i < 3; i++)
 		s->status_dly[i] = s->status_dly[i+1];
@@ -441,23 +1461,166 @@ fail:
 	exit(0);
 }
 
+/*
+idle skipping. a jump to itself (the idle loop, "j .") has no effect other than the time spent
+on it, so instead of executing it up to the next event the cycle counter and timers are advanced
+at once, stopping on the cycle before any timer event (or change of the interrupt cause) and
+not going past the cycle given as a limit (the checkpoint). the state is the same as if the loop
+was executed, including the cycle count.
+*/
+static void idle_skip(state *s, uint64_t limit){
+	uint32_t i, t0, k, shift, bound, gpiocause, s0cause;
+	uint64_t lim;
+
+	if (s->stall || mem_fetch(s, s->pc) != 0x0000006f) return;
+	if (s->exception || (s->status && (s->cause & s->mask))) return;
+	for (i = 0; i < 4; i++)
+		if (s->status_dly[i] != s->status) return;
+
+	gpiocause = (s->pain ^ s->pain_inv) & s->pain_mask ? 0x01 : 0x00;
+	s0cause = (gpiocause ^ s->gpiocause_inv) & s->gpiomask ? 0x02 : 0x00;
+	s0cause |= (s->timercause ^ s->timercause_inv) & s->timermask ? 0x04 : 0x00;
+	if (gpiocause != s->gpiocause || s0cause != s->s0cause || (s0cause ? 0x01 : 0x00) != s->cause) return;
+	if (s->timer1 == s->timer1_ctc || (s->timer1 < s->timer1_ocr) != ((s->timercause & 0x8) != 0)) return;
+
+	/* timer0 bits 16, 18 (timercause) and 19 (pain) change only on a 64k boundary */
+	t0 = s->timer0;
+	k = -t0 & 0xffff;
+
+	/* timer1 must stay below the compare and output compare registers */
+	bound = 0x10000;
+	if (s->timer1_ctc > s->timer1) bound = s->timer1_ctc;
+	if (s->timer1_ocr > s->timer1 && s->timer1_ocr < bound) bound = s->timer1_ocr;
+	shift = (s->timer1_pre >= 1 && s->timer1_pre <= 7) ? s->timer1_pre * 2 : 0;
+	lim = ((((uint64_t)t0 >> shift) + bound - s->timer1) << shift) - 1 - t0;
+	if (lim < k) k = lim;
+	if (s->cycles <= limit && limit - s->cycles < k) k = limit - s->cycles;
+	if (k < 2) return;
+
+	if (prof_enabled)
+		prof_account(s, s->pc, k);
+	if (icache.size){
+		icache.accesses += k;
+		if (icache.sym_accesses)
+			icache.sym_accesses[find_symbol(s->pc)] += k;
+	}
+	s->timer1 += (((uint64_t)t0 + k) >> shift) - (t0 >> shift);
+	s->timer0 += k;
+	s->cycles += k;
+}
+
+/*
+checkpoints. the processor state (including device registers) and memory are saved on a given
+cycle, and a simulation can be started from a checkpoint instead of a binary. memory is saved in
+pages, and pages with only zeros are skipped. predecoded instructions are not saved, and are
+decoded again after a restore.
+*/
+#define CHECKPOINT_MAGIC		0x5256434b	/* "RVCK" */
+#define CHECKPOINT_VERSION		2
+#define CHECKPOINT_PAGE			4096
+
+typedef struct {
+	uint32_t magic, version, state_size, mem_size;
+} checkpoint_header;
+
+static void checkpoint_save(state *s, char *file){
+	FILE *f;
+	checkpoint_header h;
+	uint32_t i, end = -1;
+	int8_t *page;
+
+	f = fopen(file, "wb");
+	if (!f){
+		printf("\nerror opening checkpoint file.\n");
+		return;
+	}
+	h.magic = CHECKPOINT_MAGIC;
+	h.version = CHECKPOINT_VERSION;
+	h.state_size = sizeof(state);
+	h.mem_size = MEM_SIZE;
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(s, sizeof(state), 1, f);
+	for (i = 0; i < MEM_SIZE / CHECKPOINT_PAGE; i++){
+		page = &sram[i * CHECKPOINT_PAGE];
+		if (page[0] == 0 && !memcmp(page, page + 1, CHECKPOINT_PAGE - 1)) continue;
+		fwrite(&i, sizeof(i), 1, f);
+		fwrite(page, 1, CHECKPOINT_PAGE, f);
+	}
+	fwrite(&end, sizeof(end), 1, f);
+	fclose(f);
+	printf("\ncheckpoint saved - %ld cycles.\n", s->cycles);
+}
+
+static int32_t checkpoint_restore(state *s, FILE *f){
+	checkpoint_header h;
+	uint32_t i;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != CHECKPOINT_MAGIC || h.version != CHECKPOINT_VERSION ||
+		h.state_size != sizeof(state) || h.mem_size != MEM_SIZE)
+		return -1;
+	if (fread(s, sizeof(state), 1, f) != 1)
+		return -1;
+	s->mem = &sram[0];
+	memset(sram, 0, MEM_SIZE);
+	for (;;){
+		if (fread(&i, sizeof(i), 1, f) != 1)
+			return -1;
+		if (i == (uint32_t)-1)
+			return 0;
+		if (i >= MEM_SIZE / CHECKPOINT_PAGE || fread(&sram[i * CHECKPOINT_PAGE], 1, CHECKPOINT_PAGE, f) != CHECKPOINT_PAGE)
+			return -1;
+	}
+}
+
 int main(int argc, char *argv[]){
 	state context;
 	state *s;
 	FILE *in;
-	int bytes;
+	int bytes, restore = 0, i, n;
+	uint32_t pc;
+	uint64_t checkpoint = -1;
+	char *checkpoint_file = NULL, *elf_file = NULL, *icache_config = NULL, *dcache_config = NULL, *sd_file = NULL;
 
 	s = &context;
 	memset(s, 0, sizeof(state));
 	memset(sram, 0xff, sizeof(MEM_SIZE));
 
+	for (i = 1, n = 1; i < argc; i++){
+		if (!strcmp(argv[i], "-s") && i + 2 < argc){
+			checkpoint = strtoull(argv[i + 1], NULL, 10);
+			checkpoint_file = argv[i + 2];
+			i += 2;
+		}else if (!strcmp(argv[i], "-p") && i + 1 < argc){
+			elf_file = argv[++i];
+		}else if (!strcmp(argv[i], "-ic") && i + 1 < argc){
+			icache_config = argv[++i];
+		}else if (!strcmp(argv[i], "-dc") && i + 1 < argc){
+			dcache_config = argv[++i];
+		}else if (!strcmp(argv[i], "-sd") && i + 1 < argc){
+			sd_file = argv[++i];
+		}else if (!strcmp(argv[i], "-r")){
+			restore = 1;
+		}else{
+			argv[n++] = argv[i];
+		}
+	}
+	argc = n;
+
 	if (argc >= 2){
 		in = fopen(argv[1], "rb");
 		if (in == 0){
 			printf("\nerror opening binary file.\n");
 			return 1;
 		}
-		bytes = fread(&sram, 1, MEM_SIZE, in);
+		if (restore){
+			if (checkpoint_restore(s, in)){
+				printf("\nerror reading checkpoint file.\n");
+				return 1;
+			}
+			bytes = MEM_SIZE;
+		}else{
+			bytes = fread(&sram, 1, MEM_SIZE, in);
+		}
 		fclose(in);
 		if (bytes == 0){
 			printf("\nerror reading binary file.\n");
@@ -471,27 +1634,70 @@ int main(int argc, char *argv[]){
 			}
 			log_enabled = 1;
 		}
+		if (elf_file){
+			if (load_symbols(elf_file)){
+				printf("\nerror reading symbols from %s.\n", elf_file);
+				return 1;
+			}
+			prof_hits = calloc(MEM_SIZE >> 2, sizeof(uint64_t));
+			prof_stacks = calloc(PROF_STACKS, sizeof(prof_stack));
+			prof_active = calloc(n_symbols + 1, sizeof(uint32_t));
+			prof_since = calloc(n_symbols + 1, sizeof(uint64_t));
+			prof_total = calloc(n_symbols + 1, sizeof(uint64_t));
+			prof_next = s->cycles;
+			prof_enabled = 1;
+			atexit(prof_report);
+		}
+		if ((icache_config && cache_init(&icache, icache_config)) || (dcache_config && cache_init(&dcache, dcache_config))){
+			printf("\ninvalid cache configuration (size,ways,line,penalty).\n");
+			return 1;
+		}
+		if (n_symbols){
+			icache.sym_accesses = calloc(n_symbols + 1, sizeof(uint64_t));
+			icache.sym_misses = calloc(n_symbols + 1, sizeof(uint64_t));
+			dcache.sym_accesses = calloc(n_symbols + 1, sizeof(uint64_t));
+			dcache.sym_misses = calloc(n_symbols + 1, sizeof(uint64_t));
+		}
+		if (icache.size || dcache.size)
+			atexit(cache_report);
+		if (sd_file){
+			if (sd_open(sd_file)){
+				printf("\nerror opening SD card image %s (512KB at least).\n", sd_file);
+				return 1;
+			}
+			atexit(sd_report);
+		}
 	}else{
-		printf("\nsyntax: hf_risc_sim [file.bin] [logfile.txt]\n");
+		printf("\nsyntax: hf_risc_sim [file.bin | -r checkpoint] [logfile.txt] [-s cycle checkpoint] [-p file.elf]\n");
+		printf("         [-ic size,ways,line,penalty] [-dc size,ways,line,penalty] [-sd image]\n");
 		return 1;
 	}
 
-	memset(s, 0, sizeof(context));
-	s->pc = SRAM_BASE;
-	s->pc_next = s->pc + 4;
-	s->mem = &sram[0];
-	s->r[2] = MEM_SIZE - 4;
-	s->exception = 0;
+	if (!restore){
+		memset(s, 0, sizeof(context));
+		s->pc = SRAM_BASE;
+		s->pc_next = s->pc + 4;
+		s->mem = &sram[0];
+		s->r[2] = MEM_SIZE - 4;
+		s->exception = 0;
+	}
+	register_devices();
 
 	for(;;){
+		if (s->cycles >= checkpoint){
+			checkpoint_save(s, checkpoint_file);
+			checkpoint = -1;
+		}
 		if (s->timer0 & 0x80000) {
 			s->pain |= 0x8;
 		} else {
 			s->pain &= ~0x8;
 		}
+		pc = s->pc;
 		cycle(s);
+		if (s->pc == pc)
+			idle_skip(s, checkpoint);
 	}
 
 	return 0;
 }
-
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include "noc.h"
 
 /*
@@ -9,8 +11,11 @@
 */
 
 #define MAX_N_CORES			257		// max number of cores + 1
-#define MEM_SIZE			(1024*1024)
-#define CPU_NETWORK_CLK_RATIO		10		// freq ratio between cpus and interconnect. 
+#define MEM_SIZE			(1024*1024)	// default memory per core
+#define CPU_NETWORK_CLK_RATIO		10		// default freq ratio between cpus and interconnect. 
+#define NOC_BUFFER_SIZE			16		// default depth of router buffers (in flits)
+#define MAX_THREADS			64		// max number of host threads
+#define DECODE_CACHE_SIZE		8192		// predecoded instructions per core (power of 2)
 
 #define RAM_INTERNAL_BASE		0x00000000
 #define RAM_EXTERNAL_BASE		0x10000000
@@ -32,6 +37,9 @@
 #define OUT_FACILITY			0x200000D0	/* not implemented yet */
 #define LOG_FACILITY			0x200000E0
 #define EXIT_TRAP			0x200000F0
+#define NOC_WIN_BASE			0x20000100	/*RDMA WINDOW BASE*/
+#define NOC_WIN_SIZE			0x20000110	/*RDMA WINDOW SIZE*/
+#define NOC_WIN_CTRL			0x20000120	/*RDMA WINDOW CONTROL / NUMBER OF WINDOWS*/
 
 #define IRQ_UART_READ_AVAILABLE		0x01
 #define IRQ_UART_WRITE_AVAILABLE	0x02
@@ -143,16 +151,22 @@ static char *class_shift[]={
 unsigned char is_sending[MAX_N_CORES]; // necessary to synchronize with noc simulator 
 unsigned char is_reading[MAX_N_CORES];
 int flits_remaining[MAX_N_CORES]; 
-extern Router *routers;
-extern NetworkInterface *network_interfaces;
-extern Core *cores;
 
 unsigned int reference_clock=25000000;
+pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;	// reference_clock and max_cycles are shared by all cores
 static int n_cores=0;
 static int big_endian=1;
 
+/*
+the platform is configured on the command line: size of the network, depth of router buffers,
+clock ratio between cpus and interconnect and memory per core. memory is allocated only for the
+cores that have object codes (or that were saved on a checkpoint).
+*/
+static unsigned int mem_size = MEM_SIZE;
+static int clk_ratio = CPU_NETWORK_CLK_RATIO;
+
 unsigned int HWMemory[5][MAX_N_CORES];
-unsigned char SRAM[MEM_SIZE*MAX_N_CORES];
+unsigned char *SRAM;
 unsigned int GPIOAIN[MAX_N_CORES];
 unsigned int GPIO0OUT[MAX_N_CORES];
 
@@ -423,29 +437,99 @@ static int show_mpsoc_stats(unsigned char *output){
 	fprintf(rpt_ptr, "\n\nBroadcasts: %ld",k);
 	for(j=0;j<n_cores;j++)
 		fprintf(rpt_ptr, "\n    core %d: %ld",j, flits_received[j]);
+#ifndef BUS
+	fprintf(rpt_ptr, "\n\nHigh priority packets routed:");
+	for(j=0;j<noc_cores;j++)
+		fprintf(rpt_ptr, "\n    router %d: %d",j, getRouter(j)->high_priority);
+#else
+	fprintf(rpt_ptr, "\n\nHigh priority packets routed: %d", getRouter(0)->high_priority);
+#endif
+	fprintf(rpt_ptr, "\n\nRDMA requests served by the NI (put / get):");
+	for(j=0;j<n_cores;j++)
+		fprintf(rpt_ptr, "\n    core %d: %d / %d",j, getNetworkInterface(j)->rdma_puts, getNetworkInterface(j)->rdma_gets);
+	// routers run once every clk_ratio cycles
+	if (cycles / clk_ratio > 0){
+		double net_cycles = (double)(cycles / clk_ratio);
+		Router *router;
+#ifndef BUS
+		fprintf(rpt_ptr, "\n\nLink utilization (flits per network cycle, east / west / north / south / local):");
+		for(j=0;j<noc_cores;j++){
+			router = getRouter(j);
+			fprintf(rpt_ptr, "\n    router %d: %.3f / %.3f / %.3f / %.3f / %.3f",j, router->flits[EAST] / net_cycles, router->flits[WEST] / net_cycles,
+				router->flits[NORTH] / net_cycles, router->flits[SOUTH] / net_cycles, router->flits[LOCAL] / net_cycles);
+		}
+#else
+		router = getRouter(0);
+		k = 0;
+		for(j=0;j<noc_cores;j++)
+			k += router->flits[j];
+		fprintf(rpt_ptr, "\n\nBus utilization (flits per network cycle): %.3f", k / net_cycles);
+		for(j=0;j<noc_cores;j++)
+			fprintf(rpt_ptr, "\n    port %d: %.3f",j, router->flits[j] / net_cycles);
+#endif
+	}
 	fprintf(rpt_ptr, "\n");
 
 	fclose(rpt_ptr);	
 }
 	
 
-static int mem_read(State *s, int size, unsigned int address, int cpu_n){
-	unsigned int value=0;
-	unsigned int *ptr;
-	
-	Core *core;
-	NetworkInterface *ni;
-	Buffer *buffer;
-	Port *port;
+/*
+memory mapped devices. each device registers the address range it decodes and handlers for
+its registers. RAM accesses (below MISC_BASE) use the memory array directly, and only
+accesses to the I/O space are dispatched to the region table. addresses not claimed by a
+device (or with no handler for the access) fall back to RAM.
+*/
+#define MAX_REGIONS			16
+
+typedef struct {
+	unsigned int base, size;
+	unsigned int (*read)(State *s, int size, unsigned int address, int cpu_n);
+	void (*write)(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n);
+} Region;
+
+static Region regions[MAX_REGIONS];
+static int n_regions = 0;
+
+static void register_region(unsigned int base, unsigned int size,
+	unsigned int (*read)(State *s, int size, unsigned int address, int cpu_n),
+	void (*write)(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n)){
 
+	if (n_regions == MAX_REGIONS){
+		printf("\nToo many memory regions");
+		exit(1);
+	}
+	regions[n_regions].base = base;
+	regions[n_regions].size = size;
+	regions[n_regions].read = read;
+	regions[n_regions].write = write;
+	n_regions++;
+}
+
+static Region *find_region(unsigned int address){
+	int i;
+
+	for (i = 0; i < n_regions; i++)
+		if (address - regions[i].base < regions[i].size)
+			return &regions[i];
+
+	return NULL;
+}
+
+static unsigned int uart_read(State *s, int size, unsigned int address, int cpu_n){
+//	if(kbhit())
+//	HWMemory[0] = getchar();
+	HWMemory[2][cpu_n] &= ~IRQ_UART_READ_AVAILABLE; //clear bit
+	return HWMemory[0][cpu_n];
+}
+
+static void uart_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	HWMemory[2][cpu_n] &= ~IRQ_UART_WRITE_AVAILABLE;
+	putc(value, std_out);
+}
+
+static unsigned int irq_read(State *s, int size, unsigned int address, int cpu_n){
 	switch(address){
-		case UART_READ:
-//			if(kbhit())
-//			HWMemory[0] = getchar();
-			HWMemory[2][cpu_n] &= ~IRQ_UART_READ_AVAILABLE; //clear bit
-			return HWMemory[0][cpu_n];
-		case GPIOA_IN:
-			return GPIOAIN[cpu_n];
 		case IRQ_MASK:
 			return HWMemory[1][cpu_n];
 		case IRQ_MASK + 4:
@@ -455,8 +539,49 @@ static int mem_read(State *s, int size, unsigned int address, int cpu_n){
 //			if(kbhit())
 //				HWMemory[2][cpu_n] |= IRQ_UART_READ_AVAILABLE;
 			return HWMemory[2][cpu_n];
-		case COUNTER_REG:
-			return (unsigned int)cpu_cycles[cpu_n];
+	}
+
+	return 0;
+}
+
+static void irq_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	switch(address){
+		case IRQ_MASK:
+			HWMemory[1][cpu_n] = value;
+			return;
+		case IRQ_STATUS:
+//			HWMemory[2][cpu_n] = value;
+			return;
+	}
+}
+
+static unsigned int gpio_read(State *s, int size, unsigned int address, int cpu_n){
+	switch(address){
+		case GPIO0_OUT:
+			return GPIO0OUT[cpu_n];
+		case GPIOA_IN:
+			return GPIOAIN[cpu_n];
+	}
+
+	return 0;
+}
+
+static void gpio_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	if (address == GPIO0_OUT)
+		GPIO0OUT[cpu_n] = value;
+}
+
+static unsigned int counter_read(State *s, int size, unsigned int address, int cpu_n){
+	return (unsigned int)cpu_cycles[cpu_n];
+}
+
+static unsigned int noc_read(State *s, int size, unsigned int address, int cpu_n){
+	Core *core;
+	NetworkInterface *ni;
+	Buffer *buffer;
+	Port *port;
+
+	switch(address){
 		case NOC_READ:
 
 			if(HWMemory[2][cpu_n] & IRQ_NOC_READ)
@@ -486,77 +611,69 @@ static int mem_read(State *s, int size, unsigned int address, int cpu_n){
 			ni = getNetworkInterface(cpu_n);
 			buffer = getBuffer(ni, PLASMA);
 			return isEmpty(buffer);
-
-		case FREQUENCY_REG:
-			return HWMemory[3][cpu_n];
-		case TICK_TIME_REG:
-			return HWMemory[4][cpu_n];
-		case LOG_FACILITY:
-			return 0xa5a5a5a5;
-	}
-
-	ptr = (unsigned int *)(s->mem + (address % MEM_SIZE));
-
-	switch(size){
-		case 4:
-			if(address & 3){
-				printf("\nUnaligned access PC=0x%x data=0x%x :(", s->pc, address);
-				fflush(stdout);
-			}
-			value = *(int*)ptr;
-			if(big_endian)
-				value = ntohl(value);
-			break;
-		case 2:
-			value = *(unsigned short*)ptr;
-			if(big_endian)
-				value = ntohs((unsigned short)value);
-			break;
-		case 1:
-			value = *(unsigned char*)ptr;
-			break;
-		default:
-			printf("ERROR");
-			fflush(stdout);
 	}
 
-	return(value);
+	return 0;
 }
 
-static void mem_write(State *s, int size, int unsigned address, unsigned int value, FILE *std_out, int cpu_n){
-	static int char_count=0;
-	unsigned int *ptr;
-	
+static void noc_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
 	Core *core;
 	Port *port;	
 
+	if (address == NOC_WRITE){
+		core = getCore(cpu_n);
+		port = &(core->port);
+		is_sending[cpu_n] = ON;
+		port->out = value;
+		port->out_request = ON;
+		port->out_ack = OFF;			
+	}
+}
+
+static unsigned int window_read(State *s, int size, unsigned int address, int cpu_n){
 	switch(address){
-		case UART_WRITE:
-			HWMemory[2][cpu_n] &= ~IRQ_UART_WRITE_AVAILABLE;
-			putc(value, std_out);
-			return;
-		case GPIO0_OUT:
-			GPIO0OUT[cpu_n] = value;
-			return;
-		case IRQ_MASK:
-			HWMemory[1][cpu_n] = value;
+		case NOC_WIN_BASE:
+			return getNetworkInterface(cpu_n)->win_base;
+		case NOC_WIN_SIZE:
+			return getNetworkInterface(cpu_n)->win_size;
+		case NOC_WIN_CTRL:
+			return NI_WINDOWS;
+	}
+
+	return 0;
+}
+
+static void window_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	switch(address){
+		case NOC_WIN_BASE:
+			getNetworkInterface(cpu_n)->win_base = value;
 			return;
-		case IRQ_STATUS:
-//			HWMemory[2][cpu_n] = value;
+		case NOC_WIN_SIZE:
+			getNetworkInterface(cpu_n)->win_size = value;
 			return;
-		case NOC_WRITE:
-			
-			core = getCore(cpu_n);
-			port = &(core->port);
-			is_sending[cpu_n] = ON;
-			port->out = value;
-			port->out_request = ON;
-			port->out_ack = OFF;			
+		case NOC_WIN_CTRL:
+			windowNetworkInterface(cpu_n, value);
 			return;
-			
+	}
+}
+
+static unsigned int clock_read(State *s, int size, unsigned int address, int cpu_n){
+	switch(address){
+		case FREQUENCY_REG:
+			return HWMemory[3][cpu_n];
+		case TICK_TIME_REG:
+			return HWMemory[4][cpu_n];
+	}
+
+	return 0;
+}
+
+static void clock_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	switch(address){
 		case FREQUENCY_REG:
 			if ((value == 25000000) || (value == 33333333) || (value == 50000000) || (value == 66666666) || (value == 100000000)){
 				HWMemory[3][cpu_n] = value;
+				pthread_mutex_lock(&clock_lock);
 				switch (sim_metric){
 					case 'c':
 							break;
@@ -579,6 +696,7 @@ static void mem_write(State *s, int size, int unsigned address, unsigned int val
 							break;
 				}
 				reference_clock = value;
+				pthread_mutex_unlock(&clock_lock);
 				printf("\nClock frequency reconfigured for %d MHz on core %d", (value/1000000), cpu_n);
 				fflush(stdout);
 			}else{
@@ -590,6 +708,11 @@ static void mem_write(State *s, int size, int unsigned address, unsigned int val
 //			HWMemory[2][cpu_n] |= IRQ_COUNTER18_NOT;
 			HWMemory[4][cpu_n] = value;
 			return;
+	}
+}
+
+static void facility_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	switch(address){
 		case OUT_FACILITY:
  			fprintf(out_out[cpu_n], "%c", value);
  			return;
@@ -608,14 +731,86 @@ static void mem_write(State *s, int size, int unsigned address, unsigned int val
 				}
 			}
 			return;
-		case EXIT_TRAP:
-			printf("[BP, CPU %d]", cpu_n);
+	}
+}
+
+static void exit_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	printf("[BP, CPU %d]", cpu_n);
+	fflush(stdout);
+	brkpt[cpu_n] = 1;
+}
+
+static unsigned int facility_read(State *s, int size, unsigned int address, int cpu_n){
+	if (address == LOG_FACILITY)
+		return 0xa5a5a5a5;
+
+	return 0;
+}
+
+static void register_devices(void){
+	register_region(UART_WRITE, 0x10, uart_read, uart_write);
+	register_region(IRQ_MASK, 0x20, irq_read, irq_write);
+	register_region(GPIO0_OUT, 0x30, gpio_read, gpio_write);
+	register_region(COUNTER_REG, 0x10, counter_read, NULL);
+	register_region(NOC_READ, 0x30, noc_read, noc_write);
+	register_region(FREQUENCY_REG, 0x20, clock_read, clock_write);
+	register_region(ENERGY_MONITOR, 0x30, facility_read, facility_write);
+	register_region(EXIT_TRAP, 0x10, NULL, exit_write);
+	register_region(NOC_WIN_BASE, 0x30, window_read, window_write);
+}
+
+static int mem_read(State *s, int size, unsigned int address, int cpu_n){
+	unsigned int value=0;
+	unsigned int *ptr;
+	Region *r;
+
+	if (address >= MISC_BASE){
+		r = find_region(address);
+		if (r && r->read)
+			return r->read(s, size, address, cpu_n);
+	}
+
+	ptr = (unsigned int *)(s->mem + (address & (mem_size - 1)));
+
+	switch(size){
+		case 4:
+			if(address & 3){
+				printf("\nUnaligned access PC=0x%x data=0x%x :(", s->pc, address);
+				fflush(stdout);
+			}
+			value = *(int*)ptr;
+			if(big_endian)
+				value = ntohl(value);
+			break;
+		case 2:
+			value = *(unsigned short*)ptr;
+			if(big_endian)
+				value = ntohs((unsigned short)value);
+			break;
+		case 1:
+			value = *(unsigned char*)ptr;
+			break;
+		default:
+			printf("ERROR");
 			fflush(stdout);
-			brkpt[cpu_n] = 1;
+	}
+
+	return(value);
+}
+
+static void mem_write(State *s, int size, unsigned int address, unsigned int value, FILE *std_out, int cpu_n){
+	unsigned int *ptr;
+	Region *r;
+
+	if (address >= MISC_BASE){
+		r = find_region(address);
+		if (r && r->write){
+			r->write(s, size, address, value, std_out, cpu_n);
 			return;
+		}
 	}
 
-	ptr = (unsigned int *)(s->mem + (address % MEM_SIZE));
+	ptr = (unsigned int *)(s->mem + (address & (mem_size - 1)));
 
 	switch(size){
 		case 4:
@@ -683,9 +878,51 @@ void mult_big_signed(int a, int b, unsigned int *hi, unsigned int *lo){
 	*lo = c0;
 }
 
+/*
+	PREDECODED INSTRUCTIONS
+
+	Each core has a direct mapped table of decoded instructions. Entries hold the instruction they
+	were decoded from, so instructions changed by stores (or by the network interface) are decoded
+	again on the next fetch.
+*/
+typedef struct {
+	unsigned int opcode;
+	unsigned char valid, op, rs, rt, rd, re, func;
+	unsigned int imm, target;
+	int imm_shift;
+} Decoded;
+
+Decoded (*predecoded)[DECODE_CACHE_SIZE];
+
+// instructions are fetched from memory, with no access to memory mapped registers
+static unsigned int mem_fetch(State *s, unsigned int address){
+	unsigned int value;
+
+	value = *(unsigned int *)(s->mem + (address & (mem_size - 1)));
+	if(big_endian)
+		value = ntohl(value);
+
+	return value;
+}
+
+static void decode(Decoded *d, unsigned int opcode){
+	d->opcode = opcode;
+	d->valid = 1;
+	d->op = (opcode >> 26) & 0x3f;
+	d->rs = (opcode >> 21) & 0x1f;
+	d->rt = (opcode >> 16) & 0x1f;
+	d->rd = (opcode >> 11) & 0x1f;
+	d->re = (opcode >> 6) & 0x1f;
+	d->func = opcode & 0x3f;
+	d->imm = opcode & 0xffff;
+	d->imm_shift = (((int)(short)d->imm) << 2) - 4;
+	d->target = (opcode << 6) >> 4;
+}
+
 //execute one cycle of a Plasma CPU
 void cycle(State *s, int show_mode, int cpu_n, FILE *std_out, int *pause_cycles, int *irq){
 	unsigned int opcode;
+	Decoded *d;
 	unsigned int op, rs, rt, rd, re, func, imm, target;
 	int imm_shift, branch=0, lbranch=2;
 	int *r=s->r;
@@ -705,16 +942,19 @@ void cycle(State *s, int show_mode, int cpu_n, FILE *std_out, int *pause_cycles,
 		}
 	}
 
-	opcode = mem_read(s, 4, s->pc, cpu_n);
-	op = (opcode >> 26) & 0x3f;
-	rs = (opcode >> 21) & 0x1f;
-	rt = (opcode >> 16) & 0x1f;
-	rd = (opcode >> 11) & 0x1f;
-	re = (opcode >> 6) & 0x1f;
-	func = opcode & 0x3f;
-	imm = opcode & 0xffff;
-	imm_shift = (((int)(short)imm) << 2) - 4;
-	target = (opcode << 6) >> 4;
+	opcode = mem_fetch(s, s->pc);
+	d = &predecoded[cpu_n][(s->pc >> 2) & (DECODE_CACHE_SIZE - 1)];
+	if (d->opcode != opcode || !d->valid)
+		decode(d, opcode);
+	op = d->op;
+	rs = d->rs;
+	rt = d->rt;
+	rd = d->rd;
+	re = d->re;
+	func = d->func;
+	imm = d->imm;
+	imm_shift = d->imm_shift;
+	target = d->target;
 	ptr = (short)imm + r[rs];
 	r[0] = 0;
 	if(show_mode){
@@ -1122,87 +1362,420 @@ void cycle(State *s, int show_mode, int cpu_n, FILE *std_out, int *pause_cycles,
 	}
 }
 
-int do_debug(State *s[], FILE *std_out[]){
-	int ch;
-	unsigned char mem;
-	int i, j=0, watch=0, addr, k=0, l, m, n[MAX_N_CORES];
-	int pause_cpu[MAX_N_CORES];
-	int irq_counter[MAX_N_CORES];
-	char report_string[]= "./reports/report\0\0\0\0\0\0\0\0\0\0";
-	unsigned long long gcycles = 0;
+/*
+	PARALLEL SIMULATION
 
+	The mesh is partitioned in tiles (bands of rows of the mesh, or groups of cores on a bus), each
+	one simulated by a host thread. Cores, network interfaces and routers of a tile are touched only
+	by its thread. Links between routers change state only on router cycles (every
+	clk_ratio cycles), so tiles are synchronized by a barrier before router cycles and
+	another one before links are synchronized, and results are the same of a sequential simulation.
+*/
+typedef struct {
+	int first;
+	int last;
+	State **s;
+	FILE **std_out;
+	pthread_t thread;
+} Tile;
+
+static int n_threads = 1;
+static Tile tiles[MAX_THREADS];
+static int pause_cpu[MAX_N_CORES];
+static int irq_counter[MAX_N_CORES];
+static int finished[MAX_N_CORES];
+static int barrier_count = 0, barrier_sense = 0, sim_done = 0;
+
+/*
+	IDLE SKIPPING
+
+	A core on the idle loop (a branch to itself, with a nop on the delay slot) does nothing but
+	spend cycles. When all cores are on the idle loop and the network is idle, nothing happens
+	until the next timer tick (or the end of the simulation), so cores and routers are advanced
+	at once up to the cycle before it. Instruction counters and energy estimation are updated as
+	if the loop was executed, so reports are the same. This is done by the last thread to reach
+	the barrier before router cycles, while other threads are waiting.
+*/
+static unsigned long long idle_skipped = 0;
+static unsigned long long checkpoint_cycle = -1;
+
+// returns the opcode of the idle loop branch, or zero if the core is not on the idle loop
+static int idle_loop(State *s){
+	unsigned int pc, opcode;
+
+	if (s->skip || s->no_execute_branch_delay_slot || s->exceptionId)
+		return 0;
+	if (s->pc_next == s->pc + 4)
+		pc = s->pc;
+	else if (s->pc_next + 4 == s->pc)
+		pc = s->pc_next;
+	else
+		return 0;
+	if (mem_fetch(s, pc + 4) != 0)
+		return 0;
+
+	opcode = mem_fetch(s, pc);
+	if ((opcode >> 26) == 0x04 && ((opcode >> 21) & 0x1f) == ((opcode >> 16) & 0x1f) && (opcode & 0xffff) == 0xffff)
+		return 0x04;	// b .
+	if ((opcode >> 26) == 0x02 && (((pc + 4) & 0xf0000000) | ((opcode << 6) >> 4)) == pc)
+		return 0x02;	// j .
+
+	return 0;
+}
+
+// cycles that can be skipped (a multiple of the loop length and of the network clock ratio), not
+// going past the checkpoint
+static unsigned long long idle_cycles(State *s[], unsigned long long gcycles){
+	unsigned long long n = -1, c, d, tick;
+	int j, active = 0;
+
+	for(j=0;j<n_cores;j++){
+		if (brkpt[j]) continue;
+		if (pause_cpu[j] || irq_counter[j] || is_sending[j] == ON || !idle_loop(s[j]))
+			return 0;
+		if (!(HWMemory[2][j] & IRQ_UART_WRITE_AVAILABLE))
+			return 0;
+
+		c = cpu_cycles[j];
+		if (c >= max_cycles)
+			return 0;
+		if (max_cycles - c < n)
+			n = max_cycles - c;
+
+		// timer ticks happen when the low bits of the cycle counter are all set
+		tick = HWMemory[4][j];
+		if (tick){
+			if (tick & (tick - 1))
+				return 0;
+			d = (c | (tick - 1)) - c;
+			if (d == 0)
+				d = tick;
+			if (d - 1 < n)
+				n = d - 1;
+		}
+		active++;
+	}
+	if (!active || !idleNetwork())
+		return 0;
+	if (gcycles <= checkpoint_cycle && checkpoint_cycle - gcycles < n)
+		n = checkpoint_cycle - gcycles;
+
+	return n - n % (2 * clk_ratio);
+}
+
+static void idle_skip(State *s[], unsigned long long n){
+	int j, op;
+
+	for(j=0;j<n_cores;j++){
+		if (brkpt[j]) continue;
+		op = idle_loop(s[j]);
+		ins_counter_op[op][j] += n / 2;
+		est_energy[j] += (n / 2) * ENERGY_PER_CYCLE_BRANCH_JUMP;
+		cpu_cycles[j] += n;
+	}
+#ifndef BUS
+	for(j=0;j<noc_cores;j++)
+		idleRouter(j, n / clk_ratio);
+#else
+	idleRouter(0, n / clk_ratio);
+#endif
+}
+
+// the last thread to reach the barrier checks if all cores are done (and if cycles can be skipped
+// from gcycles, on the barrier before router cycles) before releasing the others
+static void barrier(int *sense, unsigned long long *gcycles){
+	int i;
+
+	*sense = !*sense;
+	if (__atomic_add_fetch(&barrier_count, 1, __ATOMIC_ACQ_REL) == n_threads){
+		barrier_count = 0;
+		for(i=0;i<n_cores;i++)
+			if (finished[i] == 0) break;
+		sim_done = (i == n_cores);
+		if (gcycles){
+			idle_skipped = sim_done ? 0 : idle_cycles(tiles[0].s, *gcycles);
+			if (idle_skipped)
+				idle_skip(tiles[0].s, idle_skipped);
+		}
+		__atomic_store_n(&barrier_sense, *sense, __ATOMIC_RELEASE);
+	}else{
+		for(i=0;__atomic_load_n(&barrier_sense, __ATOMIC_ACQUIRE) != *sense;i++)
+			if (i > 1000) sched_yield();
+	}
+}
+
+/*
+	CHECKPOINTS
+
+	The state of the whole platform (cores, memory, memory mapped registers, statistics, routers
+	and network interfaces) is saved on a cycle given on the command line, and a simulation can be
+	started from a saved checkpoint instead of object codes. The checkpoint is taken at the start
+	of a cycle, between barriers, so it does not depend on the number of threads. Memory is saved
+	in pages, and pages with only zeros are skipped. Predecoded instructions are not saved, and
+	are decoded again after a restore. The configuration of the platform is taken from the
+	checkpoint, so options given with -r are ignored.
+*/
+#define CHECKPOINT_MAGIC		0x4d50434b	// "MPCK"
+#define CHECKPOINT_VERSION		3
+#define CHECKPOINT_PAGE			4096
+
+typedef struct {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int n_cores, noc_width, noc_height, noc_cores, buffer_size, mem_size, clk_ratio;
+	unsigned int routing, torus, routing_delay, routersize, packet_size, state_size, router_size, ni_size;
+} CheckpointHeader;
+
+static char *checkpoint_file = NULL, *restore_file = NULL;
+static unsigned long long start_cycle = 0;
+
+static void checkpoint_header(CheckpointHeader *h){
+	memset(h, 0, sizeof(CheckpointHeader));
+	h->magic = CHECKPOINT_MAGIC;
+	h->version = CHECKPOINT_VERSION;
+	h->n_cores = n_cores;
+	h->noc_width = noc_width;
+	h->noc_height = noc_height;
+	h->noc_cores = noc_cores;
+	h->buffer_size = noc_buffer_size;
+	h->mem_size = mem_size;
+	h->clk_ratio = clk_ratio;
+	h->routing = noc_routing;
+	h->torus = noc_torus;
+	h->routing_delay = noc_routing_delay;
+	h->routersize = ROUTERSIZE;
+	h->packet_size = OS_PACKET_SIZE;
+	h->state_size = sizeof(State);
+	h->router_size = sizeof(Router);
+	h->ni_size = sizeof(NetworkInterface);
+}
+
+// reads or writes n elements of a per core array
+static int checkpoint_io(FILE *f, void *p, size_t size, size_t n, int save){
+	if (save)
+		return fwrite(p, size, n, f) == n ? 0 : -1;
+	else
+		return fread(p, size, n, f) == n ? 0 : -1;
+}
+
+// everything but memory and the network, in the same order for saving and restoring
+static int checkpoint_data(FILE *f, State *s[], unsigned long long *cycle, int save){
+	int i, j, err = 0;
+	unsigned char *mem;
+
+	err |= checkpoint_io(f, cycle, sizeof(unsigned long long), 1, save);
+	err |= checkpoint_io(f, &reference_clock, sizeof(unsigned int), 1, save);
+	err |= checkpoint_io(f, &bus_est_energy, sizeof(double), 1, save);
+	for(j=0;j<n_cores;j++){
+		mem = s[j]->mem;
+		err |= checkpoint_io(f, s[j], sizeof(State), 1, save);
+		s[j]->mem = mem;
+	}
+	for(i=0;i<5;i++)
+		err |= checkpoint_io(f, HWMemory[i], sizeof(unsigned int), n_cores, save);
+	for(i=0;i<0x40;i++){
+		err |= checkpoint_io(f, ins_counter_op[i], sizeof(unsigned int), n_cores, save);
+		err |= checkpoint_io(f, ins_counter_func[i], sizeof(unsigned int), n_cores, save);
+		err |= checkpoint_io(f, ins_counter_rt[i], sizeof(unsigned int), n_cores, save);
+	}
+	for(i=0;i<6;i++)
+		err |= checkpoint_io(f, ins_class_counter[i], sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, is_sending, sizeof(unsigned char), n_cores, save);
+	err |= checkpoint_io(f, is_reading, sizeof(unsigned char), n_cores, save);
+	err |= checkpoint_io(f, flits_remaining, sizeof(int), n_cores, save);
+	err |= checkpoint_io(f, GPIOAIN, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, GPIO0OUT, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, cpu_cycles, sizeof(unsigned long long), n_cores, save);
+	err |= checkpoint_io(f, uart_delay, sizeof(int), n_cores, save);
+	err |= checkpoint_io(f, est_energy, sizeof(double), n_cores, save);
+	err |= checkpoint_io(f, ins_counter, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, io_counter, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, brkpt, sizeof(unsigned char), n_cores, save);
+	err |= checkpoint_io(f, flits_sent, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, flits_received, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, broadcasts, sizeof(unsigned int), n_cores, save);
+	err |= checkpoint_io(f, pause_cpu, sizeof(int), n_cores, save);
+	err |= checkpoint_io(f, irq_counter, sizeof(int), n_cores, save);
+
+	return err;
+}
+
+static void checkpoint_save(State *s[], unsigned long long cycle){
+	FILE *f;
+	CheckpointHeader h;
+	unsigned int i, k, end = -1;
+	unsigned char *page;
+
+	f = fopen(checkpoint_file, "wb");
+	if (f == NULL){
+		printf("\nCould not open checkpoint file %s for writing.\n", checkpoint_file);
+		fflush(stdout);
+		return;
+	}
+	checkpoint_header(&h);
+	fwrite(&h, sizeof(CheckpointHeader), 1, f);
+	checkpoint_data(f, s, &cycle, 1);
+	for(i=0;i<n_cores;i++){
+		for(k=0;k<mem_size/CHECKPOINT_PAGE;k++){
+			page = &SRAM[i*mem_size+k*CHECKPOINT_PAGE];
+			if (page[0] == 0 && memcmp(page, page + 1, CHECKPOINT_PAGE - 1) == 0)
+				continue;
+			fwrite(&k, sizeof(unsigned int), 1, f);
+			fwrite(page, 1, CHECKPOINT_PAGE, f);
+		}
+		fwrite(&end, sizeof(unsigned int), 1, f);
+	}
+	save_architecture(f);
+	fclose(f);
+
+	printf("\nCheckpoint saved to %s (cycle %llu).", checkpoint_file, cycle);
+	fflush(stdout);
+}
+
+// reads the header of a checkpoint, and configures the platform as it was saved
+static FILE *checkpoint_open(void){
+	FILE *f;
+	CheckpointHeader h, expected;
+
+	f = fopen(restore_file, "rb");
+	if (f == NULL){
+		printf("\nCould not open checkpoint file %s.\n", restore_file);
+		fflush(stdout);
+		return NULL;
+	}
+	if (fread(&h, sizeof(CheckpointHeader), 1, f) != 1)
+		h.magic = 0;
+	n_cores = h.n_cores;
+	noc_width = h.noc_width;
+	noc_height = h.noc_height;
+	noc_cores = h.noc_cores;
+	noc_buffer_size = h.buffer_size;
+	mem_size = h.mem_size;
+	clk_ratio = h.clk_ratio;
+	noc_routing = h.routing;
+	noc_torus = h.torus;
+	noc_routing_delay = h.routing_delay;
+	checkpoint_header(&expected);
+	if (memcmp(&h, &expected, sizeof(CheckpointHeader))){
+		printf("\nCheckpoint %s was not saved by this simulator.\n", restore_file);
+		fflush(stdout);
+		fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+static int checkpoint_restore(FILE *f, State *s[]){
+	unsigned int i, k;
+	int err = 0;
+
+	for(i=0;i<n_cores;i++)
+		s[i]->mem = &SRAM[i*mem_size];
+	err = checkpoint_data(f, s, &start_cycle, 0);
+	for(i=0;i<n_cores && !err;i++){
+		while (!(err = (fread(&k, sizeof(unsigned int), 1, f) != 1)) && k != -1){
+			if (k >= mem_size/CHECKPOINT_PAGE || fread(&SRAM[i*mem_size+k*CHECKPOINT_PAGE], 1, CHECKPOINT_PAGE, f) != CHECKPOINT_PAGE){
+				err = 1;
+				break;
+			}
+		}
+	}
+	if (!err)
+		err = restore_architecture(f);
+	fclose(f);
+	if (err){
+		printf("\nCheckpoint %s is corrupted.\n", restore_file);
+		fflush(stdout);
+		return -1;
+	}
+
+	printf("\nCheckpoint restored from %s (cycle %llu).", restore_file, start_cycle);
+	fflush(stdout);
+
+	return 0;
+}
+
+static void step_devices(State *s[], int j){
 	Core *core;
 	NetworkInterface *ni;
 	Buffer *buffer;
 	Port *port;
 
-	for(j=0;j<MAX_N_CORES;j++){
-		l = -1;
-		m = -1;
-		n[j] = 0;
-		pause_cpu[j] = 0;
-		irq_counter[j] = 0;
+	if ((cpu_cycles[j] & ((long long)HWMemory[4][j] - 1)) == ((long long)HWMemory[4][j] - 1)){
+		if (HWMemory[1][j] & (IRQ_COUNTER18 | IRQ_COUNTER18_NOT)){
+//		if ((HWMemory[1][j] & (IRQ_COUNTER18 | IRQ_COUNTER18_NOT)) && ((HWMemory[2][j] & IRQ_NOC_READ) == 0) ){
+			if(s[j]->status == 1) irq_counter[j] = 1;
+		}
+		if (HWMemory[2][j] & IRQ_COUNTER18){
+			HWMemory[2][j] &= ~IRQ_COUNTER18;
+			HWMemory[2][j] |= IRQ_COUNTER18_NOT;
+		}else{
+			HWMemory[2][j] &= ~IRQ_COUNTER18_NOT;
+			HWMemory[2][j] |= IRQ_COUNTER18;
+		}
 	}
 
-	for(j=0;j<n_cores;j++){
-		s[j]->pc_next = s[j]->pc + 4;
-		s[j]->skip = 0;
-		s[j]->wakeup = 0;
-		cycle(s[j], 0, j, std_out[j], &pause_cpu[j], &irq_counter[j]);
+	if ((!(HWMemory[2][j] & IRQ_UART_WRITE_AVAILABLE)) && (uart_delay[j]) > 0){
+		uart_delay[j]--;
+		io_counter[j]++;
+	}else{
+		uart_delay[j] = UART_DELAY;
+		HWMemory[2][j] |= IRQ_UART_WRITE_AVAILABLE;
 	}
 
-	while(1){
-		for(j=0;j<n_cores;j++){
-			if (brkpt[j] == 0){
-				if ((cpu_cycles[j] & ((long long)HWMemory[4][j] - 1)) == ((long long)HWMemory[4][j] - 1)){
-					if (HWMemory[1][j] & (IRQ_COUNTER18 | IRQ_COUNTER18_NOT)){
-//					if ((HWMemory[1][j] & (IRQ_COUNTER18 | IRQ_COUNTER18_NOT)) && ((HWMemory[2][j] & IRQ_NOC_READ) == 0) ){
-						if(s[j]->status == 1) irq_counter[j] = 1;
-					}
-					if (HWMemory[2][j] & IRQ_COUNTER18){
-						HWMemory[2][j] &= ~IRQ_COUNTER18;
-						HWMemory[2][j] |= IRQ_COUNTER18_NOT;
-					}else{
-						HWMemory[2][j] &= ~IRQ_COUNTER18_NOT;
-						HWMemory[2][j] |= IRQ_COUNTER18;
-					}
-				}
+	core = getCore(j);
+	port = &(core->port);
+	ni = getNetworkInterface(j);
+	buffer = getBuffer(ni, NOC);
+	if(isFull(buffer) && port->in_request == ON && flits_remaining[j] == 0 )//&& irq_counter[j] == 0)
+	// to create a noc interrupt the buffer need to be full and requesing to send the first flit,
+	// there also can't be any thing on the idle buffer and a clock interrupt can't be generated at the same cycle
+	{
+		if(HWMemory[1][j] & IRQ_NOC_READ)
+		// não mascarada					
+		{
+			if(s[j]->status == 1)
+			// interrupções habilitadas
+			{
+				flits_remaining[j] = OS_PACKET_SIZE+1;
+//				irq_counter[j] = 1;
+				irq_counter[j] = 2;
+				HWMemory[2][j] |= IRQ_NOC_READ;
+			}
+		}
+	}
+}
 
-				if ((!(HWMemory[2][j] & IRQ_UART_WRITE_AVAILABLE)) && (uart_delay[j]) > 0){
-					uart_delay[j]--;
-					io_counter[j]++;
-				}else{
-					uart_delay[j] = UART_DELAY;
-					HWMemory[2][j] |= IRQ_UART_WRITE_AVAILABLE;
-				}
+static void *simulate(void *arg){
+	Tile *t = (Tile *)arg;
+	State **s = t->s;
+	int j, sense = 0, saved = 0;
+	unsigned long long gcycles = start_cycle;
+	int phase = gcycles % clk_ratio, sync = 1 % clk_ratio;	// cycles since the last router cycle
 
-				core = getCore(j);
-				port = &(core->port);
-				ni = getNetworkInterface(j);
-				buffer = getBuffer(ni, NOC);
-				if(isFull(buffer) && port->in_request == ON && flits_remaining[j] == 0 )//&& irq_counter[j] == 0)
-				// to create a noc interrupt the buffer need to be full and requesing to send the first flit,
-				// there also can't be any thing on the idle buffer and a clock interrupt can't be generated at the same cycle
-				{
-					if(HWMemory[1][j] & IRQ_NOC_READ)
-					// não mascarada					
-					{
-						if(s[j]->status == 1)
-						// interrupções habilitadas
-						{
-							flits_remaining[j] = OS_PACKET_SIZE+1;
-//							irq_counter[j] = 1;
-							irq_counter[j] = 2;
-							HWMemory[2][j] |= IRQ_NOC_READ;
-						}
-					}
-				}
-			}
+	Core *core;
+	Port *port;
+
+	while(1){
+		// all tiles are on the same cycle, so all threads take the checkpoint together
+		if (gcycles >= checkpoint_cycle && !saved){
+			barrier(&sense, NULL);
+			if (t == &tiles[0])
+				checkpoint_save(s, gcycles);
+			barrier(&sense, NULL);
+			saved = 1;
 		}
 
+		for(j=t->first;j<t->last && j<n_cores;j++)
+			if (brkpt[j] == 0)
+				step_devices(s, j);
+
 		gcycles++;
+		if (++phase == clk_ratio)
+			phase = 0;
 
-		for(j=0;j<n_cores;j++)
+		for(j=t->first;j<t->last && j<n_cores;j++)
 		{
 			if(is_sending[j] == ON)
 			{
@@ -1217,36 +1790,43 @@ int do_debug(State *s[], FILE *std_out[]){
 				}
 			}
 		}
-		
-#ifndef BUS
-		for(j=0;j<N_CORES;j++){
-			synchronizeRouter(j);
+
+		// links between tiles, after all router cycles are done
+		if (phase == sync){
+			barrier(&sense, NULL);
+			if (sim_done) break;
+			for(j=t->first;j<t->last;j++)
+				synchronizeLinks(j);
+		}
+
+		for(j=t->first;j<t->last;j++){
+			synchronizeLocal(j);
 			synchronizeNetworkInterface(j);
 			synchronizeCore(j);
 		}
-		
-		for(j=0;j<N_CORES;j++){
-			if (gcycles % CPU_NETWORK_CLK_RATIO == 0)
+
+		// routers, after all links are synchronized
+		if (phase == 0){
+			barrier(&sense, &gcycles);
+			if (sim_done) break;
+			gcycles += idle_skipped;
+#ifndef BUS
+			for(j=t->first;j<t->last;j++)
 				cycleRouter(j);
-			cycleNetworkInterface(j);
-		}
 #else
-		synchronizeRouter(0);
-		for(j=0;j<N_CORES;j++){
-			synchronizeNetworkInterface(j);
-			synchronizeCore(j);
+			// the bus is shared by all tiles
+			if (t->first == 0)
+				cycleRouter(0);
+			barrier(&sense, NULL);
+#endif
 		}
-		if (gcycles % CPU_NETWORK_CLK_RATIO == 0)
-			cycleRouter(0);
-		for(j=0;j<N_CORES;j++){
+		for(j=t->first;j<t->last;j++)
 			cycleNetworkInterface(j);
-		}
-#endif
 
-		for(j=0;j<n_cores;j++){					
+		for(j=t->first;j<t->last && j<n_cores;j++){
 			if (brkpt[j] == 0){			
 				if (pause_cpu[j] == 0 && is_sending[j] == OFF)
-					cycle(s[j], 0, j, std_out[j], &pause_cpu[j], &irq_counter[j]);
+					cycle(s[j], 0, j, t->std_out[j], &pause_cpu[j], &irq_counter[j]);
 				else if(pause_cpu[j] >= 1)
 					pause_cpu[j]--;
 
@@ -1255,21 +1835,138 @@ int do_debug(State *s[], FILE *std_out[]){
 				}
 				cpu_cycles[j]++;
 			}else{
-				n[j] = 1;
+				finished[j] = 1;
 			}		
 		}
-		for(j=0;j<n_cores;j++)
-			if (n[j] == 0) break;
-		if (j == n_cores){
-			printf("\n");
-			for(j=0;j<n_cores;j++){
-				show_cpu_stats(strcat(strcat(report_string, itoa(j)),".txt"),j);
-				strcpy(report_string, "./reports/report\0\0\0\0\0\0\0\0\0\0\0");
-			}
-			show_mpsoc_stats("./reports/mpsoc.txt");
-			return 0;
+	}
+
+	return NULL;
+}
+
+int do_debug(State *s[], FILE *std_out[]){
+	int i, j;
+	char report_string[]= "./reports/report\0\0\0\0\0\0\0\0\0\0";
+
+	for(j=0;j<MAX_N_CORES;j++)
+		finished[j] = 0;
+
+	// a restored checkpoint is already running
+	if (restore_file == NULL){
+		for(j=0;j<MAX_N_CORES;j++){
+			pause_cpu[j] = 0;
+			irq_counter[j] = 0;
 		}
+
+		for(j=0;j<n_cores;j++){
+			s[j]->pc_next = s[j]->pc + 4;
+			s[j]->skip = 0;
+			s[j]->wakeup = 0;
+			cycle(s[j], 0, j, std_out[j], &pause_cpu[j], &irq_counter[j]);
+		}
+	}
+
+#ifndef BUS
+	// bands of rows
+	if (n_threads > noc_height)
+		n_threads = noc_height;
+	for(i=0;i<n_threads;i++){
+		tiles[i].first = (i * noc_height / n_threads) * noc_width;
+		tiles[i].last = ((i + 1) * noc_height / n_threads) * noc_width;
 	}
+#else
+	if (n_threads > noc_cores)
+		n_threads = noc_cores;
+	for(i=0;i<n_threads;i++){
+		tiles[i].first = i * noc_cores / n_threads;
+		tiles[i].last = (i + 1) * noc_cores / n_threads;
+	}
+#endif
+	for(i=0;i<n_threads;i++){
+		tiles[i].s = s;
+		tiles[i].std_out = std_out;
+	}
+
+	for(i=1;i<n_threads;i++){
+		if (pthread_create(&tiles[i].thread, NULL, simulate, &tiles[i])){
+			printf("\nCould not create simulation thread %d.\n", i);
+			fflush(stdout);
+			exit(1);
+		}
+	}
+	simulate(&tiles[0]);
+	for(i=1;i<n_threads;i++)
+		pthread_join(tiles[i].thread, NULL);
+
+	printf("\n");
+	for(j=0;j<n_cores;j++){
+		show_cpu_stats(strcat(strcat(report_string, itoa(j)),".txt"),j);
+		strcpy(report_string, "./reports/report\0\0\0\0\0\0\0\0\0\0\0");
+	}
+	show_mpsoc_stats("./reports/mpsoc.txt");
+
+	return 0;
+}
+
+// the default network is the smallest mesh (or bus) for the cores in use
+static int configure(void){
+#ifndef BUS
+	if (noc_cores == 0){
+		for(noc_width=2;noc_width*noc_width<n_cores;noc_width++);
+		noc_height = (n_cores + noc_width - 1) / noc_width;
+		if (noc_height < 2)
+			noc_height = 2;
+		noc_cores = noc_width * noc_height;
+	}
+	if (noc_width < 2 || noc_width > MAX_NOC_SIZE || noc_height < 2 || noc_height > MAX_NOC_SIZE){
+		printf("\nThe mesh must have between 2 and %d rows and columns.\n", MAX_NOC_SIZE);
+		return -1;
+	}
+	if (noc_routing < 0 || noc_routing >= ROUTING_ALGORITHMS || noc_routing_delay < 0){
+		printf("\nUnknown routing algorithm (xy, westfirst, oddeven or adaptive) or invalid routing delay.\n");
+		return -1;
+	}
+	if (noc_torus && (noc_routing == ROUTING_WEST_FIRST || noc_routing == ROUTING_ODD_EVEN)){
+		printf("\nTurn model routing (westfirst and oddeven) needs a mesh without wraparound links.\n");
+		return -1;
+	}
+	printf("\nNetwork: %dx%d %s, %s routing", noc_width, noc_height, noc_torus ? "torus" : "mesh", routing_names[noc_routing]);
+#else
+	if (noc_routing != ROUTING_XY || noc_torus){
+		printf("\nRouting algorithms and wraparound links are for the mesh.\n");
+		return -1;
+	}
+	if (noc_cores == 0)
+		noc_cores = n_cores;
+	if (noc_cores < 1 || noc_cores > MAX_NOC_CORES){
+		printf("\nThe bus must have between 1 and %d cores.\n", MAX_NOC_CORES);
+		return -1;
+	}
+	printf("\nNetwork: bus, %d cores", noc_cores);
+#endif
+	printf(", %d flit buffers, clock ratio %d, %dKB of memory per core\n", noc_buffer_size, clk_ratio, mem_size / 1024);
+	fflush(stdout);
+	if (n_cores > noc_cores){
+		printf("\nThere are %d object codes, but only %d cores on the network.\n", n_cores, noc_cores);
+		return -1;
+	}
+	if (noc_buffer_size < 1 || clk_ratio < 1){
+		printf("\nBuffer depth and clock ratio must be at least 1.\n");
+		return -1;
+	}
+	if (mem_size < CHECKPOINT_PAGE || mem_size > RAM_EXTERNAL_BASE || (mem_size & (mem_size - 1))){
+		printf("\nMemory per core must be a power of 2, between %dKB and %dMB.\n", CHECKPOINT_PAGE / 1024, RAM_EXTERNAL_BASE / 1024 / 1024);
+		return -1;
+	}
+	if (n_cores == 0)
+		return 0;
+	SRAM = (unsigned char *)calloc(n_cores, mem_size);
+	predecoded = calloc(n_cores, sizeof(*predecoded));
+	if (SRAM == NULL || predecoded == NULL){
+		printf("\nCould not allocate %dKB of memory for %d cores.\n", mem_size / 1024, n_cores);
+		return -1;
+	}
+
+	return 0;
 }
 
 int main(int argc,char *argv[]){
@@ -1279,10 +1976,14 @@ int main(int argc,char *argv[]){
 	FILE *std_out[MAX_N_CORES];
 	int bytes, index;
 	clock_t time;
+	FILE *checkpoint = NULL;
+	char *pattern = NULL, *loads = "0.1";
 	int i,j;
 	char filename_string[] = "./objects/code\0\0\0\0\0\0\0\0\0\0\0";
 	char stdout_string[] = "./reports/stdout\0\0\0\0\0\0\0\0\0\0\0";
 
+	noc_buffer_size = NOC_BUFFER_SIZE;
+
 	printf("\nN-MIPS MPSoC Simulator");
 	printf("\nEmbedded Systems Group - GSE, PUCRS [2007 - 2011]\n");
 	fflush(stdout);
@@ -1301,8 +2002,6 @@ int main(int argc,char *argv[]){
 		HWMemory[3][j] = reference_clock;
 		HWMemory[4][j] = 0x40000;
 
-		for(i=0;i<MEM_SIZE;i++)
-			SRAM[j*MEM_SIZE+i] = 0;
 		GPIOAIN[j] = 0;
 		GPIO0OUT[j] = 0;
 		cpu_cycles[j] = 0;
@@ -1324,19 +2023,36 @@ int main(int argc,char *argv[]){
 	}	
 
 	if(argc <= 1){
-		printf("\nUsage: mpsoc_sim [n_cycles] [frequency]");
+		printf("\nUsage: mpsoc_sim [n_cycles] [frequency] [threads] [options]");
 		printf("\n         or");
-		printf("\n       mpsoc_sim [time unit] e.g. 1000 ns 10 us, 50 ms, 1 s");
+		printf("\n       mpsoc_sim [time unit] [threads] [options] e.g. 1000 ns 10 us, 50 ms, 1 s");
+#ifndef BUS
+		printf("\n - Options: -n WxH (mesh size, default: the smallest mesh for the object codes),");
+#else
+		printf("\n - Options: -n cores (bus size, default: the number of object codes),");
+#endif
+		printf("\n   -b flits (router buffer depth, default: %d), -c ratio (cpu / network clock", NOC_BUFFER_SIZE);
+		printf("\n   ratio, default: %d), -m KB (memory per core, default: %d), -s cycle file, -r file.", CPU_NETWORK_CLK_RATIO, MEM_SIZE / 1024);
+#ifndef BUS
+		printf("\n - Routing on the mesh: -R xy, westfirst, oddeven or adaptive (default: xy),");
+		printf("\n   -d cycles (routing delay, default: %d), -T (torus, with wraparound links).", ROUTING_ALGORITHM_DELAY);
+#endif
+		printf("\n - With -t pattern (uniform, transpose, hotspot[:node:percent], bitcomp or trace:file),");
+		printf("\n   synthetic traffic is injected on the network, with no processors. The offered");
+		printf("\n   load is given with -i (flits/node/network cycle, or first:last:step for a sweep).");
+		printf("\n - A checkpoint is saved to [file] on [cycle] with -s, and the simulation");
+		printf("\n   is started from a checkpoint instead of object codes with -r.");
 		printf("\n - Object codes must be in /objects directory and named");
 		printf("\n   code0.bin, code1.bin, code2.bin...");
-		printf("\n   There must be between 1 and 128 object codes in this directory.");
-		printf("\n - Reports will be saved in /reports directory.\n\n");
+		printf("\n   There must be between 1 and %d object codes in this directory.", MAX_NOC_CORES);
+		printf("\n - Reports will be saved in /reports directory.");
+		printf("\n - The network is partitioned in [threads] tiles, simulated in parallel (default: 1).\n\n");
 		fflush(stdout);
 
 		return 0;
 	}
 
-	if(argc == 3 && argv[2][0] != '\0'){
+	if(argc >= 3 && argv[2][0] != '\0'){
 		max_cycles = atoll(argv[1]+'\0');
 		if (argv[2][0] == 'c'){
 			sim_metric = 'c';
@@ -1357,13 +2073,72 @@ int main(int argc,char *argv[]){
 			max_cycles *= ((double)reference_clock / 1000000000.0);
 			sim_metric = 'n';
 		}
+		if (argc >= 4)
+			n_threads = atoi(argv[3]);
+		if (n_threads < 1 || n_threads > MAX_THREADS)
+			n_threads = 1;
+		for(i=3;i<argc;i++){
+			if (strcmp(argv[i], "-s") == 0 && i + 2 < argc){
+				checkpoint_cycle = atoll(argv[i+1]);
+				checkpoint_file = argv[i+2];
+				i += 2;
+			}else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+				restore_file = argv[i+1];
+				i++;
+			}else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc){
+#ifndef BUS
+				if (sscanf(argv[i+1], "%dx%d", &noc_width, &noc_height) != 2)
+					noc_width = noc_height = 0;
+				noc_cores = noc_width * noc_height;
+#else
+				noc_cores = atoi(argv[i+1]);
+#endif
+				if (noc_cores == 0)
+					noc_cores = -1;
+				i++;
+			}else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+				noc_buffer_size = atoi(argv[i+1]);
+				i++;
+			}else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+				clk_ratio = atoi(argv[i+1]);
+				i++;
+			}else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc){
+				mem_size = atoi(argv[i+1]) * 1024;
+				i++;
+			}else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc){
+				pattern = argv[i+1];
+				i++;
+			}else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc){
+				loads = argv[i+1];
+				i++;
+			}else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc){
+				for(noc_routing=0;noc_routing<ROUTING_ALGORITHMS;noc_routing++)
+					if (strcmp(argv[i+1], routing_names[noc_routing]) == 0) break;
+				i++;
+			}else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc){
+				noc_routing_delay = atoi(argv[i+1]);
+				i++;
+			}else if (strcmp(argv[i], "-T") == 0){
+				noc_torus = 1;
+			}
+		}
 	}else{
 		printf("\nType mpsoc_emu for help.\n");
 		fflush(stdout);
 		return (-1);
 	}
 
-	for(j=0;j<MAX_N_CORES;j++){
+	// synthetic traffic, with no processors
+	if (pattern){
+		if (configure())
+			return (-1);
+		return traffic(pattern, loads, max_cycles, clk_ratio, "./reports/traffic.txt") ? -1 : 0;
+	}
+
+	if (restore_file && (checkpoint = checkpoint_open()) == NULL)
+		return (-1);
+
+	for(j=0;j<MAX_N_CORES && restore_file == NULL;j++){
 		in[j] = fopen(strcat(strcat(filename_string, itoa(j)),".bin"), "rb");
 		strcpy(filename_string, "./objects/code\0\0\0\0\0\0\0\0\0\0\0");
 		if (in[j] == NULL){
@@ -1380,6 +2155,15 @@ int main(int argc,char *argv[]){
 		}
 	}
 
+	if (configure())
+		return (-1);
+
+	load_architecture();
+	register_devices();
+
+	if (restore_file && checkpoint_restore(checkpoint, s))
+		return (-1);
+
 	for(j=0;j<n_cores;j++){
 		std_out[j] = fopen(strcat(strcat(stdout_string, itoa(j)),".txt"), "wb");
 		strcpy(stdout_string, "./reports/stdout\0\0\0\0\0\0\0\0\0\0\0");
@@ -1391,21 +2175,21 @@ int main(int argc,char *argv[]){
 		}
 	}
 
-	for(j=0;j<n_cores;j++){
-		bytes = fread(&SRAM[j*MEM_SIZE], 1, MEM_SIZE, in[j]);
+	for(j=0;j<n_cores && restore_file == NULL;j++){
+		bytes = fread(&SRAM[j*mem_size], 1, mem_size, in[j]);
 		fclose(in[j]);
 	}
 
 	for(j=n_cores;j<MAX_N_CORES;j++)
 		brkpt[j] = 1;
 	
-	for(j=0;j<n_cores;j++){
+	for(j=0;j<n_cores && restore_file == NULL;j++){
 		s[j]->pc = 0x0;
 		s[j]->irqStatus = 0;
 		s[j]->big_endian = 1;
 		s[j]->jump_or_branch = 0;
 		s[j]->no_execute_branch_delay_slot = 0;
-		s[j]->mem = &SRAM[j*MEM_SIZE];
+		s[j]->mem = &SRAM[j*mem_size];
 		index = mem_read(s[j], 4, 0, j);
 		if(index == 0x3c1c1000)
 			s[j]->pc = RAM_EXTERNAL_BASE;
@@ -1430,7 +2214,10 @@ int main(int argc,char *argv[]){
  		}
 	}
 
-	load_architecture();	
+	for(j=0;j<n_cores;j++){
+		getNetworkInterface(j)->mem = &SRAM[j*mem_size];
+		getNetworkInterface(j)->mem_size = mem_size;
+	}
 	
 	time = clock();
 	
@@ -5,6 +5,16 @@
 #include <math.h>
 #include "noc.h"
 
+Router *routers;
+NetworkInterface *network_interfaces;
+Core *cores;
+
+// size of the network and depth of router buffers, set before load_architecture()
+int noc_width, noc_height, noc_cores, noc_buffer_size;
+// routing on the mesh, wraparound links (torus) and cycles taken by the routing decision
+int noc_routing = ROUTING_XY, noc_torus = 0, noc_routing_delay = ROUTING_ALGORITHM_DELAY;
+char *routing_names[ROUTING_ALGORITHMS] = {"xy", "westfirst", "oddeven", "adaptive"};
+
 /*
 
 
@@ -82,7 +92,7 @@ void unload_architecture()
 	Router *router;
 	NetworkInterface *network_interface;
 	Core *core;
-	for( i = 0 ; i < N_CORES ; i++ )
+	for( i = 0 ; i < noc_cores ; i++ )
 	{
 		router = getRouter(i);
 		for( k = 0 ; k < 5 ; k++ )
@@ -90,13 +100,14 @@ void unload_architecture()
 			destroy(&(router->buffers[k]));
 		}
 	}
-	for( i = 0 ; i < 2 ; i++ )
+	for( i = 0 ; i < noc_cores ; i++ )
 	{
 		network_interface = getNetworkInterface(i);
 		for( k = 0 ; k < 2 ; k++ )
 		{
 			destroy(&(network_interface->buffers[k]));
 		}
+		destroy(&(network_interface->dma));
 	}
 	free(routers);
 	free(network_interfaces);
@@ -114,13 +125,14 @@ void unload_architecture()
 	{
 		destroy(&(router->buffers[k]));
 	}
-	for( i = 0 ; i < 2 ; i++ )
+	for( i = 0 ; i < noc_cores ; i++ )
 	{
 		network_interface = getNetworkInterface(i);
 		for( k = 0 ; k < 2 ; k++ )
 		{
 			destroy(&(network_interface->buffers[k]));
 		}
+		destroy(&(network_interface->dma));
 	}
 	free(routers);
 	free(network_interfaces);
@@ -135,18 +147,29 @@ void load_architecture()
 	Router *router;
 	Core *core;
 	NetworkInterface *network_interface;
-	routers = (Router*) malloc(sizeof(Router)*N_CORES);
-	network_interfaces = (NetworkInterface*) malloc(sizeof(NetworkInterface)*N_CORES);
-	cores = (Core*) malloc(sizeof(Core)*N_CORES);
-	for( i = 0 ; i < N_CORES ; i++ )
+	routers = (Router*) malloc(sizeof(Router)*noc_cores);
+	network_interfaces = (NetworkInterface*) malloc(sizeof(NetworkInterface)*noc_cores);
+	cores = (Core*) malloc(sizeof(Core)*noc_cores);
+	for( i = 0 ; i < noc_cores ; i++ )
 	{
 		//router
 		router = getRouter(i);
 		router->arbiter = 0;
+		router->high_priority = 0;
 		//network interface
 		network_interface = getNetworkInterface(i);
 		create(getBuffer(network_interface, NOC), NI_BUFFER_LENGTH);
 		create(getBuffer(network_interface, PLASMA), NI_BUFFER_LENGTH);
+		create(&(network_interface->dma), NI_BUFFER_LENGTH);
+		network_interface->out_source = NONE;
+		network_interface->out_count = 0;
+		network_interface->delivered = 0;
+		network_interface->mem = NULL;
+		network_interface->mem_size = 0;
+		memset(network_interface->windows, 0, sizeof(network_interface->windows));
+		memset(&(network_interface->get), 0, sizeof(Transfer));
+		network_interface->rdma_puts = 0;
+		network_interface->rdma_gets = 0;
 		//core
 		core = getCore(i);
 		cleanPort(&(core->port));
@@ -157,7 +180,9 @@ void load_architecture()
 			router->status[k] = IDLE;
 			router->redirect_to[k] = NONE;
 			router->routing_delay[k] = NONE;
-			create(getBuffer(router, k), NOC_BUFFER_SIZE);
+			router->downstream[k] = 0;
+			router->flits[k] = 0;
+			create(getBuffer(router, k), noc_buffer_size);
 			//ports
 			cleanPort(&(router->ports[k]));
 			if( k <= 1 )
@@ -175,10 +200,11 @@ void load_architecture()
 	Core *core;
 	NetworkInterface *network_interface;
 	routers = (Router*) malloc(sizeof(Router));
-	network_interfaces = (NetworkInterface*) malloc(sizeof(NetworkInterface)*N_CORES);
-	cores = (Core*) malloc(sizeof(Core)*N_CORES);
-	router = getRouter(i);
+	network_interfaces = (NetworkInterface*) malloc(sizeof(NetworkInterface)*noc_cores);
+	cores = (Core*) malloc(sizeof(Core)*noc_cores);
+	router = getRouter(0);
 	router->arbiter = 0;
+	router->high_priority = 0;
 	for( k = 0 ; k < ROUTERSIZE ; k++ )
 	{
 		//router
@@ -186,16 +212,28 @@ void load_architecture()
 		router->status[k] = IDLE;
 		router->redirect_to[k] = NONE;
 		router->routing_delay[k] = NONE;
-		create(getBuffer(router, k), NOC_BUFFER_SIZE);
+		router->downstream[k] = 0;
+		router->flits[k] = 0;
+		create(getBuffer(router, k), noc_buffer_size);
 		//ports
 		cleanPort(&(router->ports[k]));
 	}
-	for( i = 0 ; i < N_CORES ; i++ )
+	for( i = 0 ; i < noc_cores ; i++ )
 	{
 		//network interface
 		network_interface = getNetworkInterface(i);
 		create(getBuffer(network_interface, NOC), NI_BUFFER_LENGTH);
 		create(getBuffer(network_interface, PLASMA), NI_BUFFER_LENGTH);
+		create(&(network_interface->dma), NI_BUFFER_LENGTH);
+		network_interface->out_source = NONE;
+		network_interface->out_count = 0;
+		network_interface->delivered = 0;
+		network_interface->mem = NULL;
+		network_interface->mem_size = 0;
+		memset(network_interface->windows, 0, sizeof(network_interface->windows));
+		memset(&(network_interface->get), 0, sizeof(Transfer));
+		network_interface->rdma_puts = 0;
+		network_interface->rdma_gets = 0;
 		//core
 		core = getCore(i);
 		cleanPort(&(core->port));
@@ -207,170 +245,137 @@ void load_architecture()
 }
 #endif
 
-#ifndef BUS
-void cycleRouter(int n)
+/*
+ * checkpoints. routers, network interfaces and core ports are saved as they are, followed by
+ * the contents of their buffers. on restore, buffers (allocated by load_architecture()) and
+ * the local memory of network interfaces are kept, and everything else is replaced.
+ */
+static void saveBuffer(FILE *f, Buffer *buffer)
 {
-	unsigned char in_use = 0, active = 0;
-	int i, j, dest, l, c;
-	long long int header;
-	Flit flit;
-	Router *router = getRouter(n);
-	Buffer *buffer;
-	Port *port_source, *port_dest;
+	fwrite(buffer->buffer, sizeof(Flit), buffer->max, f);
+}
 
-	for( i = 0 ; i < 5 ; i++ )
+static int restoreBuffer(FILE *f, Buffer *buffer, Flit *flits, int max)
+{
+	if( buffer->max != max )
 	{
-		if( router->ports[i].in_request == ON )
+		return -1;
+	}
+	buffer->buffer = flits;
+
+	return fread(flits, sizeof(Flit), max, f) == max ? 0 : -1;
+}
+
+void save_architecture(FILE *f)
+{
+	int i, k, n = noc_cores;
+	Router *router;
+	NetworkInterface *ni;
+
+#ifdef BUS
+	n = 1;
+#endif
+	for( i = 0 ; i < n ; i++ )
+	{
+		router = getRouter(i);
+		fwrite(router, sizeof(Router), 1, f);
+		for( k = 0 ; k < ROUTERSIZE ; k++ )
 		{
-			buffer = getBuffer(router, i);
-			if( ! isFull( buffer ) )
-			{
-				port_source = getPort(router, i);
-				put(buffer, port_source->in);
-				port_source->in_ack = ON;				
-			}
+			saveBuffer(f, getBuffer(router, k));
 		}
 	}
+	for( i = 0 ; i < noc_cores ; i++ )
+	{
+		ni = getNetworkInterface(i);
+		fwrite(ni, sizeof(NetworkInterface), 1, f);
+		saveBuffer(f, getBuffer(ni, NOC));
+		saveBuffer(f, getBuffer(ni, PLASMA));
+		saveBuffer(f, &(ni->dma));
+	}
+	fwrite(cores, sizeof(Core), noc_cores, f);
+}
 
-	if( SIMULTANEOUS_SWITCHING == 0 )
+int restore_architecture(FILE *f)
+{
+	int i, k, n = noc_cores;
+	Router *router;
+	Router saved_router;
+	NetworkInterface *ni;
+	NetworkInterface saved_ni;
+
+#ifdef BUS
+	n = 1;
+#endif
+	for( i = 0 ; i < n ; i++ )
 	{
-		for( j = 0 ; j <= 5 ; j++ )
+		router = getRouter(i);
+		saved_router = *router;
+		if( fread(router, sizeof(Router), 1, f) != 1 )
 		{
-			if( router->status[ router->arbiter ] != IDLE )
+			return -1;
+		}
+		for( k = 0 ; k < ROUTERSIZE ; k++ )
+		{
+			if( restoreBuffer(f, getBuffer(router, k), saved_router.buffers[k].buffer, saved_router.buffers[k].max) )
 			{
-				active++;
+				return -1;
 			}
 		}
 	}
-
-	if( router->status[ router->arbiter ] == IDLE && active == 0 )
-	{        
-		buffer = getBuffer(router, router->arbiter);
-		if( ! isEmpty(buffer) )
+	for( i = 0 ; i < noc_cores ; i++ )
+	{
+		ni = getNetworkInterface(i);
+		saved_ni = *ni;
+		if( fread(ni, sizeof(NetworkInterface), 1, f) != 1 )
 		{
-			i = router->arbiter;
-			port_source = getPort(router, i);
-			flit = read(buffer);
-			header = (long long int) flit;
-			header = headerToDecimal(header);
-		    
-			if( GET_LINE(n) == GET_LINE(header) && GET_COLUMN(n) == GET_COLUMN(header) )
-			{
-				dest = LOCAL;
-			}
-			else if( GET_COLUMN(n) < GET_COLUMN(header) )
-			{
-				dest = EAST;
-			}
-			else if( GET_COLUMN(n) > GET_COLUMN(header) )
-			{
-				dest = WEST;
-			}
-			else if( GET_LINE(n) > GET_LINE(header) )
-			{
-				dest = SOUTH;
-			}
-		    	else if( GET_LINE(n) < GET_LINE(header) )
-			{
-				dest = NORTH;
-			}
-			
-			in_use = 0;
-			for( j = 0 ; j < 5 ; j++ )
-			{
-				if( j != i )
-				{
-					if( router->status[j] != IDLE && router->redirect_to[j] == dest )
-					{
-			        		in_use = 1;
-			        	}
-				}
-			}
-
-			if( ! in_use )
-			{
-				router->redirect_to[i] = dest;
-				router->status[i] = ROUTING_DELAY;
-		        	router->routing_delay[i] = ROUTING_ALGORITHM_DELAY;
-				active = 1;
-				//printf("\nNEW CONNECTION ROUTER: %d (%s->%s)", n, directions[i], directions[dest]);
-			}
+			return -1;
 		}
-    	}
+		ni->mem = saved_ni.mem;
+		ni->mem_size = saved_ni.mem_size;
+		if( restoreBuffer(f, getBuffer(ni, NOC), saved_ni.buffers[NOC].buffer, saved_ni.buffers[NOC].max) ||
+		    restoreBuffer(f, getBuffer(ni, PLASMA), saved_ni.buffers[PLASMA].buffer, saved_ni.buffers[PLASMA].max) ||
+		    restoreBuffer(f, &(ni->dma), saved_ni.dma.buffer, saved_ni.dma.max) )
+		{
+			return -1;
+		}
+	}
 
-	for( i = 0 ; i <= 4 ; i++ )
+	return fread(cores, sizeof(Core), noc_cores, f) == noc_cores ? 0 : -1;
+}
+
+/*
+ * selects the input port to be considered for a new connection. the round-robin arbiter is
+ * overridden by a waiting high priority packet (the first one after the arbiter position),
+ * so it is routed ahead of normal priority packets waiting on other ports.
+ */
+static int arbitrate(Router *router, int ports)
+{
+	int i, j;
+	Buffer *buffer;
+
+	for( j = 0 ; j < ports ; j++ )
 	{
-		if( router->status[i] != IDLE )
+		i = (router->arbiter + j) % ports;
+		buffer = getBuffer(router, i);
+		if( router->status[i] == IDLE && ! isEmpty(buffer) && getPriority(read(buffer)) == PRIORITY_HIGH )
 		{
-			buffer = getBuffer(router, i);
-			port_dest = getPort(router, router->redirect_to[i]);
-			if( router->status[i] == ROUTING_DELAY )
-			{
-				if( router->routing_delay[i]-- <= 0 )
-				{
-					if( ! isEmpty( buffer ) )
-					{
-						flit = take(buffer);
-						port_dest->out = flit;
-						port_dest->out_request = ON;
-						port_dest->out_ack = OFF;
-						router->status[i] = ROUTING_HEADER;
-						//printf("\n\tROUTER %d HEADER %d", n, flit);
-					}
-				}
-			}
-			else
-			{
-				if( port_dest->out_ack == ON )
-				{
-					if( router->status[i] == ROUTING_HEADER && ! isEmpty(buffer) )
-					{
-						flit = take(buffer);
-						port_dest->out_request = ON;
-						port_dest->out_ack = OFF;
-						port_dest->out = flit;
-						router->packets_remaining[i] = (long long int) flit;
-						router->status[i] = ROUTING_PAYLOAD;
-						//printf("\n\tROUTER %d PAYLOAD %d", n, flit);
-					}
-					else if( router->status[i] == ROUTING_PAYLOAD || router->status[i] == ROUTING_DATA )
-					{
-						if( router->status[i] == ROUTING_PAYLOAD )
-						{
-							router->status[i] = ROUTING_DATA;
-						}				
-					
-						if( router->packets_remaining[i] == 0 )
-						{
-							//printf("\nCONNECTION CLOSED ROUTER %d (%s->%s)", n, directions[i], directions[router->redirect_to[i]]);
-							router->status[i] = IDLE;
-							router->packets_remaining[i] = 0;
-							router->redirect_to[i] = NONE;
-							port_dest->out_request = OFF;
-							port_dest->out = 0;
-							port_dest->out_ack = OFF;
-						}
-						else
-						{
-							if( ! isEmpty( buffer ) )
-							{
-								flit = take(buffer);
-								port_dest->out_request = ON;
-								port_dest->out_ack = OFF;
-								port_dest->out = flit;
-									router->packets_remaining[i]--;
-							}
-						}
-					}        
-				}
-			}
+			return i;
 		}
-	}   
-    
-	router->arbiter = ++router->arbiter % 5;
+	}
+
+	return router->arbiter;
+}
+
+#ifndef BUS
+// round robin arbitration. on routers at the borders of the mesh, ports with no neighbour are skipped
+static void nextArbiter(Router *router, int n)
+{
+	int l, c;
 
+	router->arbiter = ++router->arbiter % 5;
 
-	if( ARBITRATION_CONSIDERING_POS == 1 )
+	// all ports have a neighbour on a torus
+	if( ARBITRATION_CONSIDERING_POS == 1 && ! noc_torus )
 	{
 		l = GET_LINE(n);
 		c = GET_COLUMN(n);
@@ -385,7 +390,7 @@ void cycleRouter(int n)
 			router->arbiter = LOCAL;
 			}
 		}
-		else if( l == 0 && c == NOC_WIDTH-1 )
+		else if( l == 0 && c == noc_width-1 )
 		{
 			if( router->arbiter == EAST )
 			{
@@ -396,7 +401,7 @@ void cycleRouter(int n)
 				router->arbiter = LOCAL;
 			}
 		}
-		else if( l == NOC_HEIGHT-1 && c == 0 )
+		else if( l == noc_height-1 && c == 0 )
 		{
 			if( router->arbiter == WEST )
 			{
@@ -407,7 +412,7 @@ void cycleRouter(int n)
 				router->arbiter = LOCAL;
 			}
 		}
-		else if( l == NOC_HEIGHT-1 && c == NOC_WIDTH-1 )
+		else if( l == noc_height-1 && c == noc_width-1 )
 		{
 			if( router->arbiter == EAST )
 			{
@@ -432,14 +437,14 @@ void cycleRouter(int n)
 				router->arbiter = NORTH;
 			}
 		}
-		else if( l == NOC_HEIGHT-1 )
+		else if( l == noc_height-1 )
 		{
 			if( router->arbiter == NORTH )
 			{
 				router->arbiter = SOUTH;
 			}
 		}
-		else if( c == NOC_WIDTH-1 )
+		else if( c == noc_width-1 )
 		{
 			if( router->arbiter == EAST )
 			{
@@ -448,18 +453,126 @@ void cycleRouter(int n)
 		}
 	}
 }
-#else
+
+/*
+ * output ports (a bit for each) that a packet on router n, which arrived on port in, may take
+ * towards its target. all algorithms route on minimal paths (on a torus, the shorter way around
+ * each ring). west-first routes west before any other direction, and odd-even forbids east to
+ * north/south turns on even columns and north/south to west turns on odd columns (Chiu, 2000).
+ * on these turn models, only east to north/south turns are taken on the column the packet was
+ * injected, which is the only case when a packet heading east arrives from the north or south.
+ */
+static int admissiblePorts(int n, int target, int in)
+{
+	int c = GET_COLUMN(n), l = GET_LINE(n), tc = GET_COLUMN(target), tl = GET_LINE(target);
+	int x = NONE, y = NONE, dx, dy, ports;
+
+	if( n == target )
+	{
+		return 1 << LOCAL;
+	}
+	if( noc_torus )
+	{
+		dx = (tc - c + noc_width) % noc_width;
+		dy = (tl - l + noc_height) % noc_height;
+		if( dx )
+		{
+			x = dx <= noc_width / 2 ? EAST : WEST;
+		}
+		if( dy )
+		{
+			y = dy <= noc_height / 2 ? NORTH : SOUTH;
+		}
+	}
+	else
+	{
+		if( tc != c )
+		{
+			x = tc > c ? EAST : WEST;
+		}
+		if( tl != l )
+		{
+			y = tl > l ? NORTH : SOUTH;
+		}
+	}
+
+	if( x == NONE )
+	{
+		return 1 << y;
+	}
+	if( y == NONE )
+	{
+		return 1 << x;
+	}
+	switch( noc_routing )
+	{
+		case ROUTING_XY:
+			return 1 << x;
+		case ROUTING_WEST_FIRST:
+			return x == WEST ? 1 << WEST : (1 << x) | (1 << y);
+		case ROUTING_ODD_EVEN:
+			if( x == EAST )
+			{
+				ports = 0;
+				if( (c & 1) || in == LOCAL || in == NORTH || in == SOUTH )
+				{
+					ports |= 1 << y;
+				}
+				if( (tc & 1) || tc - c != 1 )
+				{
+					ports |= 1 << EAST;
+				}
+				return ports;
+			}
+			return (c & 1) ? 1 << WEST : (1 << WEST) | (1 << y);
+		default:
+			return (1 << x) | (1 << y);
+	}
+}
+
+/*
+ * selects the output port of a new connection from input port i, or NONE if all admissible ports
+ * are taken by other connections. among free ports, the one with the least flits waiting on the
+ * next router is selected (ties are broken on the order of ports, so X is preferred over Y).
+ */
+static int route(Router *router, int n, int i, int target)
+{
+	int j, k, ports, dest = NONE;
+
+	ports = admissiblePorts(n, target, i);
+	for( k = 0 ; k < 5 ; k++ )
+	{
+		if( !(ports & (1 << k)) )
+		{
+			continue;
+		}
+		for( j = 0 ; j < 5 ; j++ )
+		{
+			if( j != i && router->status[j] != IDLE && router->redirect_to[j] == k )
+			{
+				break;
+			}
+		}
+		if( j == 5 && (dest == NONE || router->downstream[k] < router->downstream[dest]) )
+		{
+			dest = k;
+		}
+	}
+
+	return dest;
+}
+
 void cycleRouter(int n)
 {
-	unsigned char in_use = 0, active = 0;
-	int i, j, dest, l, c;
+	unsigned char active = 0;
+	int i, j, dest, sel;
 	long long int header;
 	Flit flit;
 	Router *router = getRouter(n);
 	Buffer *buffer;
 	Port *port_source, *port_dest;
 
-	for( i = 0 ; i < ROUTERSIZE ; i++ )
+	for( i = 0 ; i < 5 ; i++ )
 	{
 		if( router->ports[i].in_request == ON )
 		{
@@ -473,35 +586,46 @@ void cycleRouter(int n)
 		}
 	}
 
-	for( j = 0 ; j <= ROUTERSIZE ; j++ )
+	if( SIMULTANEOUS_SWITCHING == 0 )
 	{
-		if( router->status[ router->arbiter ] != IDLE )
+		for( j = 0 ; j <= 5 ; j++ )
 		{
-			active++;
+			if( router->status[ router->arbiter ] != IDLE )
+			{
+				active++;
+			}
 		}
 	}
 
-	if( router->status[ router->arbiter ] == IDLE && active == 0 )
+	sel = arbitrate(router, 5);
+	if( router->status[ sel ] == IDLE && active == 0 )
 	{        
-		buffer = getBuffer(router, router->arbiter);
+		buffer = getBuffer(router, sel);
 		if( ! isEmpty(buffer) )
 		{
-			i = router->arbiter;
+			i = sel;
 			port_source = getPort(router, i);
 			flit = read(buffer);
-			header = (long long int) flit;	
-				    
-			dest = header;		
-						
-			//i removed the is_use logic because it will never happen with a bus arch
-			router->redirect_to[i] = dest;
-			router->status[i] = ROUTING_DELAY;
-		        router->routing_delay[i] = ROUTING_ALGORITHM_DELAY;			
-//			printf("\nNEW CONNECTION ROUTER: %d (%d->%d)", n, i, dest);
+			header = (long long int) flit;
+			header = headerToDecimal(header);
+			dest = route(router, n, i, header);
+
+			if( dest != NONE )
+			{
+				router->redirect_to[i] = dest;
+				router->status[i] = ROUTING_DELAY;
+		        	router->routing_delay[i] = noc_routing_delay;
+				if( getPriority(flit) == PRIORITY_HIGH )
+				{
+					router->high_priority++;
+				}
+				active = 1;
+				//printf("\nNEW CONNECTION ROUTER: %d (%s->%s)", n, directions[i], directions[dest]);
+			}
 		}
     	}
 
-	for( i = 0 ; i <= ROUTERSIZE ; i++ )
+	for( i = 0 ; i <= 4 ; i++ )
 	{
 		if( router->status[i] != IDLE )
 		{
@@ -514,11 +638,12 @@ void cycleRouter(int n)
 					if( ! isEmpty( buffer ) )
 					{
 						flit = take(buffer);
+						router->flits[ router->redirect_to[i] ]++;
 						port_dest->out = flit;
 						port_dest->out_request = ON;
 						port_dest->out_ack = OFF;
 						router->status[i] = ROUTING_HEADER;
-//						printf("\n\tROUTER %d HEADER %d", n, flit);
+						//printf("\n\tROUTER %d HEADER %d", n, flit);
 					}
 				}
 			}
@@ -529,12 +654,13 @@ void cycleRouter(int n)
 					if( router->status[i] == ROUTING_HEADER && ! isEmpty(buffer) )
 					{
 						flit = take(buffer);
+						router->flits[ router->redirect_to[i] ]++;
 						port_dest->out_request = ON;
 						port_dest->out_ack = OFF;
 						port_dest->out = flit;
 						router->packets_remaining[i] = (long long int) flit;
 						router->status[i] = ROUTING_PAYLOAD;
-//						printf("\n\tROUTER %d PAYLOAD %d", n, flit);
+						//printf("\n\tROUTER %d PAYLOAD %d", n, flit);
 					}
 					else if( router->status[i] == ROUTING_PAYLOAD || router->status[i] == ROUTING_DATA )
 					{
@@ -545,7 +671,7 @@ void cycleRouter(int n)
 					
 						if( router->packets_remaining[i] == 0 )
 						{
-//							printf("\nCONNECTION CLOSED ROUTER %d (%d->%d)", n, i, router->redirect_to[i]);
+							//printf("\nCONNECTION CLOSED ROUTER %d (%s->%s)", n, directions[i], directions[router->redirect_to[i]]);
 							router->status[i] = IDLE;
 							router->packets_remaining[i] = 0;
 							router->redirect_to[i] = NONE;
@@ -558,20 +684,153 @@ void cycleRouter(int n)
 							if( ! isEmpty( buffer ) )
 							{
 								flit = take(buffer);
+								router->flits[ router->redirect_to[i] ]++;
 								port_dest->out_request = ON;
 								port_dest->out_ack = OFF;
 								port_dest->out = flit;
-								router->packets_remaining[i]--;
+									router->packets_remaining[i]--;
 							}
 						}
 					}        
 				}
 			}
 		}
-	}
-	
-	active = 0;
+	}   
+    
+	nextArbiter(router, n);
+}
+#else
+void cycleRouter(int n)
+{
+	unsigned char in_use = 0, active = 0;
+	int i, j, dest, l, c, sel;
+	long long int header;
+	Flit flit;
+	Router *router = getRouter(n);
+	Buffer *buffer;
+	Port *port_source, *port_dest;
+
+	for( i = 0 ; i < ROUTERSIZE ; i++ )
+	{
+		if( router->ports[i].in_request == ON )
+		{
+			buffer = getBuffer(router, i);
+			if( ! isFull( buffer ) )
+			{
+				port_source = getPort(router, i);
+				put(buffer, port_source->in);
+				port_source->in_ack = ON;				
+			}
+		}
+	}
+
 	for( j = 0 ; j <= ROUTERSIZE ; j++ )
+	{
+		if( router->status[ router->arbiter ] != IDLE )
+		{
+			active++;
+		}
+	}
+
+	sel = arbitrate(router, ROUTERSIZE);
+	if( router->status[ sel ] == IDLE && active == 0 )
+	{        
+		buffer = getBuffer(router, sel);
+		if( ! isEmpty(buffer) )
+		{
+			i = sel;
+			port_source = getPort(router, i);
+			flit = read(buffer);
+			header = (long long int) flit;	
+				    
+			dest = header & 0xff;		
+						
+			//i removed the is_use logic because it will never happen with a bus arch
+			router->redirect_to[i] = dest;
+			router->status[i] = ROUTING_DELAY;
+		        router->routing_delay[i] = noc_routing_delay;			
+			if( getPriority(flit) == PRIORITY_HIGH )
+			{
+				router->high_priority++;
+			}
+//			printf("\nNEW CONNECTION ROUTER: %d (%d->%d)", n, i, dest);
+		}
+    	}
+
+	for( i = 0 ; i < ROUTERSIZE ; i++ )
+	{
+		if( router->status[i] != IDLE )
+		{
+			buffer = getBuffer(router, i);
+			port_dest = getPort(router, router->redirect_to[i]);
+			if( router->status[i] == ROUTING_DELAY )
+			{
+				if( router->routing_delay[i]-- <= 0 )
+				{
+					if( ! isEmpty( buffer ) )
+					{
+						flit = take(buffer);
+						router->flits[ router->redirect_to[i] ]++;
+						port_dest->out = flit;
+						port_dest->out_request = ON;
+						port_dest->out_ack = OFF;
+						router->status[i] = ROUTING_HEADER;
+//						printf("\n\tROUTER %d HEADER %d", n, flit);
+					}
+				}
+			}
+			else
+			{
+				if( port_dest->out_ack == ON )
+				{
+					if( router->status[i] == ROUTING_HEADER && ! isEmpty(buffer) )
+					{
+						flit = take(buffer);
+						router->flits[ router->redirect_to[i] ]++;
+						port_dest->out_request = ON;
+						port_dest->out_ack = OFF;
+						port_dest->out = flit;
+						router->packets_remaining[i] = (long long int) flit;
+						router->status[i] = ROUTING_PAYLOAD;
+//						printf("\n\tROUTER %d PAYLOAD %d", n, flit);
+					}
+					else if( router->status[i] == ROUTING_PAYLOAD || router->status[i] == ROUTING_DATA )
+					{
+						if( router->status[i] == ROUTING_PAYLOAD )
+						{
+							router->status[i] = ROUTING_DATA;
+						}				
+					
+						if( router->packets_remaining[i] == 0 )
+						{
+//							printf("\nCONNECTION CLOSED ROUTER %d (%d->%d)", n, i, router->redirect_to[i]);
+							router->status[i] = IDLE;
+							router->packets_remaining[i] = 0;
+							router->redirect_to[i] = NONE;
+							port_dest->out_request = OFF;
+							port_dest->out = 0;
+							port_dest->out_ack = OFF;
+						}
+						else
+						{
+							if( ! isEmpty( buffer ) )
+							{
+								flit = take(buffer);
+								router->flits[ router->redirect_to[i] ]++;
+								port_dest->out_request = ON;
+								port_dest->out_ack = OFF;
+								port_dest->out = flit;
+								router->packets_remaining[i]--;
+							}
+						}
+					}        
+				}
+			}
+		}
+	}
+	
+	active = 0;
+	for( j = 0 ; j < ROUTERSIZE ; j++ )
 	{
 		if( router->status[ j ] != IDLE )
 		{
@@ -585,13 +844,315 @@ void cycleRouter(int n)
 }
 #endif
 
+/*
+ * a network with no flits buffered or on the links and no pending transfers changes only the
+ * arbiters of the routers from one cycle to the next. idleNetwork() checks for this state, and
+ * idleRouter() advances a router of an idle network by a number of router cycles at once.
+ */
+static int idlePort(Port *port)
+{
+	return port->in_request == OFF && port->out_request == OFF;
+}
+
+static int idleRouterPorts(Router *router)
+{
+	int k;
+
+	for( k = 0 ; k < ROUTERSIZE ; k++ )
+	{
+		if( router->status[k] != IDLE || ! isEmpty(getBuffer(router, k)) || ! idlePort(getPort(router, k)) )
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int idleNetwork(void)
+{
+	int i;
+	NetworkInterface *ni;
+
+#ifndef BUS
+	for( i = 0 ; i < noc_cores ; i++ )
+	{
+		if( ! idleRouterPorts(getRouter(i)) )
+		{
+			return 0;
+		}
+	}
+#else
+	if( ! idleRouterPorts(getRouter(0)) )
+	{
+		return 0;
+	}
+#endif
+	for( i = 0 ; i < noc_cores ; i++ )
+	{
+		ni = getNetworkInterface(i);
+		if( ! isEmpty(getBuffer(ni, NOC)) || ! isEmpty(getBuffer(ni, PLASMA)) || ! isEmpty(&(ni->dma)) || ni->get.active )
+		{
+			return 0;
+		}
+		if( ! idlePort(getPort(ni, NOC)) || ! idlePort(getPort(ni, PLASMA)) || ! idlePort(&(getCore(i)->port)) )
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#ifndef BUS
+void idleRouter(int n, int cycles)
+{
+	Router *router = getRouter(n);
+
+	// the arbiter sequence enters a cycle (of at most 5 ports) after at most 5 steps
+	if( cycles > 65 )
+	{
+		cycles = 5 + (cycles - 5) % 60;
+	}
+	while( cycles-- > 0 )
+	{
+		nextArbiter(router, n);
+	}
+}
+#else
+void idleRouter(int n, int cycles)
+{
+	Router *router = getRouter(0);
+
+	router->arbiter = (router->arbiter + cycles) % ROUTERSIZE;
+}
+#endif
+
+
+/*
+
+
+	REMOTE MEMORY ACCESS (NI)
+
+
+*/
+
+void windowNetworkInterface(int n, unsigned int ctrl)
+{
+	NetworkInterface *ni = getNetworkInterface(n);
+	Window *win;
+
+	if( (ctrl & 0xff) >= NI_WINDOWS )
+	{
+		return;
+	}
+	win = &(ni->windows[ ctrl & 0xff ]);
+	win->base = ni->win_base;
+	win->size = ni->win_size;
+	win->flags = (ctrl >> 8) & (WIN_READ | WIN_WRITE);
+}
+
+// returns the window accessed by a request, if it can be served by the NI
+static Window *rdmaWindow(NetworkInterface *ni, Flit *header, int flag)
+{
+	Window *win;
+	unsigned int offset;
+
+	if( header[PKT_CHANNEL] >= NI_WINDOWS || ni->mem == NULL )
+	{
+		return NULL;
+	}
+	win = &(ni->windows[ header[PKT_CHANNEL] ]);
+	if( !(win->flags & flag) )
+	{
+		return NULL;
+	}
+	offset = ((unsigned int) header[RDMA_OFFSET_HI] << 16) | header[RDMA_OFFSET_LO];
+	if( offset > win->size || header[PKT_MSG_SIZE] > win->size - offset )
+	{
+		return NULL;
+	}
+	return win;
+}
+
+// returns the flit at position i of the packet on a full buffer
+static Flit peek(Buffer* buffer, int i)
+{
+	return buffer->buffer[ (buffer->start + i) % buffer->max ];
+}
+
+/*
+ * RDMA requests (packets to RDMA_PORT on a window registered on the NI) are served without
+ * processor intervention. A put is written to memory, and a get is replied by the DMA engine
+ * as a regular message. A get is kept on the buffer (stalling the network) while another get
+ * is being replied. Any other packet (including requests to windows not registered on the NI)
+ * is delivered to the processor.
+ */
+static void rdmaRequest(int n)
+{
+	NetworkInterface *ni = getNetworkInterface(n);
+	Buffer *buffer_noc = getBuffer(ni, NOC);
+	Port *plasma_port = getPort(ni, PLASMA);
+	Core *core = getCore(n);
+	Flit header[RDMA_HEADER_SIZE];
+	Window *win;
+	unsigned int address;
+	int i, size;
+
+	for( i = 0 ; i < RDMA_HEADER_SIZE ; i++ )
+	{
+		header[i] = peek(buffer_noc, i);
+	}
+	if( header[PKT_TARGET_PORT] != RDMA_PORT )
+	{
+		return;
+	}
+
+	switch( header[PKT_SEQ] )
+	{
+		case RDMA_PUT:
+			win = rdmaWindow(ni, header, WIN_WRITE);
+			if( win == NULL || header[PKT_MSG_SIZE] > (NI_BUFFER_LENGTH - RDMA_HEADER_SIZE) * 2 )
+			{
+				return;
+			}
+			address = win->base + (((unsigned int) header[RDMA_OFFSET_HI] << 16) | header[RDMA_OFFSET_LO]);
+			size = header[PKT_MSG_SIZE];
+			for( i = 0 ; i < size ; i++ )
+			{
+				if( i & 1 )
+				{
+					ni->mem[ (address + i) % ni->mem_size ] = peek(buffer_noc, RDMA_HEADER_SIZE + i / 2) & 0xff;
+				}
+				else
+				{
+					ni->mem[ (address + i) % ni->mem_size ] = peek(buffer_noc, RDMA_HEADER_SIZE + i / 2) >> 8;
+				}
+			}
+			ni->rdma_puts++;
+			break;
+		case RDMA_GET:
+			if( header[PKT_CHANNEL] >= NI_WINDOWS || !(ni->windows[ header[PKT_CHANNEL] ].flags & WIN_READ) || ni->mem == NULL )
+			{
+				return;
+			}
+			if( ni->get.active )
+			{
+				return;
+			}
+			win = rdmaWindow(ni, header, WIN_READ);
+			memcpy(ni->get.header, header, sizeof(header));
+			if( win == NULL )
+			{
+				// out of bounds, replied with an empty message
+				ni->get.header[PKT_MSG_SIZE] = 0;
+				ni->get.address = 0;
+			}
+			else
+			{
+				ni->get.address = win->base + (((unsigned int) header[RDMA_OFFSET_HI] << 16) | header[RDMA_OFFSET_LO]);
+			}
+			ni->get.sent = 0;
+			ni->get.seq = 1;
+			ni->get.active = 1;
+			ni->rdma_gets++;
+			break;
+		default:
+			return;
+	}
+
+	// the packet is consumed, and never presented to the processor
+	while( !isEmpty(buffer_noc) )
+	{
+		take(buffer_noc);
+	}
+	plasma_port->out_request = OFF;
+	plasma_port->out_ack = OFF;
+	plasma_port->out = 0;
+	core->port.in_request = OFF;
+	core->port.in = 0;
+}
+
+// builds the next reply packet of a get on the DMA buffer
+static void rdmaReply(int n)
+{
+	NetworkInterface *ni = getNetworkInterface(n);
+	Transfer *get = &(ni->get);
+	Flit flit;
+	int i, size;
+
+	if( !get->active || !isEmpty(&(ni->dma)) )
+	{
+		return;
+	}
+
+	size = get->header[PKT_MSG_SIZE];
+#ifndef BUS
+	put(&(ni->dma), (get->header[PKT_TARGET_CPU] & 0xff00) | (get->header[PKT_SOURCE_CPU] < noc_cores ? decimalToHeader(get->header[PKT_SOURCE_CPU]) : 0));
+#else
+	put(&(ni->dma), (get->header[PKT_TARGET_CPU] & 0xff00) | (get->header[PKT_SOURCE_CPU] < noc_cores ? get->header[PKT_SOURCE_CPU] : 0));
+#endif
+	put(&(ni->dma), NI_BUFFER_LENGTH - 2);
+	put(&(ni->dma), n);
+	put(&(ni->dma), RDMA_PORT);
+	put(&(ni->dma), get->header[PKT_SOURCE_PORT]);
+	put(&(ni->dma), size);
+	put(&(ni->dma), get->seq++);
+	put(&(ni->dma), get->header[RDMA_CHANNEL]);
+	for( i = PKT_HEADER_SIZE ; i < NI_BUFFER_LENGTH ; i++ )
+	{
+		if( get->sent < size )
+		{
+			flit = ni->mem[ (get->address + get->sent) % ni->mem_size ] << 8;
+			if( get->sent + 1 < size )
+			{
+				flit |= ni->mem[ (get->address + get->sent + 1) % ni->mem_size ];
+			}
+			get->sent += 2;
+		}
+		else
+		{
+			flit = 0xdead;
+		}
+		put(&(ni->dma), flit);
+	}
+	if( get->sent >= size )
+	{
+		get->active = 0;
+	}
+}
+
+// selects the buffer which feeds the NoC. packets from the processor and from the DMA engine are interleaved
+static Buffer *outBuffer(NetworkInterface *ni)
+{
+	if( ni->out_count == 0 )
+	{
+		if( ! isEmpty(getBuffer(ni, PLASMA)) )
+		{
+			ni->out_source = PLASMA;
+			ni->out_count = NI_BUFFER_LENGTH;
+		}
+		else if( ! isEmpty(&(ni->dma)) )
+		{
+			ni->out_source = DMA;
+			ni->out_count = NI_BUFFER_LENGTH;
+		}
+		else
+		{
+			return NULL;
+		}
+	}
+
+	return ni->out_source == DMA ? &(ni->dma) : getBuffer(ni, PLASMA);
+}
+
 void cycleNetworkInterface(int n)
 {
 	int i;
 	NetworkInterface *ni = getNetworkInterface(n);
     	Port *plasma_port = getPort(ni, PLASMA);
     	Port *noc_port = getPort(ni, NOC);
-	Buffer *buffer_noc, *buffer_plasma;
+	Buffer *buffer_noc, *buffer_plasma, *buffer_out;
 
 	if(NI_BUFFER_LENGTH==0)
 	{
@@ -622,20 +1183,30 @@ void cycleNetworkInterface(int n)
 			noc_port->in_ack = ON;
 		}
 	}
+
+	// remote memory access, on a packet boundary (no flits of this packet taken by the processor)
+	if( isFull(buffer_noc) && ni->delivered % NI_BUFFER_LENGTH == 0 )
+	{
+		rdmaRequest(n);
+	}
+	rdmaReply(n);
     
 	//máquina de envio de flits para a noc
-    	if( ! isEmpty(buffer_plasma) )
+	buffer_out = outBuffer(ni);
+    	if( buffer_out && ! isEmpty(buffer_out) )
     	{
 		if( noc_port->out_ack == ON )
 		{
-			take(buffer_plasma);
+			take(buffer_out);
 			noc_port->out_ack = OFF;
 			noc_port->out_request = OFF;
 			noc_port->out = 0;
+			ni->out_count--;
+			buffer_out = outBuffer(ni);
 		}
-		if( ! isEmpty(buffer_plasma) )
+		if( buffer_out && ! isEmpty(buffer_out) )
 		{
-		    	noc_port->out = read(buffer_plasma);
+		    	noc_port->out = read(buffer_out);
 		    	noc_port->out_request = ON;
 		}
     	}
@@ -646,6 +1217,7 @@ void cycleNetworkInterface(int n)
 		if( plasma_port->out_ack == ON )
 		{
 			i = take(buffer_noc);
+			ni->delivered++;
 			plasma_port->out_ack = OFF;
 			plasma_port->out_request = OFF;
 			plasma_port->out = 0;
@@ -675,119 +1247,143 @@ void synchronizePorts(Port *p1, Port *p2)
 }
 
 #ifndef BUS
-void synchronizeRouter(int n)
+void synchronizeLocal(int n)
 {
-	int l, c;
 	Router *router = getRouter(n);
-	Router *aux;
 	NetworkInterface *ni;
 	Core *core;
 	Port *p1, *p2;
-	char flags[4];
-	
-    	if( NI_BUFFER_LENGTH != 0 )
-    	{
+
+	p1 = &(router->ports[LOCAL]);
+	if( NI_BUFFER_LENGTH != 0 )
+	{
 		ni = getNetworkInterface(n);
+        	p2 = getPort(ni, NOC);
     	}
-    	else
+	else
 	{
-	    	core = getCore(n);
+		core = getCore(n);
+        	p2 = &(core->port);
     	}
+    	synchronizePorts(p1, p2);
+}
+
+/*
+ * links between routers change state only on router cycles, and synchronizePorts() reaches a
+ * fixed point after being applied once. so links need to be synchronized only on the first cycle
+ * after a router cycle (this is what allows tiles of the mesh to be simulated in parallel). the
+ * occupancy of the buffers at the other end of the links is taken here too, for adaptive routing.
+ */
+static void synchronizeLink(Router *router, int port, int n, int neighbour_port)
+{
+	Router *aux = getRouter(n);
+
+	synchronizePorts(getPort(router, port), getPort(aux, neighbour_port));
+	router->downstream[port] = getBuffer(aux, neighbour_port)->size;
+}
+
+void synchronizeLinks(int n)
+{
+	int l, c;
+	Router *router = getRouter(n);
+	char flags[4];
+	
 	l = GET_LINE(n);
 	c = GET_COLUMN(n);
     	flags[0] = flags[1] = flags[2] = flags[3] = OFF;
 
-    	if( c == 0 )
-    	{
-        	flags[EAST] = ON;
-	}
-	else if( c == NOC_WIDTH-1 )
+	// on a torus, routers on the borders are linked to the ones on the opposite border
+	if( noc_torus )
 	{
-	    	flags[WEST] = ON;
+		flags[EAST] = flags[WEST] = flags[NORTH] = flags[SOUTH] = ON;
 	}
 	else
 	{
-	    	flags[EAST] = ON;
-	    	flags[WEST] = ON;
-	}
+		if( c == 0 )
+		{
+			flags[EAST] = ON;
+		}
+		else if( c == noc_width-1 )
+		{
+			flags[WEST] = ON;
+		}
+		else
+		{
+			flags[EAST] = ON;
+			flags[WEST] = ON;
+		}
 
-	if( l == 0 ) 
-	{
-	    	flags[NORTH] = ON;
-	}
-    	else if( l == NOC_HEIGHT-1 ) 
-    	{
-        	flags[SOUTH] = ON;
-	}
-    	else 
-	{ 
-	    	flags[SOUTH] = ON;
-	    	flags[NORTH] = ON;
+		if( l == 0 )
+		{
+			flags[NORTH] = ON;
+		}
+		else if( l == noc_height-1 )
+		{
+			flags[SOUTH] = ON;
+		}
+		else
+		{
+			flags[SOUTH] = ON;
+			flags[NORTH] = ON;
+		}
 	}
 
-	p1 = &(router->ports[LOCAL]);
-	if( NI_BUFFER_LENGTH != 0 )
-	{
-        	p2 = getPort(ni, NOC);
-    	}
-	else
-	{
-        	p2 = &(core->port);
-    	}
-    	synchronizePorts(p1, p2);
-	
 	if( flags[SOUTH] )
 	{
-		aux = getRouter(n-NOC_WIDTH);
-		p1 = getPort(router, SOUTH);
-		p2 = getPort(aux, NORTH);
-		synchronizePorts(p1, p2);
+		synchronizeLink(router, SOUTH, ((l + noc_height - 1) % noc_height) * noc_width + c, NORTH);
 	}
 	if( flags[NORTH] )
 	{
-	    	aux = getRouter(n+NOC_WIDTH);
-		p1 = getPort(router, NORTH);
-		p2 = getPort(aux, SOUTH);
-		synchronizePorts(p1, p2);
+		synchronizeLink(router, NORTH, ((l + 1) % noc_height) * noc_width + c, SOUTH);
 	}
 	if( flags[EAST] )
 	{
-	    	aux = getRouter(n+1);
-		p1 = getPort(router, EAST);
-		p2 = getPort(aux, WEST);
-		synchronizePorts(p1, p2);
+		synchronizeLink(router, EAST, l * noc_width + (c + 1) % noc_width, WEST);
 	}
 	if( flags[WEST] )
 	{
-	    	aux = getRouter(n-1);
-		p1 = getPort(router, WEST);
-		p2 = getPort(aux, EAST);
-		synchronizePorts(p1, p2);
+		synchronizeLink(router, WEST, l * noc_width + (c + noc_width - 1) % noc_width, EAST);
 	}
 }
-#else
+
 void synchronizeRouter(int n)
 {
-	int l, c;
-	Router *router = getRouter(n);
-	Router *aux;
+	synchronizeLocal(n);
+	synchronizeLinks(n);
+}
+#else
+void synchronizeLocal(int n)
+{
+	Router *router = getRouter(0);
 	NetworkInterface *ni;
 	Core *core;
 	Port *p1, *p2;
+
+	p1 = &(router->ports[n]);	
+    	if( NI_BUFFER_LENGTH != 0 )
+    	{
+		ni = getNetworkInterface(n);
+		p2 = getPort(ni, NOC);
+    	}
+    	else
+	{
+	    	core = getCore(n);
+		p2 = &(core->port);
+    	}
+    	synchronizePorts(p1, p2);
+}
+
+void synchronizeLinks(int n)
+{
+}
+
+void synchronizeRouter(int n)
+{
+	int l;
+
 	for( l = 0 ; l < ROUTERSIZE ; l++ )
 	{
-		p1 = &(router->ports[l]);	
-	    	if( NI_BUFFER_LENGTH != 0 )
-	    	{
-			ni = getNetworkInterface(l);
-			p2 = getPort(ni, NOC);
-	    	}
-	    	else
-		{
-		    	core = getCore(l);
-			p2 = &(core->port);
-	    	}
-	    	synchronizePorts(p1, p2);
+		synchronizeLocal(l);
     	}
 }
 #endif
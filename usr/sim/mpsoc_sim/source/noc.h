@@ -6,30 +6,73 @@ typedef unsigned short int Flit;
 #define ROUTING_ALGORITHM_DELAY		7
 #define PACKET_LENGTH_NOHEADER		(PACKET_LENGTH-2)
 
+//ROUTING ALGORITHMS (on the mesh, selected at run time)
+#define ROUTING_XY			0	// dimension ordered
+#define ROUTING_WEST_FIRST		1	// turn model, adaptive
+#define ROUTING_ODD_EVEN		2	// turn model, adaptive
+#define ROUTING_ADAPTIVE		3	// minimal fully adaptive
+#define ROUTING_ALGORITHMS		4
+
+//PRIORITY DEFINITIONS (on the high byte of the header flit)
+#define PRIORITY_SHIFT			8
+#define PRIORITY_NORMAL			0
+#define PRIORITY_HIGH			1
+
+//RDMA DEFINITIONS (remote memory windows, served by the NI)
+#define NI_WINDOWS			8
+#define RDMA_PORT			65534
+#define RDMA_PUT			1
+#define RDMA_GET			2
+#define RDMA_HEADER_SIZE		11	// in flits
+#define WIN_READ			0x01
+#define WIN_WRITE			0x02
+
+//PACKET HEADER (OS packet format)
+#define PKT_TARGET_CPU			0
+#define PKT_PAYLOAD			1
+#define PKT_SOURCE_CPU			2
+#define PKT_SOURCE_PORT			3
+#define PKT_TARGET_PORT			4
+#define PKT_MSG_SIZE			5
+#define PKT_SEQ				6
+#define PKT_CHANNEL			7
+#define PKT_HEADER_SIZE			8
+#define RDMA_OFFSET_HI			8
+#define RDMA_OFFSET_LO			9
+#define RDMA_CHANNEL			10
+
+//NETWORK SIZE (given at run time, up to these limits)
+#define MAX_NOC_SIZE			16	// width or height of the mesh (4 bit coordinates on headers)
+#define MAX_NOC_CORES			256
+
 #ifdef BUS
-	#define ROUTERSIZE 			N_CORES
+	#define ROUTERSIZE 			noc_cores
+	#define MAX_ROUTERSIZE			MAX_NOC_CORES
 	#define ARBITRATION_CONSIDERING_POS	0
 	#define SIMULTANEOUS_SWITCHING		0
 #else	
 	#define ROUTERSIZE 			5
+	#define MAX_ROUTERSIZE			5
 	#define ARBITRATION_CONSIDERING_POS	1
 	#define SIMULTANEOUS_SWITCHING		1
 #endif
 
 //USEFUL MACROS
-#define headerToDecimal(X)		( ( ((unsigned int) X) & 0x0f )*NOC_WIDTH + ( (unsigned int) ((unsigned int) X & 0xf0)>>4 )  )
+#define headerToDecimal(X)		( ( ((unsigned int) X) & 0x0f )*noc_width + ( (unsigned int) ((unsigned int) X & 0xf0)>>4 )  )
 #define decimalToHeader(X)		( GET_COLUMN(X)<<4 | GET_LINE(X) ) 
-#define GET_LINE(n)			((int) n / NOC_WIDTH)
-#define GET_COLUMN(n)			((int) n % NOC_WIDTH)
+#define GET_LINE(n)			((int) n / noc_width)
+#define GET_COLUMN(n)			((int) n % noc_width)
 #define getRouter(n)			(&routers[ n ])
 #define getBuffer(x, p)			(&(x->buffers[ p ]))
 #define getNetworkInterface(n)		(&network_interfaces[ n ])
 #define getCore(n)			(&cores[ n ])
 #define getPort(x,j)			(&(x->ports[ j ]))
+#define getPriority(X)			( (((unsigned int) X) >> PRIORITY_SHIFT) & 0x1 )
 
 //PORT IDENTIFIERS
 #define PLASMA				0
 #define NOC				1
+#define DMA				2
 #define EAST				0
 #define WEST				1
 #define NORTH				2
@@ -69,19 +112,48 @@ typedef struct {
 	Port 				port;
 } Core;
 
+typedef struct {
+	unsigned int			base;
+	unsigned int			size;
+	unsigned int			flags;
+} Window;
+
+typedef struct {
+	Flit				header[RDMA_HEADER_SIZE];	// request being replied
+	unsigned int			address;
+	int				sent;
+	int				seq;
+	int				active;
+} Transfer;
+
 typedef struct {
 	Buffer				buffers[2];	
 	Port				ports[2];
+	Buffer				dma;		// packets generated by the NI (get replies)
+	int				out_source;	// buffer feeding the NoC (PLASMA or DMA)
+	int				out_count;	// flits remaining of the packet being sent
+	unsigned int			delivered;	// flits taken by the processor
+	unsigned char			*mem;		// local memory, for remote memory access
+	unsigned int			mem_size;
+	unsigned int			win_base;	// window registers
+	unsigned int			win_size;
+	Window				windows[NI_WINDOWS];
+	Transfer			get;
+	unsigned int			rdma_puts;
+	unsigned int			rdma_gets;
 } NetworkInterface;
 
 typedef struct {
 	unsigned char			arbiter;
-	unsigned char			status[ROUTERSIZE];
-	long long int			packets_remaining[ROUTERSIZE];
-	unsigned char			redirect_to[ROUTERSIZE];
-	int				routing_delay[ROUTERSIZE];
-	Buffer				buffers[ROUTERSIZE];
-	Port				ports[ROUTERSIZE];
+	unsigned int			high_priority;	// high priority packets routed
+	unsigned char			status[MAX_ROUTERSIZE];
+	long long int			packets_remaining[MAX_ROUTERSIZE];
+	unsigned char			redirect_to[MAX_ROUTERSIZE];
+	int				routing_delay[MAX_ROUTERSIZE];
+	Buffer				buffers[MAX_ROUTERSIZE];
+	Port				ports[MAX_ROUTERSIZE];
+	int				downstream[MAX_ROUTERSIZE];	// flits on the buffer at the other end of each link
+	unsigned int			flits[MAX_ROUTERSIZE];		// flits sent on each output port
 } Router;
 
 int teste(int i);
@@ -99,14 +171,28 @@ void destroy(Buffer* buffer);
 void cleanPort(Port *port);
 void unload_architecture();
 void load_architecture();
+void save_architecture(FILE *f);
+int restore_architecture(FILE *f);
 void cycleRouter(int n);
 void cycleNetworkInterface(int n);
 void synchronizePorts(Port *p1, Port *p2);
 void synchronizeRouter(int n);
+void synchronizeLocal(int n);
+void synchronizeLinks(int n);
 void synchronizeNetworkInterface(int n);
 void synchronizeCore(int n);
+int idleNetwork(void);
+void idleRouter(int n, int cycles);
+
+void windowNetworkInterface(int n, unsigned int ctrl);
+
+// SYNTHETIC TRAFFIC (traffic.c)
+int traffic(char *pattern, char *loads, unsigned long long cycles, int clk_ratio, char *output);
 
 // GLOBAL VARS
-Router *routers;
-NetworkInterface *network_interfaces;
-Core *cores;
+extern Router *routers;
+extern NetworkInterface *network_interfaces;
+extern Core *cores;
+extern int noc_width, noc_height, noc_cores, noc_buffer_size;
+extern int noc_routing, noc_torus, noc_routing_delay;
+extern char *routing_names[ROUTING_ALGORITHMS];
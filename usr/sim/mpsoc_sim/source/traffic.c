@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "noc.h"
+
+/*
+
+
+	SYNTHETIC TRAFFIC
+
+
+ * the network is simulated with no processors. packets are generated on every node by a traffic
+ * pattern (or read from a trace), kept on an unbounded source queue and written directly to the
+ * buffer of the network interface. on the receiving side, a sink takes flits from the processor
+ * port of the network interface as soon as they are presented. packets carry their source, the
+ * cycle they were generated and the cycle they entered the network interface, so latencies are
+ * measured when the last flit is taken.
+ *
+ * the offered load is given in flits per node per network cycle, and a list of loads can be
+ * simulated in a sweep (the network is rebuilt for each one). statistics are taken for packets
+ * generated after a warm up period (a tenth of the cycles, or none for traces). a trace has one
+ * packet per line (cycle, source and target nodes).
+ */
+#define PATTERN_UNIFORM			0
+#define PATTERN_TRANSPOSE		1
+#define PATTERN_HOTSPOT			2
+#define PATTERN_BITCOMP			3
+#define PATTERN_TRACE			4
+
+#define PKT_CREATED			8	// generation cycle (4 flits)
+#define PKT_INJECTED			12	// cycle the packet entered the NI (4 flits)
+#define TRAFFIC_MAX_LOADS		64
+#define TRAFFIC_BUCKETS			10
+#define SATURATION_LATENCY		3	// times the zero load latency
+
+typedef struct {
+	unsigned long long cycle;
+	int source;
+	int target;
+} TracePacket;
+
+typedef struct {
+	unsigned long long created;
+	int target;
+} Pending;
+
+typedef struct {
+	Pending *queue;				// source queue (ring, grows as needed)
+	int head, count, max;
+	int sent;				// flits of the head packet written to the NI
+	unsigned long long injected;
+	Flit packet[NI_BUFFER_LENGTH];		// packet being received
+	int received;
+} Node;
+
+typedef struct {
+	double offered;
+	double accepted;			// flits per node per network cycle
+	unsigned long long generated, delivered, flits;
+	double latency, network_latency;	// averages (cpu cycles)
+	unsigned int min, p50, p90, p99, max;
+	unsigned long long histogram[TRAFFIC_BUCKETS];
+} Result;
+
+static int pattern, hotspot = 0, hotspot_percent = 20;
+static Node *nodes;
+static TracePacket *trace;
+static int trace_size, trace_next;
+static unsigned int *latencies;
+static unsigned long long n_latencies, max_latencies;
+static unsigned long long seed = 88172645463325252ULL;
+
+static unsigned int xorshift(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return (unsigned int) (seed >> 32);
+}
+
+// target of a packet generated on node n, or -1 if the node does not inject on this pattern
+static int target(int n)
+{
+	int t, l, c;
+
+	switch( pattern )
+	{
+		case PATTERN_HOTSPOT:
+			if( (int) (xorshift() % 100) < hotspot_percent )
+			{
+				return hotspot == n ? -1 : hotspot;
+			}
+			// fall through
+		case PATTERN_UNIFORM:
+			if( noc_cores < 2 )
+			{
+				return -1;
+			}
+			t = xorshift() % (noc_cores - 1);
+			return t >= n ? t + 1 : t;
+		case PATTERN_TRANSPOSE:
+			l = GET_LINE(n);
+			c = GET_COLUMN(n);
+			t = c * noc_width + l;
+			break;
+		case PATTERN_BITCOMP:
+#ifndef BUS
+			l = GET_LINE(n);
+			c = GET_COLUMN(n);
+			t = (noc_height - 1 - l) * noc_width + (noc_width - 1 - c);
+#else
+			t = noc_cores - 1 - n;
+#endif
+			break;
+		default:
+			return -1;
+	}
+
+	return t == n ? -1 : t;
+}
+
+static void enqueue(int n, int t, unsigned long long cycle)
+{
+	Node *node = &nodes[n];
+
+	if( node->count == node->max )
+	{
+		node->queue = (Pending *) realloc(node->queue, sizeof(Pending) * node->max * 2);
+		memcpy(&node->queue[node->max], node->queue, sizeof(Pending) * node->head);
+		node->max *= 2;
+	}
+	node->queue[ (node->head + node->count) % node->max ].created = cycle;
+	node->queue[ (node->head + node->count) % node->max ].target = t;
+	node->count++;
+}
+
+static void putStamp(Buffer *buffer, unsigned long long cycle)
+{
+	int i;
+
+	for( i = 3 ; i >= 0 ; i-- )
+	{
+		put(buffer, (Flit) (cycle >> (16 * i)));
+	}
+}
+
+static unsigned long long getStamp(Flit *flits)
+{
+	unsigned long long cycle = 0;
+	int i;
+
+	for( i = 0 ; i < 4 ; i++ )
+	{
+		cycle = (cycle << 16) | flits[i];
+	}
+
+	return cycle;
+}
+
+// writes flits of the packet on the head of the source queue to the NI, as buffer space allows
+static void inject(int n, unsigned long long cycle)
+{
+	Node *node = &nodes[n];
+	Buffer *buffer = getBuffer(getNetworkInterface(n), PLASMA);
+	Pending *p;
+
+	while( node->count && ! isFull(buffer) )
+	{
+		p = &node->queue[node->head];
+		switch( node->sent )
+		{
+			case PKT_TARGET_CPU:
+#ifndef BUS
+				put(buffer, decimalToHeader(p->target));
+#else
+				put(buffer, p->target);
+#endif
+				node->injected = cycle;
+				break;
+			case PKT_PAYLOAD:
+				put(buffer, NI_BUFFER_LENGTH - 2);
+				break;
+			case PKT_SOURCE_CPU:
+				put(buffer, n);
+				break;
+			case PKT_CREATED:
+				if( buffer->max - buffer->size < 4 )
+				{
+					return;
+				}
+				putStamp(buffer, p->created);
+				node->sent += 3;
+				break;
+			case PKT_INJECTED:
+				if( buffer->max - buffer->size < 4 )
+				{
+					return;
+				}
+				putStamp(buffer, node->injected);
+				node->sent += 3;
+				break;
+			default:
+				put(buffer, 0);
+		}
+		if( ++node->sent == NI_BUFFER_LENGTH )
+		{
+			node->sent = 0;
+			node->head = (node->head + 1) % node->max;
+			node->count--;
+		}
+	}
+}
+
+// takes the flit presented by the NI, and accounts a packet when its last flit is taken
+static void sink(int n, unsigned long long cycle, unsigned long long warmup, Result *r)
+{
+	Node *node = &nodes[n];
+	Port *port = &(getCore(n)->port);
+	unsigned long long created, latency;
+
+	if( port->in_request != ON || port->in_ack == ON )
+	{
+		return;
+	}
+	node->packet[node->received++] = port->in;
+	port->in_ack = ON;
+	if( cycle >= warmup )
+	{
+		r->flits++;
+	}
+	if( node->received < NI_BUFFER_LENGTH )
+	{
+		return;
+	}
+	node->received = 0;
+	created = getStamp(&node->packet[PKT_CREATED]);
+	if( created < warmup )
+	{
+		return;
+	}
+	latency = cycle - created;
+	r->delivered++;
+	r->latency += latency;
+	r->network_latency += cycle - getStamp(&node->packet[PKT_INJECTED]);
+	if( n_latencies == max_latencies )
+	{
+		max_latencies = max_latencies ? max_latencies * 2 : 65536;
+		latencies = (unsigned int *) realloc(latencies, sizeof(unsigned int) * max_latencies);
+	}
+	latencies[n_latencies++] = latency;
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int compareTrace(const void *a, const void *b)
+{
+	const TracePacket *x = (const TracePacket *) a, *y = (const TracePacket *) b;
+
+	return x->cycle < y->cycle ? -1 : x->cycle > y->cycle;
+}
+
+static void distribution(Result *r)
+{
+	unsigned long long i, width;
+
+	if( n_latencies == 0 )
+	{
+		return;
+	}
+	qsort(latencies, n_latencies, sizeof(unsigned int), compareLatency);
+	r->latency /= r->delivered;
+	r->network_latency /= r->delivered;
+	r->min = latencies[0];
+	r->p50 = latencies[n_latencies * 50 / 100];
+	r->p90 = latencies[n_latencies * 90 / 100];
+	r->p99 = latencies[n_latencies * 99 / 100];
+	r->max = latencies[n_latencies - 1];
+	width = (r->max - r->min) / TRAFFIC_BUCKETS + 1;
+	for( i = 0 ; i < n_latencies ; i++ )
+	{
+		r->histogram[ (latencies[i] - r->min) / width ]++;
+	}
+}
+
+static void simulate(double load, unsigned long long cycles, int clk_ratio, Result *r)
+{
+	unsigned long long gcycles = 0, warmup = pattern == PATTERN_TRACE ? 0 : cycles / 10;
+	int j, t, phase = 0, sync = 1 % clk_ratio;
+	unsigned int threshold;
+
+	memset(r, 0, sizeof(Result));
+	r->offered = load;
+	// a packet is generated on a network cycle with probability load / packet length
+	threshold = (unsigned int) (load / NI_BUFFER_LENGTH * 4294967295.0);
+	n_latencies = 0;
+	trace_next = 0;
+	for( j = 0 ; j < noc_cores ; j++ )
+	{
+		nodes[j].head = nodes[j].count = nodes[j].sent = nodes[j].received = 0;
+	}
+	load_architecture();
+
+	while( gcycles < cycles )
+	{
+		gcycles++;
+		if( ++phase == clk_ratio )
+		{
+			phase = 0;
+		}
+		if( phase == sync )
+		{
+			for( j = 0 ; j < noc_cores ; j++ )
+			{
+				synchronizeLinks(j);
+			}
+		}
+		for( j = 0 ; j < noc_cores ; j++ )
+		{
+			synchronizeLocal(j);
+			synchronizeNetworkInterface(j);
+			synchronizeCore(j);
+		}
+		if( phase == 0 )
+		{
+#ifndef BUS
+			for( j = 0 ; j < noc_cores ; j++ )
+			{
+				cycleRouter(j);
+			}
+#else
+			cycleRouter(0);
+#endif
+			for( j = 0 ; j < noc_cores && pattern != PATTERN_TRACE ; j++ )
+			{
+				if( xorshift() < threshold && (t = target(j)) >= 0 )
+				{
+					enqueue(j, t, gcycles);
+					if( gcycles >= warmup )
+					{
+						r->generated++;
+					}
+				}
+			}
+		}
+		for( ; pattern == PATTERN_TRACE && trace_next < trace_size && trace[trace_next].cycle <= gcycles ; trace_next++ )
+		{
+			enqueue(trace[trace_next].source, trace[trace_next].target, gcycles);
+			if( gcycles >= warmup )
+			{
+				r->generated++;
+			}
+		}
+		for( j = 0 ; j < noc_cores ; j++ )
+		{
+			cycleNetworkInterface(j);
+			inject(j, gcycles);
+			sink(j, gcycles, warmup, r);
+		}
+	}
+
+	unload_architecture();
+	r->accepted = (double) r->flits * clk_ratio / ((double) noc_cores * (cycles - warmup));
+	if( pattern == PATTERN_TRACE )
+	{
+		r->offered = (double) r->generated * NI_BUFFER_LENGTH * clk_ratio / ((double) noc_cores * cycles);
+	}
+	distribution(r);
+}
+
+static int readTrace(char *file)
+{
+	FILE *f;
+	TracePacket p;
+	int max = 0;
+
+	f = fopen(file, "r");
+	if( f == NULL )
+	{
+		printf("\nCould not open trace %s.\n", file);
+		return -1;
+	}
+	// one packet per line: cycle source target
+	while( fscanf(f, "%llu %d %d", &p.cycle, &p.source, &p.target) == 3 )
+	{
+		if( p.source < 0 || p.source >= noc_cores || p.target < 0 || p.target >= noc_cores || p.source == p.target )
+		{
+			continue;
+		}
+		if( trace_size == max )
+		{
+			max = max ? max * 2 : 1024;
+			trace = (TracePacket *) realloc(trace, sizeof(TracePacket) * max);
+		}
+		trace[trace_size++] = p;
+	}
+	fclose(f);
+	qsort(trace, trace_size, sizeof(TracePacket), compareTrace);
+
+	return 0;
+}
+
+// loads are given as a value or as a sweep (first:last:step)
+static int parseLoads(char *loads, double *load)
+{
+	double first, last, step;
+	int n = 0;
+
+	if( sscanf(loads, "%lf:%lf:%lf", &first, &last, &step) == 3 && step > 0 )
+	{
+		for( ; first <= last + step / 1000 && n < TRAFFIC_MAX_LOADS ; first += step )
+		{
+			load[n++] = first;
+		}
+	}
+	else if( sscanf(loads, "%lf", &first) == 1 )
+	{
+		load[n++] = first;
+	}
+
+	return n;
+}
+
+static void report(FILE *f, char *name, Result *r, int n)
+{
+	int k;
+
+	fprintf(f, "\nSynthetic traffic: %s, %d nodes, %d flit packets", name, noc_cores, NI_BUFFER_LENGTH);
+	fprintf(f, "\nLoads in flits/node/network cycle, latencies in cpu cycles\n");
+	fprintf(f, "\n   offered  accepted    packets   latency   network       p50       p90       p99       max");
+	for( k = 0 ; k < n ; k++ )
+	{
+		fprintf(f, "\n%10.4f%10.4f%11llu%10.1f%10.1f%10u%10u%10u%10u", r[k].offered, r[k].accepted, r[k].delivered,
+			r[k].latency, r[k].network_latency, r[k].p50, r[k].p90, r[k].p99, r[k].max);
+		if( r[k].generated > r[k].delivered )
+		{
+			fprintf(f, "  (%llu not delivered)", r[k].generated - r[k].delivered);
+		}
+	}
+	fprintf(f, "\n");
+}
+
+static void histogram(FILE *f, Result *r)
+{
+	unsigned int i, width;
+
+	if( r->delivered == 0 )
+	{
+		return;
+	}
+	width = (r->max - r->min) / TRAFFIC_BUCKETS + 1;
+	fprintf(f, "\nLatency distribution, offered load %.4f:", r->offered);
+	for( i = 0 ; i < TRAFFIC_BUCKETS ; i++ )
+	{
+		fprintf(f, "\n    %8u - %8u: %10llu (%6.2f%%)", r->min + i * width, r->min + (i + 1) * width - 1,
+			r->histogram[i], 100.0 * r->histogram[i] / r->delivered);
+	}
+	fprintf(f, "\n");
+}
+
+// saturation: the highest accepted load, and the first offered load with latencies far above the zero load latency
+static void saturation(FILE *f, Result *r, int n)
+{
+	int k, best = 0;
+
+	if( n < 2 )
+	{
+		return;
+	}
+	for( k = 1 ; k < n ; k++ )
+	{
+		if( r[k].accepted > r[best].accepted )
+		{
+			best = k;
+		}
+	}
+	fprintf(f, "\nSaturation throughput: %.4f flits/node/network cycle (offered load %.4f)", r[best].accepted, r[best].offered);
+	for( k = 1 ; k < n ; k++ )
+	{
+		if( r[k].delivered == 0 || r[k].latency > SATURATION_LATENCY * r[0].latency )
+		{
+			fprintf(f, "\nLatency over %dx the zero load latency (%.1f cycles) from offered load %.4f", SATURATION_LATENCY, r[0].latency, r[k].offered);
+			break;
+		}
+	}
+	fprintf(f, "\n");
+}
+
+int traffic(char *name, char *loads, unsigned long long cycles, int clk_ratio, char *output)
+{
+	Result r[TRAFFIC_MAX_LOADS];
+	double load[TRAFFIC_MAX_LOADS];
+	FILE *f;
+	int j, k, n;
+
+	if( strcmp(name, "uniform") == 0 )
+	{
+		pattern = PATTERN_UNIFORM;
+	}
+	else if( strcmp(name, "transpose") == 0 )
+	{
+		pattern = PATTERN_TRANSPOSE;
+#ifndef BUS
+		if( noc_width != noc_height )
+#endif
+		{
+			printf("\nTranspose traffic needs a square mesh.\n");
+			return -1;
+		}
+	}
+	else if( strncmp(name, "hotspot", 7) == 0 )
+	{
+		pattern = PATTERN_HOTSPOT;
+		sscanf(name, "hotspot:%d:%d", &hotspot, &hotspot_percent);
+		if( hotspot < 0 || hotspot >= noc_cores || hotspot_percent < 0 || hotspot_percent > 100 )
+		{
+			printf("\nHotspot traffic is given as hotspot:node:percent.\n");
+			return -1;
+		}
+	}
+	else if( strcmp(name, "bitcomp") == 0 )
+	{
+		pattern = PATTERN_BITCOMP;
+	}
+	else if( strncmp(name, "trace:", 6) == 0 )
+	{
+		pattern = PATTERN_TRACE;
+		if( readTrace(name + 6) )
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		printf("\nUnknown traffic pattern %s (uniform, transpose, hotspot[:node:percent], bitcomp or trace:file).\n", name);
+		return -1;
+	}
+
+	n = pattern == PATTERN_TRACE ? 1 : parseLoads(loads, load);
+	if( n == 0 || cycles < 10 * clk_ratio )
+	{
+		printf("\nInvalid offered load or number of cycles.\n");
+		return -1;
+	}
+	for( k = 0 ; k < n && pattern != PATTERN_TRACE ; k++ )
+	{
+		if( load[k] <= 0 || load[k] > 1 )
+		{
+			printf("\nOffered loads must be between 0 and 1 flits/node/network cycle.\n");
+			return -1;
+		}
+	}
+
+	nodes = (Node *) calloc(noc_cores, sizeof(Node));
+	for( j = 0 ; j < noc_cores ; j++ )
+	{
+		nodes[j].max = 16;
+		nodes[j].queue = (Pending *) malloc(sizeof(Pending) * nodes[j].max);
+	}
+	for( k = 0 ; k < n ; k++ )
+	{
+		simulate(pattern == PATTERN_TRACE ? 0 : load[k], cycles, clk_ratio, &r[k]);
+		printf("\noffered load %.4f: accepted %.4f, average latency %.1f cycles", r[k].offered, r[k].accepted, r[k].latency);
+		fflush(stdout);
+	}
+	printf("\n");
+	report(stdout, name, r, n);
+	saturation(stdout, r, n);
+
+	f = fopen(output, "w");
+	if( f == NULL )
+	{
+		printf("\nCould not open %s for writing.\n", output);
+		return -1;
+	}
+	report(f, name, r, n);
+	saturation(f, r, n);
+	for( k = 0 ; k < n ; k++ )
+	{
+		histogram(f, &r[k]);
+	}
+	fclose(f);
+
+	for( j = 0 ; j < noc_cores ; j++ )
+	{
+		free(nodes[j].queue);
+	}
+	free(nodes);
+	free(latencies);
+	free(trace);
+
+	return 0;
+}
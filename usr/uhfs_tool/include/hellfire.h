@@ -0,0 +1,42 @@
+/*
+host replacement of the system wide include file. the file system and device layers are built
+from the kernel sources, with the kernel services they use mapped to the host C library.
+*/
+#ifndef HOST_HELLFIRE_H
+#define HOST_HELLFIRE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include "../../../sys/include/ecodes.h"
+#include "../../../sys/include/queue.h"
+#include "../../../lib/include/crc.h"
+
+/* kernel messages are shown in verbose mode only */
+extern int32_t host_verbose;
+#define kprintf(...)		(host_verbose ? fprintf(stderr, __VA_ARGS__) : 0)
+
+#define hf_malloc(size)		malloc(size)
+#define hf_free(ptr)		free(ptr)
+
+/* there are no other tasks: semaphores are never waited on by more than one, and no tasks are spawned */
+#define hf_seminit(s, v)	sem_init(s, 0, v)
+#define hf_semdestroy(s)	sem_destroy(s)
+#define hf_semwait(s)		sem_wait(s)
+#define hf_sempost(s)		sem_post(s)
+#define hf_yield()		((void)0)
+
+typedef int32_t mutex_t;
+#define hf_mtxinit(m)		(*(m) = 0)
+#define hf_mtxlock(m)		((void)(m))
+#define hf_mtxunlock(m)		((void)(m))
+
+static inline uint32_t _di(void){ return 0; }
+static inline void _ei(uint32_t status){ (void)status; }
+
+int32_t hf_id(int8_t *name);
+int32_t hf_spawn(void (*task)(), uint16_t period, uint16_t capacity, uint16_t deadline, int8_t *name, uint32_t stack_size);
+
+#endif
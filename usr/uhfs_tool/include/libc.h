@@ -0,0 +1,2 @@
+/* the kernel headers used by library sources are replaced by the host include file */
+#include <hellfire.h>
@@ -0,0 +1,992 @@
+/* file:          uhfs_tool.c
+ * description:   uhfs volume image tool (host side)
+ * date:          10/2026
+ */
+
+/*
+uhfs volumes are created, filled, extracted and checked on the development machine. the file
+system (fs/uhfs.c) and device layer (drivers/device/device.c) are the same ones built into the
+kernel, running on top of a block device backed by an image file (or a raw device, such as a SD
+card reader). images are made of sectors with the volume block size (512 bytes by default, the
+sector size of the SD card driver, the ramdisk and the simulator SD card model).
+
+	uhfs_tool [-v] [-s] image mkfs [size [block size]]
+	uhfs_tool [-v] [-s] image info
+	uhfs_tool [-v] [-s] image ls [-r] [path]
+	uhfs_tool [-v] [-s] image mkdir path
+	uhfs_tool [-v] [-s] image put host_path [path]
+	uhfs_tool [-v] [-s] image get path [host_path]
+	uhfs_tool [-v] [-s] image rm path
+	uhfs_tool [-v] [-s] image fsck
+	uhfs_tool [-v] [-s] image frag
+
+-v shows the file system messages, -s shows device statistics (requests and blocks moved) when
+done, so file system algorithms can be compared on the host. sizes take K, M and G suffixes. a
+size is mandatory for mkfs when the image does not exist yet. put and get copy whole directory
+trees, and files imported are preallocated, so they are extents whenever there is space for them.
+*/
+
+#include <hellfire.h>
+#include <device.h>
+#include <block.h>
+#include <uhfs.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define COPY_BUFFER		65536
+#define MAX_PATH		1024
+#define FRAG_REPORT		10			/* most fragmented files listed by frag */
+
+int32_t host_verbose = 0;
+
+/* no tasks on the host: requests are done when submitted */
+int32_t hf_id(int8_t *name)
+{
+	return -1;
+}
+
+int32_t hf_spawn(void (*task)(), uint16_t period, uint16_t capacity, uint16_t deadline, int8_t *name, uint32_t stack_size)
+{
+	return -1;
+}
+
+/*
+file backed block device
+*/
+static int image_fd = -1;
+static uint32_t image_sector = 512;
+static uint32_t image_sectors;
+static uint32_t image_pos;
+static uint32_t io_reads, io_writes, io_rblocks, io_wblocks;
+
+static int32_t image_transfer(uint32_t op, uint32_t lba, void *buf, uint32_t count)
+{
+	off_t offset = (off_t)lba * image_sector;
+	size_t size = (size_t)count * image_sector;
+
+	if (lba >= image_sectors || count > image_sectors - lba)
+		return -1;
+	if (op == DEV_WRITE) {
+		if (pwrite(image_fd, buf, size, offset) != (ssize_t)size)
+			return -1;
+		io_writes++;
+		io_wblocks += count;
+	} else {
+		if (pread(image_fd, buf, size, offset) != (ssize_t)size)
+			return -1;
+		io_reads++;
+		io_rblocks += count;
+	}
+
+	return 0;
+}
+
+static int32_t image_open(uint32_t flags)
+{
+	return 0;
+}
+
+static int32_t image_read(void *buf, uint32_t size)
+{
+	int32_t err;
+
+	err = image_transfer(DEV_READ, image_pos, buf, size);
+	image_pos += size;
+
+	return err;
+}
+
+static int32_t image_write(void *buf, uint32_t size)
+{
+	int32_t err;
+
+	err = image_transfer(DEV_WRITE, image_pos, buf, size);
+	image_pos += size;
+
+	return err;
+}
+
+static int32_t image_close(void)
+{
+	return 0;
+}
+
+static int32_t image_ioctl(uint32_t request, void *pval)
+{
+	struct blk_info *info;
+
+	switch (request) {
+	case DISK_INIT:
+		return 0;
+	case DISK_GETINFO:
+		info = (struct blk_info *)pval;
+		memset(info, 0, sizeof(struct blk_info));
+		info->num_sectors = image_sectors;
+		info->bytes_sector = image_sector;
+		return 0;
+	case DISK_SEEKSET:
+		image_pos = (uint32_t)(uintptr_t)pval;
+		return 0;
+	case DISK_SEEKCUR:
+		image_pos += (uint32_t)(uintptr_t)pval;
+		return 0;
+	case DISK_SEEKEND:
+		image_pos = image_sectors + (uint32_t)(uintptr_t)pval;
+		return 0;
+	case DISK_FINISH:
+		return fsync(image_fd);
+	default:
+		return -1;
+	}
+}
+
+static int32_t image_request(struct dev_request *req)
+{
+	return image_transfer(req->op, req->lba, req->buf, req->count);
+}
+
+static struct device image = {image_open, image_read, image_write, image_close, image_ioctl, 0, image_request};
+
+static uint64_t parsesize(char *str)
+{
+	char *end;
+	uint64_t size;
+
+	size = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'G': case 'g': size <<= 10;
+	case 'M': case 'm': size <<= 10;
+	case 'K': case 'k': size <<= 10;
+	}
+
+	return size;
+}
+
+/* open an image. with size, the image is created (or resized), and the sector size is given */
+static int openimage(char *name, uint64_t size, uint32_t sector)
+{
+	struct fs_superblock sblock;
+	off_t length;
+
+	image_fd = open(name, size || sector ? O_RDWR | O_CREAT : O_RDWR, 0644);
+	if (image_fd < 0) {
+		perror(name);
+		return -1;
+	}
+	if (size && ftruncate(image_fd, size) && lseek(image_fd, 0, SEEK_END) < (off_t)size) {
+		perror(name);
+		return -1;
+	}
+	length = lseek(image_fd, 0, SEEK_END);
+
+	/* the sector size of an existing volume is its block size */
+	if (sector) {
+		image_sector = sector;
+	} else {
+		if (pread(image_fd, &sblock, sizeof(struct fs_superblock), 0) != sizeof(struct fs_superblock) || sblock.signature != 0x66600666) {
+			fprintf(stderr, "%s: not an uhfs volume\n", name);
+			return -1;
+		}
+		image_sector = sblock.block_size;
+	}
+	image_sectors = length / image_sector;
+	if (!image_sectors) {
+		fprintf(stderr, "%s: empty image\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mountvolume(void)
+{
+	if (hf_mount(&image)) {
+		fprintf(stderr, "can't mount the volume\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int umountvolume(void)
+{
+	if (hf_umount(&image)) {
+		fprintf(stderr, "can't unmount the volume\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* path on the volume of an entry of a directory */
+static void joinpath(char *path, char *dir, char *name)
+{
+	snprintf(path, MAX_PATH, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+}
+
+/* directories are opened by a name that is not on them (hf_opendir() takes "/dir/.") */
+static struct file *opendirectory(char *path)
+{
+	char dir[MAX_PATH];
+
+	joinpath(dir, path, ".");
+
+	return hf_opendir(&image, dir);
+}
+
+/* the entry of a path on its directory (0 if it doesn't exist, -1 on errors) */
+static int lookup(char *path, struct fs_direntry *entry)
+{
+	char dir[MAX_PATH], *name;
+	struct file *desc;
+	struct fs_direntry e;
+
+	if (!strcmp(path, "/")) {
+		memset(entry, 0, sizeof(struct fs_direntry));
+		entry->attributes = UHFS_ATTRDIR;
+		return 1;
+	}
+	name = strrchr(path, '/');
+	if (!name || !name[1])
+		return -1;
+	snprintf(dir, MAX_PATH, "%.*s", name == path ? 1 : (int)(name - path), path);
+	name++;
+	desc = opendirectory(dir);
+	if (!desc)
+		return 0;
+	while (!hf_readdir(desc, &e)) {
+		if (!(e.attributes & UHFS_ATTRFREE) && !strcmp(e.filename, name)) {
+			*entry = e;
+			hf_closedir(desc);
+			return 1;
+		}
+	}
+	hf_closedir(desc);
+
+	return 0;
+}
+
+static char *attributes(uint8_t attr)
+{
+	static char str[8];
+
+	str[0] = attr & UHFS_ATTRDIR ? 'd' : '-';
+	str[1] = attr & UHFS_ATTRREAD ? 'r' : '-';
+	str[2] = attr & UHFS_ATTRWRITE ? 'w' : '-';
+	str[3] = attr & UHFS_ATTREXEC ? 'x' : '-';
+	str[4] = attr & UHFS_ATTRHIDDEN ? 'h' : '-';
+	str[5] = attr & UHFS_ATTRSYSTEM ? 's' : '-';
+	str[6] = attr & UHFS_ATTRARCHIVE ? 'a' : '-';
+	str[7] = 0;
+
+	return str;
+}
+
+/*
+volume management
+*/
+static int cmd_mkfs(char *name, int argc, char **argv)
+{
+	uint64_t size = 0;
+	uint32_t bsize = 512;
+
+	if (argc > 0)
+		size = parsesize(argv[0]);
+	if (argc > 1)
+		bsize = parsesize(argv[1]);
+	if (openimage(name, size, bsize))
+		return 1;
+	if (hf_mkfs(&image, bsize)) {
+		fprintf(stderr, "can't create the volume\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cmd_info(void)
+{
+	struct fs_blkdevice *blk_device;
+	struct fs_superblock *sb;
+
+	if (mountvolume())
+		return 1;
+	blk_device = image.ptr;
+	sb = &blk_device->fssblock;
+	printf("label: %.16s\n", sb->volume_label);
+	printf("block size: %u, blocks: %u (%llu bytes)\n", sb->block_size, sb->n_blocks, (unsigned long long)sb->n_blocks * sb->block_size);
+	printf("free blocks: %d (%llu bytes)\n", hf_getfree(&image), (unsigned long long)hf_getfree(&image) * sb->block_size);
+	printf("storage regions: %u (%u blocks each)\n", blk_device->regions, sb->block_size / (uint32_t)sizeof(uint32_t));
+	if (sb->journal_blocks)
+		printf("journal: %u blocks at block %u\n", sb->journal_blocks, sb->journal_block);
+	else
+		printf("journal: none\n");
+
+	return umountvolume();
+}
+
+/*
+directories and files
+*/
+static int list(char *path, int recursive)
+{
+	struct file *desc;
+	struct fs_direntry entry;
+	char sub[MAX_PATH];
+	char (*names)[sizeof(entry.filename)] = 0;
+	int count = 0, i, err = 0;
+
+	desc = opendirectory(path);
+	if (!desc) {
+		fprintf(stderr, "%s: directory not found\n", path);
+		return 1;
+	}
+	if (recursive)
+		printf("%s:\n", path);
+	while (!hf_readdir(desc, &entry)) {
+		if (entry.attributes & UHFS_ATTRFREE)
+			continue;
+		printf("%s %10llu %04d-%02d-%02d %02d:%02d %s%s\n", attributes(entry.attributes), (unsigned long long)entry.size,
+			entry.date.year, entry.date.month, entry.date.day, entry.time.hour, entry.time.minute,
+			entry.filename, entry.attributes & UHFS_ATTRDIR ? "/" : "");
+		/* hf_readdir() keeps the position of a single directory, so subdirectories are listed after */
+		if (recursive && (entry.attributes & UHFS_ATTRDIR)) {
+			names = realloc(names, (count + 1) * sizeof(entry.filename));
+			if (!names) {
+				fprintf(stderr, "out of memory\n");
+				hf_closedir(desc);
+				return 1;
+			}
+			memcpy(names[count++], entry.filename, sizeof(entry.filename));
+		}
+	}
+	hf_closedir(desc);
+	for (i = 0; i < count; i++) {
+		joinpath(sub, path, names[i]);
+		printf("\n");
+		err |= list(sub, recursive);
+	}
+	free(names);
+
+	return err;
+}
+
+static int cmd_ls(int argc, char **argv)
+{
+	int recursive = 0, err;
+
+	if (argc > 0 && !strcmp(argv[0], "-r")) {
+		recursive = 1;
+		argc--;
+		argv++;
+	}
+	if (mountvolume())
+		return 1;
+	err = list(argc > 0 ? argv[0] : "/", recursive);
+
+	return umountvolume() || err;
+}
+
+static int cmd_mkdir(int argc, char **argv)
+{
+	int err = 0;
+
+	if (argc < 1)
+		return 2;
+	if (mountvolume())
+		return 1;
+	if (hf_mkdir(&image, argv[0])) {
+		fprintf(stderr, "%s: can't create the directory\n", argv[0]);
+		err = 1;
+	}
+
+	return umountvolume() || err;
+}
+
+static void setdate(char *path, time_t mtime)
+{
+	struct tm *tm;
+	struct fs_date date;
+	struct fs_time time;
+
+	tm = localtime(&mtime);
+	memset(&date, 0, sizeof(struct fs_date));
+	memset(&time, 0, sizeof(struct fs_time));
+	date.day = tm->tm_mday;
+	date.month = tm->tm_mon + 1;
+	date.year = tm->tm_year + 1900;
+	time.second = tm->tm_sec;
+	time.minute = tm->tm_min;
+	time.hour = tm->tm_hour;
+	hf_touch(&image, path, &date, &time);
+}
+
+static int putfile(char *src, char *dst, struct stat *st)
+{
+	static char buf[COPY_BUFFER];
+	FILE *in;
+	struct file *out;
+	size_t n;
+	int err = 0;
+
+	in = fopen(src, "rb");
+	if (!in) {
+		perror(src);
+		return 1;
+	}
+	out = hf_fopen(&image, dst, "w");
+	if (!out) {
+		fprintf(stderr, "%s: can't create the file\n", dst);
+		fclose(in);
+		return 1;
+	}
+	/* the whole file is allocated first, so its blocks are contiguous if possible */
+	if (st->st_size && hf_fallocate(out, st->st_size)) {
+		fprintf(stderr, "%s: volume is full\n", dst);
+		err = 1;
+	}
+	while (!err && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (hf_fwrite(buf, 1, n, out) != (int64_t)n) {
+			fprintf(stderr, "%s: write error\n", dst);
+			err = 1;
+		}
+	}
+	if (ferror(in)) {
+		perror(src);
+		err = 1;
+	}
+	hf_fclose(out);
+	fclose(in);
+	setdate(dst, st->st_mtime);
+	if (!(st->st_mode & S_IWUSR) || (st->st_mode & S_IXUSR))
+		hf_chmod(&image, dst, UHFS_ATTRREAD | (st->st_mode & S_IWUSR ? UHFS_ATTRWRITE : 0) | (st->st_mode & S_IXUSR ? UHFS_ATTREXEC : 0));
+
+	return err;
+}
+
+static int put(char *src, char *dst)
+{
+	struct stat st;
+	struct fs_direntry entry;
+	DIR *dir;
+	struct dirent *de;
+	char hsub[MAX_PATH], sub[MAX_PATH];
+	int err = 0;
+
+	if (stat(src, &st)) {
+		perror(src);
+		return 1;
+	}
+	if (S_ISREG(st.st_mode))
+		return putfile(src, dst, &st);
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: skipped (not a file or directory)\n", src);
+		return 0;
+	}
+
+	if (lookup(dst, &entry) != 1) {
+		if (hf_mkdir(&image, dst)) {
+			fprintf(stderr, "%s: can't create the directory\n", dst);
+			return 1;
+		}
+	} else if (!(entry.attributes & UHFS_ATTRDIR)) {
+		fprintf(stderr, "%s: not a directory\n", dst);
+		return 1;
+	}
+	dir = opendir(src);
+	if (!dir) {
+		perror(src);
+		return 1;
+	}
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		/* names are split on spaces too by the file system */
+		if (strlen(de->d_name) >= sizeof(entry.filename) || strchr(de->d_name, ' ') || !strcmp(de->d_name, ".")) {
+			fprintf(stderr, "%s/%s: skipped (invalid name on the volume)\n", src, de->d_name);
+			err = 1;
+			continue;
+		}
+		snprintf(hsub, MAX_PATH, "%s/%s", src, de->d_name);
+		joinpath(sub, dst, de->d_name);
+		err |= put(hsub, sub);
+	}
+	closedir(dir);
+
+	return err;
+}
+
+static int cmd_put(int argc, char **argv)
+{
+	struct fs_direntry entry;
+	char dst[MAX_PATH], *base;
+	int err;
+
+	if (argc < 1)
+		return 2;
+	if (mountvolume())
+		return 1;
+	/* copying to a directory keeps the name (a source ending in "." copies the contents) */
+	snprintf(dst, MAX_PATH, "%s", argc > 1 ? argv[1] : "/");
+	while (strlen(argv[0]) > 1 && argv[0][strlen(argv[0]) - 1] == '/')
+		argv[0][strlen(argv[0]) - 1] = 0;
+	base = strrchr(argv[0], '/');
+	base = base ? base + 1 : argv[0];
+	if (lookup(dst, &entry) == 1 && (entry.attributes & UHFS_ATTRDIR) && base[0] && strcmp(base, ".") && strcmp(base, ".."))
+		joinpath(dst, argc > 1 ? argv[1] : "/", base);
+	err = put(argv[0], dst);
+
+	return umountvolume() || err;
+}
+
+static int getfile(char *src, char *dst, struct fs_direntry *entry)
+{
+	static char buf[COPY_BUFFER];
+	struct file *in;
+	FILE *out;
+	int64_t n;
+	int err = 0;
+
+	in = hf_fopen(&image, src, "r");
+	if (!in) {
+		fprintf(stderr, "%s: can't open the file\n", src);
+		return 1;
+	}
+	out = fopen(dst, "wb");
+	if (!out) {
+		perror(dst);
+		hf_fclose(in);
+		return 1;
+	}
+	while ((n = hf_fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, n, out) != (size_t)n) {
+			perror(dst);
+			err = 1;
+			break;
+		}
+	}
+	if (n < 0) {
+		fprintf(stderr, "%s: read error\n", src);
+		err = 1;
+	}
+	hf_fclose(in);
+	if (fclose(out))
+		err = 1;
+	if (entry->attributes & UHFS_ATTREXEC)
+		chmod(dst, 0755);
+
+	return err;
+}
+
+static int get(char *src, char *dst)
+{
+	struct file *desc;
+	struct fs_direntry entry;
+	char sub[MAX_PATH], hsub[MAX_PATH];
+	char (*names)[sizeof(entry.filename)] = 0;
+	int count = 0, i, err = 0;
+
+	if (lookup(src, &entry) != 1) {
+		fprintf(stderr, "%s: not found\n", src);
+		return 1;
+	}
+	if (!(entry.attributes & UHFS_ATTRDIR))
+		return getfile(src, dst, &entry);
+
+	if (mkdir(dst, 0755) && access(dst, W_OK)) {
+		perror(dst);
+		return 1;
+	}
+	/* names are collected first, as hf_readdir() keeps the position of a single directory */
+	desc = opendirectory(src);
+	while (desc && !hf_readdir(desc, &entry)) {
+		if (entry.attributes & UHFS_ATTRFREE)
+			continue;
+		names = realloc(names, (count + 1) * sizeof(entry.filename));
+		if (!names) {
+			fprintf(stderr, "out of memory\n");
+			hf_closedir(desc);
+			return 1;
+		}
+		memcpy(names[count++], entry.filename, sizeof(entry.filename));
+	}
+	if (desc)
+		hf_closedir(desc);
+	for (i = 0; i < count; i++) {
+		joinpath(sub, src, names[i]);
+		snprintf(hsub, MAX_PATH, "%s/%s", dst, names[i]);
+		err |= get(sub, hsub);
+	}
+	free(names);
+
+	return err;
+}
+
+static int cmd_get(int argc, char **argv)
+{
+	char *base;
+	int err;
+
+	if (argc < 1)
+		return 2;
+	if (mountvolume())
+		return 1;
+	base = strrchr(argv[0], '/');
+	base = base && base[1] ? base + 1 : ".";
+	err = get(argv[0], argc > 1 ? argv[1] : base);
+
+	return umountvolume() || err;
+}
+
+static int cmd_rm(int argc, char **argv)
+{
+	struct fs_direntry entry;
+	char dir[MAX_PATH];
+	int err = 0;
+
+	if (argc < 1)
+		return 2;
+	if (mountvolume())
+		return 1;
+	joinpath(dir, argv[0], ".");
+	if (!strcmp(argv[0], "/")) {
+		fprintf(stderr, "/: the root directory can't be removed\n");
+		err = 1;
+	} else if (lookup(argv[0], &entry) != 1) {
+		fprintf(stderr, "%s: not found\n", argv[0]);
+		err = 1;
+	} else if (entry.attributes & UHFS_ATTRDIR ? hf_rmdir(&image, dir) : hf_unlink(&image, argv[0])) {
+		fprintf(stderr, "%s: can't remove%s\n", argv[0], entry.attributes & UHFS_ATTRDIR ? " (directory not empty?)" : "");
+		err = 1;
+	}
+
+	return umountvolume() || err;
+}
+
+/*
+volume checks, on the image itself (after the journal is replayed): the whole cluster map is
+loaded, and the directory tree is walked from the root. every chain must end, use only data
+blocks allocated on the map and share no block with other chains. allocated blocks not reached
+from the tree are lost. the fragmentation report counts the runs of consecutive data blocks
+(stepping over cluster map blocks, like extents) of each file, and of free space.
+*/
+static struct fs_superblock sb;
+static uint32_t *map;					/* cluster map entry of each block */
+static uint8_t *seen;					/* blocks reached from the directory tree */
+static uint32_t mask;
+static uint32_t errors, lost;
+static uint32_t files, dirs, used_blocks, fragmented, fragments;
+static struct frag {
+	uint32_t fragments;
+	uint32_t blocks;
+	char path[MAX_PATH];
+} worst[FRAG_REPORT];
+
+static int iscmb(uint32_t blk)
+{
+	return ((blk - 1) & mask) == 0;
+}
+
+static uint32_t nextdata(uint32_t blk)
+{
+	return (blk & mask) ? blk + 1 : blk + 2;
+}
+
+static void problem(char *path, char *fmt, uint32_t blk)
+{
+	errors++;
+	printf("%s: ", path);
+	printf(fmt, blk);
+	printf("\n");
+}
+
+static int loadmap(void)
+{
+	uint32_t *buf, k, i;
+
+	buf = malloc(image_sector);
+	if (!buf || hf_dev_readblk(&image, 0, buf, 1))
+		return -1;
+	memcpy(&sb, buf, sizeof(struct fs_superblock));
+	mask = sb.block_size / sizeof(uint32_t) - 1;
+	map = calloc(sb.n_blocks, sizeof(uint32_t));
+	seen = calloc(sb.n_blocks, 1);
+	if (!map || !seen)
+		return -1;
+	for (k = sb.first_cmb; k < sb.n_blocks; k += mask + 1) {
+		if (hf_dev_readblk(&image, k, buf, 1))
+			return -1;
+		for (i = 0; i <= mask && k + i < sb.n_blocks; i++)
+			map[k + i] = buf[i];
+	}
+	free(buf);
+
+	return 0;
+}
+
+/* follow a chain, marking its blocks. returns the number of blocks and fragments */
+static uint32_t walkchain(char *path, uint32_t blk, uint32_t *frags)
+{
+	uint32_t count = 0, prev = 0;
+
+	*frags = 0;
+	while (blk != UHFS_EOCHBLK) {
+		if (blk == 0 || blk >= sb.n_blocks || iscmb(blk)) {
+			problem(path, "invalid block %u on the chain", blk);
+			break;
+		}
+		if (map[blk] == UHFS_FREEBLK || map[blk] == UHFS_FIXDBLK || map[blk] == UHFS_DEADBLK) {
+			problem(path, "block %u on the chain is not allocated", blk);
+			break;
+		}
+		if (seen[blk]) {
+			problem(path, "block %u is shared with other chain (or the chain loops)", blk);
+			break;
+		}
+		seen[blk] = 1;
+		if (!prev || nextdata(prev) != blk)
+			(*frags)++;
+		prev = blk;
+		count++;
+		blk = map[blk];
+	}
+
+	return count;
+}
+
+static void report(char *path, uint32_t frags, uint32_t blocks)
+{
+	int i, j;
+
+	for (i = 0; i < FRAG_REPORT && worst[i].fragments >= frags; i++);
+	if (i == FRAG_REPORT)
+		return;
+	for (j = FRAG_REPORT - 1; j > i; j--)
+		worst[j] = worst[j - 1];
+	worst[i].fragments = frags;
+	worst[i].blocks = blocks;
+	strncpy(worst[i].path, path, MAX_PATH - 1);
+}
+
+static void walkdir(char *path, uint32_t first)
+{
+	struct fs_direntry *dir_data;
+	uint32_t blk, count, blocks_dir, frags, broken, i, k, extent;
+	uint32_t entries = sb.block_size / sizeof(struct fs_direntry);
+	uint32_t *blocks;
+	char sub[MAX_PATH];
+
+	dirs++;
+	blocks_dir = walkchain(path, first, &frags);
+	if (!blocks_dir)
+		return;
+	used_blocks += blocks_dir;
+
+	/* directory blocks, then their entries */
+	blocks = malloc(blocks_dir * sizeof(uint32_t));
+	dir_data = malloc(sb.block_size);
+	if (!blocks || !dir_data) {
+		problem(path, "out of memory (%u directory blocks)", blocks_dir);
+		return;
+	}
+	for (blk = first, i = 0; i < blocks_dir; blk = map[blk])
+		blocks[i++] = blk;
+	for (i = 0; i < blocks_dir; i++) {
+		if (hf_dev_readblk(&image, blocks[i], dir_data, 1)) {
+			problem(path, "can't read directory block %u", blocks[i]);
+			continue;
+		}
+		for (k = 0; k < entries; k++) {
+			if (dir_data[k].attributes & UHFS_ATTRFREE)
+				continue;
+			if (!memchr(dir_data[k].filename, 0, sizeof(dir_data[k].filename)) || !dir_data[k].filename[0] || strchr(dir_data[k].filename, '/')) {
+				problem(path, "invalid name on directory block %u", blocks[i]);
+				continue;
+			}
+			joinpath(sub, path, dir_data[k].filename);
+			if (dir_data[k].attributes & UHFS_ATTRDIR) {
+				walkdir(sub, dir_data[k].first_block);
+				continue;
+			}
+			files++;
+			broken = errors;
+			count = walkchain(sub, dir_data[k].first_block, &frags);
+			used_blocks += count;
+			if (errors != broken)
+				continue;
+			if (dir_data[k].size > (uint64_t)count * sb.block_size)
+				problem(sub, "size is larger than the chain (%u blocks)", count);
+			/* a wrong extent record is not harmful (the chain is walked when opened), but it is reported */
+			if (dir_data[k].metadata_block & UHFS_EXTENT) {
+				extent = dir_data[k].metadata_block & ~UHFS_EXTENT;
+				if (frags != 1 || extent != count)
+					printf("%s: stale extent record (%u blocks, chain has %u blocks in %u runs)\n", sub, extent, count, frags);
+			}
+			if (frags > 1) {
+				fragmented++;
+				report(sub, frags, count);
+			}
+			fragments += frags;
+		}
+	}
+	free(dir_data);
+	free(blocks);
+}
+
+static int checkvolume(void)
+{
+	uint32_t k, i;
+
+	if (mountvolume() || umountvolume())
+		return -1;
+	if (loadmap()) {
+		fprintf(stderr, "can't read the cluster map\n");
+		return -1;
+	}
+
+	/* cluster map blocks are chained, and the journal is fixed */
+	for (k = sb.first_cmb; k < sb.n_blocks; k += mask + 1) {
+		if (map[k] != (k + mask + 1 < sb.n_blocks ? k + mask + 1 : UHFS_EOCHBLK))
+			problem("cluster map", "block %u is not chained to the next storage region", k);
+	}
+	for (i = 0; i < sb.journal_blocks; i++)
+		if (map[sb.journal_block + i] != UHFS_FIXDBLK)
+			problem("journal", "block %u is not reserved", sb.journal_block + i);
+
+	walkdir("/", sb.root_dir_block);
+
+	for (k = sb.first_cmb + 1; k < sb.n_blocks; k++) {
+		if (iscmb(k) || seen[k])
+			continue;
+		if (map[k] != UHFS_FREEBLK && map[k] != UHFS_FIXDBLK && map[k] != UHFS_DEADBLK)
+			lost++;
+	}
+
+	return 0;
+}
+
+static int cmd_fsck(void)
+{
+	if (checkvolume())
+		return 1;
+	if (lost)
+		printf("%u lost blocks (allocated, but not on any chain)\n", lost);
+	printf("%u directories, %u files, %u blocks used: %u errors\n", dirs, files, used_blocks, errors + (lost ? 1 : 0));
+
+	return errors || lost;
+}
+
+static int cmd_frag(void)
+{
+	uint32_t k, run = 0, runs = 0, largest = 0, free_blocks = 0;
+	int i;
+
+	if (checkvolume())
+		return 1;
+
+	/* free space, in runs of consecutive data blocks */
+	for (k = sb.first_cmb + 1; k < sb.n_blocks; k++) {
+		if (iscmb(k))
+			continue;
+		if (map[k] == UHFS_FREEBLK) {
+			if (!run)
+				runs++;
+			run++;
+			free_blocks++;
+			if (run > largest)
+				largest = run;
+		} else {
+			run = 0;
+		}
+	}
+
+	printf("files: %u, fragmented: %u (%.1f%%), fragments per file: %.2f\n", files, fragmented,
+		files ? 100.0 * fragmented / files : 0.0, files ? (double)fragments / files : 0.0);
+	printf("free blocks: %u, free runs: %u, largest: %u blocks, average: %.1f blocks\n", free_blocks, runs, largest,
+		runs ? (double)free_blocks / runs : 0.0);
+	for (i = 0; i < FRAG_REPORT && worst[i].fragments; i++) {
+		if (!i)
+			printf("most fragmented files:\n");
+		printf("%8u fragments %8u blocks  %s\n", worst[i].fragments, worst[i].blocks, worst[i].path);
+	}
+	if (errors || lost)
+		printf("the volume has errors (run fsck)\n");
+
+	return 0;
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-v] [-s] image command [arguments]\n"
+		"\tmkfs [size [block size]]\tcreate a volume (on the image, created if needed)\n"
+		"\tinfo\t\t\t\tvolume information\n"
+		"\tls [-r] [path]\t\t\tlist a directory\n"
+		"\tmkdir path\t\t\tcreate a directory\n"
+		"\tput host_path [path]\t\tcopy a file or directory tree to the volume\n"
+		"\tget path [host_path]\t\tcopy a file or directory tree from the volume\n"
+		"\trm path\t\t\t\tremove a file or an empty directory\n"
+		"\tfsck\t\t\t\tcheck the volume\n"
+		"\tfrag\t\t\t\tfragmentation report\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	char *tool = argv[0], *name, *cmd;
+	int stats = 0, err;
+	int i = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-v"))
+			host_verbose = 1;
+		else if (!strcmp(argv[i], "-s"))
+			stats = 1;
+		else
+			break;
+	}
+	if (argc - i < 2) {
+		usage(argv[0]);
+		return 2;
+	}
+	name = argv[i++];
+	cmd = argv[i++];
+	argc -= i;
+	argv += i;
+
+	if (!strcmp(cmd, "mkfs")) {
+		err = cmd_mkfs(name, argc, argv);
+	} else {
+		if (openimage(name, 0, 0))
+			return 1;
+		if (!strcmp(cmd, "info"))
+			err = cmd_info();
+		else if (!strcmp(cmd, "ls"))
+			err = cmd_ls(argc, argv);
+		else if (!strcmp(cmd, "mkdir"))
+			err = cmd_mkdir(argc, argv);
+		else if (!strcmp(cmd, "put"))
+			err = cmd_put(argc, argv);
+		else if (!strcmp(cmd, "get"))
+			err = cmd_get(argc, argv);
+		else if (!strcmp(cmd, "rm"))
+			err = cmd_rm(argc, argv);
+		else if (!strcmp(cmd, "fsck"))
+			err = cmd_fsck();
+		else if (!strcmp(cmd, "frag"))
+			err = cmd_frag();
+		else
+			err = 2;
+	}
+	if (err == 2)
+		usage(tool);
+	if (host_verbose)
+		fprintf(stderr, "\n");
+	if (stats)
+		printf("device: %u reads (%u blocks), %u writes (%u blocks)\n", io_reads, io_rblocks, io_writes, io_wblocks);
+	if (image_fd >= 0)
+		close(image_fd);
+
+	return err;
+}